@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
+#include <sys/mman.h>
+#include "sxccd.h"
+#include "sxutil.h"
+#include "aip.h"
+#include "fits.h"
+#define NSEC_PER_SEC        1000000000LL
+#define NSEC_PER_MSEC       1000000LL
+#define MAX_LINE            1024
+#define MAX_ARGS            32
+#define MAX_PATH            1024
+#define JOB_DONE            0
+#define JOB_NEXT            1
+#define JOB_ERROR           -1
+#define TRACK_STAR_RADIUS   200 // Focus star max radius in microns
+#define TRACK_STAR_SIGMA    1.0
+#define LATE_ROW_FRACTION   0.1 // Rows latched over 10% of a row period late
+/*
+ * Simulated camera. Bias, sky and read noise plus a fixed field of gaussian
+ * stars, scaled by the actual time between clear and latch.
+ */
+#define SIM_WIDTH           1392
+#define SIM_HEIGHT          1040
+#define SIM_PIXEL_SIZE      6.45
+#define SIM_STARS           64
+#define SIM_BIAS            1000.0
+#define SIM_SKY             40.0    // ADU/sec
+#define SIM_READ_NOISE      8.0     // ADU
+#define SIM_STAR_FLUX       200000.0 // ADU/sec for the brightest star
+#define SIM_PSF_SIGMA       1.5     // Pixels
+#define SIM_SCAN_TILE       4       // Frame heights before the TDI sky repeats
+struct sim_star
+{
+    float x, y, flux;
+};
+struct camera
+{
+    HANDLE          handle;
+    int             model, interlaced;
+    int             width, height; // Field height for interlaced sensors
+    float           pixel_width, pixel_height;
+    /*
+     * Simulator state.
+     */
+    int             simulated;
+    uint32_t        seed;
+    struct sim_star stars[SIM_STARS];
+    int64_t         start[2];  // Integration start per field
+    int64_t         tdi_latch; // Last TDI row latch
+    long            tdi_row;
+    uint16_t       *latched;
+    int             latched_count;
+};
+/*
+ * Job description and per job state machine.
+ */
+enum
+{
+    JOB_SNAP = 0,
+    JOB_FOCUS,
+    JOB_TDI
+};
+static const char *job_names[] = {"snap", "focus", "tdi"};
+struct job
+{
+    int       type, index, line;
+    /*
+     * Parameters from the job file.
+     */
+    int       count, exposure, xbin, ybin;
+    float     rate, minutes;
+    char      file[MAX_PATH];
+    /*
+     * Running state.
+     */
+    int       frame, field;
+    int       width, height, pixel_count;
+    int64_t   deadline, frame_start;
+    uint16_t *pixels, *field_pixels;
+    /*
+     * TDI state.
+     */
+    long      row, rows;
+    double    row_time, row_period;
+    int64_t   scan_start;
+    FILE     *spill;
+    char      spill_name[MAX_PATH];
+    double    late_sum, late_max;
+    int       late_count;
+};
+static struct camera  cam;
+static HANDLE         cam_handles[SXCCD_MAX_CAMS];
+static t_sxccd_params cam_params[SXCCD_MAX_CAMS];
+static int            cam_count = 0;
+static int            signal_pipe[2];
+static volatile int   stopping  = 0;
+static int            job_count = 0;
+/*
+ * Monotonic clock in nsec.
+ */
+static int64_t clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+/*
+ * Event loop wait. Block until the deadline or a termination signal; never
+ * wakes early to poll. Returns 0 at the deadline, -1 when asked to stop.
+ */
+static void on_signal(int sig)
+{
+    char c = (char)sig;
+    if (write(signal_pipe[1], &c, 1) < 0)
+        stopping = 1;
+}
+static int wait_until(int64_t deadline)
+{
+    fd_set          fds;
+    struct timespec timeout;
+    int64_t         delta;
+    char            c;
+    while (!stopping)
+    {
+        if ((delta = deadline - clock_now()) <= 0)
+            return 0;
+        timeout.tv_sec  = delta / NSEC_PER_SEC;
+        timeout.tv_nsec = delta % NSEC_PER_SEC;
+        FD_ZERO(&fds);
+        FD_SET(signal_pipe[0], &fds);
+        if (pselect(signal_pipe[0] + 1, &fds, NULL, NULL, &timeout, NULL) > 0
+         && read(signal_pipe[0], &c, 1) == 1)
+            stopping = 1;
+    }
+    return -1;
+}
+/*
+ * JSON lines output. One object per line on stdout, flushed as written.
+ */
+static void json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < ' ')
+            printf("\\u%04x", (unsigned char)*str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+static void json_begin(const char *event, struct job *job)
+{
+    printf("{\"event\":\"%s\"", event);
+    if (job)
+        printf(",\"job\":%d,\"type\":\"%s\"", job->index, job_names[job->type]);
+    printf(",\"time\":%.3f", (double)clock_now() / NSEC_PER_SEC);
+}
+static void json_end(void)
+{
+    printf("}\n");
+    fflush(stdout);
+}
+static void json_error(struct job *job, const char *message)
+{
+    json_begin("error", job);
+    printf(",\"message\":");
+    json_string(message);
+    json_end();
+}
+/*
+ * Simulator.
+ */
+static float sim_random(void)
+{
+    /*
+     * xorshift32, uniform in [0, 1).
+     */
+    cam.seed ^= cam.seed << 13;
+    cam.seed ^= cam.seed >> 17;
+    cam.seed ^= cam.seed << 5;
+    return (cam.seed >> 8) / 16777216.0f;
+}
+static float sim_noise(float sigma)
+{
+    /*
+     * Sum of uniforms is close enough to gaussian for noise.
+     */
+    return (sim_random() + sim_random() + sim_random() + sim_random() - 2.0f) * 1.7320508f * sigma;
+}
+static void sim_init(void)
+{
+    cam.simulated    = 1;
+    cam.seed         = 0x5EED5EED;
+    cam.model        = 0;
+    cam.interlaced   = 0;
+    cam.width        = SIM_WIDTH;
+    cam.height       = SIM_HEIGHT;
+    cam.pixel_width  = SIM_PIXEL_SIZE;
+    cam.pixel_height = SIM_PIXEL_SIZE;
+    for (int i = 0; i < SIM_STARS; i++)
+    {
+        cam.stars[i].x    = sim_random() * cam.width;
+        cam.stars[i].y    = sim_random() * cam.height * SIM_SCAN_TILE;
+        cam.stars[i].flux = SIM_STAR_FLUX * powf(sim_random(), 3.0f); // Mostly faint stars
+    }
+    cam.start[0] = cam.start[1] = clock_now();
+    cam.latched  = NULL;
+}
+static uint16_t sim_pixel(float signal)
+{
+    signal += sim_noise(sqrtf(signal > 0.0f ? signal : 0.0f) + SIM_READ_NOISE);
+    return signal <= 0.0f ? 0 : signal >= 65535.0f ? 65535 : (uint16_t)signal;
+}
+static void sim_star(float *signal, int width, int height, float col0, float row0, int xbin, int ybin, struct sim_star *star, float y, float flux)
+{
+    /*
+     * Add one star's gaussian to the binned pixels it covers. Row and column
+     * zero sit at sensor coordinates col0, row0.
+     */
+    float norm = flux * xbin * ybin / (2 * M_PI * SIM_PSF_SIGMA * SIM_PSF_SIGMA);
+    int   xMin = (int)((star->x - SIM_PSF_SIGMA * 4 - col0) / xbin);
+    int   xMax = (int)((star->x + SIM_PSF_SIGMA * 4 - col0) / xbin);
+    int   yMin = (int)((y - SIM_PSF_SIGMA * 4 - row0) / ybin);
+    int   yMax = (int)((y + SIM_PSF_SIGMA * 4 - row0) / ybin);
+    if (xMin < 0) xMin = 0;
+    if (yMin < 0) yMin = 0;
+    if (xMax >= width)  xMax = width  - 1;
+    if (yMax >= height) yMax = height - 1;
+    for (int j = yMin; j <= yMax; j++)
+        for (int i = xMin; i <= xMax; i++)
+        {
+            float dx = star->x - (col0 + (i + 0.5f) * xbin);
+            float dy = y       - (row0 + (j + 0.5f) * ybin);
+            signal[j * width + i] += norm * expf(-(dx * dx + dy * dy) / (2 * SIM_PSF_SIGMA * SIM_PSF_SIGMA));
+        }
+}
+static void sim_latch(int flags, int xoffset, int yoffset, int width, int height, int xbin, int ybin)
+{
+    int64_t now    = clock_now();
+    int     pixels = (width / xbin) * (height / ybin);
+    float  *signal, exposure;
+    if (pixels > cam.latched_count)
+    {
+        cam.latched       = (uint16_t *)realloc(cam.latched, sizeof(uint16_t) * pixels);
+        cam.latched_count = pixels;
+    }
+    signal = (float *)malloc(sizeof(float) * pixels);
+    if (flags & SXCCD_EXP_FLAGS_TDI)
+    {
+        /*
+         * One binned row off the bottom of a sensor sliding over the sky.
+         * Every row spent a full sensor transit integrating.
+         */
+        float tile  = (float)(cam.height * SIM_SCAN_TILE);
+        float sky_y = fmodf((float)(cam.tdi_row * ybin), tile);
+        exposure    = cam.tdi_latch ? (float)(now - cam.tdi_latch) / NSEC_PER_SEC * cam.height / ybin : 0.0f;
+        for (int x = 0; x < pixels; x++)
+            signal[x] = SIM_BIAS + SIM_SKY * exposure * xbin * ybin;
+        for (int i = 0; i < SIM_STARS; i++)
+        {
+            /*
+             * Nearest repeat of the star along the scan.
+             */
+            float y = cam.stars[i].y;
+            if (y - sky_y >  tile / 2) y -= tile;
+            if (y - sky_y < -tile / 2) y += tile;
+            sim_star(signal, width / xbin, 1, 0.0f, sky_y, xbin, ybin, &cam.stars[i], y, cam.stars[i].flux * exposure / cam.height);
+        }
+        cam.tdi_latch = now;
+        cam.tdi_row++;
+    }
+    else
+    {
+        int field = (flags & SXCCD_EXP_FLAGS_FIELD_MASK) == SXCCD_EXP_FLAGS_FIELD_ODD ? 1 : 0;
+        exposure  = (float)(now - cam.start[field]) / NSEC_PER_SEC;
+        for (int x = 0; x < pixels; x++)
+            signal[x] = SIM_BIAS + SIM_SKY * exposure * xbin * ybin;
+        for (int i = 0; i < SIM_STARS; i++)
+            if (cam.stars[i].y < cam.height)
+                sim_star(signal, width / xbin, height / ybin, xoffset, yoffset, xbin, ybin, &cam.stars[i], cam.stars[i].y, cam.stars[i].flux * exposure);
+        /*
+         * Photosites start integrating again as soon as their charge is latched.
+         */
+        if (flags & SXCCD_EXP_FLAGS_FIELD_EVEN) cam.start[0] = now;
+        if (flags & SXCCD_EXP_FLAGS_FIELD_ODD)  cam.start[1] = now;
+    }
+    for (int x = 0; x < pixels; x++)
+        cam.latched[x] = sim_pixel(signal[x]);
+    free(signal);
+}
+/*
+ * Camera operations, real or simulated. Return non-zero on success like libsxccd.
+ */
+static int cam_clear(int flags)
+{
+    if (cam.simulated)
+    {
+        int64_t now = clock_now();
+        if (!(flags & SXCCD_EXP_FLAGS_NOWIPE_FRAME))
+        {
+            if (flags & SXCCD_EXP_FLAGS_FIELD_EVEN) cam.start[0] = now;
+            if (flags & SXCCD_EXP_FLAGS_FIELD_ODD)  cam.start[1] = now;
+        }
+        cam.tdi_latch = 0;
+        return 1;
+    }
+    return sxClearImage(cam.handle, flags, SXCCD_IMAGE_HEAD);
+}
+static int cam_latch(int flags, int xoffset, int yoffset, int width, int height, int xbin, int ybin)
+{
+    if (cam.simulated)
+    {
+        sim_latch(flags, xoffset, yoffset, width, height, xbin, ybin);
+        return 1;
+    }
+    return sxLatchImage(cam.handle, flags, SXCCD_IMAGE_HEAD, xoffset, yoffset, width, height, xbin, ybin);
+}
+static int cam_read(uint16_t *pixels, int count)
+{
+    if (cam.simulated)
+    {
+        memcpy(pixels, cam.latched, sizeof(uint16_t) * (count < cam.latched_count ? count : cam.latched_count));
+        return count;
+    }
+    return sxReadImage(cam.handle, pixels, count);
+}
+/*
+ * Frame statistics.
+ */
+static void json_stats(uint16_t *pixels, int count)
+{
+    double sum = 0.0, sum_sq = 0.0, mean;
+    int    pixel_min = MAX_PIX, pixel_max = MIN_PIX;
+    for (int i = 0; i < count; i++)
+    {
+        if (pixels[i] < pixel_min) pixel_min = pixels[i];
+        if (pixels[i] > pixel_max) pixel_max = pixels[i];
+        sum    += pixels[i];
+        sum_sq += (double)pixels[i] * pixels[i];
+    }
+    mean = count ? sum / count : 0.0;
+    printf(",\"min\":%d,\"max\":%d,\"mean\":%.2f,\"stddev\":%.2f", pixel_min, pixel_max, mean,
+           count ? sqrt(fmax(sum_sq / count - mean * mean, 0.0)) : 0.0);
+}
+static int write_fits(struct job *job, const char *filename, uint16_t *pixels, int width, int height, int exposure)
+{
+    if (fits_open(filename)
+     || fits_write_image(pixels, width, height)
+     || fits_write_key_int("EXPOSURE", exposure, "Total Exposure Time")
+     || fits_write_key_int("XBINNING", job->xbin, "Horizontal Binning")
+     || fits_write_key_int("YBINNING", job->ybin, "Vertical Binning")
+     || fits_write_key_float("XPIXSZ", cam.pixel_width * job->xbin, "Binned Pixel Width (microns)")
+     || fits_write_key_float("YPIXSZ", cam.pixel_height * job->ybin, "Binned Pixel Height (microns)")
+     || (job->type == JOB_TDI && fits_write_key_float("SCANRATE", job->rate, "Scan Rate (rows/sec)"))
+     || fits_write_key_string("CREATOR", "sxcapd", "Imaging Application")
+     || fits_write_key_string("CAMERA", cam.simulated ? "Simulated Camera" : "StarLight Xpress Camera", "Imaging Device")
+     || fits_close())
+    {
+        fits_cleanup();
+        return -1;
+    }
+    return 0;
+}
+/*
+ * Snapshot and focus jobs. Both expose full frames; snapshots are saved,
+ * focus frames report the best star instead.
+ */
+static int frame_start(struct job *job)
+{
+    job->width       = cam.width / job->xbin;
+    job->height      = (cam.interlaced ? cam.height * 2 : cam.height) / job->ybin;
+    job->pixel_count = job->width * job->height;
+    job->pixels      = (uint16_t *)malloc(sizeof(uint16_t) * job->pixel_count);
+    if (cam.interlaced)
+        job->field_pixels = (uint16_t *)malloc(sizeof(uint16_t) * job->pixel_count / 2);
+    job->frame       = 0;
+    job->field       = 0;
+    cam_clear(SXCCD_EXP_FLAGS_FIELD_BOTH);
+    job->frame_start = clock_now();
+    job->deadline    = job->frame_start + job->exposure * NSEC_PER_MSEC;
+    return JOB_NEXT;
+}
+static int frame_done(struct job *job)
+{
+    char filename[MAX_PATH + 16];
+    json_begin("frame", job);
+    printf(",\"frame\":%d,\"exposure\":%d,\"elapsed\":%.3f", job->frame, job->exposure,
+           (double)(clock_now() - job->frame_start) / NSEC_PER_SEC);
+    json_stats(job->pixels, job->pixel_count);
+    if (job->type == JOB_FOCUS)
+    {
+        float xCentroid = job->width  / 2;
+        float yCentroid = job->height / 2;
+        int   xRadius   = TRACK_STAR_RADIUS / (cam.pixel_width  * job->xbin);
+        int   yRadius   = TRACK_STAR_RADIUS / (cam.pixel_height * job->ybin);
+        if (findBestCentroid(job->width, job->height, job->pixels,
+                             &xCentroid, &yCentroid,
+                             job->width / 2, job->height / 2,
+                             &xRadius, &yRadius,
+                             TRACK_STAR_SIGMA))
+            printf(",\"star\":{\"x\":%.2f,\"y\":%.2f,\"xradius\":%d,\"yradius\":%d}", xCentroid, yCentroid, xRadius, yRadius);
+        else
+            printf(",\"star\":null");
+    }
+    if (job->type == JOB_SNAP)
+    {
+        if (job->count > 1)
+            sprintf(filename, "%s%03d.fits", job->file, job->frame);
+        else
+            sprintf(filename, "%s.fits", job->file);
+        if (write_fits(job, filename, job->pixels, job->width, job->height, job->exposure))
+        {
+            json_end();
+            json_error(job, "writing FITS file failed");
+            return JOB_ERROR;
+        }
+        printf(",\"file\":");
+        json_string(filename);
+    }
+    json_end();
+    if (++job->frame >= job->count)
+        return JOB_DONE;
+    cam_clear(SXCCD_EXP_FLAGS_FIELD_BOTH);
+    job->frame_start = clock_now();
+    job->deadline    = job->frame_start + job->exposure * NSEC_PER_MSEC;
+    return JOB_NEXT;
+}
+static int frame_step(struct job *job)
+{
+    if (!cam.interlaced)
+    {
+        if (!cam_latch(SXCCD_EXP_FLAGS_FIELD_BOTH, 0, 0, cam.width, cam.height, job->xbin, job->ybin)
+         || !cam_read(job->pixels, job->pixel_count))
+        {
+            json_error(job, "camera read failed");
+            return JOB_ERROR;
+        }
+        return frame_done(job);
+    }
+    /*
+     * Interlaced sensors: read the even field, then integrate and read the odd
+     * field on its own and interleave the two.
+     */
+    int field_width  = job->width;
+    int field_height = job->height / 2;
+    if (!cam_latch(job->field == 0 ? SXCCD_EXP_FLAGS_FIELD_EVEN : SXCCD_EXP_FLAGS_FIELD_ODD, 0, 0, cam.width, cam.height, job->xbin, job->ybin)
+     || !cam_read(job->field_pixels, job->pixel_count / 2))
+    {
+        json_error(job, "camera read failed");
+        return JOB_ERROR;
+    }
+    for (int l = 0; l < field_height; l++)
+        memcpy(job->pixels + (2 * l + job->field) * field_width, job->field_pixels + l * field_width, sizeof(uint16_t) * field_width);
+    if (job->field == 0)
+    {
+        job->field    = 1;
+        cam_clear(SXCCD_EXP_FLAGS_FIELD_BOTH);
+        job->deadline = clock_now() + job->exposure * NSEC_PER_MSEC;
+        return JOB_NEXT;
+    }
+    job->field = 0;
+    return frame_done(job);
+}
+/*
+ * TDI scan job. Rows latch against absolute deadlines and stream to a spill
+ * file; the FITS file is written from the mapped spill file at the end.
+ */
+static int tdi_start(struct job *job)
+{
+    char spill_name[] = "/tmp/sxcapdXXXXXX";
+    int  fd;
+    if (job->rate <= 0.0)
+    {
+        json_error(job, "tdi needs a rate");
+        return JOB_ERROR;
+    }
+    job->width      = cam.width / job->xbin;
+    job->height     = cam.height / job->ybin;
+    job->row_period = NSEC_PER_SEC / job->rate * job->ybin;
+    job->rows       = (long)(job->minutes * 60.0 * NSEC_PER_SEC / job->row_period);
+    if (job->rows < job->height * 2)
+        job->rows = job->height * 2;
+    job->pixels     = (uint16_t *)malloc(sizeof(uint16_t) * job->width);
+    if ((fd = mkstemp(spill_name)) < 0 || (job->spill = fdopen(fd, "w+b")) == NULL)
+    {
+        json_error(job, "creating spill file failed");
+        return JOB_ERROR;
+    }
+    strcpy(job->spill_name, spill_name);
+    job->row        = 0;
+    job->row_time   = 0.0;
+    job->late_sum   = job->late_max = 0.0;
+    job->late_count = 0;
+    cam_clear(SXCCD_EXP_FLAGS_FIELD_BOTH);
+    job->scan_start = clock_now();
+    job->row_time  += job->row_period;
+    job->deadline   = job->scan_start + (int64_t)job->row_time;
+    return JOB_NEXT;
+}
+static int tdi_finish(struct job *job)
+{
+    /*
+     * Skip the ramp up frame.
+     */
+    int       height = job->row - job->height;
+    size_t    size   = sizeof(uint16_t) * job->row * job->width;
+    uint16_t *scan;
+    int       err    = 0;
+    if (height <= 0)
+    {
+        json_error(job, "scan shorter than a frame");
+        return JOB_ERROR;
+    }
+    if (fflush(job->spill)
+     || (scan = (uint16_t *)mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(job->spill), 0)) == MAP_FAILED)
+    {
+        json_error(job, "mapping spill file failed");
+        return JOB_ERROR;
+    }
+    if (write_fits(job, job->file, scan + job->height * job->width, job->width, height, (int)(height * job->row_period / NSEC_PER_MSEC)))
+    {
+        json_error(job, "writing FITS file failed");
+        err = 1;
+    }
+    munmap(scan, size);
+    if (!err)
+    {
+        json_begin("scan", job);
+        printf(",\"rows\":%ld,\"height\":%d,\"file\":", job->row, height);
+        json_string(job->file);
+        json_end();
+    }
+    return err ? JOB_ERROR : JOB_DONE;
+}
+static int tdi_step(struct job *job)
+{
+    double late = (double)(clock_now() - job->deadline) / NSEC_PER_MSEC;
+    if (!cam_latch(SXCCD_EXP_FLAGS_TDI | SXCCD_EXP_FLAGS_FIELD_BOTH, 0, 0, cam.width, job->ybin, job->xbin, job->ybin)
+     || !cam_read(job->pixels, job->width))
+    {
+        json_error(job, "camera read failed");
+        return JOB_ERROR;
+    }
+    if (fwrite(job->pixels, sizeof(uint16_t), job->width, job->spill) != (size_t)job->width)
+    {
+        json_error(job, "writing spill file failed");
+        return JOB_ERROR;
+    }
+    job->late_sum += late;
+    if (late > job->late_max)
+        job->late_max = late;
+    if (late > job->row_period / NSEC_PER_MSEC * LATE_ROW_FRACTION)
+        job->late_count++;
+    /*
+     * Report once per frame height of rows.
+     */
+    if (++job->row % job->height == 0)
+    {
+        json_begin("rows", job);
+        printf(",\"row\":%ld,\"of\":%ld,\"latency\":%.3f,\"late_max\":%.3f,\"late\":%d",
+               job->row, job->rows, job->late_sum / job->height, job->late_max, job->late_count);
+        json_stats(job->pixels, job->width);
+        json_end();
+        job->late_sum   = job->late_max = 0.0;
+        job->late_count = 0;
+    }
+    if (job->row >= job->rows)
+        return tdi_finish(job);
+    job->row_time += job->row_period;
+    job->deadline  = job->scan_start + (int64_t)job->row_time;
+    return JOB_NEXT;
+}
+static void job_cleanup(struct job *job)
+{
+    free(job->pixels);
+    free(job->field_pixels);
+    job->pixels = job->field_pixels = NULL;
+    if (job->spill)
+    {
+        fclose(job->spill);
+        unlink(job->spill_name);
+        job->spill = NULL;
+    }
+}
+/*
+ * Run one job through the event loop.
+ */
+static int run_job(struct job *job)
+{
+    int status;
+    json_begin("start", job);
+    printf(",\"line\":%d", job->line);
+    json_end();
+    status = job->type == JOB_TDI ? tdi_start(job) : frame_start(job);
+    while (status == JOB_NEXT)
+    {
+        if (wait_until(job->deadline))
+        {
+            /*
+             * Stopped: keep whatever a TDI scan has collected so far.
+             */
+            if (job->type == JOB_TDI && job->row > job->height)
+                tdi_finish(job);
+            status = JOB_ERROR;
+            break;
+        }
+        status = job->type == JOB_TDI ? tdi_step(job) : frame_step(job);
+    }
+    job_cleanup(job);
+    json_begin("done", job);
+    printf(",\"status\":\"%s\"", stopping ? "stopped" : status == JOB_DONE ? "ok" : "error");
+    json_end();
+    return status == JOB_DONE ? 0 : -1;
+}
+/*
+ * Job file. One job per line, a type followed by key=value pairs:
+ *
+ *  snap  count=10 exposure=2000 file=m42-
+ *  focus count=50 exposure=100 xbin=2 ybin=2
+ *  tdi   rate=1.234 minutes=60 ybin=2 file=scan.fits
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ */
+static int parse_job(char *line, int line_num, struct job *job)
+{
+    char *argv[MAX_ARGS];
+    int   argc = 0;
+    char *token;
+    for (token = strtok(line, " \t\r\n"); token && argc < MAX_ARGS; token = strtok(NULL, " \t\r\n"))
+        argv[argc++] = token;
+    if (argc == 0 || argv[0][0] == '#')
+        return 0;
+    memset(job, 0, sizeof(struct job));
+    job->line     = line_num;
+    job->count    = 1;
+    job->exposure = 1000;
+    job->xbin     = 1;
+    job->ybin     = 1;
+    job->minutes  = 60.0;
+    if      (!strcmp(argv[0], "snap"))  { job->type = JOB_SNAP;  strcpy(job->file, "snap"); }
+    else if (!strcmp(argv[0], "focus")) { job->type = JOB_FOCUS; job->count = 10; job->exposure = 100; }
+    else if (!strcmp(argv[0], "tdi"))   { job->type = JOB_TDI;   strcpy(job->file, "scan.fits"); }
+    else
+    {
+        fprintf(stderr, "Line %d: unknown job '%s'\n", line_num, argv[0]);
+        return -1;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        char *value = strchr(argv[i], '=');
+        if (value == NULL)
+        {
+            fprintf(stderr, "Line %d: expected key=value, got '%s'\n", line_num, argv[i]);
+            return -1;
+        }
+        *value++ = '\0';
+        if      (!strcmp(argv[i], "count"))    job->count    = atoi(value);
+        else if (!strcmp(argv[i], "exposure")) job->exposure = atoi(value);
+        else if (!strcmp(argv[i], "xbin"))     job->xbin     = atoi(value);
+        else if (!strcmp(argv[i], "ybin"))     job->ybin     = atoi(value);
+        else if (!strcmp(argv[i], "rate"))     job->rate     = atof(value);
+        else if (!strcmp(argv[i], "minutes"))  job->minutes  = atof(value);
+        else if (!strcmp(argv[i], "file"))
+        {
+            strncpy(job->file, value, MAX_PATH - 1);
+            job->file[MAX_PATH - 1] = '\0';
+        }
+        else
+        {
+            fprintf(stderr, "Line %d: unknown key '%s'\n", line_num, argv[i]);
+            return -1;
+        }
+    }
+    if (job->count < 1 || job->exposure < 0 || job->xbin < 1 || job->xbin > 4 || job->ybin < 1 || job->ybin > 4)
+    {
+        fprintf(stderr, "Line %d: parameter out of range\n", line_num);
+        return -1;
+    }
+    return 1;
+}
+static int connect_camera(int index, int simulate)
+{
+    memset(&cam, 0, sizeof(cam));
+    if (simulate)
+    {
+        sim_init();
+        return 0;
+    }
+    cam_count = sxProbe(cam_handles, cam_params, 0);
+    if (index >= cam_count)
+        return -1;
+    cam.handle       = cam_handles[index];
+    cam.model        = sxGetCameraModel(cam.handle);
+    cam.interlaced   = (cam.model & SXCCD_INTERLEAVE) != 0;
+    cam.width        = cam_params[index].width;
+    cam.height       = cam_params[index].height;
+    cam.pixel_width  = cam_params[index].pix_width;
+    cam.pixel_height = cam_params[index].pix_height;
+    if (cam.interlaced)
+        cam.pixel_height /= 2;
+    return 0;
+}
+int main(int argc, char **argv)
+{
+    FILE      *jobs;
+    char       line[MAX_LINE];
+    struct job job;
+    int        line_num = 0, parsed, err = 0, index = 0, simulate = 0, opt;
+    struct sigaction action;
+    while ((opt = getopt(argc, argv, "c:sh")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                index = atoi(optarg);
+                break;
+            case 's':
+                simulate = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c camera index] [-s] [job file]\n", argv[0]);
+                fprintf(stderr, "  -s  use the simulated camera\n");
+                return 1;
+        }
+    }
+    if (optind < argc)
+    {
+        if ((jobs = fopen(argv[optind], "r")) == NULL)
+        {
+            fprintf(stderr, "Unable to open job file %s\n", argv[optind]);
+            return 1;
+        }
+    }
+    else
+        jobs = stdin;
+    if (connect_camera(index, simulate))
+    {
+        fprintf(stderr, "No camera found\n");
+        return 1;
+    }
+    /*
+     * Signals end the current job cleanly through the event loop.
+     */
+    if (pipe(signal_pipe))
+        return 1;
+    fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    json_begin("camera", NULL);
+    printf(",\"simulated\":%s,\"model\":%d,\"width\":%d,\"height\":%d,\"interlaced\":%s,\"pixel_width\":%.2f,\"pixel_height\":%.2f",
+           cam.simulated ? "true" : "false", cam.model, cam.width, cam.height,
+           cam.interlaced ? "true" : "false", cam.pixel_width, cam.pixel_height);
+    json_end();
+    while (!stopping && fgets(line, sizeof(line), jobs))
+    {
+        line_num++;
+        if ((parsed = parse_job(line, line_num, &job)) < 0)
+        {
+            err = 1;
+            break;
+        }
+        if (parsed)
+        {
+            job.index = job_count++;
+            if (run_job(&job))
+                err = 1;
+        }
+    }
+    if (jobs != stdin)
+        fclose(jobs);
+    if (cam_count)
+        sxRelease(cam_handles, cam_count);
+    free(cam.latched);
+    return err;
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ccd_combine.h"
+#include "fits.h"
+#define NSEC_PER_SEC        1000000000LL
+#define FITS_RECORD_SIZE    2880
+#define FITS_CARD_SIZE      80
+#define FITS_CARD_COUNT     (FITS_RECORD_SIZE/FITS_CARD_SIZE)
+#define MAX_PIXEL           65535.0
+#define HOT_SIGS            8.0     // Hot pixels stand this far above the master's spread
+#define DEAD_FLAT           0.5     // Flat response below this fraction of the median is dead
+#define LEVEL_STEP          4       // Sample every 4th pixel of the center for levels
+#define PEDESTAL            1000.0  // Lifts bias subtracted darks so their negative noise fits 16 bits
+/*
+ * Master types.
+ */
+enum
+{
+    MASTER_BIAS = 0,
+    MASTER_DARK,
+    MASTER_FLAT
+};
+static const char *master_names[] = {"bias", "dark", "flat"};
+static const char *master_types[] = {"Bias Frame", "Dark Frame", "Flat Field"};
+/*
+ * A calibration frame read in place, a band of rows at a time.
+ */
+struct frame
+{
+    const char *name;
+    int         fd;
+    off_t       offset;
+    float       exposure;
+    float       pedestal;   // From the header, removed as the frame is read
+    float       level;
+    float       scale;
+};
+struct master
+{
+    int           type;
+    int           width, height;
+    float         exposure;
+    int           frame_count;
+    struct frame *frames;
+    float        *bias;       // Master bias to subtract, top row first
+    float        *dark;       // Master dark to subtract, scaled by exposure
+    float         dark_exposure;
+    float         pedestal;   // Added to the calibrated frames before they are combined
+    int           scaling;    // Frame scales are applied
+};
+/*
+ * Monotonic clock in seconds.
+ */
+static double clock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / NSEC_PER_SEC;
+}
+static void json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            printf("\\%c", *str);
+        else if ((unsigned char)*str < ' ')
+            printf("\\u%04x", *str);
+        else
+            putchar(*str);
+    }
+    putchar('"');
+}
+static void json_begin(const char *event, int type)
+{
+    printf("{\"event\":\"%s\",\"type\":\"%s\",\"time\":%.3f", event, master_names[type], clock_now());
+}
+static void json_end(void)
+{
+    printf("}\n");
+    fflush(stdout);
+}
+/*
+ * Read the primary header of a 16 bit FITS image. Returns the file
+ * descriptor positioned anywhere, and the data offset, or -1 on error.
+ */
+static int fits_open_frame(const char *name, int *width, int *height, float *exposure, float *pedestal, off_t *offset)
+{
+    char key[10], record[FITS_CARD_COUNT][FITS_CARD_SIZE + 1];
+    int  fd, i, records = 0, done = 0, depth = 0, naxis = 0, zimage = 0;
+    float zero = 0.0;
+    *width = *height = 0;
+    *exposure = *pedestal = 0.0;
+    if ((fd = open(name, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    while (!done)
+    {
+        char buf[FITS_RECORD_SIZE];
+        if (read(fd, buf, FITS_RECORD_SIZE) != FITS_RECORD_SIZE)
+            break;
+        for (i = 0; i < FITS_CARD_COUNT && !done; i++)
+        {
+            memcpy(record[i], buf + i * FITS_CARD_SIZE, FITS_CARD_SIZE);
+            record[i][FITS_CARD_SIZE] = '\0';
+            key[0] = '\0';
+            sscanf(record[i], "%8s", key);
+            if (records == 0 && i == 0 && strcmp(key, "SIMPLE"))
+                break;
+            if (!strcmp(key, "BITPIX"))
+                sscanf(&record[i][10], "%d", &depth);
+            else if (!strcmp(key, "NAXIS"))
+                sscanf(&record[i][10], "%d", &naxis);
+            else if (!strcmp(key, "NAXIS1"))
+                sscanf(&record[i][10], "%d", width);
+            else if (!strcmp(key, "NAXIS2"))
+                sscanf(&record[i][10], "%d", height);
+            else if (!strcmp(key, "BZERO"))
+                sscanf(&record[i][10], "%f", &zero);
+            else if (!strcmp(key, "EXPOSURE") || !strcmp(key, "EXPTIME"))
+                sscanf(&record[i][10], "%f", exposure);
+            else if (!strcmp(key, "PEDESTAL"))
+                sscanf(&record[i][10], "%f", pedestal);
+            else if (!strcmp(key, "ZIMAGE"))
+                zimage = 1;
+            else if (!strcmp(key, "END"))
+                done = 1;
+        }
+        if (i == 0)
+            break;
+        records++;
+    }
+    if (!done || zimage || depth != 16 || naxis != 2 || zero != 32768.0 || *width <= 0 || *height <= 0)
+    {
+        fprintf(stderr, "%s is not an uncompressed 16 bit unsigned FITS image\n", name);
+        close(fd);
+        return -1;
+    }
+    *offset = (off_t)records * FITS_RECORD_SIZE;
+    return fd;
+}
+/*
+ * Read rows of a frame, top row first, as calibrated floats. FITS rows are
+ * stored bottom up, big endian and offset by BZERO, and any pedestal the
+ * frame was written with is taken off again.
+ */
+static int read_frame_rows(struct master *master, struct frame *frame, int y, int rows, float *dst)
+{
+    int            pitch = master->width * 2, i, x;
+    unsigned char *raw, *src;
+    float         *row, *bias, *dark, dark_scale, scale;
+    if ((raw = malloc(rows * pitch)) == NULL)
+        return -1;
+    if (pread(frame->fd, raw, rows * pitch, frame->offset + (off_t)(master->height - y - rows) * pitch) != rows * pitch)
+    {
+        free(raw);
+        return -1;
+    }
+    dark_scale = (master->dark && master->dark_exposure > 0.0) ? frame->exposure / master->dark_exposure : 1.0;
+    scale      = master->scaling ? frame->scale : 1.0;
+    for (i = 0; i < rows; i++)
+    {
+        src  = raw + (rows - 1 - i) * pitch;
+        row  = dst + i * master->width;
+        bias = master->bias ? master->bias + (y + i) * master->width : NULL;
+        dark = master->dark ? master->dark + (y + i) * master->width : NULL;
+        for (x = 0; x < master->width; x++)
+            row[x] = (float)(((src[x * 2] << 8) | src[x * 2 + 1]) ^ 0x8000) - frame->pedestal;
+        if (bias)
+            for (x = 0; x < master->width; x++)
+                row[x] -= bias[x];
+        if (dark)
+            for (x = 0; x < master->width; x++)
+                row[x] -= dark[x] * dark_scale;
+        if (scale != 1.0)
+            for (x = 0; x < master->width; x++)
+                row[x] *= scale;
+    }
+    free(raw);
+    return 0;
+}
+/*
+ * Band reader for the combine engine, called from several threads at once.
+ * The combine runs on 16 bit pixels, so bias subtracted darks carry the
+ * pedestal through it rather than losing their negative noise at 0.
+ */
+static int read_rows(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst)
+{
+    struct master  *master = source;
+    unsigned short *pixels = (unsigned short *)dst;
+    float          *band;
+    unsigned int    p;
+    if ((band = malloc(rows * master->width * sizeof(float))) == NULL)
+        return -1;
+    if (read_frame_rows(master, &master->frames[frame], y, rows, band))
+    {
+        free(band);
+        return -1;
+    }
+    for (p = 0; p < rows * master->width; p++)
+    {
+        band[p]  += master->pedestal;
+        pixels[p] = band[p] <= 0.0 ? 0 : band[p] >= MAX_PIXEL ? (unsigned short)MAX_PIXEL : (unsigned short)(band[p] + 0.5);
+    }
+    free(band);
+    return 0;
+}
+/*
+ * Load a whole master frame to subtract.
+ */
+static float *load_master(struct master *master, const char *name, float *exposure)
+{
+    struct master plain;
+    struct frame  frame;
+    int           width, height;
+    float        *pixels;
+    if ((frame.fd = fits_open_frame(name, &width, &height, &frame.exposure, &frame.pedestal, &frame.offset)) < 0)
+        return NULL;
+    if (width != master->width || height != master->height)
+    {
+        fprintf(stderr, "%s doesn't match the frame size\n", name);
+        close(frame.fd);
+        return NULL;
+    }
+    memset(&plain, 0, sizeof(plain));
+    plain.width  = width;
+    plain.height = height;
+    if ((pixels = malloc(width * height * sizeof(float))) && read_frame_rows(&plain, &frame, 0, height, pixels))
+    {
+        free(pixels);
+        pixels = NULL;
+    }
+    close(frame.fd);
+    *exposure = frame.exposure;
+    return pixels;
+}
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return fa < fb ? -1 : fa > fb;
+}
+/*
+ * Median of every LEVEL_STEP'th pixel in the central half of the columns of
+ * the given rows, with the robust spread if asked for.
+ */
+static float sample_median(float *plane, int width, int first, int rows, float *mad)
+{
+    int    x, y, n = 0, count;
+    float *samples, median;
+    count = ((rows + LEVEL_STEP - 1) / LEVEL_STEP) * ((width / 2 + LEVEL_STEP - 1) / LEVEL_STEP);
+    if ((samples = malloc((count ? count : 1) * sizeof(float))) == NULL)
+        return 0.0;
+    for (y = first; y < first + rows; y += LEVEL_STEP)
+        for (x = width / 4; x < width / 4 + width / 2 && n < count; x += LEVEL_STEP)
+            samples[n++] = plane[y * width + x];
+    qsort(samples, n, sizeof(float), compare_floats);
+    median = n ? samples[n / 2] : 0.0;
+    if (mad)
+    {
+        for (x = 0; x < n; x++)
+            samples[x] = fabs(samples[x] - median);
+        qsort(samples, n, sizeof(float), compare_floats);
+        *mad = n ? samples[n / 2] * 1.4826 : 0.0;
+    }
+    free(samples);
+    return median;
+}
+/*
+ * Flat frames are brought to a common level before combining, so a sky that
+ * brightened through the run doesn't weight the master.
+ */
+static int level_frames(struct master *master)
+{
+    int    f, rows = master->height / 2;
+    float *band, target = 0.0;
+    if ((band = malloc(rows * master->width * sizeof(float))) == NULL)
+        return -1;
+    for (f = 0; f < master->frame_count; f++)
+    {
+        if (read_frame_rows(master, &master->frames[f], master->height / 4, rows, band))
+        {
+            free(band);
+            return -1;
+        }
+        master->frames[f].level = sample_median(band, master->width, 0, rows, NULL);
+        if (master->frames[f].level <= 0.0)
+        {
+            fprintf(stderr, "%s has no signal\n", master->frames[f].name);
+            free(band);
+            return -1;
+        }
+        target += master->frames[f].level / master->frame_count;
+        json_begin("level", master->type);
+        printf(",\"frame\":%d,\"level\":%.2f", f, master->frames[f].level);
+        json_end();
+    }
+    for (f = 0; f < master->frame_count; f++)
+        master->frames[f].scale = target / master->frames[f].level;
+    master->scaling = 1;
+    free(band);
+    return 0;
+}
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -t bias|dark|flat [-o master.fits] [-b bias.fits] [-d dark.fits]\n", prog);
+    fprintf(stderr, "          [-m clip|winsor|median|mean] [-e exposure msec] frame.fits ...\n");
+}
+int main(int argc, char **argv)
+{
+    struct master   master;
+    const char     *output = NULL, *bias_name = NULL, *dark_name = NULL;
+    unsigned short *pixels;
+    float          *sigma, *plane, bias_exposure, median, mad, noise, exposure_override = -1.0;
+    int             opt, op = CCD_IMAGE_COMBINE_SIGMA_CLIP, f, width, height, hot = 0, dead = 0;
+    long            p, size;
+    double          start, mean;
+    char            default_output[32];
+    memset(&master, 0, sizeof(master));
+    master.type = -1;
+    while ((opt = getopt(argc, argv, "t:o:b:d:m:e:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                for (master.type = MASTER_FLAT; master.type >= 0 && strcmp(optarg, master_names[master.type]); master.type--);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'b':
+                bias_name = optarg;
+                break;
+            case 'd':
+                dark_name = optarg;
+                break;
+            case 'm':
+                if (!strcmp(optarg, "clip"))
+                    op = CCD_IMAGE_COMBINE_SIGMA_CLIP;
+                else if (!strcmp(optarg, "winsor"))
+                    op = CCD_IMAGE_COMBINE_WINSORIZE;
+                else if (!strcmp(optarg, "median"))
+                    op = CCD_IMAGE_COMBINE_MEDIAN;
+                else if (!strcmp(optarg, "mean"))
+                    op = CCD_IMAGE_COMBINE_MEAN;
+                else
+                    op = -1;
+                break;
+            case 'e':
+                exposure_override = atof(optarg) / 1000.0;
+                break;
+            default:
+                op = -1;
+        }
+    }
+    if (master.type < 0 || op < 0 || optind >= argc || (master.type == MASTER_BIAS && (bias_name || dark_name)))
+    {
+        usage(argv[0]);
+        fprintf(stderr, "  -b and -d subtract a master bias and a master dark (scaled by exposure) from\n");
+        fprintf(stderr, "     dark and flat frames. -e gives the frame exposure when the FITS header\n");
+        fprintf(stderr, "     doesn't have it in seconds.\n");
+        return 1;
+    }
+    if (!output)
+    {
+        sprintf(default_output, "master_%s.fits", master_names[master.type]);
+        output = default_output;
+    }
+    start = clock_now();
+    /*
+     * Open every frame and check they all agree.
+     */
+    master.frame_count = argc - optind;
+    if ((master.frames = calloc(master.frame_count, sizeof(struct frame))) == NULL)
+        return 1;
+    for (f = 0; f < master.frame_count; f++)
+    {
+        master.frames[f].name  = argv[optind + f];
+        master.frames[f].scale = 1.0;
+        if ((master.frames[f].fd = fits_open_frame(master.frames[f].name, &width, &height, &master.frames[f].exposure, &master.frames[f].pedestal, &master.frames[f].offset)) < 0)
+            return 1;
+        if (exposure_override >= 0.0)
+            master.frames[f].exposure = exposure_override;
+        if (f == 0)
+        {
+            master.width  = width;
+            master.height = height;
+        }
+        else if (width != master.width || height != master.height)
+        {
+            fprintf(stderr, "%s doesn't match the size of %s\n", master.frames[f].name, master.frames[0].name);
+            return 1;
+        }
+        master.exposure += master.frames[f].exposure / master.frame_count;
+        json_begin("frame", master.type);
+        printf(",\"frame\":%d,\"exposure\":%.3f,\"file\":", f, master.frames[f].exposure);
+        json_string(master.frames[f].name);
+        json_end();
+    }
+    if (bias_name && (master.bias = load_master(&master, bias_name, &bias_exposure)) == NULL)
+        return 1;
+    if (dark_name && (master.dark = load_master(&master, dark_name, &master.dark_exposure)) == NULL)
+        return 1;
+    if (master.type == MASTER_FLAT && level_frames(&master))
+        return 1;
+    if (master.type == MASTER_DARK && master.bias)
+        master.pedestal = PEDESTAL;
+    /*
+     * Stream the frames through the combine engine, band by band.
+     */
+    size   = (long)master.width * master.height;
+    pixels = malloc(size * sizeof(unsigned short));
+    sigma  = malloc(size * sizeof(float));
+    plane  = malloc(size * sizeof(float));
+    if (!pixels || !sigma || !plane)
+    {
+        fprintf(stderr, "Not enough memory for a %dx%d master\n", master.width, master.height);
+        return 1;
+    }
+    if (ccd_combine_stream(master.width, master.height, 16, (unsigned char *)pixels, sigma, read_rows, &master, master.frame_count, op))
+    {
+        fprintf(stderr, "Error reading frames\n");
+        return 1;
+    }
+    for (f = 0; f < master.frame_count; f++)
+        close(master.frames[f].fd);
+    /*
+     * Statistics. The noise is the typical spread of a pixel through the
+     * frames: read noise for a bias, read plus dark shot noise for a dark.
+     * The levels are measured without the pedestal.
+     */
+    for (p = 0, mean = 0.0; p < size; p++)
+    {
+        plane[p] = pixels[p] - master.pedestal;
+        mean    += plane[p];
+    }
+    mean  /= size;
+    median = sample_median(plane, master.width, master.height / 4, master.height / 2, &mad);
+    noise  = sample_median(sigma, master.width, master.height / 4, master.height / 2, NULL);
+    for (p = 0; p < size; p++)
+    {
+        if (mad > 0.0 && plane[p] > median + mad * HOT_SIGS)
+            hot++;
+        if (master.type == MASTER_FLAT && plane[p] < median * DEAD_FLAT)
+            dead++;
+    }
+    if (fits_open(output)
+     || fits_write_image(pixels, master.width, master.height)
+     || fits_write_key_float("EXPOSURE", master.exposure, "Mean Exposure Time")
+     || fits_write_key_string("IMAGETYP", master_types[master.type], "Type of Image")
+     || fits_write_key_int("NCOMBINE", master.frame_count, "Number of Frames Combined")
+     || fits_write_key_float("NOISE", noise, "Median Pixel Noise Through Frames (ADU)")
+     || (master.pedestal > 0.0 && fits_write_key_float("PEDESTAL", master.pedestal, "Added to Every Pixel, Subtract Before Use (ADU)"))
+     || fits_write_key_string("CREATOR", "sxmaster", "Imaging Application")
+     || fits_close())
+    {
+        fits_cleanup();
+        fprintf(stderr, "Unable to write %s\n", output);
+        return 1;
+    }
+    json_begin("master", master.type);
+    printf(",\"frames\":%d,\"width\":%d,\"height\":%d,\"exposure\":%.3f,\"elapsed\":%.3f,\"mean\":%.2f,\"median\":%.2f,\"sigma\":%.2f,\"noise\":%.2f,\"hot\":%d",
+           master.frame_count, master.width, master.height, master.exposure, clock_now() - start, mean, median, mad, noise, hot);
+    if (master.type == MASTER_DARK && master.bias && master.exposure > 0.0)
+        printf(",\"dark_current\":%.4f", median / master.exposure);
+    if (master.type == MASTER_FLAT)
+        printf(",\"dead\":%d", dead);
+    printf(",\"file\":");
+    json_string(output);
+    json_end();
+    return 0;
+}
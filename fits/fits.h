@@ -1,10 +1,27 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+/*
+ * Tile compression types (FITS tiled image convention).
+ */
+#define FITS_COMPRESS_NONE  0
+#define FITS_COMPRESS_RICE  1
+#define FITS_COMPRESS_GZIP  2
+/*
+ * Row filter: copy width pixels from src to dst, changing them on the way.
+ */
+typedef void (*fits_row_filter)(const unsigned short *src, unsigned short *dst, int width, void *data);
 int fits_write_key_int(const char *key, int value, const char *comment);
 int fits_write_key_float(const char *key, float value, const char *comment);
 int fits_write_key_string(const char *key, const char * value, const char *comment);
+int fits_template_begin(void);
+int fits_template_end(void);
+int fits_write_template(void);
 int fits_write_image(unsigned short *pixels, int width, int height);
+int fits_write_cube(unsigned short **frames, int width, int height, int depth);
+int fits_write_extension(unsigned short *pixels, int width, int height);
+int fits_set_compression(int type, int threads);
+int fits_set_row_filter(fits_row_filter filter, void *data);
 int fits_open(const char *filename);
 int fits_close(void);
 int fits_cleanup(void);
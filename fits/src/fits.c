@@ -5,13 +5,27 @@
 #include <math.h>
 #include <string.h>
 #ifdef _MSC_VER
+#include <windows.h>
+#include <process.h>
 #include <io.h>
 #include <sys/stat.h>
 #define creat(f,m) _open(f,O_BINARY|O_WRONLY|O_CREAT,_S_IWRITE)
 #define write _write
 #define close _close
+typedef HANDLE fits_thread_t;
+#define FITS_THREAD_PROC unsigned __stdcall
+#define fits_thread_create(t,f,a) ((*(t) = (HANDLE)_beginthreadex(NULL, 0, f, a, 0, NULL)) == 0)
+#define fits_thread_join(t) (WaitForSingleObject(t, INFINITE), CloseHandle(t))
 #else
 #include <unistd.h>
+#include <pthread.h>
+typedef pthread_t fits_thread_t;
+#define FITS_THREAD_PROC void *
+#define fits_thread_create(t,f,a) pthread_create(t, NULL, f, a)
+#define fits_thread_join(t) pthread_join(t, NULL)
+#endif
+#ifdef FITS_ZLIB
+#include <zlib.h>
 #endif
 #include "fits.h"
 /*
@@ -21,10 +35,35 @@
 #define FITS_CARD_SIZE      80
 #define FITS_RECORD_SIZE    (FITS_CARD_COUNT*FITS_CARD_SIZE)
 #define FITS_CARD_COMMENT   31
+#define FITS_CARD_VALUE     10
+#define FITS_CARD_VALUE_END 30
+#define FITS_HDU_CARDS      32 // Room reserved ahead of the keys for mandatory cards
 #define BZERO               32768
-static int             fits_fd, fits_card, image_width, image_height;
-static char            fits_record[FITS_CARD_COUNT+10][FITS_CARD_SIZE]; // Add a little buffer space
-static unsigned short *image_pixels;
+#define RICE_BLOCKSIZE      32
+#define RICE_FS_BITS        4
+#define RICE_FS_MAX         14
+#define MAX_THREADS         16
+static int             fits_fd, fits_hdu;
+static int             image_width, image_height, image_depth, image_naxis;
+static int             fits_compress = FITS_COMPRESS_NONE, fits_threads = 1;
+static unsigned short *image_pixels, **image_frames;
+static fits_row_filter  row_filter;
+static void            *row_filter_data;
+/*
+ * Growable card lists. Buffers are kept between files and only grow.
+ */
+struct card_list
+{
+    char *cards;
+    int   count, alloc, reserve;
+};
+static struct card_list fits_keys     = {NULL, 0, 0, FITS_HDU_CARDS};
+static struct card_list fits_template = {NULL, 0, 0, 0};
+static struct card_list *fits_key_list = &fits_keys;
+/*
+ * Source row for tile: rows are stored bottom up, one plane after another.
+ */
+#define TILE_ROW(t)     (image_frames[(t) / image_height] + (image_height - 1 - (t) % image_height) * image_width)
 
 /*
  * Convert unsigned LE pixels to signed BE pixels.
@@ -42,45 +81,709 @@ static void convert_pixels(unsigned short *src, unsigned short *dst, int offset,
 	   *dst++ = pixel;
     }
 }
+/*
+ * Rice compress one tile of pixels. Output buffer must hold count * 3 + 16 bytes.
+ */
+#define PUT_BITS(v, n)                                          \
+    do {                                                        \
+        bitbuf  = (bitbuf << (n)) | (v);                        \
+        bitcnt += (n);                                          \
+        while (bitcnt >= 8)                                     \
+        {                                                       \
+            bitcnt -= 8;                                        \
+            *dst++  = (unsigned char)(bitbuf >> bitcnt);        \
+        }                                                       \
+    } while (0)
+static int rice_compress(unsigned short *src, int count, unsigned char *out)
+{
+    unsigned int   diff[RICE_BLOCKSIZE], pixelsum, psum, top, bitbuf;
+    unsigned short pixel, lastpix;
+    unsigned char *dst = out;
+    double         dpsum;
+    int            i, j, block, fs, bitcnt;
+
+    bitbuf  = 0;
+    bitcnt  = 0;
+    lastpix = *src - BZERO;
+    PUT_BITS(lastpix, 16);
+    for (i = 0; i < count; i += RICE_BLOCKSIZE)
+    {
+        block    = count - i < RICE_BLOCKSIZE ? count - i : RICE_BLOCKSIZE;
+        pixelsum = 0;
+        for (j = 0; j < block; j++)
+        {
+            /*
+             * Map signed 16 bit differences to unsigned (zig-zag).
+             */
+            pixel    = src[i + j] - BZERO;
+            diff[j]  = (unsigned short)(pixel - lastpix);
+            diff[j]  = (diff[j] & 0x8000) ? ((~diff[j] << 1) | 1) & 0xFFFF : diff[j] << 1;
+            pixelsum += diff[j];
+            lastpix  = pixel;
+        }
+        dpsum = ((double)pixelsum - (block / 2) - 1) / block;
+        if (dpsum < 0.0)
+            dpsum = 0.0;
+        psum = (unsigned int)dpsum >> 1;
+        for (fs = 0; psum > 0; fs++)
+            psum >>= 1;
+        if (fs >= RICE_FS_MAX)
+        {
+            /*
+             * High entropy block - write differences verbatim.
+             */
+            PUT_BITS(RICE_FS_MAX + 1, RICE_FS_BITS);
+            for (j = 0; j < block; j++)
+                PUT_BITS(diff[j], 16);
+        }
+        else if (pixelsum == 0)
+        {
+            /*
+             * Constant block.
+             */
+            PUT_BITS(0, RICE_FS_BITS);
+        }
+        else
+        {
+            PUT_BITS(fs + 1, RICE_FS_BITS);
+            for (j = 0; j < block; j++)
+            {
+                /*
+                 * Unary coded high bits followed by fs low bits.
+                 */
+                for (top = diff[j] >> fs; top >= 16; top -= 16)
+                    PUT_BITS(0, 16);
+                PUT_BITS(1, top + 1);
+                if (fs)
+                    PUT_BITS(diff[j] & ((1 << fs) - 1), fs);
+            }
+        }
+    }
+    if (bitcnt)
+        *dst++ = (unsigned char)(bitbuf << (8 - bitcnt));
+    return (int)(dst - out);
+}
+#ifdef FITS_ZLIB
+/*
+ * GZIP_2 compress one tile: byte shuffle big endian pixels then gzip.
+ */
+static int gzip_compress(unsigned short *src, int count, unsigned char *out, unsigned char *shuffle)
+{
+    z_stream       strm;
+    unsigned short pixel;
+    int            i, len;
+
+    for (i = 0; i < count; i++)
+    {
+        pixel = src[i] - BZERO;
+        shuffle[i]         = pixel >> 8;
+        shuffle[i + count] = pixel & 0xFF;
+    }
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, Z_BEST_SPEED, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    strm.next_in   = shuffle;
+    strm.avail_in  = count * 2;
+    strm.next_out  = out;
+    strm.avail_out = count * 3 + 16;
+    len = deflate(&strm, Z_FINISH) == Z_STREAM_END ? (int)strm.total_out : -1;
+    deflateEnd(&strm);
+    return len;
+}
+#endif
+/*
+ * Tile compression worker. Each image row is one tile.
+ */
+struct tile_work
+{
+    int            first, last;
+    int           *tile_size;
+    unsigned char *heap;
+    int            heap_size, heap_alloc;
+};
+static FITS_THREAD_PROC compress_tiles(void *param)
+{
+    struct tile_work *work = (struct tile_work *)param;
+    unsigned char    *shuffle = NULL;
+    unsigned short   *src, *row = NULL;
+    int               tile, bound, len;
+
+    bound = image_width * 3 + 16;
+    work->heap_alloc = (work->last - work->first) * image_width + bound;
+    work->heap_size  = 0;
+    work->heap       = (unsigned char *)malloc(work->heap_alloc);
+    if (fits_compress == FITS_COMPRESS_GZIP)
+        shuffle = (unsigned char *)malloc(image_width * 2);
+    if (row_filter && !(row = (unsigned short *)malloc(image_width * 2)))
+    {
+        free(work->heap);
+        work->heap = NULL;
+    }
+    for (tile = work->first; tile < work->last && work->heap; tile++)
+    {
+        if (work->heap_alloc - work->heap_size < bound)
+        {
+            work->heap_alloc += work->heap_alloc / 2 + bound;
+            work->heap = (unsigned char *)realloc(work->heap, work->heap_alloc);
+            if (!work->heap)
+                break;
+        }
+        src = TILE_ROW(tile);
+        if (row)
+        {
+            row_filter(src, row, image_width, row_filter_data);
+            src = row;
+        }
+#ifdef FITS_ZLIB
+        if (fits_compress == FITS_COMPRESS_GZIP)
+            len = gzip_compress(src, image_width, work->heap + work->heap_size, shuffle);
+        else
+#endif
+            len = rice_compress(src, image_width, work->heap + work->heap_size);
+        if (len < 0)
+        {
+            free(work->heap);
+            work->heap = NULL;
+            break;
+        }
+        work->tile_size[tile] = len;
+        work->heap_size      += len;
+    }
+    if (shuffle)
+        free(shuffle);
+    if (row)
+        free(row);
+    return 0;
+}
+/*
+ * Card formatting. Cards are kept blank filled so only the fields need to be written.
+ */
+static int format_int(char *str, long value)
+{
+    char          digits[24];
+    unsigned long mag;
+    int           i, n;
+
+    mag = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+    n   = 0;
+    do
+    {
+        digits[n++] = '0' + mag % 10;
+        mag /= 10;
+    } while (mag);
+    i = 0;
+    if (value < 0)
+        str[i++] = '-';
+    while (n)
+        str[i++] = digits[--n];
+    return i;
+}
+static char *card_key(char *card, const char *key)
+{
+    int i;
+
+    for (i = 0; key[i] && i < 8; i++)
+        card[i] = key[i];
+    card[8] = '=';
+    return card;
+}
+static int card_int(char *card, const char *key, long value)
+{
+    char str[24];
+    int  len;
+
+    len = format_int(str, value);
+    memcpy(card_key(card, key) + FITS_CARD_VALUE_END - len, str, len);
+    return FITS_CARD_VALUE_END;
+}
+static int card_logical(char *card, const char *key, int value)
+{
+    card_key(card, key)[FITS_CARD_VALUE_END - 1] = value ? 'T' : 'F';
+    return FITS_CARD_VALUE_END;
+}
+static int card_float(char *card, const char *key, double value)
+{
+    char          str[40];
+    unsigned long whole, frac;
+    double        mag;
+    int           len, i;
+
+    /*
+     * Fixed point with six decimals, same as %f.
+     */
+    mag = value < 0.0 ? -value : value;
+    if (!(mag < 2147483647.0))
+        len = sprintf(str, "%.10G", value);
+    else
+    {
+        whole = (unsigned long)mag;
+        frac  = (unsigned long)((mag - whole) * 1000000.0 + 0.5);
+        if (frac >= 1000000)
+        {
+            whole++;
+            frac -= 1000000;
+        }
+        len = 0;
+        if (value < 0.0 && (whole || frac))
+            str[len++] = '-';
+        len += format_int(str + len, whole);
+        str[len++] = '.';
+        for (i = 5; i >= 0; i--, frac /= 10)
+            str[len + i] = '0' + frac % 10;
+        len += 6;
+    }
+    memcpy(card_key(card, key) + FITS_CARD_VALUE_END - len, str, len);
+    return FITS_CARD_VALUE_END;
+}
+static int card_string(char *card, const char *key, const char *value)
+{
+    int i;
+
+    i = FITS_CARD_VALUE;
+    card_key(card, key)[i++] = '\'';
+    for (; *value && i < FITS_CARD_SIZE - 1; value++)
+    {
+        if (*value == '\'')
+        {
+            if (i >= FITS_CARD_SIZE - 2)
+                break;
+            card[i++] = '\'';
+        }
+        card[i++] = *value;
+    }
+    if (i < FITS_CARD_VALUE + 9)
+        i = FITS_CARD_VALUE + 9; // Pad to eight characters
+    card[i++] = '\'';
+    return i;
+}
+static void card_comment(char *card, int col, const char *comment)
+{
+    if (++col < FITS_CARD_COMMENT)
+        col = FITS_CARD_COMMENT;
+    if (comment && col < FITS_CARD_SIZE - 2)
+    {
+        card[col] = '/';
+        for (col += 2; *comment && col < FITS_CARD_SIZE; col++)
+            card[col] = *comment++;
+    }
+}
+/*
+ * Make room for count more cards plus END and record padding.
+ */
+static int grow_cards(struct card_list *list, int count)
+{
+    int   alloc;
+    char *cards;
+
+    alloc = list->reserve + list->count + count + FITS_CARD_COUNT;
+    if (alloc > list->alloc)
+    {
+        alloc = ((alloc + alloc / 2) / FITS_CARD_COUNT + 1) * FITS_CARD_COUNT;
+        if (!(cards = (char *)realloc(list->cards, alloc * FITS_CARD_SIZE)))
+            return -1;
+        memset(cards + list->alloc * FITS_CARD_SIZE, ' ', (alloc - list->alloc) * FITS_CARD_SIZE);
+        list->cards = cards;
+        list->alloc = alloc;
+    }
+    return 0;
+}
+static char *new_card(void)
+{
+    struct card_list *list = fits_key_list;
+
+    if (grow_cards(list, 1))
+        return NULL;
+    return list->cards + (list->reserve + list->count++) * FITS_CARD_SIZE;
+}
+static void clear_cards(struct card_list *list)
+{
+    int used;
+
+    used = list->reserve + list->count + FITS_CARD_COUNT;
+    if (used > list->alloc)
+        used = list->alloc;
+    if (list->cards)
+        memset(list->cards, ' ', used * FITS_CARD_SIZE);
+    list->count = 0;
+}
 int fits_write_key_int(const char *key, int value, const char *comment)
 {
-    sprintf(fits_record[fits_card], "%-8s= %20d", key, value);
-    if (comment)
-        sprintf(fits_record[fits_card] + FITS_CARD_COMMENT, "/ %s", comment);
-    return ++fits_card >= FITS_CARD_COUNT;
+    char *card;
+
+    if (!(card = new_card()))
+        return -1;
+    card_comment(card, card_int(card, key, value), comment);
+    return 0;
 }
 int fits_write_key_float(const char *key, float value, const char *comment)
 {
-    sprintf(fits_record[fits_card], "%-8s= %20f", key, value);
-    if (comment)
-        sprintf(fits_record[fits_card] + FITS_CARD_COMMENT, "/ %s", comment);
-    return ++fits_card >= FITS_CARD_COUNT;
+    char *card;
+
+    /*
+     * NaN and infinity have no FITS representation, leave the key out.
+     */
+    if (!isfinite(value))
+        return 0;
+    if (!(card = new_card()))
+        return -1;
+    card_comment(card, card_float(card, key, value), comment);
+    return 0;
 }
 int fits_write_key_string(const char *key, const char * value, const char *comment)
 {
-    sprintf(fits_record[fits_card], "%-8s= '%s'", key, value);
-    if (comment)
-        sprintf(fits_record[fits_card] + FITS_CARD_COMMENT + (strlen(value) > 18 ? strlen(value) - 18 : 0), "/ %s", comment);
-    return ++fits_card >= FITS_CARD_COUNT;
+    char *card;
+
+    if (!(card = new_card()))
+        return -1;
+    card_comment(card, card_string(card, key, value), comment);
+    return 0;
+}
+/*
+ * Header template: keys written between fits_template_begin() and fits_template_end()
+ * are saved once and cloned into each header by fits_write_template().
+ */
+int fits_template_begin(void)
+{
+    clear_cards(&fits_template);
+    fits_key_list = &fits_template;
+    return 0;
+}
+int fits_template_end(void)
+{
+    fits_key_list = &fits_keys;
+    return 0;
+}
+int fits_write_template(void)
+{
+    if (grow_cards(&fits_keys, fits_template.count))
+        return -1;
+    memcpy(fits_keys.cards + (fits_keys.reserve + fits_keys.count) * FITS_CARD_SIZE,
+           fits_template.cards,
+           fits_template.count * FITS_CARD_SIZE);
+    fits_keys.count += fits_template.count;
+    return 0;
 }
+/*
+ * Set the image for the current HDU. Mandatory cards are generated when the HDU is written.
+ */
 int fits_write_image(unsigned short *pixels, int width, int height)
 {
+    image_width  = width;
+    image_height = height;
+    image_depth  = 1;
+    image_naxis  = 2;
+    image_pixels = pixels;
+    image_frames = &image_pixels;
+    return 0;
+}
+/*
+ * Set a 3D image (NAXIS3 = depth) for the current HDU from an array of frames.
+ */
+int fits_write_cube(unsigned short **frames, int width, int height, int depth)
+{
+    image_width  = width;
+    image_height = height;
+    image_depth  = depth;
+    image_naxis  = 3;
+    image_frames = frames;
+    return depth < 1;
+}
+/*
+ * Pass every row of the current HDU's image through filter on its way to the
+ * file, so a correction can be applied without a second copy of the image.
+ * The source is never written. With compression the filter runs on several
+ * threads at once.
+ */
+int fits_set_row_filter(fits_row_filter filter, void *data)
+{
+    row_filter      = filter;
+    row_filter_data = data;
+    return 0;
+}
+/*
+ * Select tile compression for subsequent files. Zero threads uses all cores.
+ */
+int fits_set_compression(int type, int threads)
+{
+#ifndef FITS_ZLIB
+    if (type == FITS_COMPRESS_GZIP)
+        return -1;
+#endif
+    if (type < FITS_COMPRESS_NONE || type > FITS_COMPRESS_GZIP)
+        return -1;
+    if (threads <= 0)
+    {
+#ifdef _MSC_VER
+        SYSTEM_INFO sysinfo;
+        GetSystemInfo(&sysinfo);
+        threads = sysinfo.dwNumberOfProcessors;
+#else
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    }
+    fits_compress = type;
+    fits_threads  = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    return 0;
+}
+/*
+ * Write header: mandatory cards are placed in the room reserved ahead of the keys
+ * so the whole header goes out in one write, padded to full records.
+ */
+static int write_header(char hdu_cards[][FITS_CARD_SIZE], int count, int keys)
+{
+    char *header;
+    int   size;
+
+    if (!keys)
+    {
+        /*
+         * Mandatory cards only - always fits in one record.
+         */
+        memcpy(hdu_cards[count], "END", 3);
+        return write(fits_fd, hdu_cards, FITS_RECORD_SIZE) == FITS_RECORD_SIZE ? 0 : -1;
+    }
+    if (grow_cards(&fits_keys, 0))
+        return -1;
+    header = fits_keys.cards + (fits_keys.reserve - count) * FITS_CARD_SIZE;
+    memcpy(header, hdu_cards, count * FITS_CARD_SIZE);
+    count += fits_keys.count;
+    memcpy(header + count * FITS_CARD_SIZE, "END", 3);
+    size = ((count + FITS_CARD_COUNT) / FITS_CARD_COUNT) * FITS_RECORD_SIZE;
+    return write(fits_fd, header, size) == size ? 0 : -1;
+}
+/*
+ * Convert and write image data, padded out to full record.
+ */
+static int write_pixels(void)
+{
+    int             i, plane, image_pitch, size;
+    unsigned short *fits_pixels, *src;
+
+    image_pitch = image_width * 2;
+    fits_pixels = (unsigned short *)malloc(image_pitch > FITS_RECORD_SIZE ? image_pitch : FITS_RECORD_SIZE);
+    size = 0;
+    for (plane = 0; plane < image_depth; plane++)
+        for (i = 0; i < image_height; i++)
+        {
+            src = image_frames[plane] + (image_height - 1 - i) * image_width;
+            if (row_filter)
+            {
+                /*
+                 * Filter in place in the output row, then convert in place.
+                 */
+                row_filter(src, fits_pixels, image_width, row_filter_data);
+                src = fits_pixels;
+            }
+            convert_pixels(src, fits_pixels, BZERO, image_width);
+            if (write(fits_fd, fits_pixels, image_pitch) != image_pitch)
+            {
+                free(fits_pixels);
+                return -1;
+            }
+            size = (size + image_pitch) % FITS_RECORD_SIZE;
+        }
+    if (size)
+    {
+        memset(fits_pixels, 0, FITS_RECORD_SIZE - size);
+        if (write(fits_fd, fits_pixels, FITS_RECORD_SIZE - size) != FITS_RECORD_SIZE - size)
+        {
+            free(fits_pixels);
+            return -1;
+        }
+    }
+    free(fits_pixels);
+    return 0;
+}
+/*
+ * Write tile compressed image as binary table extension.
+ */
+static int write_compressed(void)
+{
+    struct tile_work work[MAX_THREADS];
+    fits_thread_t    threads[MAX_THREADS];
+    unsigned char   *table, pad[FITS_RECORD_SIZE];
+    int              started[MAX_THREADS];
+    int             *tile_size, tile_count, thread_count, tile, offset, maxlen, i, c;
+    char             hdu_cards[FITS_CARD_COUNT][FITS_CARD_SIZE], tform[24];
+
     /*
-     * Fill out image header values.
+     * Compress tiles in parallel.
      */
-    sprintf(fits_record[fits_card++], "BITPIX  = %20d", 16);
-    sprintf(fits_record[fits_card++], "NAXIS   = %20d", 2);
-    sprintf(fits_record[fits_card++], "NAXIS1  = %20d", width);
-    sprintf(fits_record[fits_card++], "NAXIS2  = %20d", height);
-    sprintf(fits_record[fits_card++], "BZERO   = %20f", (float)BZERO);
-    sprintf(fits_record[fits_card++], "BSCALE  = %20f", 1.0);
+    tile_count   = image_height * image_depth;
+    tile_size    = (int *)malloc(tile_count * sizeof(int));
+    thread_count = fits_threads < tile_count ? fits_threads : tile_count;
+    for (i = 0; i < thread_count; i++)
+    {
+        work[i].first     = tile_count *  i      / thread_count;
+        work[i].last      = tile_count * (i + 1) / thread_count;
+        work[i].tile_size = tile_size;
+        work[i].heap      = NULL;
+        started[i]        = i && !fits_thread_create(&threads[i], compress_tiles, &work[i]);
+    }
+    for (i = 0; i < thread_count; i++)
+        if (!started[i])
+            compress_tiles(&work[i]);
+    for (i = 0; i < thread_count; i++)
+        if (started[i])
+            fits_thread_join(threads[i]);
+    for (i = 0; i < thread_count; i++)
+        if (!work[i].heap)
+            break;
     /*
-     * Save image values.
+     * Build the descriptor table: (length, offset) pairs into the heap.
      */
-    image_width  = width;
-    image_height = height;
-    image_pixels = (unsigned short *)pixels;
-    return fits_card >= FITS_CARD_COUNT;
+    table  = (unsigned char *)malloc(tile_count * 8);
+    offset = maxlen = 0;
+    if (i == thread_count && table)
+    {
+        for (tile = 0; tile < tile_count; tile++)
+        {
+            table[tile * 8 + 0] = tile_size[tile] >> 24;
+            table[tile * 8 + 1] = tile_size[tile] >> 16;
+            table[tile * 8 + 2] = tile_size[tile] >> 8;
+            table[tile * 8 + 3] = tile_size[tile];
+            table[tile * 8 + 4] = offset >> 24;
+            table[tile * 8 + 5] = offset >> 16;
+            table[tile * 8 + 6] = offset >> 8;
+            table[tile * 8 + 7] = offset;
+            offset += tile_size[tile];
+            if (tile_size[tile] > maxlen)
+                maxlen = tile_size[tile];
+        }
+        memset(hdu_cards, ' ', sizeof(hdu_cards));
+        c = 0;
+        card_string(hdu_cards[c++], "XTENSION", "BINTABLE");
+        card_int(hdu_cards[c++], "BITPIX", 8);
+        card_int(hdu_cards[c++], "NAXIS", 2);
+        card_int(hdu_cards[c++], "NAXIS1", 8);
+        card_int(hdu_cards[c++], "NAXIS2", tile_count);
+        card_int(hdu_cards[c++], "PCOUNT", offset);
+        card_int(hdu_cards[c++], "GCOUNT", 1);
+        card_int(hdu_cards[c++], "TFIELDS", 1);
+        card_string(hdu_cards[c++], "TTYPE1", "COMPRESSED_DATA");
+        memcpy(tform, "1PB(", 4);
+        i = 4 + format_int(tform + 4, maxlen);
+        tform[i++] = ')';
+        tform[i]   = '\0';
+        card_string(hdu_cards[c++], "TFORM1", tform);
+        card_logical(hdu_cards[c++], "ZIMAGE", 1);
+        card_int(hdu_cards[c++], "ZBITPIX", 16);
+        card_int(hdu_cards[c++], "ZNAXIS", image_naxis);
+        card_int(hdu_cards[c++], "ZNAXIS1", image_width);
+        card_int(hdu_cards[c++], "ZNAXIS2", image_height);
+        if (image_naxis == 3)
+            card_int(hdu_cards[c++], "ZNAXIS3", image_depth);
+        card_int(hdu_cards[c++], "ZTILE1", image_width);
+        card_int(hdu_cards[c++], "ZTILE2", 1);
+        if (image_naxis == 3)
+            card_int(hdu_cards[c++], "ZTILE3", 1);
+        if (fits_compress == FITS_COMPRESS_GZIP)
+            card_string(hdu_cards[c++], "ZCMPTYPE", "GZIP_2");
+        else
+        {
+            card_string(hdu_cards[c++], "ZCMPTYPE", "RICE_1");
+            card_string(hdu_cards[c++], "ZNAME1", "BLOCKSIZE");
+            card_int(hdu_cards[c++], "ZVAL1", RICE_BLOCKSIZE);
+            card_string(hdu_cards[c++], "ZNAME2", "BYTEPIX");
+            card_int(hdu_cards[c++], "ZVAL2", 2);
+        }
+        card_float(hdu_cards[c++], "BZERO", (float)BZERO);
+        card_float(hdu_cards[c++], "BSCALE", 1.0);
+        /*
+         * Write header, descriptor table and heap, then pad to full record.
+         */
+        if (write_header(hdu_cards, c, 1)
+         || write(fits_fd, table, tile_count * 8) != tile_count * 8)
+            c = -1;
+        for (i = 0; i < thread_count && c >= 0; i++)
+            if (write(fits_fd, work[i].heap, work[i].heap_size) != work[i].heap_size)
+                c = -1;
+        offset = (tile_count * 8 + offset) % FITS_RECORD_SIZE;
+        if (offset && c >= 0)
+        {
+            memset(pad, 0, FITS_RECORD_SIZE - offset);
+            if (write(fits_fd, pad, FITS_RECORD_SIZE - offset) != FITS_RECORD_SIZE - offset)
+                c = -1;
+        }
+    }
+    else
+        c = -1;
+    for (i = 0; i < thread_count; i++)
+        if (work[i].heap)
+            free(work[i].heap);
+    if (table)
+        free(table);
+    free(tile_size);
+    return c < 0 ? -1 : 0;
+}
+/*
+ * Write the current HDU and reset for the next one.
+ */
+static int write_hdu(int extend)
+{
+    char hdu_cards[FITS_CARD_COUNT][FITS_CARD_SIZE];
+    int  c, result;
+
+    memset(hdu_cards, ' ', sizeof(hdu_cards));
+    c = 0;
+    if (fits_compress != FITS_COMPRESS_NONE && image_naxis)
+    {
+        if (fits_hdu == 0)
+        {
+            /*
+             * Empty primary ahead of the compressed image. Keys go with the image.
+             */
+            card_logical(hdu_cards[c++], "SIMPLE", 1);
+            card_int(hdu_cards[c++], "BITPIX", 16);
+            card_int(hdu_cards[c++], "NAXIS", 0);
+            card_logical(hdu_cards[c++], "EXTEND", 1);
+            if (write_header(hdu_cards, c, 0))
+                return -1;
+            memset(hdu_cards, ' ', sizeof(hdu_cards));
+            c = 0;
+        }
+        result = write_compressed();
+    }
+    else
+    {
+        if (fits_hdu == 0)
+            card_logical(hdu_cards[c++], "SIMPLE", 1);
+        else
+            card_string(hdu_cards[c++], "XTENSION", "IMAGE");
+        card_int(hdu_cards[c++], "BITPIX", 16);
+        card_int(hdu_cards[c++], "NAXIS", image_naxis);
+        if (image_naxis)
+        {
+            card_int(hdu_cards[c++], "NAXIS1", image_width);
+            card_int(hdu_cards[c++], "NAXIS2", image_height);
+            if (image_naxis == 3)
+                card_int(hdu_cards[c++], "NAXIS3", image_depth);
+        }
+        if (fits_hdu == 0)
+        {
+            if (extend)
+                card_logical(hdu_cards[c++], "EXTEND", 1);
+        }
+        else
+        {
+            card_int(hdu_cards[c++], "PCOUNT", 0);
+            card_int(hdu_cards[c++], "GCOUNT", 1);
+        }
+        if (image_naxis)
+        {
+            card_float(hdu_cards[c++], "BZERO", (float)BZERO);
+            card_float(hdu_cards[c++], "BSCALE", 1.0);
+        }
+        result = write_header(hdu_cards, c, 1);
+        if (result == 0 && image_naxis)
+            result = write_pixels();
+    }
+    fits_hdu++;
+    image_naxis = 0;
+    image_depth = 0;
+    row_filter  = NULL;
+    clear_cards(&fits_keys);
+    return result;
 }
 /*
  * Init FITS header and image array.
@@ -95,43 +798,31 @@ int fits_open(const char *filename)
     /*
      * Init header and pixel pointers
      */
-    memset(fits_record, ' ', FITS_RECORD_SIZE);
-    sprintf(fits_record[0], "SIMPLE  = %20c", 'T');
-    fits_card = 1;
+    clear_cards(&fits_keys);
+    fits_key_list = &fits_keys;
+    fits_hdu    = 0;
+    image_naxis = 0;
+    image_depth = 0;
+    row_filter  = NULL;
     return 0;
 }
+/*
+ * Write out the current HDU and begin an IMAGE extension. Keys written after
+ * this go into the extension header.
+ */
+int fits_write_extension(unsigned short *pixels, int width, int height)
+{
+    if (write_hdu(1))
+        return -1;
+    return fits_write_image(pixels, width, height);
+}
 /*
  * Write out header and image array then close file.
  */
 int fits_close(void)
 {
-    int i, image_end, image_pitch;
-    unsigned short *fits_pixels;
-    /*
-     * End header and convert NULLS to spaces.
-     */
-    sprintf(fits_record[fits_card], "END");
-    for (i = 0; i < FITS_RECORD_SIZE; i++)
-        if (((char *)fits_record)[i] < ' ')
-            ((char *)fits_record)[i] = ' ';
-    if (write(fits_fd, fits_record, FITS_RECORD_SIZE) != FITS_RECORD_SIZE)
+    if (write_hdu(0))
         return -1;
-    /*
-     * Convert and write image data.
-     */
-    image_end  = image_width * (image_height - 1);
-    image_pitch = image_width * 2;
-    fits_pixels = (unsigned short *)malloc(image_pitch);
-    for (i = 0; i < image_height; i++)
-    {
-        convert_pixels(image_pixels + image_end - i * image_width, fits_pixels, BZERO, image_width);
-        if (write(fits_fd, fits_pixels, image_pitch) != image_pitch)
-        {
-            free(fits_pixels);
-            return -1;
-        }
-    }
-    free(fits_pixels);
     return close(fits_fd);
 }
 int fits_cleanup(void)
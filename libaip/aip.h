@@ -12,6 +12,39 @@ extern unsigned char blugrnLUT[LUT_SIZE];
 void calcRamp(int black, int white, float gamma, int filter);
 void calcCentroid(int width, int height, unsigned short *pixels, int x, int y, int x_radius, int y_radius, float *x_centroid, float *y_centroid, int min);
 int findBestCentroid(int width, int height, unsigned short *pixels, float *x_centroid, float *y_centroid, int x_range, int y_range, int *x_max_radius, int *y_max_radius, float sigs);
+/*
+ * Rotations are in degrees counterclockwise, multiples of 90. Pitches are in
+ * pixels. 90 and 270 degree rotations write a height x width destination.
+ */
+void transposePixels(int width, int height, int pixelSize, const void *src, int srcPitch, void *dst, int dstPitch);
+void rotatePixels(int width, int height, int pixelSize, const void *src, int srcPitch, void *dst, int dstPitch, int angle);
+int rotatePixelsInPlace(int width, int height, int pixelSize, void *pixels, int angle);
+void flipPixels(int width, int height, int pixelSize, void *pixels, int pitch, int horiz, int vert);
+/*
+ * Resampling. Shrinking averages the source pixels each destination pixel
+ * covers, enlarging interpolates with the filter. Weight tables live in the
+ * scaler and are only rebuilt when the sizes or filter change, so keep one
+ * per view. A zeroed scaler is ready to use. Pitches here are in bytes to
+ * match display buffers with padded rows.
+ */
+#define SCALE_AREA          0
+#define SCALE_BILINEAR      1
+#define SCALE_BICUBIC       2
+#define SCALE_LANCZOS       3
+struct scaleAxis
+{
+    int    srcSize, dstSize, filter, taps;
+    int   *first;
+    short *weights;
+};
+struct scaler
+{
+    struct scaleAxis x, y;
+    void            *row;
+    int              rowSize;
+};
+int scalePixels(struct scaler *scaler, int filter, const void *src, int srcWidth, int srcHeight, int srcPitch, void *dst, int dstWidth, int dstHeight, int dstPitch, int pixelSize, int channels);
+void freeScaler(struct scaler *scaler);
 #ifdef __cplusplus
 }
 #endif
@@ -1,4 +1,10 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "aip.h"
 #ifdef __cplusplus
 extern "C" {
@@ -149,6 +155,504 @@ int findBestCentroid(int width, int height, unsigned short *pixels, float *x_cen
     }
     return x >= 0 && y >= 0;
 }
+/*
+ * Rotation and flips. Transposes walk the image in ROT_BLOCK square blocks
+ * transposed in registers, a ROT_TILE square at a time so the source rows
+ * being read and the destination rows being written both stay in cache.
+ */
+#define ROT_BLOCK           8
+#define ROT_TILE            256
+static void copyPixel(unsigned char *dst, const unsigned char *src, int pixelSize)
+{
+    switch (pixelSize)
+    {
+        case 1:
+            *dst = *src;
+            break;
+        case 2:
+            *(uint16_t *)dst = *(const uint16_t *)src;
+            break;
+        case 4:
+            *(uint32_t *)dst = *(const uint32_t *)src;
+            break;
+        default:
+            memcpy(dst, src, pixelSize);
+    }
+}
+/*
+ * Transpose one block. Strides are in bytes and go negative to walk rows
+ * backwards, which turns the transpose into a rotation.
+ */
+static void transposeBlock(const unsigned char *src, long srcStride, unsigned char *dst, long dstStride, int rows, int cols, int pixelSize)
+{
+    int r, c;
+#ifdef __SSE2__
+    if (pixelSize == 2 && rows == ROT_BLOCK && cols == ROT_BLOCK)
+    {
+        __m128i a0, a1, a2, a3, a4, a5, a6, a7, b0, b1, b2, b3, b4, b5, b6, b7;
+        a0 = _mm_loadu_si128((const __m128i *)(src));
+        a1 = _mm_loadu_si128((const __m128i *)(src + srcStride));
+        a2 = _mm_loadu_si128((const __m128i *)(src + srcStride * 2));
+        a3 = _mm_loadu_si128((const __m128i *)(src + srcStride * 3));
+        a4 = _mm_loadu_si128((const __m128i *)(src + srcStride * 4));
+        a5 = _mm_loadu_si128((const __m128i *)(src + srcStride * 5));
+        a6 = _mm_loadu_si128((const __m128i *)(src + srcStride * 6));
+        a7 = _mm_loadu_si128((const __m128i *)(src + srcStride * 7));
+        /*
+         * Interleave pairs of rows, then pairs of pairs, then halves.
+         */
+        b0 = _mm_unpacklo_epi16(a0, a1);
+        b1 = _mm_unpackhi_epi16(a0, a1);
+        b2 = _mm_unpacklo_epi16(a2, a3);
+        b3 = _mm_unpackhi_epi16(a2, a3);
+        b4 = _mm_unpacklo_epi16(a4, a5);
+        b5 = _mm_unpackhi_epi16(a4, a5);
+        b6 = _mm_unpacklo_epi16(a6, a7);
+        b7 = _mm_unpackhi_epi16(a6, a7);
+        a0 = _mm_unpacklo_epi32(b0, b2);
+        a1 = _mm_unpackhi_epi32(b0, b2);
+        a2 = _mm_unpacklo_epi32(b1, b3);
+        a3 = _mm_unpackhi_epi32(b1, b3);
+        a4 = _mm_unpacklo_epi32(b4, b6);
+        a5 = _mm_unpackhi_epi32(b4, b6);
+        a6 = _mm_unpacklo_epi32(b5, b7);
+        a7 = _mm_unpackhi_epi32(b5, b7);
+        _mm_storeu_si128((__m128i *)(dst),                 _mm_unpacklo_epi64(a0, a4));
+        _mm_storeu_si128((__m128i *)(dst + dstStride),     _mm_unpackhi_epi64(a0, a4));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 2), _mm_unpacklo_epi64(a1, a5));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 3), _mm_unpackhi_epi64(a1, a5));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 4), _mm_unpacklo_epi64(a2, a6));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 5), _mm_unpackhi_epi64(a2, a6));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 6), _mm_unpacklo_epi64(a3, a7));
+        _mm_storeu_si128((__m128i *)(dst + dstStride * 7), _mm_unpackhi_epi64(a3, a7));
+        return;
+    }
+#endif
+    for (c = 0; c < cols; c++)
+        for (r = 0; r < rows; r++)
+            copyPixel(dst + c * dstStride + r * pixelSize, src + r * srcStride + c * pixelSize, pixelSize);
+}
+/*
+ * dst row c, column r gets src row r, column c.
+ */
+static void transposeTiles(int width, int height, int pixelSize, const unsigned char *src, long srcStride, unsigned char *dst, long dstStride)
+{
+    int xTile, yTile, x, y, xEnd, yEnd;
+    for (yTile = 0; yTile < height; yTile += ROT_TILE)
+    {
+        yEnd = yTile + ROT_TILE < height ? yTile + ROT_TILE : height;
+        for (xTile = 0; xTile < width; xTile += ROT_TILE)
+        {
+            xEnd = xTile + ROT_TILE < width ? xTile + ROT_TILE : width;
+            for (y = yTile; y < yEnd; y += ROT_BLOCK)
+                for (x = xTile; x < xEnd; x += ROT_BLOCK)
+                    transposeBlock(src + y * srcStride + x * pixelSize, srcStride,
+                                   dst + x * dstStride + y * pixelSize, dstStride,
+                                   yEnd - y < ROT_BLOCK ? yEnd - y : ROT_BLOCK,
+                                   xEnd - x < ROT_BLOCK ? xEnd - x : ROT_BLOCK,
+                                   pixelSize);
+        }
+    }
+}
+/*
+ * Reverse the pixel order of a row, in place if src and dst are the same.
+ */
+static void reverseRow(const unsigned char *src, unsigned char *dst, int width, int pixelSize)
+{
+    unsigned char tmp[ROT_BLOCK];
+    int left = 0, right = width - 1;
+#ifdef __SSE2__
+    if (pixelSize == 2)
+    {
+        /*
+         * Swap 8 pixels from each end at a time, reversed in register.
+         */
+        while (right - left + 1 >= 16)
+        {
+            __m128i l = _mm_loadu_si128((const __m128i *)(src + left * 2));
+            __m128i r = _mm_loadu_si128((const __m128i *)(src + (right - 7) * 2));
+            l = _mm_shuffle_epi32(l, _MM_SHUFFLE(1, 0, 3, 2));
+            r = _mm_shuffle_epi32(r, _MM_SHUFFLE(1, 0, 3, 2));
+            l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(l, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+            r = _mm_shufflehi_epi16(_mm_shufflelo_epi16(r, _MM_SHUFFLE(0, 1, 2, 3)), _MM_SHUFFLE(0, 1, 2, 3));
+            _mm_storeu_si128((__m128i *)(dst + left * 2), r);
+            _mm_storeu_si128((__m128i *)(dst + (right - 7) * 2), l);
+            left  += 8;
+            right -= 8;
+        }
+    }
+#endif
+    for (; left <= right; left++, right--)
+    {
+        memcpy(tmp, src + left * pixelSize, pixelSize);
+        copyPixel(dst + left * pixelSize, src + right * pixelSize, pixelSize);
+        copyPixel(dst + right * pixelSize, tmp, pixelSize);
+    }
+}
+void transposePixels(int width, int height, int pixelSize, const void *src, int srcPitch, void *dst, int dstPitch)
+{
+    transposeTiles(width, height, pixelSize, (const unsigned char *)src, (long)srcPitch * pixelSize, (unsigned char *)dst, (long)dstPitch * pixelSize);
+}
+void rotatePixels(int width, int height, int pixelSize, const void *src, int srcPitch, void *dst, int dstPitch, int angle)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char       *d = (unsigned char *)dst;
+    long srcStride = (long)srcPitch * pixelSize;
+    long dstStride = (long)dstPitch * pixelSize;
+    int  y;
+    switch ((angle % 360 + 360) % 360)
+    {
+        case 90:
+            /*
+             * Source column x becomes destination row width - 1 - x.
+             */
+            transposeTiles(width, height, pixelSize, s, srcStride, d + (width - 1) * dstStride, -dstStride);
+            break;
+        case 180:
+            for (y = 0; y < height; y++)
+                reverseRow(s + y * srcStride, d + (height - 1 - y) * dstStride, width, pixelSize);
+            break;
+        case 270:
+            /*
+             * Source row y becomes destination column height - 1 - y.
+             */
+            transposeTiles(width, height, pixelSize, s + (height - 1) * srcStride, -srcStride, d, dstStride);
+            break;
+        default:
+            for (y = 0; y < height; y++)
+                memcpy(d + y * dstStride, s + y * srcStride, width * pixelSize);
+    }
+}
+/*
+ * Square images rotate in place by transposing block pairs across the
+ * diagonal, then flipping. Returns -1 if a 90 degree rotation would change
+ * the shape.
+ */
+int rotatePixelsInPlace(int width, int height, int pixelSize, void *pixels, int angle)
+{
+    unsigned char  upper[ROT_BLOCK * ROT_BLOCK * 4], lower[ROT_BLOCK * ROT_BLOCK * 4];
+    unsigned char *p = (unsigned char *)pixels;
+    long stride = (long)width * pixelSize, blockStride = ROT_BLOCK * pixelSize;
+    int  x, y, r, rows, cols;
+    angle = (angle % 360 + 360) % 360;
+    if (angle == 0)
+        return 0;
+    if (angle == 180)
+    {
+        flipPixels(width, height, pixelSize, pixels, width, 1, 1);
+        return 0;
+    }
+    if (width != height || pixelSize > 4)
+        return -1;
+    for (y = 0; y < height; y += ROT_BLOCK)
+    {
+        rows = height - y < ROT_BLOCK ? height - y : ROT_BLOCK;
+        for (x = y; x < width; x += ROT_BLOCK)
+        {
+            cols = width - x < ROT_BLOCK ? width - x : ROT_BLOCK;
+            transposeBlock(p + y * stride + x * pixelSize, stride, upper, blockStride, rows, cols, pixelSize);
+            transposeBlock(p + x * stride + y * pixelSize, stride, lower, blockStride, cols, rows, pixelSize);
+            for (r = 0; r < cols; r++)
+                memcpy(p + (x + r) * stride + y * pixelSize, upper + r * blockStride, rows * pixelSize);
+            if (x != y)
+                for (r = 0; r < rows; r++)
+                    memcpy(p + (y + r) * stride + x * pixelSize, lower + r * blockStride, cols * pixelSize);
+        }
+    }
+    flipPixels(width, height, pixelSize, pixels, width, angle == 270, angle == 90);
+    return 0;
+}
+void flipPixels(int width, int height, int pixelSize, void *pixels, int pitch, int horiz, int vert)
+{
+    unsigned char *top    = (unsigned char *)pixels;
+    unsigned char *bottom = top + (long)(height - 1) * pitch * pixelSize;
+    unsigned char *tmp;
+    int y;
+    if (vert && (tmp = (unsigned char *)malloc(width * pixelSize)) != NULL)
+    {
+        for (y = 0; y < height / 2; y++)
+        {
+            memcpy(tmp,    top,    width * pixelSize);
+            memcpy(top,    bottom, width * pixelSize);
+            memcpy(bottom, tmp,    width * pixelSize);
+            top    += (long)pitch * pixelSize;
+            bottom -= (long)pitch * pixelSize;
+        }
+        free(tmp);
+    }
+    if (horiz)
+        for (y = 0, top = (unsigned char *)pixels; y < height; y++, top += (long)pitch * pixelSize)
+            reverseRow(top, top, width, pixelSize);
+}
+/*
+ * Resampling. Each axis has a table of fixed point weights, a fixed number
+ * of taps per destination pixel starting at first[]. Taps off the edge of
+ * the source fold onto the edge pixel. Rows are filtered vertically into a
+ * row of intermediate samples, then horizontally into the destination.
+ */
+#define SCALE_BITS          14
+#define SCALE_ONE           (1<<SCALE_BITS)
+#ifndef M_PI
+#define M_PI                3.14159265358979323846
+#endif
+static const double scaleSupport[] = {0.5, 1.0, 2.0, 3.0};
+static double scaleKernel(int filter, double x)
+{
+    x = fabs(x);
+    switch (filter)
+    {
+        case SCALE_BILINEAR:
+            return x < 1.0 ? 1.0 - x : 0.0;
+        case SCALE_BICUBIC: // Catmull-Rom
+            if (x < 1.0)
+                return (1.5 * x - 2.5) * x * x + 1.0;
+            if (x < 2.0)
+                return ((-0.5 * x + 2.5) * x - 4.0) * x + 2.0;
+            return 0.0;
+        case SCALE_LANCZOS:
+            if (x < 1.0e-6)
+                return 1.0;
+            if (x < 3.0)
+                return 3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0) / (M_PI * M_PI * x * x);
+            return 0.0;
+    }
+    return 0.0;
+}
+static int buildScaleAxis(struct scaleAxis *axis, int filter, int srcSize, int dstSize)
+{
+    double scale = (double)srcSize / dstSize, lo, hi, total, *w;
+    int    kernel, kernelTaps, i, k, idx, start, first, big, sum;
+    if (axis->first && axis->filter == filter && axis->srcSize == srcSize && axis->dstSize == dstSize)
+        return 0;
+    free(axis->first);
+    free(axis->weights);
+    axis->filter  = filter;
+    axis->srcSize = srcSize;
+    axis->dstSize = dstSize;
+    kernel        = (filter == SCALE_AREA || dstSize < srcSize) ? SCALE_AREA : filter;
+    kernelTaps    = kernel == SCALE_AREA ? (int)ceil(scale) + 1 : (int)(scaleSupport[kernel] * 2.0);
+    axis->taps    = kernelTaps < srcSize ? kernelTaps : srcSize;
+    axis->first   = (int *)malloc(sizeof(int) * dstSize);
+    axis->weights = (short *)malloc(sizeof(short) * dstSize * axis->taps);
+    w             = (double *)malloc(sizeof(double) * axis->taps);
+    if (!axis->first || !axis->weights || !w)
+    {
+        free(axis->first);
+        free(axis->weights);
+        free(w);
+        axis->first   = NULL;
+        axis->weights = NULL;
+        return -1;
+    }
+    for (i = 0; i < dstSize; i++)
+    {
+        if (kernel == SCALE_AREA)
+        {
+            lo    = i * scale;
+            hi    = lo + scale;
+            start = (int)floor(lo);
+        }
+        else
+        {
+            lo    = (i + 0.5) * scale - 0.5; // Source position of the pixel center
+            start = (int)floor(lo) - kernelTaps / 2 + 1;
+        }
+        first = start < 0 ? 0 : start > srcSize - axis->taps ? srcSize - axis->taps : start;
+        for (k = 0; k < axis->taps; k++)
+            w[k] = 0.0;
+        for (k = 0, total = 0.0; k < kernelTaps; k++)
+        {
+            double weight;
+            idx = start + k;
+            if (kernel == SCALE_AREA)
+                weight = (hi < idx + 1 ? hi : idx + 1) - (lo > idx ? lo : idx);
+            else
+                weight = scaleKernel(kernel, lo - idx);
+            if (weight == 0.0 || (kernel == SCALE_AREA && weight < 0.0))
+                continue;
+            idx = idx < 0 ? 0 : idx >= srcSize ? srcSize - 1 : idx;
+            w[idx - first] += weight;
+            total          += weight;
+        }
+        /*
+         * Weights sum to exactly SCALE_ONE, rounding goes to the biggest.
+         */
+        for (k = 0, big = 0, sum = 0; k < axis->taps; k++)
+        {
+            axis->weights[i * axis->taps + k] = (short)floor(w[k] / total * SCALE_ONE + 0.5);
+            sum += axis->weights[i * axis->taps + k];
+            if (w[k] > w[big])
+                big = k;
+        }
+        axis->weights[i * axis->taps + big] += SCALE_ONE - sum;
+        axis->first[i] = first;
+    }
+    free(w);
+    return 0;
+}
+/*
+ * Vertical pass for 8 and 16 bit samples into a row of ints.
+ */
+static void scaleColumn(const unsigned char *src, long srcStride, int pixelSize, int samples, const short *weights, int taps, int *row)
+{
+    int s = 0, k, acc;
+#ifdef __SSE2__
+    /*
+     * Taps go in pairs through madd. 16 bit samples are biased to signed,
+     * and the weights summing to SCALE_ONE makes the bias a constant.
+     */
+    const __m128i bias   = _mm_set1_epi16(pixelSize == 2 ? (short)0x8000 : 0);
+    const __m128i offset = _mm_set1_epi32((pixelSize == 2 ? 32768 * SCALE_ONE : 0) + SCALE_ONE / 2);
+    const __m128i zero   = _mm_setzero_si128();
+    for (; s + 8 <= samples; s += 8)
+    {
+        __m128i acc0 = offset, acc1 = offset;
+        for (k = 0; k < taps; k += 2)
+        {
+            const unsigned char *p0 = src + k * srcStride + s * pixelSize;
+            const unsigned char *p1 = k + 1 < taps ? p0 + srcStride : p0;
+            __m128i w  = _mm_set1_epi32((unsigned short)weights[k] | ((k + 1 < taps ? (int)weights[k + 1] : 0) << 16));
+            __m128i a, b;
+            if (pixelSize == 2)
+            {
+                a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p0), bias);
+                b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)p1), bias);
+            }
+            else
+            {
+                a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p0), zero);
+                b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p1), zero);
+            }
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        _mm_storeu_si128((__m128i *)(row + s),     _mm_srai_epi32(acc0, SCALE_BITS));
+        _mm_storeu_si128((__m128i *)(row + s + 4), _mm_srai_epi32(acc1, SCALE_BITS));
+    }
+#endif
+    for (; s < samples; s++)
+    {
+        for (k = 0, acc = SCALE_ONE / 2; k < taps; k++)
+            acc += weights[k] * (pixelSize == 2 ? (int)((const unsigned short *)(src + k * srcStride))[s] : (int)src[k * srcStride + s]);
+        row[s] = acc >> SCALE_BITS;
+    }
+}
+/*
+ * Horizontal pass from the row of ints into the destination. The common
+ * tap and channel counts get their own unrolled loops.
+ */
+#define SCALE_ROW(pixel_type, chans, n)                                                             \
+    for (x = 0; x < dstWidth; x++, weights += n)                                                    \
+    {                                                                                               \
+        const int *src = row + first[x] * (chans);                                                  \
+        for (c = 0; c < (chans); c++, src++)                                                        \
+        {                                                                                           \
+            for (k = 0, acc = SCALE_ONE / 2; k < (n); k++)                                          \
+                acc += weights[k] * src[k * (chans)];                                               \
+            acc >>= SCALE_BITS;                                                                     \
+            ((pixel_type *)dst)[x * (chans) + c] = acc < 0 ? 0 : acc > maxPixel ? maxPixel : acc;   \
+        }                                                                                           \
+    }
+#define SCALE_TAPS(pixel_type, chans)           \
+    switch (taps)                               \
+    {                                           \
+        case 2:                                 \
+            SCALE_ROW(pixel_type, chans, 2);    \
+            break;                              \
+        case 3:                                 \
+            SCALE_ROW(pixel_type, chans, 3);    \
+            break;                              \
+        case 4:                                 \
+            SCALE_ROW(pixel_type, chans, 4);    \
+            break;                              \
+        case 6:                                 \
+            SCALE_ROW(pixel_type, chans, 6);    \
+            break;                              \
+        default:                                \
+            SCALE_ROW(pixel_type, chans, taps); \
+    }
+static void scaleRow(const int *row, const int *first, const short *weights, int taps, unsigned char *dst, int dstWidth, int pixelSize, int channels, int maxPixel)
+{
+    int x, c, k, acc;
+    if (pixelSize == 2 && channels == 1)
+        SCALE_TAPS(unsigned short, 1)
+    else if (pixelSize == 2)
+        SCALE_TAPS(unsigned short, channels)
+    else if (channels == 1)
+        SCALE_TAPS(unsigned char, 1)
+    else if (channels == 3)
+        SCALE_TAPS(unsigned char, 3)
+    else
+        SCALE_TAPS(unsigned char, channels)
+}
+#undef SCALE_TAPS
+#undef SCALE_ROW
+int scalePixels(struct scaler *scaler, int filter, const void *src, int srcWidth, int srcHeight, int srcPitch, void *dst, int dstWidth, int dstHeight, int dstPitch, int pixelSize, int channels)
+{
+    const unsigned char *s = (const unsigned char *)src;
+    unsigned char       *d = (unsigned char *)dst;
+    long   srcStride = srcPitch;
+    long   dstStride = dstPitch;
+    int    samples   = srcWidth * channels, rowSize, x, y, c, k, maxPixel;
+    const short *weights;
+    if (srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0
+     || buildScaleAxis(&scaler->x, filter, srcWidth,  dstWidth)
+     || buildScaleAxis(&scaler->y, filter, srcHeight, dstHeight))
+        return -1;
+    rowSize = samples * (pixelSize == 4 ? sizeof(double) : sizeof(int));
+    if (scaler->rowSize < rowSize)
+    {
+        free(scaler->row);
+        if ((scaler->row = malloc(rowSize)) == NULL)
+        {
+            scaler->rowSize = 0;
+            return -1;
+        }
+        scaler->rowSize = rowSize;
+    }
+    if (pixelSize == 4)
+    {
+        /*
+         * 32 bit samples don't fit the fixed point passes.
+         */
+        double *row = (double *)scaler->row, sum;
+        for (y = 0; y < dstHeight; y++, d += dstStride)
+        {
+            const unsigned char *column = s + scaler->y.first[y] * srcStride;
+            weights = scaler->y.weights + y * scaler->y.taps;
+            for (x = 0; x < samples; x++)
+                for (k = 0, row[x] = 0.0; k < scaler->y.taps; k++)
+                    row[x] += weights[k] * (double)((const uint32_t *)(column + k * srcStride))[x];
+            for (x = 0; x < dstWidth; x++)
+                for (c = 0, weights = scaler->x.weights + x * scaler->x.taps; c < channels; c++)
+                {
+                    for (k = 0, sum = 0.0; k < scaler->x.taps; k++)
+                        sum += weights[k] * row[(scaler->x.first[x] + k) * channels + c];
+                    sum = floor(sum / ((double)SCALE_ONE * SCALE_ONE) + 0.5);
+                    ((uint32_t *)d)[x * channels + c] = sum <= 0.0 ? 0 : sum >= 4294967295.0 ? 0xFFFFFFFF : (uint32_t)sum;
+                }
+        }
+        return 0;
+    }
+    maxPixel = pixelSize == 2 ? 0xFFFF : 0xFF;
+    for (y = 0; y < dstHeight; y++, d += dstStride)
+    {
+        int *row = (int *)scaler->row;
+        scaleColumn(s + scaler->y.first[y] * srcStride, srcStride, pixelSize, samples,
+                    scaler->y.weights + y * scaler->y.taps, scaler->y.taps, row);
+        scaleRow(row, scaler->x.first, scaler->x.weights, scaler->x.taps, d, dstWidth, pixelSize, channels, maxPixel);
+    }
+    return 0;
+}
+void freeScaler(struct scaler *scaler)
+{
+    free(scaler->x.first);
+    free(scaler->x.weights);
+    free(scaler->y.first);
+    free(scaler->y.weights);
+    free(scaler->row);
+    memset(scaler, 0, sizeof(struct scaler));
+}
 #ifdef __cplusplus
 }
 #endif
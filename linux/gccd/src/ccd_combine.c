@@ -0,0 +1,393 @@
+/*
+ * GCCD - Gnome CCD Camera Controller
+ * Copyright (C) 2001 David Schmenk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include "ccd_combine.h"
+#ifndef min
+#define min(a,b)    (((a)<(b))?(a):(b))
+#endif
+#ifndef max
+#define max(a,b)    (((a)>(b))?(a):(b))
+#endif
+
+/*
+ * Image combining.
+ * The following combine a number of frames into a single image. Nothing here
+ * depends on the GUI, so command line tools can share it with gccd.
+ *
+ * Frames are pulled into the combine engine a band of rows at a time through
+ * a read callback, so a stack kept on disk never has to be resident. Worker
+ * threads each claim the next band, gather every frame's rows for that band
+ * into a private buffer and reduce each pixel's samples. Ranked combines use
+ * a selection (or a sorting network for small odd stacks) instead of a sort.
+ */
+#define COMBINE_MAX_THREADS     16
+#define COMBINE_CLIP_SIGMA      2.5
+#define COMBINE_CLIP_PASSES     3
+#define COMBINE_WINSOR_FRACTION 10
+struct combine_state
+{
+    unsigned int      width;
+    unsigned int      height;
+    unsigned int      depth;
+    unsigned char    *pixels;
+    float            *sigma;
+    int             (*read_rows)(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst);
+    void             *source;
+    unsigned int      frame_count;
+    unsigned int      band_rows;
+    unsigned int      next_row;
+    int               op;
+    int               error;
+    pthread_mutex_t   lock;
+};
+/*
+ * Select the sample of the given rank. On return every sample below the rank
+ * is no greater, and every sample above it no less, than the one returned.
+ */
+static unsigned long select_sample(unsigned long *samples, unsigned int count, unsigned int rank)
+{
+    unsigned long pivot, tmp;
+    int           left, right, i, j;
+
+    left  = 0;
+    right = count - 1;
+    while (left < right)
+    {
+        pivot = samples[rank];
+        i     = left;
+        j     = right;
+        do
+        {
+            while (samples[i] < pivot)
+                i++;
+            while (pivot < samples[j])
+                j--;
+            if (i <= j)
+            {
+                tmp        = samples[i];
+                samples[i] = samples[j];
+                samples[j] = tmp;
+                i++;
+                j--;
+            }
+        } while (i <= j);
+        if (j < (int)rank)
+            left = i;
+        if ((int)rank < i)
+            right = j;
+    }
+    return (samples[rank]);
+}
+/*
+ * Median of the samples. Small odd stacks use minimal median networks.
+ */
+#define SAMPLE_SORT(a,b)                \
+    if (samples[a] > samples[b])        \
+    {                                   \
+        tmp        = samples[a];        \
+        samples[a] = samples[b];        \
+        samples[b] = tmp;               \
+    }
+static unsigned long median_sample(unsigned long *samples, unsigned int count)
+{
+    unsigned long tmp;
+
+    switch (count)
+    {
+        case 1:
+            return (samples[0]);
+        case 3:
+            SAMPLE_SORT(0, 1); SAMPLE_SORT(1, 2); SAMPLE_SORT(0, 1);
+            return (samples[1]);
+        case 5:
+            SAMPLE_SORT(0, 1); SAMPLE_SORT(3, 4); SAMPLE_SORT(0, 3);
+            SAMPLE_SORT(1, 4); SAMPLE_SORT(1, 2); SAMPLE_SORT(2, 3);
+            SAMPLE_SORT(1, 2);
+            return (samples[2]);
+        case 7:
+            SAMPLE_SORT(0, 5); SAMPLE_SORT(0, 3); SAMPLE_SORT(1, 6);
+            SAMPLE_SORT(2, 4); SAMPLE_SORT(0, 1); SAMPLE_SORT(3, 5);
+            SAMPLE_SORT(2, 6); SAMPLE_SORT(2, 3); SAMPLE_SORT(3, 6);
+            SAMPLE_SORT(4, 5); SAMPLE_SORT(1, 4); SAMPLE_SORT(1, 3);
+            SAMPLE_SORT(3, 4);
+            return (samples[3]);
+        case 9:
+            SAMPLE_SORT(1, 2); SAMPLE_SORT(4, 5); SAMPLE_SORT(7, 8);
+            SAMPLE_SORT(0, 1); SAMPLE_SORT(3, 4); SAMPLE_SORT(6, 7);
+            SAMPLE_SORT(1, 2); SAMPLE_SORT(4, 5); SAMPLE_SORT(7, 8);
+            SAMPLE_SORT(0, 3); SAMPLE_SORT(5, 8); SAMPLE_SORT(4, 7);
+            SAMPLE_SORT(3, 6); SAMPLE_SORT(1, 4); SAMPLE_SORT(2, 5);
+            SAMPLE_SORT(4, 7); SAMPLE_SORT(4, 2); SAMPLE_SORT(6, 4);
+            SAMPLE_SORT(4, 2);
+            return (samples[4]);
+    }
+    return (select_sample(samples, count, count / 2));
+}
+#undef SAMPLE_SORT
+/*
+ * Mean after iteratively rejecting samples more than COMBINE_CLIP_SIGMA
+ * deviations from the median.
+ */
+static float clip_mean_samples(unsigned long *samples, unsigned int count)
+{
+    unsigned int i, keep, pass;
+    float        center, sigma, dev, sum;
+
+    for (pass = 0; pass < COMBINE_CLIP_PASSES && count >= 3; pass++)
+    {
+        center = median_sample(samples, count);
+        sigma  = 0.0;
+        for (i = 0; i < count; i++)
+        {
+            dev    = samples[i] - center;
+            sigma += dev * dev;
+        }
+        sigma = sqrt(sigma / count) * COMBINE_CLIP_SIGMA;
+        for (i = keep = 0; i < count; i++)
+            if (fabs(samples[i] - center) <= sigma)
+                samples[keep++] = samples[i];
+        if (keep == count)
+            break;
+        count = keep;
+    }
+    for (i = 0, sum = 0.0; i < count; i++)
+        sum += samples[i];
+    return (sum / count);
+}
+/*
+ * Mean after clamping the lowest and highest COMBINE_WINSOR_FRACTION percent
+ * of the samples to their nearest survivors.
+ */
+static float winsor_mean_samples(unsigned long *samples, unsigned int count)
+{
+    unsigned int i, trim;
+    float        sum;
+
+    trim = count * COMBINE_WINSOR_FRACTION / 100;
+    if (trim == 0 && count >= 5)
+        trim = 1;
+    if (trim)
+    {
+        select_sample(samples, count, trim);
+        select_sample(&samples[trim], count - trim, count - 1 - trim * 2);
+    }
+    sum = (float)trim * (samples[trim] + samples[count - 1 - trim]);
+    for (i = trim; i < count - trim; i++)
+        sum += samples[i];
+    return (sum / count);
+}
+/*
+ * The result is clamped in double, which holds a 32 bit pixel maximum exactly.
+ */
+static unsigned long combine_samples(unsigned long *samples, unsigned int count, int op, double pixel_max)
+{
+    unsigned int  i;
+    unsigned long rank;
+    double        pixel;
+
+    switch (op)
+    {
+        case CCD_IMAGE_COMBINE_MEDIAN:
+            return (median_sample(samples, count));
+        case CCD_IMAGE_COMBINE_MIN:
+            rank = samples[0];
+            for (i = 1; i < count; i++)
+                rank = min(rank, samples[i]);
+            return (rank);
+        case CCD_IMAGE_COMBINE_MAX:
+            rank = samples[0];
+            for (i = 1; i < count; i++)
+                rank = max(rank, samples[i]);
+            return (rank);
+        case CCD_IMAGE_COMBINE_DIFF:
+            pixel = 0.0;
+            for (i = 0; i < count; i++)
+                pixel = fabs(pixel - samples[i]);
+            return (pixel);
+        case CCD_IMAGE_COMBINE_SUM:
+        case CCD_IMAGE_COMBINE_MEAN:
+            pixel = 0.0;
+            for (i = 0; i < count; i++)
+                pixel += samples[i];
+            if (op == CCD_IMAGE_COMBINE_MEAN)
+                pixel /= count;
+            break;
+        case CCD_IMAGE_COMBINE_SIGMA_CLIP:
+            pixel = clip_mean_samples(samples, count);
+            break;
+        case CCD_IMAGE_COMBINE_WINSORIZE:
+            pixel = winsor_mean_samples(samples, count);
+            break;
+        default:
+            return (0);
+    }
+    return (min(pixel, pixel_max));
+}
+/*
+ * Standard deviation of the samples about their mean.
+ */
+static float sigma_samples(unsigned long *samples, unsigned int count)
+{
+    unsigned int i;
+    double       sum, sum2;
+
+    if (count < 2)
+        return (0.0);
+    for (i = 0, sum = sum2 = 0.0; i < count; i++)
+    {
+        sum  += samples[i];
+        sum2 += (double)samples[i] * samples[i];
+    }
+    sum /= count;
+    return (sqrt(max(sum2 / count - sum * sum, 0.0) * count / (count - 1)));
+}
+static void *combine_worker(void *arg)
+{
+    struct combine_state *state = arg;
+    unsigned int          i, p, y, rows, band_pixels, pixel_size;
+    unsigned char        *band;
+    unsigned long        *samples, pixel;
+    double                pixel_max;
+
+    pixel_size = (state->depth + 7) / 8;
+    pixel_max  = (double)((1ULL << state->depth) - 1);
+    band       = malloc(state->band_rows * state->width * pixel_size * state->frame_count);
+    samples    = malloc(sizeof(unsigned long) * state->frame_count);
+    if (!band || !samples)
+    {
+        pthread_mutex_lock(&state->lock);
+        state->error = 1;
+        pthread_mutex_unlock(&state->lock);
+    }
+    while (band && samples)
+    {
+        /*
+         * Claim the next band of rows.
+         */
+        pthread_mutex_lock(&state->lock);
+        y                = state->next_row;
+        state->next_row += state->band_rows;
+        if (state->error)
+            y = state->height;
+        pthread_mutex_unlock(&state->lock);
+        if (y >= state->height)
+            break;
+        rows        = min(state->band_rows, state->height - y);
+        band_pixels = rows * state->width;
+        for (i = 0; i < state->frame_count; i++)
+            if (state->read_rows(state->source, i, y, rows, band + i * band_pixels * pixel_size))
+            {
+                pthread_mutex_lock(&state->lock);
+                state->error = 1;
+                pthread_mutex_unlock(&state->lock);
+                break;
+            }
+        if (i < state->frame_count)
+            break;
+        for (p = 0; p < band_pixels; p++)
+        {
+            switch (pixel_size)
+            {
+                case 1:
+                    for (i = 0; i < state->frame_count; i++)
+                        samples[i] = ((unsigned char *)band)[i * band_pixels + p];
+                    break;
+                case 2:
+                    for (i = 0; i < state->frame_count; i++)
+                        samples[i] = ((unsigned short *)band)[i * band_pixels + p];
+                    break;
+                case 4:
+                    for (i = 0; i < state->frame_count; i++)
+                        samples[i] = ((uint32_t *)band)[i * band_pixels + p];
+                    break;
+            }
+            /*
+             * The reducers reorder the samples, so measure the spread first.
+             */
+            if (state->sigma)
+                state->sigma[y * state->width + p] = sigma_samples(samples, state->frame_count);
+            pixel = combine_samples(samples, state->frame_count, state->op, pixel_max);
+            switch (pixel_size)
+            {
+                case 1:
+                    ((unsigned char *)state->pixels)[y * state->width + p] = pixel;
+                    break;
+                case 2:
+                    ((unsigned short *)state->pixels)[y * state->width + p] = pixel;
+                    break;
+                case 4:
+                    ((uint32_t *)state->pixels)[y * state->width + p] = pixel;
+                    break;
+            }
+        }
+    }
+    free(samples);
+    free(band);
+    return (NULL);
+}
+/*
+ * Combine frames supplied a band of rows at a time by read_rows(), which must
+ * be safe to call from several threads at once and return non-zero on error.
+ * If sigma isn't NULL it receives each pixel's standard deviation across the
+ * frames.
+ */
+int ccd_combine_stream(unsigned int width, unsigned int height, unsigned int depth, unsigned char *pixels, float *sigma, int (*read_rows)(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst), void *source, unsigned int frame_count, int op)
+{
+    struct combine_state state;
+    pthread_t            threads[COMBINE_MAX_THREADS];
+    unsigned int         i, thread_count, pixel_size;
+    long                 cpus;
+
+    if (frame_count == 0 || !pixels)
+        return (-1);
+    pixel_size = (depth + 7) / 8;
+    state.width       = width;
+    state.height      = height;
+    state.depth       = depth;
+    state.pixels      = pixels;
+    state.sigma       = sigma;
+    state.read_rows   = read_rows;
+    state.source      = source;
+    state.frame_count = frame_count;
+    state.band_rows   = max(1, CCD_COMBINE_BAND_BYTES / (width * pixel_size * frame_count));
+    state.next_row    = 0;
+    state.op          = op;
+    state.error       = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    cpus         = sysconf(_SC_NPROCESSORS_ONLN);
+    thread_count = min(min(max(cpus, 1), COMBINE_MAX_THREADS), (height + state.band_rows - 1) / state.band_rows);
+    for (i = 1; i < thread_count; i++)
+        if (pthread_create(&threads[i], NULL, combine_worker, &state))
+            break;
+    thread_count = i;
+    /*
+     * This thread takes bands too.
+     */
+    combine_worker(&state);
+    for (i = 1; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&state.lock);
+    return (state.error ? -1 : 0);
+}
@@ -0,0 +1,37 @@
+/*
+ * GCCD - Gnome CCD Camera Controller
+ * Copyright (C) 2001 David Schmenk
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307
+ * USA
+ */
+
+/*
+ * Frame combine engine, shared by gccd and the command line tools.
+ */
+#ifndef CCD_COMBINE_H
+#define CCD_COMBINE_H
+#define CCD_IMAGE_COMBINE_MEDIAN        1
+#define CCD_IMAGE_COMBINE_MIN           2
+#define CCD_IMAGE_COMBINE_MAX           3
+#define CCD_IMAGE_COMBINE_MEAN          4
+#define CCD_IMAGE_COMBINE_DIFF          5
+#define CCD_IMAGE_COMBINE_SUM           6
+#define CCD_IMAGE_COMBINE_INTERLEAVE    7
+#define CCD_IMAGE_COMBINE_SIGMA_CLIP    8
+#define CCD_IMAGE_COMBINE_WINSORIZE     9
+#define CCD_COMBINE_BAND_BYTES          (256*1024)
+int ccd_combine_stream(unsigned int width, unsigned int height, unsigned int depth, unsigned char *pixels, float *sigma, int (*read_rows)(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst), void *source, unsigned int frame_count, int op);
+#endif
@@ -21,6 +21,7 @@
 #include "gccd.h"
 #define MAX_CCD_DEVICES     4
 #define MAX_EXPOSURES       100
+#define MAX_STACK_EXPOSURES 1000
 #define GCCD_SET_BIAS       1
 #define GCCD_SET_DARK       2
 #define GCCD_SET_FLAT       3
@@ -45,6 +46,21 @@
 #define GUIDE_SELF          2
 #define GUIDE_ACQUIRE       16
 #define GUIDE_ACQUIRE_COUNT 2
+#define GUIDE_DISPLAY_MSEC  250
+#define GUIDE_PIPE_IDLE     0
+#define GUIDE_PIPE_PENDING  1
+#define GUIDE_PIPE_DONE     2
+#define GUIDE_MAX_STARS     8
+#define GUIDE_LOST_COUNT    4
+#define GUIDE_KI            0.1
+#define GUIDE_KD            0.1
+#define GUIDE_HYSTERESIS    0.1
+#define GUIDE_INTEGRAL_MAX  1.0
+#define GUIDE_PULSE_GAP     500
+#define GUIDE_DITHER_MAX    5.0
+#define GUIDE_RESET_NONE    0
+#define GUIDE_RESET_ALL     1
+#define GUIDE_RESET_MOTION  2
 #define FIELD_BOTH          0
 #define FIELD_ODD           1
 #define FIELD_EVEN          2
@@ -79,10 +95,15 @@ static struct
     struct ccd_exp    interleave;
     struct ccd_exp    focus;
     struct ccd_exp    guide;
+    struct ccd_reader exp_reader;
+    struct ccd_reader guide_reader;
     struct ccd_image *bias_frame;
     struct ccd_image *dark_frame;
     struct ccd_image *flat_frame;
+    struct ccd_calibrate *calibrate;
     unsigned char    *exp_pixels[MAX_EXPOSURES];
+    unsigned char    *field_pixels[2];
+    struct ccd_stack *exp_stack;
     unsigned char    *matrix_pixels[MAX_EXPOSURES][5];
     unsigned int      matrix_colors[5];
     unsigned int      matrix_num_frames;
@@ -125,6 +146,15 @@ static struct
     float             guide_interleave_offset;
     float             guide_min_offset;
     float             guide_train_msec;
+    float             guide_dither;
+    float             guide_x_dither;
+    float             guide_y_dither;
+    int               guide_aggression;
+    unsigned long     exp_download_start;
+    int               guide_download;
+    unsigned int      guide_download_frames;
+    float             guide_download_err;
+    float             guide_download_max;
 } ccd_state = {0};
 static struct
 {
@@ -169,8 +199,12 @@ static void (*imageAdd)(struct ccd_image *) = NULL;
 static gboolean cbUpdateExposure(gpointer data);
 static gboolean cbInterleaveExposure(gpointer data);
 static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in);
+static void cbLoadedExposure(gpointer data, gint fd, GdkInputCondition in);
 static void cbReadFocus(gpointer data, gint fd, GdkInputCondition in);
 static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in);
+static void cbLoadedGuide(gpointer data, gint fd, GdkInputCondition in);
+static void cbGuideResult(gpointer data, gint fd, GdkInputCondition in);
+static gboolean cbUpdateGuide(gpointer data);
 
 /***************************************************************************\
 *                                                                           *
@@ -406,6 +440,459 @@ static void focus_recalc_viewport()
 *                                                                           *
 \***************************************************************************/
 
+/*
+ * Guide pipeline. The next guide exposure is started as soon as a frame has
+ * downloaded, and the frame is handed to a worker thread to find the
+ * centroid. The worker wakes the main loop through a pipe, where the
+ * telescope is corrected and the guide view is (occasionally) redrawn.
+ */
+static struct
+{
+    pthread_t        thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   ready;
+    int              notify[2];
+    int              state;
+    unsigned int     cycle;
+    unsigned int     frame_cycle;
+    unsigned int     exposed_msec;
+    unsigned int     display_msec;
+    unsigned int     skipped;
+    struct ccd_image frame;
+    int              found;
+    float            x_centroid;
+    float            y_centroid;
+    int              x_radius;
+    int              y_radius;
+    float            sigs;
+} guide_pipe;
+/*
+ * Reference stars in the guide box, captured on the first frame of each
+ * guide cycle. Only touched by whoever measures the frame.
+ */
+static struct
+{
+    unsigned int    cycle;
+    int             count;
+    struct ccd_star refs[GUIDE_MAX_STARS];
+    float           dx;
+    float           dy;
+} guide_stars;
+/*
+ * Measure the guide star position. Every reference star found again is
+ * matched against where the last displacement predicts it, and the flux
+ * weighted mean displacement is reported as the guide star position. The
+ * seeing of the individual stars averages out, and the guide star can fade
+ * for a frame without losing the lock.
+ */
+static int guide_measure(struct ccd_image *frame, unsigned int cycle, int x_max_radius, int y_max_radius, float sigs, float *x_centroid, float *y_centroid)
+{
+    struct ccd_star stars[GUIDE_MAX_STARS];
+    int             i, j, num_stars, best, x_radius, y_radius;
+    float           dx, dy, dist, best_dist, sum_dx, sum_dy, sum_flux, x_primary, y_primary;
+
+    x_primary = GUIDE_WIDTH  / 2;
+    y_primary = GUIDE_HEIGHT / 2;
+    x_radius  = x_max_radius;
+    y_radius  = y_max_radius;
+    num_stars = ccd_image_find_stars(frame, frame->pixels, stars, GUIDE_MAX_STARS, x_max_radius, y_max_radius, sigs);
+    if (guide_stars.cycle != cycle || !guide_stars.count)
+    {
+        /*
+         * New references: the guide star first, then its brightest neighbors.
+         */
+        if (!ccd_image_find_best_centroid(frame, frame->pixels, &x_primary, &y_primary, frame->width/2, frame->height/2, &x_radius, &y_radius, sigs))
+            return (FALSE);
+        guide_stars.cycle = cycle;
+        guide_stars.count = 1;
+        guide_stars.dx    = 0.0;
+        guide_stars.dy    = 0.0;
+        guide_stars.refs[0].x_centroid = x_primary;
+        guide_stars.refs[0].y_centroid = y_primary;
+        guide_stars.refs[0].x_radius   = x_radius;
+        guide_stars.refs[0].y_radius   = y_radius;
+        guide_stars.refs[0].flux       = 1.0;
+        for (i = 0; i < num_stars; i++)
+        {
+            if (fabs(stars[i].x_centroid - x_primary) <= max(x_radius, stars[i].x_radius)
+             && fabs(stars[i].y_centroid - y_primary) <= max(y_radius, stars[i].y_radius))
+                guide_stars.refs[0].flux = stars[i].flux;
+            else if (guide_stars.count < GUIDE_MAX_STARS)
+                guide_stars.refs[guide_stars.count++] = stars[i];
+        }
+        *x_centroid = x_primary;
+        *y_centroid = y_primary;
+        return (TRUE);
+    }
+    sum_dx   = 0.0;
+    sum_dy   = 0.0;
+    sum_flux = 0.0;
+    for (i = 0; i < guide_stars.count; i++)
+    {
+        best      = -1;
+        best_dist = max(x_max_radius, y_max_radius);
+        best_dist = best_dist * best_dist;
+        for (j = 0; j < num_stars; j++)
+        {
+            dx   = stars[j].x_centroid - (guide_stars.refs[i].x_centroid + guide_stars.dx);
+            dy   = stars[j].y_centroid - (guide_stars.refs[i].y_centroid + guide_stars.dy);
+            dist = dx * dx + dy * dy;
+            if (dist < best_dist)
+            {
+                best      = j;
+                best_dist = dist;
+            }
+        }
+        if (best >= 0)
+        {
+            sum_dx   += (stars[best].x_centroid - guide_stars.refs[i].x_centroid) * guide_stars.refs[i].flux;
+            sum_dy   += (stars[best].y_centroid - guide_stars.refs[i].y_centroid) * guide_stars.refs[i].flux;
+            sum_flux += guide_stars.refs[i].flux;
+        }
+    }
+    if (sum_flux > 0.0)
+    {
+        guide_stars.dx = sum_dx / sum_flux;
+        guide_stars.dy = sum_dy / sum_flux;
+    }
+    else
+    {
+        /*
+         * Nothing matched, fall back to the brightest star near the center.
+         */
+        if (!ccd_image_find_best_centroid(frame, frame->pixels, &x_primary, &y_primary, frame->width/2, frame->height/2, &x_radius, &y_radius, sigs))
+            return (FALSE);
+        guide_stars.dx = x_primary - guide_stars.refs[0].x_centroid;
+        guide_stars.dy = y_primary - guide_stars.refs[0].y_centroid;
+    }
+    *x_centroid = guide_stars.refs[0].x_centroid + guide_stars.dx;
+    *y_centroid = guide_stars.refs[0].y_centroid + guide_stars.dy;
+    return (TRUE);
+}
+static void *guide_worker(void *data)
+{
+    int   found;
+    float x_centroid, y_centroid;
+
+    pthread_mutex_lock(&guide_pipe.lock);
+    while (TRUE)
+    {
+        while (guide_pipe.state != GUIDE_PIPE_PENDING)
+            pthread_cond_wait(&guide_pipe.ready, &guide_pipe.lock);
+        pthread_mutex_unlock(&guide_pipe.lock);
+        found = guide_measure(&guide_pipe.frame, guide_pipe.frame_cycle, guide_pipe.x_radius, guide_pipe.y_radius, guide_pipe.sigs, &x_centroid, &y_centroid);
+        pthread_mutex_lock(&guide_pipe.lock);
+        guide_pipe.found      = found;
+        guide_pipe.x_centroid = x_centroid;
+        guide_pipe.y_centroid = y_centroid;
+        guide_pipe.state      = GUIDE_PIPE_DONE;
+        write(guide_pipe.notify[1], "", 1);
+    }
+    return (NULL);
+}
+static int guide_pipe_init(void)
+{
+    if (guide_pipe.thread)
+        return (TRUE);
+    if (pipe(guide_pipe.notify) < 0)
+        return (FALSE);
+    pthread_mutex_init(&guide_pipe.lock, NULL);
+    pthread_cond_init(&guide_pipe.ready, NULL);
+    if (pthread_create(&guide_pipe.thread, NULL, guide_worker, NULL))
+    {
+        close(guide_pipe.notify[0]);
+        close(guide_pipe.notify[1]);
+        guide_pipe.thread = 0;
+        return (FALSE);
+    }
+    gdk_input_add(guide_pipe.notify[0], GDK_INPUT_READ, (GdkInputFunction)cbGuideResult, NULL);
+    return (TRUE);
+}
+/*
+ * Pass the downloaded guide frame to the worker, leaving a free buffer for
+ * the next exposure. Frames arriving while the worker is busy are skipped.
+ */
+static void guide_pipe_post(void)
+{
+    unsigned char *pixels;
+
+    if (guide_pipe.state != GUIDE_PIPE_IDLE)
+    {
+        guide_pipe.skipped++;
+        return;
+    }
+    pixels = guide_pipe.frame.pixels;
+    if (pixels && (guide_pipe.frame.width  != ccd_state.guide.image->width
+                || guide_pipe.frame.height != ccd_state.guide.image->height
+                || guide_pipe.frame.depth  != ccd_state.guide.image->depth))
+    {
+        free(pixels);
+        pixels = NULL;
+    }
+    memcpy(&guide_pipe.frame, ccd_state.guide.image, sizeof(struct ccd_image));
+    ccd_state.guide.image->pixels = pixels;
+    guide_pipe.frame_cycle        = guide_pipe.cycle;
+    guide_pipe.exposed_msec       = ccd_state.guide.start + ccd_state.guide.msec;
+    guide_pipe.x_radius           = ccd_state.reg_x_max_radius;
+    guide_pipe.y_radius           = ccd_state.reg_y_max_radius;
+    guide_pipe.sigs               = ccd_state.reg_noise_sigs;
+    if (!guide_pipe.thread)
+    {
+        /*
+         * No worker, find the centroid here.
+         */
+        guide_pipe.found      = guide_measure(&guide_pipe.frame, guide_pipe.frame_cycle, guide_pipe.x_radius, guide_pipe.y_radius, guide_pipe.sigs, &guide_pipe.x_centroid, &guide_pipe.y_centroid);
+        guide_pipe.state      = GUIDE_PIPE_DONE;
+        cbGuideResult(NULL, -1, GDK_INPUT_READ);
+        return;
+    }
+    pthread_mutex_lock(&guide_pipe.lock);
+    guide_pipe.state = GUIDE_PIPE_PENDING;
+    pthread_cond_signal(&guide_pipe.ready);
+    pthread_mutex_unlock(&guide_pipe.lock);
+}
+/*
+ * Guide controller. Each measured offset drives a PID loop per axis: the
+ * proportional term is scaled by the aggressiveness, the integral term
+ * learns the slow drift of the mount (periodic error, polar misalignment)
+ * and keeps correcting it even when a frame loses the star, and the
+ * derivative term damps overshoot. The output is blended with the last one
+ * (hysteresis) and moves smaller than the minimum offset are skipped. The
+ * pulses run in their own thread so a long correction never holds up the
+ * main loop or the next guide frame.
+ */
+struct guide_axis
+{
+    float integral;
+    float error;
+    float output;
+};
+static struct
+{
+    pthread_t         thread;
+    pthread_mutex_t   lock;
+    pthread_cond_t    ready;
+    pthread_cond_t    done;
+    int               pending;
+    int               busy;
+    unsigned int      cycle;
+    int               valid;
+    int               integrate;
+    float             dx;
+    float             dy;
+    float             gain;
+    float             min_offset;
+    float             track_left;
+    float             track_right;
+    float             track_up;
+    float             track_down;
+    unsigned int      max_msec;
+    struct guide_axis x_axis;
+    struct guide_axis y_axis;
+} guide_control;
+static float guide_axis_update(struct guide_axis *axis, float error)
+{
+    float output;
+
+    if (!guide_control.valid)
+    {
+        /*
+         * No measurement, keep up with the learned drift alone.
+         */
+        output = GUIDE_KI * axis->integral;
+    }
+    else
+    {
+        if (guide_control.integrate)
+        {
+            axis->integral += error;
+            if (axis->integral > GUIDE_INTEGRAL_MAX / GUIDE_KI)
+                axis->integral = GUIDE_INTEGRAL_MAX / GUIDE_KI;
+            else if (axis->integral < -GUIDE_INTEGRAL_MAX / GUIDE_KI)
+                axis->integral = -GUIDE_INTEGRAL_MAX / GUIDE_KI;
+        }
+        output = guide_control.gain * error + GUIDE_KI * axis->integral + GUIDE_KD * (error - axis->error);
+        axis->error = error;
+    }
+    output       = (1.0 - GUIDE_HYSTERESIS) * output + GUIDE_HYSTERESIS * axis->output;
+    axis->output = output;
+    return (fabs(output) < guide_control.min_offset ? 0.0 : output);
+}
+/*
+ * Clear the controller state. A motion reset drops only the derivative and
+ * hysteresis history and keeps the learned drift.
+ */
+static void guide_axis_reset(int reset)
+{
+    if (reset == GUIDE_RESET_MOTION)
+    {
+        guide_control.x_axis.error  = guide_control.y_axis.error  = 0.0;
+        guide_control.x_axis.output = guide_control.y_axis.output = 0.0;
+    }
+    else
+    {
+        memset(&guide_control.x_axis, 0, sizeof(struct guide_axis));
+        memset(&guide_control.y_axis, 0, sizeof(struct guide_axis));
+    }
+}
+/*
+ * Pulse the mount, cut short if guiding stops. Called with the lock held.
+ */
+static void guide_control_pulse(unsigned int dir, float offset, float rate, unsigned int cycle)
+{
+    unsigned int    msec;
+    struct timeval  now;
+    struct timespec deadline;
+
+    msec = min(fabs(offset) / rate * 1000, guide_control.max_msec);
+    if (!msec || guide_control.cycle != cycle)
+        return;
+    scope_move(&scope_state, dir);
+    gettimeofday(&now, NULL);
+    deadline.tv_sec  = now.tv_sec + (now.tv_usec / 1000 + msec) / 1000;
+    deadline.tv_nsec = ((now.tv_usec / 1000 + msec) % 1000) * 1000000 + (now.tv_usec % 1000) * 1000;
+    while (guide_control.cycle == cycle && pthread_cond_timedwait(&guide_control.ready, &guide_control.lock, &deadline) != ETIMEDOUT);
+    scope_move(&scope_state, SCOPE_STOP);
+    pthread_mutex_unlock(&guide_control.lock);
+    usleep(GUIDE_PULSE_GAP);
+    pthread_mutex_lock(&guide_control.lock);
+}
+static void *guide_controller(void *data)
+{
+    unsigned int cycle;
+    float        x_output, y_output;
+
+    pthread_mutex_lock(&guide_control.lock);
+    while (TRUE)
+    {
+        while (!guide_control.pending)
+            pthread_cond_wait(&guide_control.ready, &guide_control.lock);
+        guide_control.pending = FALSE;
+        guide_control.busy    = TRUE;
+        cycle    = guide_control.cycle;
+        x_output = guide_axis_update(&guide_control.x_axis, guide_control.dx);
+        y_output = guide_axis_update(&guide_control.y_axis, guide_control.dy);
+        if (x_output < 0.0)
+            guide_control_pulse(SCOPE_LEFT,  x_output, guide_control.track_left,  cycle);
+        else if (x_output > 0.0)
+            guide_control_pulse(SCOPE_RIGHT, x_output, guide_control.track_right, cycle);
+        if (y_output < 0.0)
+            guide_control_pulse(SCOPE_UP,    y_output, guide_control.track_up,    cycle);
+        else if (y_output > 0.0)
+            guide_control_pulse(SCOPE_DOWN,  y_output, guide_control.track_down,  cycle);
+        guide_control.busy = FALSE;
+        pthread_cond_broadcast(&guide_control.done);
+    }
+    return (NULL);
+}
+static int guide_control_init(void)
+{
+    if (guide_control.thread)
+        return (TRUE);
+    pthread_mutex_init(&guide_control.lock, NULL);
+    pthread_cond_init(&guide_control.ready, NULL);
+    pthread_cond_init(&guide_control.done, NULL);
+    if (pthread_create(&guide_control.thread, NULL, guide_controller, NULL))
+    {
+        guide_control.thread = 0;
+        return (FALSE);
+    }
+    return (TRUE);
+}
+/*
+ * Hand the latest offset to the controller. A correction still being
+ * pulsed finishes first, only the newest offset is kept.
+ */
+static void guide_control_post(float dx, float dy, int valid)
+{
+    float x_output, y_output;
+
+    if (guide_control.thread)
+        pthread_mutex_lock(&guide_control.lock);
+    guide_control.dx          = dx;
+    guide_control.dy          = dy;
+    guide_control.valid       = valid;
+    guide_control.integrate   = !(ccd_state.guiding & GUIDE_ACQUIRE);
+    guide_control.gain        = ccd_state.guide_aggression / 100.0;
+    guide_control.min_offset  = ccd_state.guide_min_offset;
+    guide_control.track_left  = ccd_state.guide_track_left;
+    guide_control.track_right = ccd_state.guide_track_right;
+    guide_control.track_up    = ccd_state.guide_track_up;
+    guide_control.track_down  = ccd_state.guide_track_down;
+    guide_control.max_msec    = ccd_state.guide_msec;
+    if (!guide_control.thread)
+    {
+        /*
+         * No controller thread, pulse from the main loop.
+         */
+        x_output = guide_axis_update(&guide_control.x_axis, dx);
+        y_output = guide_axis_update(&guide_control.y_axis, dy);
+        if (ccd_state.guide.timeout_id)
+        {
+            gtk_timeout_remove(ccd_state.guide.timeout_id);
+            ccd_state.guide.timeout_id = 0;
+        }
+        ccd_state.guide_dx_centroid = x_output;
+        ccd_state.guide_dy_centroid = y_output;
+        cbUpdateGuide(0);
+        return;
+    }
+    guide_control.pending = TRUE;
+    pthread_cond_broadcast(&guide_control.ready);
+    pthread_mutex_unlock(&guide_control.lock);
+}
+/*
+ * Cancel any correction and wait for the mount to stop.
+ */
+static void guide_control_stop(int reset)
+{
+    if (guide_control.thread)
+    {
+        pthread_mutex_lock(&guide_control.lock);
+        guide_control.cycle++;
+        guide_control.pending = FALSE;
+        pthread_cond_broadcast(&guide_control.ready);
+        while (guide_control.busy)
+            pthread_cond_wait(&guide_control.done, &guide_control.lock);
+        if (reset != GUIDE_RESET_NONE)
+            guide_axis_reset(reset);
+        pthread_mutex_unlock(&guide_control.lock);
+    }
+    else if (reset != GUIDE_RESET_NONE)
+        guide_axis_reset(reset);
+}
+/*
+ * Move the guide target by a random offset between exposures, so hot pixels
+ * and pattern noise land on different sky pixels in each frame. Without a
+ * guide restart pending, wait here for the star to settle on the new target.
+ */
+static void guide_dither(void)
+{
+    float x_dither, y_dither;
+
+    x_dither = ccd_state.guide_dither * (2.0 * rand() / RAND_MAX - 1.0);
+    y_dither = ccd_state.guide_dither * (2.0 * rand() / RAND_MAX - 1.0);
+    ccd_state.guide_x_centroid += x_dither - ccd_state.guide_x_dither;
+    ccd_state.guide_y_centroid += y_dither - ccd_state.guide_y_dither;
+    ccd_state.guide_x_dither    = x_dither;
+    ccd_state.guide_y_dither    = y_dither;
+    /*
+     * The jump is not motion of the mount, so forget the last error and
+     * output, but keep the drift the integral has learned. While the star is
+     * left to settle below, the integral is held.
+     */
+    guide_control_stop(GUIDE_RESET_MOTION);
+    if (verbose & 1) g_print("Dither (%.2f, %.2f)\n", x_dither, y_dither);
+    if (ccd_state.guide_download && !ccd_state.guide_dark)
+    {
+        if (gui_state.status)
+            gtk_label_set_text(GTK_LABEL(gui_state.status), _("Stabilize Guiding..."));
+        ccd_state.guide_acquire_count = 0;
+        ccd_state.guiding            |= GUIDE_ACQUIRE;
+        while (ccd_state.guiding & GUIDE_ACQUIRE)
+            gtk_main_iteration();
+    }
+}
 /*
  * Stop guiding.
  */
@@ -413,12 +900,15 @@ static int guide_stop(void)
 {
     if (ccd_state.guiding)
     {
+        guide_pipe.cycle++;
+        guide_control_stop(GUIDE_RESET_NONE);
         scope_update(SCOPE_STOP, FALSE);
         if (ccd_state.guide.input_tag)
         {
             gdk_input_remove(ccd_state.guide.input_tag);
             ccd_state.guide.input_tag = 0;
         }
+        ccd_reader_cancel(&ccd_state.guide_reader);
         ccd_state.guide.downloading = FALSE;
         ccd_state.guiding          &= ~GUIDE_ACQUIRE;
         ccd_abort_exposures(&ccd_state.guide);
@@ -439,6 +929,10 @@ static void guide_start(int guiding)
         if (!scope_state.fd)
             while (scope_connect(&scope_state) < 0)
                 gnome_warning_dialog_parented(_("Telescope busy.  Wait for GOTO to complete."), GTK_WINDOW(gui_state.window));
+        if (!guide_pipe_init())
+            fprintf(stderr, "Unable to start guide worker: %s\n", strerror(errno));
+        if (!guide_control_init())
+            fprintf(stderr, "Unable to start guide controller: %s\n", strerror(errno));
         /*
          * Set the image to match the exposure.
          */
@@ -501,9 +995,14 @@ static void exposure_stop(gint done)
     if (ccd_state.exposing)
     {
         /*
-         * Stop guiding.
+         * Stop guiding and put the guide target back where it was selected.
          */
         guide_stop();
+        guide_control_stop(GUIDE_RESET_ALL);
+        ccd_state.guide_x_centroid -= ccd_state.guide_x_dither;
+        ccd_state.guide_y_centroid -= ccd_state.guide_y_dither;
+        ccd_state.guide_x_dither    = 0.0;
+        ccd_state.guide_y_dither    = 0.0;
         /*
          * Stop/cancel the exposure request.
          */
@@ -519,6 +1018,7 @@ static void exposure_stop(gint done)
                 gdk_input_remove(ccd_state.exposure.input_tag);
                 ccd_state.exposure.input_tag = 0;
             }
+            ccd_reader_cancel(&ccd_state.exp_reader);
             ccd_state.exposure.timeout_id = 0;
             ccd_state.exposure.input_tag  = 0;
             if (ccd_state.exposure.ccd->fd)
@@ -531,12 +1031,23 @@ static void exposure_stop(gint done)
                 ccd_image_delete(ccd_state.exposure.image);
                 ccd_state.exposure.image = NULL;
             }
-            for (i = 0; i < ccd_state.exp_current; i++)
+            for (i = 0; i < min(ccd_state.exp_current, MAX_EXPOSURES); i++)
                 if (ccd_state.exp_pixels[i])
                 {
                     free(ccd_state.exp_pixels[i]);
                     ccd_state.exp_pixels[i] = NULL;
                 }
+            for (i = 0; i < 2; i++)
+                if (ccd_state.field_pixels[i])
+                {
+                    free(ccd_state.field_pixels[i]);
+                    ccd_state.field_pixels[i] = NULL;
+                }
+            if (ccd_state.exp_stack)
+            {
+                ccd_stack_delete(ccd_state.exp_stack);
+                ccd_state.exp_stack = NULL;
+            }
             if (ccd_state.interleave.timeout_id)
             {
                 gtk_timeout_remove(ccd_state.interleave.timeout_id);
@@ -550,6 +1061,8 @@ static void exposure_stop(gint done)
                 ccd_state.interleave.image = NULL;
             }
         }
+        ccd_calibrate_delete(ccd_state.calibrate);
+        ccd_state.calibrate            = NULL;
         ccd_state.exp_current          = 0;
         ccd_state.exposing             = FALSE;
         ccd_state.exposure.downloading = FALSE;
@@ -730,15 +1243,25 @@ static gboolean cbInterleaveExposure(gpointer data)
     ccd_state.interleave.timeout_id = 0;
     return (FALSE);
 }
+/*
+ * Only registering one-shot color frames needs every frame resident, since the
+ * colors are split apart before registration. Everything else is stacked.
+ */
+static int stack_resident(void)
+{
+    return (ccd_state.exp_tracknstack
+         && ccd_state.exposure.image->color != CCD_COLOR_MONOCHROME
+         && ccd_state.exp_count <= MAX_EXPOSURES);
+}
+static gboolean cbUpdateDownload(gpointer data)
+{
+    if (gui_state.progress_bar)
+        gtk_progress_bar_update(GTK_PROGRESS_BAR(gui_state.progress_bar), 1.0 - (gfloat)(ccd_state.exposure.read_row * ccd_state.exposure.ybin) / (gfloat)ccd_state.exposure.height);
+    return (TRUE);
+}
 static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
 {
-    int               i, j;
-    unsigned long     start, stop;
-    struct timeval    now;
-    struct ccd_image *flat_frame;
-    unsigned char    *comb_pixels[MAX_EXPOSURES];
-    unsigned char    *registered_pixels[MAX_EXPOSURES];
-    gchar             str[16];
+    struct timeval now;
 
     /*
      * Reset input & timer calls.
@@ -749,9 +1272,15 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
     ccd_state.exposure.input_tag   = 0;
     ccd_state.exposure.downloading = TRUE;
     /*
-     * Stop guiding until download complete.
+     * A guide camera with its own readout keeps guiding through the download,
+     * the same camera has to stop guiding until download complete.
      */
-    if (ccd_state.guiding)
+    ccd_state.guide_download        = ccd_state.guiding && ccd_state.guide.input_tag
+                                   && ccd_state.guide.ccd->base != ccd_state.exposure.ccd->base;
+    ccd_state.guide_download_frames = 0;
+    ccd_state.guide_download_err    = 0.0;
+    ccd_state.guide_download_max    = 0.0;
+    if (ccd_state.guiding && !ccd_state.guide_download)
         guide_stop();
     /*
      * Reset progress bar.
@@ -762,21 +1291,63 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
         gtk_main_iteration();
     }
     gettimeofday(&now, NULL);
-    start = now.tv_sec * 1000 + now.tv_usec / 1000;
-    while (ccd_state.exposure.downloading && ccd_load_frame(&ccd_state.exposure))
+    ccd_state.exp_download_start = now.tv_sec * 1000 + now.tv_usec / 1000;
+    if (ccd_reader_start(&ccd_state.exp_reader, &ccd_state.exposure))
+    {
+        ccd_state.exposure.input_tag  = gdk_input_add(ccd_state.exp_reader.notify[0], GDK_INPUT_READ, (GdkInputFunction)cbLoadedExposure, NULL);
+        ccd_state.exposure.timeout_id = gtk_timeout_add(250, (GtkFunction)cbUpdateDownload, NULL);
+    }
+    else
     {
         /*
-         * Update load progress bar every 32 scanlines.
+         * No reader thread, load it here.
          */
-        if (!(ccd_state.exposure.read_row & 0x0F) && gui_state.progress_bar)
+        while (ccd_state.exposure.downloading && ccd_load_frame(&ccd_state.exposure))
         {
-            gtk_progress_bar_update(GTK_PROGRESS_BAR(gui_state.progress_bar), 1.0 - (gfloat)(ccd_state.exposure.read_row * ccd_state.exposure.ybin) / (gfloat)ccd_state.exposure.height);
-            gtk_main_iteration();
+            /*
+             * Update load progress bar every chunk.
+             */
+            if (gui_state.progress_bar)
+            {
+                cbUpdateDownload(NULL);
+                gtk_main_iteration();
+            }
         }
+        cbLoadedExposure(NULL, -1, GDK_INPUT_READ);
+    }
+}
+static void cbLoadedExposure(gpointer data, gint fd, GdkInputCondition in)
+{
+    int               i, j;
+    unsigned long     stop;
+    struct timeval    now;
+    struct ccd_image *flat_frame;
+    unsigned char    *comb_pixels[MAX_EXPOSURES];
+    unsigned char    *registered_pixels[MAX_EXPOSURES];
+    gchar             str[16];
+
+    if (fd >= 0)
+    {
+        gtk_timeout_remove(ccd_state.exposure.timeout_id);
+        gdk_input_remove(ccd_state.exposure.input_tag);
+        ccd_state.exposure.timeout_id = 0;
+        ccd_state.exposure.input_tag  = 0;
+        if (!ccd_reader_finish(&ccd_state.exp_reader))
+            fprintf(stderr, "Error loading exposure\n");
     }
     gettimeofday(&now, NULL);
     stop = now.tv_sec * 1000 + now.tv_usec / 1000;
-    if (verbose & 1) g_print("Downloaded image in %ld msecs\n", stop - start);
+    if (verbose & 1) g_print("Downloaded image in %ld msecs\n", stop - ccd_state.exp_download_start);
+    if (ccd_state.guide_download && ccd_state.guide_download_frames)
+    {
+        /*
+         * How well guiding held up while the image downloaded.
+         */
+        if (verbose & 1) g_print("Guided %d frames during download, error %.2f RMS, %.2f max\n",
+                                 ccd_state.guide_download_frames,
+                                 sqrt(ccd_state.guide_download_err / ccd_state.guide_download_frames),
+                                 ccd_state.guide_download_max);
+    }
     if (gui_state.progress_bar)
         gtk_progress_bar_update(GTK_PROGRESS_BAR(gui_state.progress_bar), 0.0);
     /*
@@ -821,7 +1392,7 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
                 }
                 while (ccd_state.exposure.downloading && ccd_load_frame(&ccd_state.interleave))
                 {
-                    if (!(ccd_state.interleave.read_row & 0x0F) && gui_state.progress_bar)
+                    if (gui_state.progress_bar)
                     {
                         gtk_progress_bar_update(GTK_PROGRESS_BAR(gui_state.progress_bar), 1.0 - (gfloat)(ccd_state.interleave.read_row * ccd_state.interleave.ybin) / (gfloat)ccd_state.interleave.height);
                         gtk_main_iteration();
@@ -839,12 +1410,12 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
                 /*
                  * Fake out following field tests.
                  */
-                ccd_state.exp_pixels[ccd_state.exp_current - 1] = ccd_state.exposure.image->pixels;
-                ccd_state.exposure.image->pixels                = ccd_state.interleave.image->pixels;
-                ccd_state.exposure.ccd                          = ccd_state.interleave.ccd;
-                ccd_state.interleave.image->pixels              = NULL;
+                ccd_state.field_pixels[0]          = ccd_state.exposure.image->pixels;
+                ccd_state.exposure.image->pixels   = ccd_state.interleave.image->pixels;
+                ccd_state.exposure.ccd             = ccd_state.interleave.ccd;
+                ccd_state.interleave.image->pixels = NULL;
                 ccd_image_delete(ccd_state.interleave.image);
-                ccd_state.interleave.image                      = NULL;
+                ccd_state.interleave.image         = NULL;
             }
         }
         /*
@@ -852,7 +1423,7 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
          */
         if (ccd_state.exposure.ccd == ccd_state.exposure.ccd->odd_field)
         {
-            ccd_state.exp_loadtime = stop - start;
+            ccd_state.exp_loadtime = stop - ccd_state.exp_download_start;
             if (ccd_state.exp_loadtime < 100)
                 ccd_state.exp_loadtime = 100;
         }
@@ -862,8 +1433,9 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
         /*
          * Save even frame and prepare for odd field exposure.
          */
-        ccd_state.exp_pixels[--ccd_state.exp_current] = ccd_state.exposure.image->pixels;
-        ccd_state.exposure.image->pixels              = NULL;
+        ccd_state.field_pixels[0]        = ccd_state.exposure.image->pixels;
+        ccd_state.exposure.image->pixels = NULL;
+        ccd_state.exp_current--;
         ccd_release(ccd_state.exposure.ccd);
         /*
          * If self guided, stop guide on current field and restart on opposite field.
@@ -889,16 +1461,16 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
             /*
              * Save odd frame and combine with previous frame.
              */
-            ccd_state.exp_pixels[ccd_state.exp_current] = ccd_state.exposure.image->pixels;
-            ccd_state.exposure.image->pixels            = NULL;
-            ccd_image_combine_frames(ccd_state.exposure.image, &ccd_state.exp_pixels[ccd_state.exp_current - 1], 2, ccd_state.exp_fields);
+            ccd_state.field_pixels[1]        = ccd_state.exposure.image->pixels;
+            ccd_state.exposure.image->pixels = NULL;
+            ccd_image_combine_frames(ccd_state.exposure.image, ccd_state.field_pixels, 2, ccd_state.exp_fields);
             /*
              * Free saved frames and release ccd.
              */
-            free(ccd_state.exp_pixels[ccd_state.exp_current - 1]);
-            free(ccd_state.exp_pixels[ccd_state.exp_current]);
-            ccd_state.exp_pixels[ccd_state.exp_current - 1] = NULL;
-            ccd_state.exp_pixels[ccd_state.exp_current]     = NULL;
+            free(ccd_state.field_pixels[0]);
+            free(ccd_state.field_pixels[1]);
+            ccd_state.field_pixels[0] = NULL;
+            ccd_state.field_pixels[1] = NULL;
             ccd_release(ccd_state.exposure.ccd);
             /*
              * If self guided, stop guide on current field and restart on opposite field.
@@ -915,13 +1487,60 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
             ccd_connect(ccd_state.exposure.ccd);
         }
         /*
-         * Calibrate image.
+         * Calibrate image. The masters are prepared on the first frame and
+         * kept until the sequence moves to another filter or stops.
          */
         if (!(flat_frame = ccd_state.flat_frame) && ccd_state.sequencing)
             flat_frame = wheel_state.flat_frame[wheel_state.current_sequence];
-        if (ccd_state.bias_frame || ccd_state.dark_frame || flat_frame)
-            ccd_image_calibrate(ccd_state.exposure.image, ccd_state.bias_frame, ccd_state.dark_frame, flat_frame);
-        if (ccd_state.exp_comb != GCCD_NO_COMB && ccd_state.exp_count > 1)
+        if (!ccd_state.calibrate && (ccd_state.bias_frame || ccd_state.dark_frame || flat_frame))
+            ccd_state.calibrate = ccd_calibrate_new(ccd_state.bias_frame, ccd_state.dark_frame, flat_frame);
+        if (ccd_state.calibrate)
+            ccd_calibrate_image(ccd_state.calibrate, ccd_state.exposure.image);
+        if (ccd_state.exp_comb != GCCD_NO_COMB && ccd_state.exp_count > 1 && !stack_resident())
+        {
+            gdk_window_set_cursor(gui_state.window->window, cursorWait);
+            gdk_flush();
+            /*
+             * Add exposed pixels to the stack. Frames are spilled to disk, so
+             * only the image being exposed is ever resident.
+             */
+            if (!ccd_state.exp_stack)
+            {
+                ccd_state.exp_stack = ccd_stack_new(ccd_state.exposure.image, ccd_state.exp_comb);
+                if (ccd_state.exp_tracknstack && ccd_state.exposure.image->color == CCD_COLOR_MONOCHROME)
+                    ccd_stack_register(ccd_state.exp_stack, ccd_state.exposure.image->width*ccd_state.reg_x_range/100, ccd_state.exposure.image->height*ccd_state.reg_y_range/100, ccd_state.reg_x_max_radius, ccd_state.reg_y_max_radius, ccd_state.reg_noise_sigs);
+            }
+            if (ccd_state.exp_stack && ccd_stack_add_pixels(ccd_state.exp_stack, ccd_state.exposure.image->pixels))
+                g_print("Unable to add frame %d to stack\n", ccd_state.exp_current);
+            if (ccd_state.exp_current == ccd_state.exp_count)
+            {
+                /*
+                 * Make sure filter value is applied properly.
+                 */
+                if (wheel_state.wheel.fd == 0)
+                    ccd_state.exposure.image->filter = CCD_COLOR_MONOCHROME;
+                else
+                    ccd_state.exposure.image->filter = wheel_state.filter_mask[wheel_state.filter[wheel_state.wheel.current]];
+                /*
+                 * Combine the stack in place of the last frame.
+                 */
+                if (ccd_state.exp_stack)
+                {
+                    free(ccd_state.exposure.image->pixels);
+                    ccd_state.exposure.image->pixels = NULL;
+                    ccd_stack_combine(ccd_state.exp_stack, ccd_state.exposure.image);
+                    ccd_stack_delete(ccd_state.exp_stack);
+                    ccd_state.exp_stack = NULL;
+                }
+            }
+            else
+            {
+                free(ccd_state.exposure.image->pixels);
+                ccd_state.exposure.image->pixels = NULL;
+            }
+            gdk_window_set_cursor(gui_state.window->window, NULL);
+        }
+        else if (ccd_state.exp_comb != GCCD_NO_COMB && ccd_state.exp_count > 1)
         {
             gdk_window_set_cursor(gui_state.window->window, cursorWait);
             gdk_flush();
@@ -1108,8 +1727,8 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
                 {
                     new_image          = ccd_image_dup(ccd_state.exposure.image);
                     new_image->color   = ccd_state.matrix_colors[i];
-                    new_image->pixels  = ccd_state.matrix_pixels[0][i];
                     new_image->changed = TRUE;
+                    ccd_image_set_pixels(new_image, ccd_state.matrix_pixels[0][i]);
                     sprintf(new_image->name, "%s-%s", ccd_state.exposure.image->name, COLOR_MASK_TO_NAME(ccd_state.matrix_colors[i]));
                     if (gui_state.auto_save)
                     {
@@ -1150,7 +1769,10 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
         /*
          * Start next exposure.
          */
-        guide_start((ccd_state.exposure.msec <= 1000) ? FALSE : ccd_state.guiding);
+        if (ccd_state.guiding && ccd_state.guide_dither > 0.0 && ccd_state.exposure.msec > 1000)
+            guide_dither();
+        if (!ccd_state.guide_download)
+            guide_start((ccd_state.exposure.msec <= 1000) ? FALSE : ccd_state.guiding);
         ccd_expose_frame(&ccd_state.exposure);
         ccd_state.exposure.input_tag  = gdk_input_add(ccd_state.exposure.ccd->fd, GDK_INPUT_READ, (GdkInputFunction)cbReadExposure, NULL);
         ccd_state.exposure.timeout_id = gtk_timeout_add(ccd_state.exposure.msec < 25000 ? 250 : ccd_state.exposure.msec / 100, (GtkFunction)cbUpdateExposure, &ccd_state.exposure);
@@ -1178,6 +1800,11 @@ static void cbReadExposure(gpointer data, gint fd, GdkInputCondition in)
             for (wheel_state.current_sequence++; wheel_state.current_sequence < MAX_FILTERS && !wheel_state.sequence[wheel_state.current_sequence]; wheel_state.current_sequence++);
         if (ccd_state.sequencing && wheel_state.current_sequence < MAX_FILTERS)
         {
+            /*
+             * Next filter may have its own flat.
+             */
+            ccd_calibrate_delete(ccd_state.calibrate);
+            ccd_state.calibrate = NULL;
             /*
              * Set filter wheel if sequencing and start next exposure.
              */
@@ -1223,9 +1850,9 @@ static void cbReadFocus(gpointer data, gint fd, GdkInputCondition in)
     }
     while (ccd_state.focus.downloading && ccd_load_frame(&ccd_state.focus))
         /*
-         * Update load progress bar every 32 scanlines.
+         * Update load progress bar every chunk.
          */
-        if (!(ccd_state.focus.read_row & 0x1F) && gui_state.progress_bar)
+        if (gui_state.progress_bar)
         {
             gtk_progress_bar_update(GTK_PROGRESS_BAR(gui_state.progress_bar), 1.0 - (gfloat)(ccd_state.focus.read_row * ccd_state.focus.ybin) / (gfloat)ccd_state.focus.height);
             gtk_main_iteration();
@@ -1299,7 +1926,7 @@ static void cbReadFocus(gpointer data, gint fd, GdkInputCondition in)
         y_offset                = ccd_state.focus.yoffset       * scale;
         ccd_state.focus.xoffset = ccd_state.focus_view_xoffset  / scale;
         ccd_state.focus.yoffset = ccd_state.focus_view_yoffset  / scale;
-        scale_pixbuf            = gdk_pixbuf_scale_simple(pixbuf, width , height, GDK_INTERP_BILINEAR);
+        scale_pixbuf            = ccd_pixbuf_scale(pixbuf, width, height, &ccd_state.focus.image->scaler);
         gdk_pixbuf_unref(pixbuf);
         pixbuf = scale_pixbuf;
     }
@@ -1503,13 +2130,6 @@ static void cbReadGuideSelect(gpointer data, gint fd, GdkInputCondition in)
 }
 static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in)
 {
-    static int     lost_count = 0;
-    unsigned int   src_pixel, src_offset;
-    int            dst_rowstride, src_rowstride, src_depthbytes, x, y, x_radius, y_radius;
-    float          contrast_scale, x_centroid, y_centroid;
-    gchar         *dst_pixels, str[80];
-    GdkPixbuf     *pixbuf, *scale_pixbuf;
-
     /*
      * Reset input & timer calls.
      */
@@ -1522,39 +2142,101 @@ static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in)
     gdk_input_remove(ccd_state.guide.input_tag);
     ccd_state.guide.input_tag   = 0;
     ccd_state.guide.downloading = TRUE;
+    if (ccd_reader_start(&ccd_state.guide_reader, &ccd_state.guide))
+    {
+        ccd_state.guide.input_tag = gdk_input_add(ccd_state.guide_reader.notify[0], GDK_INPUT_READ, (GdkInputFunction)cbLoadedGuide, NULL);
+        return;
+    }
     while (ccd_state.guide.downloading && ccd_load_frame(&ccd_state.guide))
         gtk_main_iteration();
+    cbLoadedGuide(NULL, -1, GDK_INPUT_READ);
+}
+static void cbLoadedGuide(gpointer data, gint fd, GdkInputCondition in)
+{
+    if (fd >= 0)
+    {
+        gdk_input_remove(ccd_state.guide.input_tag);
+        ccd_state.guide.input_tag = 0;
+        if (!ccd_reader_finish(&ccd_state.guide_reader))
+            ccd_state.guide.downloading = FALSE;
+    }
     /*
      * Bail out if operation canceled.
      */
     if (!ccd_state.guide.downloading)
         return;
     ccd_state.guide.downloading = FALSE;
+    /*
+     * Hand off the frame and start the next exposure before any processing.
+     */
+    guide_pipe_post();
+    if (ccd_state.guide.input_tag || !ccd_state.guide.ccd->fd)
+        return;
+    ccd_expose_frame(&ccd_state.guide);
+    ccd_state.guide.input_tag = gdk_input_add(ccd_state.guide.ccd->fd, GDK_INPUT_READ, (GdkInputFunction)cbReadGuide, NULL);
+}
+static void cbGuideResult(gpointer data, gint fd, GdkInputCondition in)
+{
+    static int        lost_count = 0;
+    unsigned int      src_pixel, src_offset, now_msec;
+    int               dst_rowstride, src_rowstride, src_depthbytes, x, y, found;
+    float             contrast_scale, x_centroid, y_centroid;
+    gchar            *dst_pixels, str[80], ack;
+    GdkPixbuf        *pixbuf, *scale_pixbuf;
+    struct timeval    now;
+    struct ccd_image *frame = &guide_pipe.frame;
+
+    if (fd >= 0)
+        read(fd, &ack, 1);
+    pthread_mutex_lock(&guide_pipe.lock);
+    found      = guide_pipe.found;
+    x_centroid = guide_pipe.x_centroid;
+    y_centroid = guide_pipe.y_centroid;
+    pthread_mutex_unlock(&guide_pipe.lock);
+    guide_pipe.state = GUIDE_PIPE_IDLE;
+    /*
+     * Drop results from before guiding was stopped or restarted.
+     */
+    if (guide_pipe.frame_cycle != guide_pipe.cycle || !ccd_state.guiding)
+        return;
     /*
      * Apply corrections to telescope.
      */
-    x_centroid = GUIDE_WIDTH  / 2;
-    y_centroid = GUIDE_HEIGHT / 2;
-    x_radius   = ccd_state.reg_x_max_radius;
-    y_radius   = ccd_state.reg_y_max_radius;
-    if (!ccd_image_find_best_centroid(ccd_state.guide.image, ccd_state.guide.image->pixels, &x_centroid, &y_centroid, ccd_state.guide.image->width/2, ccd_state.guide.image->height/2, &x_radius, &y_radius, ccd_state.reg_noise_sigs)
-     && !ccd_state.guide_dark)
+    if (!found && !ccd_state.guide_dark)
     {
         /*
-         * Wait for two consecutive lost frames before bailing.
+         * Ride out a few lost frames on the controller's drift estimate
+         * before bailing.
          */
-        if (++lost_count > 1)
+        if (++lost_count >= GUIDE_LOST_COUNT)
         {
             /*
              * Lost star.
              */
             if (verbose & 1) g_print("Guide star lost\n");
+            guide_pipe.cycle++;
             if ((ccd_state.guiding & GUIDE_ACQUIRE)
              && ((ccd_state.exp_fields < FIELD_SUM) || (ccd_state.exposure.ccd == ccd_state.exposure.ccd->even_field)))
             {
                 /*
-                 * Look for a new guide star.
+                 * Abandon the exposure already in flight and look for a new guide star.
                  */
+                if (ccd_state.guide.input_tag)
+                {
+                    gdk_input_remove(ccd_state.guide.input_tag);
+                    ccd_state.guide.input_tag = 0;
+                }
+                ccd_reader_cancel(&ccd_state.guide_reader);
+                ccd_state.guide.downloading = FALSE;
+                ccd_abort_exposures(&ccd_state.guide);
+                ccd_release(ccd_state.guide.ccd);
+                if (!ccd_connect(ccd_state.guide.ccd))
+                {
+                    exposure_stop(TRUE);
+                    gnome_warning_dialog_parented(_("Unable to connect to guide camera."), GTK_WINDOW(gui_state.window));
+                    lost_count = 0;
+                    return;
+                }
                 ccd_state.guide.dac_bits = ccd_state.guide.ccd->dac_bits / 2;
                 ccd_state.guide.width    = ccd_state.guide.ccd->width;
                 ccd_state.guide.height   = ccd_state.guide.ccd->height;
@@ -1598,6 +2280,12 @@ static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in)
     y_centroid -= ccd_state.guide_y_centroid;
     ccd_state.guide_dx_centroid = x_centroid;
     ccd_state.guide_dy_centroid = y_centroid;
+    if (ccd_state.exposure.downloading)
+    {
+        ccd_state.guide_download_frames++;
+        ccd_state.guide_download_err += x_centroid * x_centroid + y_centroid * y_centroid;
+        ccd_state.guide_download_max  = max(ccd_state.guide_download_max, sqrt(x_centroid * x_centroid + y_centroid * y_centroid));
+    }
     /*
      * Notify when star acquired.
      */
@@ -1612,66 +2300,69 @@ static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in)
         else
             ccd_state.guide_acquire_count = 0;
     }
-    /*
-     * Update centroid offset.
-     */
-    sprintf(str, _("Offset (%.2f, %.2f)"), ccd_state.guide_dx_centroid, ccd_state.guide_dy_centroid);
-    if (verbose & 2) g_print("%.2f,\t%.2f\n", ccd_state.guide_dx_centroid, ccd_state.guide_dy_centroid);
     /*
      * Send commands to telescope.
      */
     if (!ccd_state.guide_dark)
-        cbUpdateGuide(0);
+        guide_control_post(x_centroid, y_centroid, found);
     /*
-     * Load image into displayable pixmap.
+     * Latency from the end of the guide exposure to the correction.
      */
-    if (gui_state.current_notebook_page == 2)
+    gettimeofday(&now, NULL);
+    now_msec = now.tv_sec * 1000 + now.tv_usec / 1000;
+    sprintf(str, _("Offset (%.2f, %.2f) %d ms"), x_centroid, y_centroid, (int)(now_msec - guide_pipe.exposed_msec));
+    if (verbose & 2) g_print("%.2f,\t%.2f,\t%d ms,\t%d skipped\n", x_centroid, y_centroid, (int)(now_msec - guide_pipe.exposed_msec), guide_pipe.skipped);
+    /*
+     * Load image into displayable pixmap, only when visible and not too often.
+     */
+    if (gui_state.current_notebook_page == 2 && now_msec - guide_pipe.display_msec >= GUIDE_DISPLAY_MSEC)
     {
-        ccd_state.guide.image->pixmin = ccd_state.guide.image->pixmax = 0;
-        ccd_image_histogram(ccd_state.guide.image);
-        pixbuf         = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, ccd_state.guide.image->width, ccd_state.guide.image->height);
+        guide_pipe.display_msec = now_msec;
+        frame->pixmin = frame->pixmax = 0;
+        ccd_image_histogram(frame);
+        pixbuf         = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, frame->width, frame->height);
         dst_pixels     = gdk_pixbuf_get_pixels(pixbuf);
         dst_rowstride  = gdk_pixbuf_get_rowstride(pixbuf);
-        src_depthbytes = (ccd_state.guide.image->depth + 7) / 8;
-        src_rowstride  = ccd_state.guide.image->width * src_depthbytes;
-        src_offset     = ccd_state.guide.image->pixmin;
-        if (ccd_state.guide.image->pixmax == ccd_state.guide.image->pixmin)
+        src_depthbytes = (frame->depth + 7) / 8;
+        src_rowstride  = frame->width * src_depthbytes;
+        src_offset     = frame->pixmin;
+        if (frame->pixmax == frame->pixmin)
             src_offset--;
-        contrast_scale = 255.0 / (ccd_state.guide.image->pixmax - src_offset);
+        contrast_scale = 255.0 / (frame->pixmax - src_offset);
         switch (src_depthbytes)
         {
             case 1:
-                for (y = 0; y < ccd_state.guide.image->height; y++)
-                    for (x = 0; x < ccd_state.guide.image->width; x++)
+                for (y = 0; y < frame->height; y++)
+                    for (x = 0; x < frame->width; x++)
                     {
-                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((ccd_state.guide.image->pixels[y * src_rowstride + x] - src_offset) * contrast_scale)];
+                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((frame->pixels[y * src_rowstride + x] - src_offset) * contrast_scale)];
                         dst_pixels[y * dst_rowstride + x * 3]     = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 1] = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 2] = src_pixel;
                     }
                 break;
             case 2:
-                for (y = 0; y < ccd_state.guide.image->height; y++)
-                    for (x = 0; x < ccd_state.guide.image->width; x++)
+                for (y = 0; y < frame->height; y++)
+                    for (x = 0; x < frame->width; x++)
                     {
-                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((*(unsigned short *)&ccd_state.guide.image->pixels[y * src_rowstride + x * 2] - src_offset) * contrast_scale)];
+                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((*(unsigned short *)&frame->pixels[y * src_rowstride + x * 2] - src_offset) * contrast_scale)];
                         dst_pixels[y * dst_rowstride + x * 3]     = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 1] = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 2] = src_pixel;
                     }
                 break;
             case 4:
-                for (y = 0; y < ccd_state.guide.image->height; y++)
-                    for (x = 0; x < ccd_state.guide.image->width; x++)
+                for (y = 0; y < frame->height; y++)
+                    for (x = 0; x < frame->width; x++)
                     {
-                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((*(unsigned long *)&ccd_state.guide.image->pixels[y * src_rowstride + x * 4] - src_offset) * contrast_scale)];
+                        src_pixel = ccd_state.guide_dark ? 0 - ((x & 1) ^ (y & 1)) : view_palettes[LINEAR_GREY][(int)((*(unsigned long *)&frame->pixels[y * src_rowstride + x * 4] - src_offset) * contrast_scale)];
                         dst_pixels[y * dst_rowstride + x * 3]     = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 1] = src_pixel;
                         dst_pixels[y * dst_rowstride + x * 3 + 2] = src_pixel;
                     }
                 break;
         }
-        scale_pixbuf  = gdk_pixbuf_scale_simple(pixbuf, GUIDE_WIDTH*GUIDE_SCALE, GUIDE_HEIGHT*GUIDE_SCALE, GDK_INTERP_BILINEAR);
+        scale_pixbuf  = ccd_pixbuf_scale(pixbuf, GUIDE_WIDTH*GUIDE_SCALE, GUIDE_HEIGHT*GUIDE_SCALE, &ccd_state.guide.image->scaler);
         dst_pixels    = gdk_pixbuf_get_pixels(scale_pixbuf);
         dst_rowstride = gdk_pixbuf_get_rowstride(scale_pixbuf);
         /*
@@ -1699,11 +2390,6 @@ static void cbReadGuide(gpointer data, gint fd, GdkInputCondition in)
         gtk_label_set_text(GTK_LABEL(gui_state.label_offset), str);
         gtk_widget_queue_draw(gui_state.view_guide);
     }
-    /*
-     * Start next exposure.
-     */
-    ccd_expose_frame(&ccd_state.guide);
-    ccd_state.guide.input_tag = gdk_input_add(ccd_state.guide.ccd->fd, GDK_INPUT_READ, (GdkInputFunction)cbReadGuide, NULL);
 }
 
 /***************************************************************************\
@@ -2863,6 +3549,12 @@ static void cbMiscChanged(GtkWidget *widget, gpointer data)
         case 9:
             scope_state.init_delay = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
             break;
+        case 10:
+            ccd_state.guide_dither = gtk_spin_button_get_value_as_float(GTK_SPIN_BUTTON(widget));
+            break;
+        case 11:
+            ccd_state.guide_aggression = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(widget));
+            break;
     }
 }
 
@@ -2894,6 +3586,8 @@ static void savePrefs(void)
         prefs.TrackTrain       = ccd_state.guide_train_msec;
         prefs.TrackMsec        = ccd_state.guide_msec;
         prefs.TrackMin         = ccd_state.guide_min_offset;
+        prefs.TrackDither      = ccd_state.guide_dither;
+        prefs.TrackAggression  = ccd_state.guide_aggression;
         prefs.TrackFieldOffset = ccd_state.guide_interleave_offset;
         prefs.TrackSelf        = ccd_state.guide_fields;
         prefs.TrackUp          = ccd_state.guide_track_up;
@@ -3414,7 +4108,7 @@ void activateAcquireImage(void (*new_image_child)(struct ccd_image *))
                 vbox_mul = gtk_vbox_new(FALSE, 0);
                 hbox     = gtk_hbox_new(FALSE, 0);
                 label    = gtk_label_new(_("Count:"));
-                spin     = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new((gfloat)ccd_state.exp_count, 1.0, MAX_EXPOSURES, 1.0, 0.0, 0.0)), 1.0, 0);
+                spin     = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new((gfloat)ccd_state.exp_count, 1.0, MAX_STACK_EXPOSURES, 1.0, 0.0, 0.0)), 1.0, 0);
                 gtk_signal_connect(GTK_OBJECT(spin), "changed", GTK_SIGNAL_FUNC(cbExpCountChanged), (gpointer)&ccd_state.exposure);
                 gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
                 gtk_object_set(GTK_OBJECT(label), "width", 40, NULL);
@@ -3444,6 +4138,16 @@ void activateAcquireImage(void (*new_image_child)(struct ccd_image *))
                 if (ccd_state.exp_comb == CCD_IMAGE_COMBINE_MEDIAN)
                     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobutton), TRUE);
                 gtk_box_pack_start(GTK_BOX(vbox_mul), radiobutton, TRUE, TRUE, 0);
+                radiobutton = gtk_radio_button_new_with_label(gtk_radio_button_group(GTK_RADIO_BUTTON(radiobutton)), "Sigma Clip");
+                gtk_signal_connect(GTK_OBJECT(radiobutton), "toggled", GTK_SIGNAL_FUNC(cbCombMode), (gpointer)CCD_IMAGE_COMBINE_SIGMA_CLIP);
+                if (ccd_state.exp_comb == CCD_IMAGE_COMBINE_SIGMA_CLIP)
+                    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobutton), TRUE);
+                gtk_box_pack_start(GTK_BOX(vbox_mul), radiobutton, TRUE, TRUE, 0);
+                radiobutton = gtk_radio_button_new_with_label(gtk_radio_button_group(GTK_RADIO_BUTTON(radiobutton)), "Winsorized");
+                gtk_signal_connect(GTK_OBJECT(radiobutton), "toggled", GTK_SIGNAL_FUNC(cbCombMode), (gpointer)CCD_IMAGE_COMBINE_WINSORIZE);
+                if (ccd_state.exp_comb == CCD_IMAGE_COMBINE_WINSORIZE)
+                    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(radiobutton), TRUE);
+                gtk_box_pack_start(GTK_BOX(vbox_mul), radiobutton, TRUE, TRUE, 0);
                 radiobutton = gtk_radio_button_new_with_label(gtk_radio_button_group(GTK_RADIO_BUTTON(radiobutton)), "Min");
                 gtk_signal_connect(GTK_OBJECT(radiobutton), "toggled", GTK_SIGNAL_FUNC(cbCombMode), (gpointer)CCD_IMAGE_COMBINE_MIN);
                 if (ccd_state.exp_comb == CCD_IMAGE_COMBINE_MEDIAN)
@@ -3799,6 +4503,8 @@ void activateAcquireImage(void (*new_image_child)(struct ccd_image *))
                 ccd_state.guide_min_offset        = prefs.TrackMin;
                 ccd_state.guide_msec              = prefs.TrackMsec;
                 ccd_state.guide_train_msec        = prefs.TrackTrain;
+                ccd_state.guide_dither            = prefs.TrackDither;
+                ccd_state.guide_aggression        = prefs.TrackAggression;
                 vbox  = gtk_vbox_new(FALSE, 0);
                 label = gtk_label_new(_("Noise threshold in standard deviations:"));
                 spin  = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new(ccd_state.reg_noise_sigs, 0.0, 10.0, 1.0, 0.0, 0.0)), 1.0, 2);
@@ -3890,6 +4596,26 @@ void activateAcquireImage(void (*new_image_child)(struct ccd_image *))
                 gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
                 gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
                 gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
+                label = gtk_label_new(_("Guide aggressiveness (%):"));
+                spin  = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new(ccd_state.guide_aggression, 10.0, 150.0, 5.0, 0.0, 0.0)), 1.0, 0);
+                hbox  = gtk_hbox_new(FALSE, 0);
+                gtk_signal_connect(GTK_OBJECT(spin), "changed", GTK_SIGNAL_FUNC(cbMiscChanged), (gpointer)11);
+                gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+                gtk_object_set(GTK_OBJECT(label), "width", MISC_LABEL_WIDTH, NULL);
+                gtk_object_set(GTK_OBJECT(spin), "width", MISC_SPIN_WIDTH, NULL);
+                gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+                gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
+                gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
+                label = gtk_label_new(_("Dither between exposures (pixels):"));
+                spin  = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new(ccd_state.guide_dither, 0.0, GUIDE_DITHER_MAX, 0.25, 0.0, 0.0)), 1.0, 2);
+                hbox  = gtk_hbox_new(FALSE, 0);
+                gtk_signal_connect(GTK_OBJECT(spin), "changed", GTK_SIGNAL_FUNC(cbMiscChanged), (gpointer)10);
+                gtk_misc_set_alignment(GTK_MISC(label), 0.0, 0.5);
+                gtk_object_set(GTK_OBJECT(label), "width", MISC_LABEL_WIDTH, NULL);
+                gtk_object_set(GTK_OBJECT(spin), "width", MISC_SPIN_WIDTH, NULL);
+                gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 0);
+                gtk_box_pack_start(GTK_BOX(hbox), spin, FALSE, FALSE, 0);
+                gtk_box_pack_start(GTK_BOX(vbox), hbox, TRUE, TRUE, 0);
                 label = gtk_label_new(_("STAR2000 init delay (msec):"));
                 spin  = gtk_spin_button_new(GTK_ADJUSTMENT(gtk_adjustment_new(scope_state.init_delay, 0.0, 10000.0, 1.0, 0.0, 0.0)), 1.0, 0);
                 hbox  = gtk_hbox_new(FALSE, 0);
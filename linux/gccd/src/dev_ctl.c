@@ -19,6 +19,8 @@
  */
 
 #include <stdio.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "gccd.h"
 
 /***************************************************************************\
@@ -129,7 +131,8 @@ void ccd_expose_frame(struct ccd_exp *exposure)
     msg[CCD_EXP_MSEC_LO_INDEX]   = exposure->msec & 0xFFFF;
     msg[CCD_EXP_MSEC_HI_INDEX]   = exposure->msec >> 16;
     write(exposure->ccd->fd, (char *)msg, CCD_MSG_EXP_LEN);
-    exposure->read_row = 0;
+    exposure->read_row   = 0;
+    exposure->read_bytes = 0;
     /*
      * Set start time.
      */
@@ -179,67 +182,102 @@ void ccd_expose_frame(struct ccd_exp *exposure)
     exposure->image->time[0]      = '\0';
 }
 /*
- * Load exposed image one row at a time.
+ * Load exposed image in large chunks. The message header is read into its
+ * own buffer alongside the first chunk of pixels, so the pixels land in place
+ * with no copy. read_bytes counts the pixel bytes loaded, read_row follows it
+ * for progress reporting.
  */
+#define CCD_LOAD_CHUNK  (256*1024)
 int ccd_load_frame(struct ccd_exp *exposure)
 {
-    int            msg_len;
+    int            msg_len, chunk;
     int            sizeof_pixel = (exposure->ccd->depth + 7) / 8;
     int            row_bytes    = (exposure->width / exposure->xbin) * sizeof_pixel;
-    CCD_ELEM_TYPE *msg          = (CCD_ELEM_TYPE *)exposure->image->pixels;
+    int            frame_bytes  = row_bytes * (exposure->height / exposure->ybin);
+    CCD_ELEM_TYPE  msg[CCD_MSG_IMAGE_LEN/CCD_ELEM_SIZE];
+    struct iovec   iov[2];
 
-    if (exposure->read_row == 0)
+    if (exposure->read_bytes == 0)
     {
         /*
-         * Get header plus first scanline.
+         * Get header plus first chunk.
          */
-        if ((msg_len = read(exposure->ccd->fd, exposure->image->pixels, row_bytes + CCD_MSG_IMAGE_LEN)) > 0)
+        iov[0].iov_base = msg;
+        iov[0].iov_len  = CCD_MSG_IMAGE_LEN;
+        iov[1].iov_base = exposure->image->pixels;
+        iov[1].iov_len  = min(frame_bytes, CCD_LOAD_CHUNK);
+        if ((msg_len = readv(exposure->ccd->fd, iov, 2)) <= 0)
         {
-            if (msg[CCD_MSG_INDEX] == CCD_MSG_IMAGE)
+            /*
+             * Error reading pixels.  Bail out.
+             */
+            fprintf(stderr, "Error reading exposure:%s\n", strerror(errno));
+            exposure->read_row = 0;
+            return (0);
+        }
+        /*
+         * Read rest of header if it didn't make it (should never happen).
+         */
+        if (msg_len < CCD_MSG_IMAGE_LEN)
+        {
+            if (read(exposure->ccd->fd, (char *)msg + msg_len, CCD_MSG_IMAGE_LEN - msg_len) != CCD_MSG_IMAGE_LEN - msg_len)
             {
-                /*
-                 * Validate message length.
-                 */
-                if ((msg[CCD_MSG_LENGTH_LO_INDEX] + (msg[CCD_MSG_LENGTH_HI_INDEX] << 16)) != (row_bytes * (exposure->height / exposure->ybin) + CCD_MSG_IMAGE_LEN))
-                {
-                    fprintf(stderr, "Image size discrepency! Read %d, expected %d\n", msg[CCD_MSG_LENGTH_LO_INDEX] + (msg[CCD_MSG_LENGTH_HI_INDEX] << 16), row_bytes * (exposure->height / exposure->ybin) + CCD_MSG_IMAGE_LEN);
-                    exposure->read_row = 0;
-                    return (0);
-                }
-                /*
-                 * Read rest of first scanline if it didn't make it (should never happen).
-                 */
-                if (msg_len != row_bytes + CCD_MSG_IMAGE_LEN)
-                    read(exposure->ccd->fd, &exposure->image->pixels[msg_len - CCD_MSG_IMAGE_LEN], row_bytes - msg_len - CCD_MSG_IMAGE_LEN);
-                exposure->read_row = (exposure->height / exposure->ybin > 1) ? 1 : 0;
-                /*
-                 * Move image data down to replace header.
-                 */
-                memcpy(exposure->image->pixels, exposure->image->pixels + CCD_MSG_IMAGE_LEN, row_bytes);
+                fprintf(stderr, "Error reading exposure header\n");
+                exposure->read_row = 0;
+                return (0);
             }
-            else
-                fprintf(stderr, "Error: wrong message 0x%04X\n", msg[CCD_MSG_INDEX]);
+            msg_len = CCD_MSG_IMAGE_LEN;
         }
-        else
+        if (msg[CCD_MSG_INDEX] != CCD_MSG_IMAGE)
+        {
+            fprintf(stderr, "Error: wrong message 0x%04X\n", msg[CCD_MSG_INDEX]);
+            exposure->read_row = 0;
+            return (0);
+        }
+        /*
+         * Validate message length.
+         */
+        if ((msg[CCD_MSG_LENGTH_LO_INDEX] + (msg[CCD_MSG_LENGTH_HI_INDEX] << 16)) != (frame_bytes + CCD_MSG_IMAGE_LEN))
+        {
+            fprintf(stderr, "Image size discrepency! Read %d, expected %d\n", msg[CCD_MSG_LENGTH_LO_INDEX] + (msg[CCD_MSG_LENGTH_HI_INDEX] << 16), frame_bytes + CCD_MSG_IMAGE_LEN);
+            exposure->read_row = 0;
+            return (0);
+        }
+        /*
+         * A zero byte count means a new frame, so make sure some pixels came with the header.
+         */
+        if (msg_len == CCD_MSG_IMAGE_LEN
+         && (msg_len += read(exposure->ccd->fd, exposure->image->pixels, min(frame_bytes, CCD_LOAD_CHUNK))) <= CCD_MSG_IMAGE_LEN)
         {
-            /*
-             * Error reading pixels.  Bail out.
-             */
             fprintf(stderr, "Error reading exposure:%s\n", strerror(errno));
             exposure->read_row = 0;
             return (0);
         }
+        exposure->read_bytes = msg_len - CCD_MSG_IMAGE_LEN;
     }
     else
     {
-        read(exposure->ccd->fd, &exposure->image->pixels[exposure->read_row * row_bytes], row_bytes);
-        if (++(exposure->read_row) == exposure->height / exposure->ybin)
-            /*
-             * Loaded entire frame.
-             */
-            exposure->read_row = 0;
+        chunk = min(frame_bytes - exposure->read_bytes, CCD_LOAD_CHUNK);
+        if ((msg_len = read(exposure->ccd->fd, &exposure->image->pixels[exposure->read_bytes], chunk)) <= 0)
+        {
+            fprintf(stderr, "Error reading exposure:%s\n", strerror(errno));
+            exposure->read_bytes = 0;
+            exposure->read_row   = 0;
+            return (0);
+        }
+        exposure->read_bytes += msg_len;
     }
-    return (exposure->read_row != 0);
+    if (exposure->read_bytes >= frame_bytes)
+    {
+        /*
+         * Loaded entire frame.
+         */
+        exposure->read_bytes = 0;
+        exposure->read_row   = 0;
+    }
+    else
+        exposure->read_row = exposure->read_bytes / row_bytes;
+    return (exposure->read_bytes != 0);
 }
 /*
  * Abort current exposures.
@@ -257,6 +295,73 @@ void ccd_abort_exposures(struct ccd_exp *exposure)
     msg[CCD_MSG_INDEX]           = CCD_MSG_ABORT;
     write(exposure->ccd->fd, (char *)msg, CCD_MSG_ABORT_LEN);
 }
+/*
+ * Threaded readout. Each device stream loads its frames on its own thread so
+ * a long download doesn't hold up the other streams. The reader owns the
+ * exposure image until it writes a byte to the notify pipe, which the main
+ * loop watches with gdk_input_add() and then collects with ccd_reader_finish().
+ */
+static void *ccd_reader_thread(void *data)
+{
+    struct ccd_reader *reader = (struct ccd_reader *)data;
+    struct pollfd      pfd;
+    int                more;
+
+    pfd.fd     = reader->exposure->ccd->fd;
+    pfd.events = POLLIN;
+    do
+    {
+        /*
+         * Don't block in read() so a cancel is seen promptly.
+         */
+        while (!reader->cancel && poll(&pfd, 1, 100) == 0);
+        if (reader->cancel || (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)))
+            break;
+        more = ccd_load_frame(reader->exposure);
+    } while (more);
+    reader->loaded = !reader->cancel && reader->exposure->read_row == 0 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
+    write(reader->notify[1], "", 1);
+    return (NULL);
+}
+int ccd_reader_start(struct ccd_reader *reader, struct ccd_exp *exposure)
+{
+    if (reader->active)
+        return (FALSE);
+    if (!reader->notify[1] && pipe(reader->notify) < 0)
+    {
+        reader->notify[0] = reader->notify[1] = 0;
+        return (FALSE);
+    }
+    reader->exposure = exposure;
+    reader->cancel   = FALSE;
+    reader->loaded   = FALSE;
+    if (pthread_create(&reader->thread, NULL, ccd_reader_thread, reader))
+        return (FALSE);
+    reader->active = TRUE;
+    return (TRUE);
+}
+/*
+ * Collect a finished reader. Returns TRUE if the whole frame was loaded.
+ */
+int ccd_reader_finish(struct ccd_reader *reader)
+{
+    char ack;
+
+    if (!reader->active)
+        return (FALSE);
+    pthread_join(reader->thread, NULL);
+    read(reader->notify[0], &ack, 1);
+    reader->active = FALSE;
+    return (reader->loaded);
+}
+void ccd_reader_cancel(struct ccd_reader *reader)
+{
+    if (reader->active)
+    {
+        reader->cancel = TRUE;
+        ccd_reader_finish(reader);
+    }
+}
 /***************************************************************************\
 *                                                                           *
 *                     Low level telescope control                           *
@@ -436,8 +541,10 @@ int scope_release(struct scope_dev *scope)
     return (0);
 }
 /*
- * Move scope.
+ * Move scope. The lock keeps guide pulses from the controller thread and
+ * manual moves from interleaving on the serial line.
  */
+static pthread_mutex_t scope_lock = PTHREAD_MUTEX_INITIALIZER;
 void scope_move(struct scope_dev *scope, unsigned int dir)
 {
     if (scope->flags & SCOPE_SWAP_XY)
@@ -492,8 +599,10 @@ void scope_move(struct scope_dev *scope, unsigned int dir)
         dir += SCOPE_DOWN + 1;
     if (scope->iface > SCOPE_MANUAL)
     {
+        pthread_mutex_lock(&scope_lock);
         scope_write(scope->fd, scope_dir[scope->iface][dir]);
         tcdrain(scope->fd);
+        pthread_mutex_unlock(&scope_lock);
     }
 }
 /***************************************************************************\
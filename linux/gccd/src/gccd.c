@@ -18,6 +18,7 @@
  * USA
  */
 
+#include <glob.h>
 #include "gccd.h"
 /*
  * Image scale sizes.
@@ -26,6 +27,10 @@
 #define SCALE_HALFX     1
 #define SCALE_2X        2
 #define SCALE_4X        3
+/*
+ * Longest side of the quick look shown while a history is evaluated.
+ */
+#define PREVIEW_SIZE    512
 
 /***************************************************************************\
 *                                                                           *
@@ -35,6 +40,7 @@
 
 static void cbAcquire(GtkObject *object, gpointer data);
 static void cbOpen(GtkObject *object, gpointer data);
+static void cbStack(GtkObject *object, gpointer data);
 static void cbProp(GtkObject *object, gpointer data);
 static void cbSaveAs(GtkObject *object, gpointer data);
 static void cbSave(GtkObject *object, gpointer data);
@@ -53,6 +59,8 @@ static void cbColorPalette(GtkObject *object, gpointer data);
 static void cbViewAspectToggle(GtkObject *object, gpointer data);
 static void cbViewBinToggle(GtkObject *object, gpointer data);
 static void cbViewMode(GtkObject *object, gpointer data);
+static void cbUndo(GtkObject *object, gpointer data);
+static void cbRedo(GtkObject *object, gpointer data);
 static void cbImageFlip(GtkObject *object, gpointer data);
 static void cbImageRotate(GtkObject *object, gpointer data);
 static void cbImageScale(GtkObject *object, gpointer data);
@@ -61,6 +69,7 @@ static void cbImageRemoveNoise(GtkObject *object, gpointer data);
 static void cbImageRemoveBackground(GtkObject *object, gpointer data);
 static void cbImageRemoveVBE(GtkObject *object, gpointer data);
 static void cbAbout(GtkObject *object, gpointer data);
+static void imageUpdate(struct ccd_image *image);
 
 /***************************************************************************\
 *                                                                           *
@@ -148,6 +157,10 @@ GnomeUIInfo menuFile[] =
         GNOME_APP_PIXMAP_DATA, camera_xpm,
         0, (GdkModifierType) 0, NULL},
     GNOMEUIINFO_MENU_OPEN_ITEM(                                               cbOpen,  NULL),
+    {   GNOME_APP_UI_ITEM, N_("Stack Series..."), N_("Register and median combine a series of images"),
+        (gpointer)cbStack, NULL, NULL,
+        GNOME_APP_PIXMAP_STOCK, GNOME_STOCK_MENU_OPEN,
+        0, (GdkModifierType) 0, NULL},
     {   GNOME_APP_UI_ITEM, N_("Properties"), N_("Image Properties"),
         (gpointer)cbProp, NULL, NULL,
         GNOME_APP_PIXMAP_STOCK, GNOME_STOCK_MENU_PROP,
@@ -305,6 +318,9 @@ GnomeUIInfo menuWindow[] =
 };
 GnomeUIInfo menuImage[] =
 {
+    GNOMEUIINFO_MENU_UNDO_ITEM(cbUndo, NULL),
+    GNOMEUIINFO_MENU_REDO_ITEM(cbRedo, NULL),
+    GNOMEUIINFO_SEPARATOR,
     {   GNOME_APP_UI_ITEM, N_("Flip Horizontal"), N_("Flip image horizontally"),
         (gpointer)cbImageFlip, GUINT_TO_POINTER(1), NULL,
         GNOME_APP_PIXMAP_NONE, NULL,
@@ -533,6 +549,8 @@ static void prefs_load(void)
     prefs.RegXRange        = gnome_config_get_int("/gccd/reg/x_range=10");
     prefs.RegYRange        = gnome_config_get_int("/gccd/reg/y_range=10");
     prefs.TrackTrain       = gnome_config_get_int("/gccd/track/train=5000");
+    prefs.TrackDither      = gnome_config_get_float("/gccd/track/dither=0.0");
+    prefs.TrackAggression  = gnome_config_get_int("/gccd/track/aggression=70");
     prefs.TrackFieldOffset = gnome_config_get_float("/gccd/track/field_offset=0.25");
     prefs.TrackMin         = gnome_config_get_float("/gccd/track/min_offset=0.5");
     prefs.TrackMsec        = gnome_config_get_int("/gccd/track/msec=500");
@@ -555,6 +573,7 @@ static void prefs_load(void)
     prefs.FilterExp[4]     = gnome_config_get_int("/gccd/filter/exposure4=100");
     prefs.FilterExp[5]     = gnome_config_get_int("/gccd/filter/exposure5=100");
     prefs.FilterExp[6]     = gnome_config_get_int("/gccd/filter/exposure6=100");
+    prefs.WorkspaceBudget  = gnome_config_get_int("/gccd/workspace/budget=512");
 }
 static void prefs_save(void)
 {
@@ -578,6 +597,8 @@ static void prefs_save(void)
     gnome_config_set_int("/gccd/reg/x_range",          prefs.RegXRange);
     gnome_config_set_int("/gccd/reg/y_range",          prefs.RegYRange);
     gnome_config_set_int("/gccd/track/train",          prefs.TrackTrain);
+    gnome_config_set_float("/gccd/track/dither",       prefs.TrackDither);
+    gnome_config_set_int("/gccd/track/aggression",     prefs.TrackAggression);
     gnome_config_set_float("/gccd/track/field_offset", prefs.TrackFieldOffset);
     gnome_config_set_float("/gccd/track/min_offset",   prefs.TrackMin);
     gnome_config_set_int("/gccd/track/msec",           prefs.TrackMsec);
@@ -600,6 +621,7 @@ static void prefs_save(void)
     gnome_config_set_int("/gccd/filter/exposure4",     prefs.FilterExp[4]);
     gnome_config_set_int("/gccd/filter/exposure5",     prefs.FilterExp[5]);
     gnome_config_set_int("/gccd/filter/exposure6",     prefs.FilterExp[6]);
+    gnome_config_set_int("/gccd/workspace/budget",     prefs.WorkspaceBudget);
     gnome_config_sync();
 }
 static void prefs_set_menu_items(GnomeMDIChild *child)
@@ -712,7 +734,7 @@ static void histogramUpdate(struct ccd_image *image)
     if (image)
     {
         ccd_image_histogram(image);
-        if (image->histogram_view)
+        if (image->histogram_view && ccd_image_pixels(image) == 0)
         {
             char str[80];
             int  x, y;
@@ -743,15 +765,21 @@ static void histogramUpdate(struct ccd_image *image)
 static void cbViewExpose(GtkWidget *widget, GdkEventExpose *event, gpointer data)
 {
     struct ccd_image *image = (struct ccd_image *)data;
+    /*
+     * The workspace may have evicted the pixmap of a view that wasn't active.
+     */
+    if (!image->pixmap)
+        imageUpdate(image);
     gdk_window_set_back_pixmap(widget->window, NULL, FALSE);
     gdk_draw_rectangle(widget->window, widget->style->bg_gc[GTK_STATE_NORMAL], TRUE,
                        event->area.x, event->area.y,
                        event->area.width, event->area.height);
-    gdk_window_copy_area(widget->window, widget->style->fg_gc[GTK_STATE_NORMAL],
-                         event->area.x, event->area.y,
-                         image->pixmap,
-                         event->area.x, event->area.y,
-                         event->area.width, event->area.height);
+    if (image->pixmap)
+        gdk_window_copy_area(widget->window, widget->style->fg_gc[GTK_STATE_NORMAL],
+                             event->area.x, event->area.y,
+                             image->pixmap,
+                             event->area.x, event->area.y,
+                             event->area.width, event->area.height);
 #if 0
     /*
      * Paint any areas outside the image with default color.
@@ -834,28 +862,29 @@ static void imageChanged(GnomeMDIChild *child, struct ccd_image *image)
     strcat(str, " *");
     gnome_mdi_child_set_name(child, str);
 }
-static void imageUpdate(struct ccd_image *image)
+static struct ccd_debayer *view_debayer = NULL;
+static void imageRender(struct ccd_image *image, struct ccd_image *src, float zoom)
 {
     int                   dst_rowstride, src_depthbytes, x, y;
     unsigned int          src_pixel, src_offset, mask, width, height;
-    unsigned char         *dst_pixels, filter[4][2][3];
+    unsigned char         *dst_pixels, *rgb_pixels[3], filter[4][2][3];
     float                 contrast_scale;
     GdkPixbuf            *pixbuf, *scale_pixbuf;
 
     /*
      * Load image into displayable pixmap.
      */
-    pixbuf         = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, image->width, image->height);
+    pixbuf         = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, src->width, src->height);
     dst_pixels     = gdk_pixbuf_get_pixels(pixbuf);
     dst_rowstride  = gdk_pixbuf_get_rowstride(pixbuf);
-    src_depthbytes = (image->depth + 7) / 8;
+    src_depthbytes = (src->depth + 7) / 8;
     if (image->view.ContrastStretch)
     {
-        ccd_image_histogram(image);
-        src_offset = image->pixmin;
-        if (image->pixmax == image->pixmin)
+        ccd_image_histogram(src);
+        src_offset = src->pixmin;
+        if (src->pixmax == src->pixmin)
             src_offset--;
-        contrast_scale = 255.5 / (image->pixmax - src_offset);
+        contrast_scale = 255.5 / (src->pixmax - src_offset);
     }
     else
     {
@@ -874,7 +903,16 @@ static void imageUpdate(struct ccd_image *image)
         }
         src_offset = 0;
     }
-    if (image->view.Color && (mask = (image->color & image->filter)))
+    rgb_pixels[0] = NULL;
+    if (image->view.Color && (src->color & 0xC000) == CCD_COLOR_MATRIX_2X2
+     && (view_debayer || (view_debayer = ccd_debayer_new()))
+     && ccd_debayer_image(view_debayer, src, CCD_DEBAYER_EDGE, TRUE, rgb_pixels))
+    {
+        /*
+         * Show the demosaiced color matrix, the mosaic masks aren't needed.
+         */
+    }
+    else if (image->view.Color && (mask = (src->color & src->filter)))
     {
         filter[0][0][0] = mask & 0x100 ? 0xFF : 0x00;
         filter[0][0][1] = mask & 0x010 ? 0xFF : 0x00;
@@ -888,7 +926,7 @@ static void imageUpdate(struct ccd_image *image)
         filter[1][1][0] = mask & 0x800 ? 0xFF : 0x00;
         filter[1][1][1] = mask & 0x080 ? 0xFF : 0x00;
         filter[1][1][2] = mask & 0x008 ? 0xFF : 0x00;
-        if (image->color & CCD_COLOR_MATRIX_ALT_EVEN)
+        if (src->color & CCD_COLOR_MATRIX_ALT_EVEN)
         {
             filter[2][1][0] = mask & 0x100 ? 0xFF : 0x00;
             filter[2][1][1] = mask & 0x010 ? 0xFF : 0x00;
@@ -906,7 +944,7 @@ static void imageUpdate(struct ccd_image *image)
             filter[2][1][1] = mask & 0x020 ? 0xFF : 0x00;
             filter[2][1][2] = mask & 0x002 ? 0xFF : 0x00;
         }
-        if (image->color & CCD_COLOR_MATRIX_ALT_ODD)
+        if (src->color & CCD_COLOR_MATRIX_ALT_ODD)
         {
             filter[3][1][0] = mask & 0x400 ? 0xFF : 0x00;
             filter[3][1][1] = mask & 0x040 ? 0xFF : 0x00;
@@ -933,17 +971,26 @@ static void imageUpdate(struct ccd_image *image)
 #define PALETTE_RED(p)      ((view_palettes[image->view.Palette][p])&0xFF)
 #define PALETTE_GREEN(p)    (((view_palettes[image->view.Palette][p])>>8)&0xFF)
 #define PALETTE_BLUE(p)     (((view_palettes[image->view.Palette][p])>>16)&0xFF)
+#define RGB_PIXEL(pixel_type, c)    ((unsigned int)min(max(((float)((pixel_type *)rgb_pixels[0])[(y * src->width + x) * 3 + c] - src_offset) * contrast_scale, 0.0), 255.0))
 #define PIXEL_LOOP(pixel_type)                                                                                      \
-    for (y = 0; y < image->height; y++)                                                                             \
-        for (x = 0; x < image->width; x++)                                                                          \
+    for (y = 0; y < src->height; y++)                                                                               \
+        for (x = 0; x < src->width; x++)                                                                            \
+        if (rgb_pixels[0])                                                                                          \
         {                                                                                                           \
-            src_pixel = (((pixel_type *)image->pixels)[y * image->width + x] - src_offset) * contrast_scale;        \
+            dst_pixels[y * dst_rowstride + x * 3 + 0] = PALETTE_RED(RGB_PIXEL(pixel_type, 0));                      \
+            dst_pixels[y * dst_rowstride + x * 3 + 1] = PALETTE_GREEN(RGB_PIXEL(pixel_type, 1));                    \
+            dst_pixels[y * dst_rowstride + x * 3 + 2] = PALETTE_BLUE(RGB_PIXEL(pixel_type, 2));                     \
+        }                                                                                                           \
+        else                                                                                                        \
+        {                                                                                                           \
+            src_pixel = (((pixel_type *)src->pixels)[y * src->width + x] - src_offset) * contrast_scale;            \
             dst_pixels[y * dst_rowstride + x * 3 + 0] = PALETTE_RED(src_pixel)   & filter[y & 3][x & 1][0];         \
             dst_pixels[y * dst_rowstride + x * 3 + 1] = PALETTE_GREEN(src_pixel) & filter[y & 3][x & 1][1];         \
             dst_pixels[y * dst_rowstride + x * 3 + 2] = PALETTE_BLUE(src_pixel)  & filter[y & 3][x & 1][2];         \
         }
 
     PIXEL_SIZE_CASE(src_depthbytes);
+#undef RGB_PIXEL
 #undef PIXEL_LOOP
 #undef PALETTE_BLUE
 #undef PALETTE_GREEN
@@ -951,51 +998,53 @@ static void imageUpdate(struct ccd_image *image)
 
     if (image->view.AspectStretch)
     {
-        if (image->pixel_height > image->pixel_width)
+        if (src->pixel_height > src->pixel_width)
         {
-            if (image->view.BinStretch && image->xbin && image->ybin)
+            if (image->view.BinStretch && src->xbin && src->ybin)
             {
-                width  = image->width  * image->xbin;
-                height = image->height * image->ybin * ((float)image->pixel_height / (float)image->ybin) / ((float)image->pixel_width / (float)image->xbin);
+                width  = src->width  * src->xbin;
+                height = src->height * src->ybin * ((float)src->pixel_height / (float)src->ybin) / ((float)src->pixel_width / (float)src->xbin);
             }
             else
             {
-                width  = image->width;
-                height = image->height * (float)image->pixel_height / (float)image->pixel_width;
+                width  = src->width;
+                height = src->height * (float)src->pixel_height / (float)src->pixel_width;
             }
         }
         else
         {
-            if (image->view.BinStretch && image->xbin && image->ybin)
+            if (image->view.BinStretch && src->xbin && src->ybin)
             {
-                width  = image->width  * image->xbin * ((float)image->pixel_width / (float)image->xbin) / ((float)image->pixel_height / (float)image->ybin);
-                height = image->height * image->ybin;
+                width  = src->width  * src->xbin * ((float)src->pixel_width / (float)src->xbin) / ((float)src->pixel_height / (float)src->ybin);
+                height = src->height * src->ybin;
             }
             else
             {
-                width  = image->width * (float)image->pixel_width / (float)image->pixel_height;
-                height = image->height;
+                width  = src->width * (float)src->pixel_width / (float)src->pixel_height;
+                height = src->height;
             }
         }
-        scale_pixbuf = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
-        gdk_pixbuf_unref(pixbuf);
-        pixbuf = scale_pixbuf;
     }
     else if (image->view.BinStretch)
     {
-        width  = image->width  * (image->xbin ? image->xbin : 1);
-        height = image->height * (image->ybin ? image->ybin : 1);
-        if (width != image->width || height != image->height)
-        {
-            scale_pixbuf = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
-            gdk_pixbuf_unref(pixbuf);
-            pixbuf = scale_pixbuf;
-        }
+        width  = src->width  * (src->xbin ? src->xbin : 1);
+        height = src->height * (src->ybin ? src->ybin : 1);
     }
     else
     {
-        width  = image->width;
-        height = image->height;
+        width  = src->width;
+        height = src->height;
+    }
+    /*
+     * Previews are zoomed back up to the size of the full image.
+     */
+    width  = width  * zoom + 0.5;
+    height = height * zoom + 0.5;
+    if (width != src->width || height != src->height)
+    {
+        scale_pixbuf = ccd_pixbuf_scale(pixbuf, width, height, &image->scaler);
+        gdk_pixbuf_unref(pixbuf);
+        pixbuf = scale_pixbuf;
     }
     if (image->pixmap)
     {
@@ -1013,13 +1062,106 @@ static void imageUpdate(struct ccd_image *image)
     gdk_pixbuf_unref(pixbuf);
     if (image->draw_area)
         gtk_drawing_area_size(GTK_DRAWING_AREA(image->draw_area), width, height);
-    histogramUpdate(image);
+    if (src == image)
+        histogramUpdate(image);
 }
-static void imageRemoveNoise(struct ccd_image *image)
+/*
+ * Finish pending history operations once the preview is up.
+ */
+static gint idleUpdate(gpointer data)
+{
+    struct ccd_image *image = (struct ccd_image *)data;
+
+    image->update_idle = 0;
+    if (ccd_image_pixels(image) == 0)
+    {
+        imageRender(image, image, 1.0);
+        if (image->draw_area)
+            gtk_widget_queue_draw(image->draw_area);
+    }
+    return (FALSE);
+}
+static void imageUpdate(struct ccd_image *image)
+{
+    struct ccd_image *preview;
+    float             zoom;
+
+    if (image->update_idle)
+    {
+        gtk_idle_remove(image->update_idle);
+        image->update_idle = 0;
+    }
+    if ((preview = ccd_image_preview(image, PREVIEW_SIZE, &zoom)))
+    {
+        imageRender(image, preview, zoom);
+        ccd_image_preview_delete(preview);
+        image->update_idle = gtk_idle_add(idleUpdate, image);
+    }
+    else if (ccd_image_pixels(image) == 0)
+        imageRender(image, image, 1.0);
+}
+/*
+ * History operations.  These run on whatever the image looks like at that
+ * point in its history, so everything they need is derived from it.
+ */
+static void opFlip(struct ccd_image *image, struct ccd_op *op)
+{
+    if (op->arg)
+        ccd_image_flip_horiz(image);
+    else
+        ccd_image_flip_vert(image);
+}
+static void opRotate(struct ccd_image *image, struct ccd_op *op)
+{
+    ccd_image_rotate(image, op->arg);
+}
+static void opScale(struct ccd_image *image, struct ccd_op *op)
+{
+    unsigned int scale_width, scale_height;
+
+    switch (op->arg)
+    {
+        case SCALE_ASPECT:
+            if (image->pixel_height == image->pixel_width)
+                return;
+            if (image->pixel_height > image->pixel_width)
+            {
+                scale_width         = image->width;
+                scale_height        = image->height * image->pixel_height / image->pixel_width;
+                image->pixel_height = image->pixel_width;
+            }
+            else
+            {
+                scale_width        = image->width * image->pixel_width / image->pixel_height;
+                scale_height       = image->height;
+                image->pixel_width = image->pixel_height;
+            }
+            break;
+        case SCALE_HALFX:
+            scale_width  = image->width  / 2;
+            scale_height = image->height / 2;
+            break;
+        case SCALE_2X:
+            scale_width  = image->width  * 2;
+            scale_height = image->height * 2;
+            break;
+        case SCALE_4X:
+            scale_width  = image->width  * 4;
+            scale_height = image->height * 4;
+            break;
+        default:
+            return;
+    }
+    ccd_image_scale(image, scale_width, scale_height);
+}
+static void opRemoveNoise(struct ccd_image *image, struct ccd_op *op)
 {
     unsigned int    i, j, k, l, x, y;
     unsigned long  sorted_pixels[9], sig, noise_hi, noise_lo;
 
+    if (ccd_image_modify(image) < 0)
+        return;
+
 #define PIXEL_LOOP(pixel_type)                                                                                      \
     for (y = 1; y < image->height - 1; y++)                                                                         \
         for (x = 1; x < image->width - 1; x++)                                                                      \
@@ -1051,7 +1193,7 @@ static void imageRemoveNoise(struct ccd_image *image)
     image->pixmax = image->pixmin = 0;
     ccd_image_histogram(image);
 }
-static void imageRemoveBackground(struct ccd_image *image)
+static void opRemoveBackground(struct ccd_image *image, struct ccd_op *op)
 {
     unsigned int          x, y, src_offset, max_count, max_index, histogram[256];
     float                 histogram_scale;
@@ -1086,6 +1228,26 @@ static void imageRemoveBackground(struct ccd_image *image)
 
     ccd_image_sub(image, src_offset);
 }
+static void opRemoveVBE(struct ccd_image *image, struct ccd_op *op)
+{
+    float          kernel[3];
+    unsigned char *pixels, *filt_pixels;
+
+    if (ccd_image_modify(image) < 0)
+        return;
+    kernel[0]     =
+    kernel[2]     = 1.0;
+    kernel[1]     = 2.0;
+    pixels        = image->pixels;
+    filt_pixels   = ccd_image_convolve(image, NULL, 0, 1, (float *)kernel);
+    image->pixels = filt_pixels;
+    kernel[0]     =
+    kernel[2]     = -1.0;
+    kernel[1]     = 6.0;
+    image->pixels = ccd_image_convolve(image, pixels, 0, 1, (float *)kernel);
+    image->pixmin = image->pixmax = 0;
+    free(filt_pixels);
+}
 static void imageNewChild(struct ccd_image *image)
 {
     gchar str[NAME_STRING_LENGTH + 2];
@@ -1108,6 +1270,7 @@ static void imageNewChild(struct ccd_image *image)
     gnome_mdi_generic_child_set_view_creator(image->child, cbViewCreate, image);
     gnome_mdi_add_view(GNOME_MDI(mdi), GNOME_MDI_CHILD(image->child));
     imageUpdateList();
+    ccd_workspace_trim(image);
 }
 
 /***************************************************************************\
@@ -1151,6 +1314,65 @@ static void cbOpen(GtkObject *object, gpointer data)
 {
     dlgGetFilename(_("Open File"), NULL, cbOpenOK);
 }
+static void cbStackOK(GtkWidget *widget, gpointer data)
+{
+    char                  filename[PATH_MAX];
+    char                  pattern[PATH_MAX];
+    char                 *dash;
+    struct ccd_image     *image;
+    struct ccd_stack     *stack;
+    glob_t                series;
+    int                   i;
+
+    /*
+     * Get path from selection dialog.
+     */
+    strcpy(filename, gtk_file_selection_get_filename(GTK_FILE_SELECTION(data)));
+    gtk_widget_destroy(GTK_WIDGET(data));
+    /*
+     * The chosen image supplies the header. Every image named like it, up to
+     * the last '-', is part of the series.
+     */
+    if (!(image = ccd_image_new_from_file(filename)))
+    {
+        gnome_warning_dialog_parented(_("Unable to load file.  Probably invalid FITS format."), GTK_WINDOW(gnome_mdi_get_active_window(GNOME_MDI(mdi))));
+        return;
+    }
+    if ((dash = strrchr(image->name, '-')))
+        *dash = '\0';
+    sprintf(pattern, "%s/%s-*%s%s", image->dir, image->name, image->ext[0] ? "." : "", image->ext);
+    if (glob(pattern, 0, NULL, &series) || !(stack = ccd_stack_new(image, CCD_IMAGE_COMBINE_MEDIAN)))
+    {
+        ccd_image_delete(image);
+        return;
+    }
+    gdk_window_set_cursor(GTK_WIDGET(gnome_mdi_get_active_window(GNOME_MDI(mdi)))->window, cursorWait);
+    gdk_flush();
+    ccd_stack_register(stack, image->width*prefs.RegXRange/100, image->height*prefs.RegYRange/100, prefs.RegXRad, prefs.RegYRad, prefs.RegSig);
+    for (i = 0; i < series.gl_pathc; i++)
+        if (ccd_stack_add_fits(stack, series.gl_pathv[i]) && (verbose & 1))
+            g_print("Skipping %s\n", series.gl_pathv[i]);
+    globfree(&series);
+    ccd_image_set_pixels(image, NULL);
+    if (ccd_stack_combine(stack, image))
+    {
+        ccd_stack_delete(stack);
+        ccd_image_delete(image);
+        gdk_window_set_cursor(GTK_WIDGET(gnome_mdi_get_active_window(GNOME_MDI(mdi)))->window, NULL);
+        return;
+    }
+    for (i = 0; i < MAX_PROCESS_HISTORY - 1 && image->history[i][0]; i++);
+    sprintf(image->history[i], "Median of %d registered frames", ccd_stack_count(stack));
+    ccd_stack_delete(stack);
+    strcat(image->name, "-stack");
+    image->changed = TRUE;
+    imageNewChild(image);
+    gdk_window_set_cursor(GTK_WIDGET(gnome_mdi_get_active_window(GNOME_MDI(mdi)))->window, NULL);
+}
+static void cbStack(GtkObject *object, gpointer data)
+{
+    dlgGetFilename(_("Stack Series"), NULL, cbStackOK);
+}
 static struct
 {
     struct ccd_image *image;
@@ -1666,86 +1888,69 @@ static void cbViewMode(GtkObject *object, gpointer data)
     gnome_mdi_set_mode(GNOME_MDI(mdi), mode);
     prefs.ViewMode = mode;
 }
-static void cbImageFlip(GtkObject *object, gpointer data)
+static void cbUndo(GtkObject *object, gpointer data)
 {
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
-    int               dir   = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
-    if (image)
+    if (image && ccd_image_undo(image) == 0)
     {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        if (dir)
-            ccd_image_flip_horiz(image);
-        else
-            ccd_image_flip_vert(image);
         imageUpdate(image);
         imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
         gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
     }
 }
-static void cbImageRotate(GtkObject *object, gpointer data)
+static void cbRedo(GtkObject *object, gpointer data)
 {
-    int               angle = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
-    if (image)
+    if (image && ccd_image_redo(image) == 0)
     {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        ccd_image_rotate(image, angle);
         imageUpdate(image);
         imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
         gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
     }
 }
-static void cbImageScale(GtkObject *object, gpointer data)
+static void imageApply(struct ccd_image *image, void (*apply)(struct ccd_image *image, struct ccd_op *op), unsigned long arg, char *name)
 {
-    unsigned int      scale_width, scale_height;
-    int               scale = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
-    struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
-    if (image)
+    gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
+    gdk_flush();
+    if (ccd_image_apply(image, apply, arg, name) == 0)
     {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        switch (scale)
-        {
-            case SCALE_ASPECT:
-                if (image->pixel_height == image->pixel_width)
-                    return;
-                if (image->pixel_height > image->pixel_width)
-                {
-                    scale_width         = image->width;
-                    scale_height        = image->height * image->pixel_height / image->pixel_width;
-                    image->pixel_height = image->pixel_width;
-                }
-                else
-                {
-                    scale_width        = image->width * image->pixel_width / image->pixel_height;
-                    scale_height       = image->height;
-                    image->pixel_width = image->pixel_height;
-                }
-                break;
-            case SCALE_HALFX:
-                scale_width  = image->width  / 2;
-                scale_height = image->height / 2;
-                break;
-            case SCALE_2X:
-                scale_width  = image->width  * 2;
-                scale_height = image->height * 2;
-                break;
-            case SCALE_4X:
-                scale_width  = image->width  * 4;
-                scale_height = image->height * 4;
-                break;
-            default:
-                return;
-        }
-        ccd_image_scale(image, scale_width, scale_height);
         imageUpdate(image);
         imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
         gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
+    }
+    gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
+}
+static void cbImageFlip(GtkObject *object, gpointer data)
+{
+    struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
+    int               dir   = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
+    if (image)
+        imageApply(image, opFlip, dir, dir ? "Flip horizontal" : "Flip vertical");
+}
+static void cbImageRotate(GtkObject *object, gpointer data)
+{
+    char              name[HISTORY_STRING_LENGTH+1];
+    int               angle = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
+    struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
+    if (image)
+    {
+        sprintf(name, "Rotate %d degrees", angle);
+        imageApply(image, opRotate, angle, name);
+    }
+}
+static void cbImageScale(GtkObject *object, gpointer data)
+{
+    static char      *names[] = {"Scale 1:1 aspect", "Scale 1/2X", "Scale 2X", "Scale 4X"};
+    int               scale   = GPOINTER_TO_UINT(gtk_object_get_data(object, GNOMEUIINFO_KEY_UIDATA));
+    struct ccd_image *image   = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
+    if (image && scale >= SCALE_ASPECT && scale <= SCALE_4X)
+    {
+        /*
+         * Nothing to record if the pixels are already square.
+         */
+        if (scale == SCALE_ASPECT && ccd_image_pixels(image) == 0 && image->pixel_height == image->pixel_width)
+            return;
+        imageApply(image, opScale, scale, names[scale]);
     }
 }
 static void cbImageColorSplit(GtkObject *object, gpointer data)
@@ -1754,7 +1959,7 @@ static void cbImageColorSplit(GtkObject *object, gpointer data)
     unsigned char    *pixels[5];
     struct ccd_image *new_image;
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
-    if (image && image->color != CCD_COLOR_MONOCHROME && image->color != 0)
+    if (image && image->color != CCD_COLOR_MONOCHROME && image->color != 0 && ccd_image_pixels(image) == 0)
     {
         gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
         gdk_flush();
@@ -1766,8 +1971,8 @@ static void cbImageColorSplit(GtkObject *object, gpointer data)
                 new_image->pixmin = 0;
                 new_image->pixmax = 0;
                 new_image->color   = colors[i];
-                new_image->pixels  = pixels[i];
                 new_image->pixmap  = NULL;
+                ccd_image_set_pixels(new_image, pixels[i]);
                 new_image->changed = TRUE;
                 sprintf(new_image->name, "%s-%s", image->name, COLOR_MASK_TO_NAME(colors[i]));
                 imageNewChild(new_image);
@@ -1779,56 +1984,19 @@ static void cbImageRemoveNoise(GtkObject *object, gpointer data)
 {
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
     if (image)
-    {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        imageRemoveNoise(image);
-        imageUpdate(image);
-        imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
-        gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
-    }
+        imageApply(image, opRemoveNoise, 0, "Remove noise");
 }
 static void cbImageRemoveBackground(GtkObject *object, gpointer data)
 {
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
     if (image)
-    {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        imageRemoveBackground(image);
-        imageUpdate(image);
-        imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
-        gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
-    }
+        imageApply(image, opRemoveBackground, 0, "Remove background");
 }
 static void cbImageRemoveVBE(GtkObject *object, gpointer data)
 {
-    float             kernel[3];
-    unsigned char    *pixels, *filt_pixels;
     struct ccd_image *image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(gnome_mdi_get_active_child(GNOME_MDI(mdi))));
     if (image)
-    {
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, cursorWait);
-        gdk_flush();
-        kernel[0]     =
-        kernel[2]     = 1.0;
-        kernel[1]     = 2.0;
-        pixels        = image->pixels;
-        filt_pixels   = ccd_image_convolve(image, NULL, 0, 1, (float *)kernel);
-        image->pixels = filt_pixels;
-        kernel[0]     =
-        kernel[2]     = -1.0;
-        kernel[1]     = 6.0;
-        image->pixels = ccd_image_convolve(image, pixels, 0, 1, (float *)kernel);
-        image->pixmin = image->pixmax = 0;
-        free(filt_pixels);
-        imageUpdate(image);
-        imageChanged(gnome_mdi_get_active_child(GNOME_MDI(mdi)), image);
-        gtk_widget_queue_draw(gnome_mdi_get_active_view(GNOME_MDI(mdi)));
-        gdk_window_set_cursor(gnome_mdi_get_active_view(GNOME_MDI(mdi))->window, NULL);
-    }
+        imageApply(image, opRemoveVBE, 0, "Remove VBE");
 }
 static void cbAbout(GtkObject *object, gpointer data)
 {
@@ -1879,7 +2047,10 @@ static gint eventChildRemove(GnomeMDI *mdi, GnomeMDIChild *child)
     }
     if (bye)
     {
-        gdk_pixmap_unref(image->pixmap);
+        if (image->update_idle)
+            gtk_idle_remove(image->update_idle);
+        if (image->pixmap)
+            gdk_pixmap_unref(image->pixmap);
         ccd_image_delete(image);
         imageUpdateList();
     }
@@ -1887,7 +2058,18 @@ static gint eventChildRemove(GnomeMDI *mdi, GnomeMDIChild *child)
 }
 static gint eventChildChange(GnomeMDI *mdi, GnomeMDIChild *old_child)
 {
-    prefs_set_menu_items(gnome_mdi_get_active_child(mdi));
+    GnomeMDIChild    *child = gnome_mdi_get_active_child(mdi);
+    struct ccd_image *image;
+
+    prefs_set_menu_items(child);
+    /*
+     * Page the active image back in, the menu callbacks work on its pixels.
+     */
+    if (child && (image = (struct ccd_image *)gtk_object_get_user_data(GTK_OBJECT(child))))
+    {
+        ccd_image_pixels(image);
+        ccd_workspace_trim(image);
+    }
     return (TRUE);
 }
 static gint eventDestroy(GtkWidget *widget, GdkEvent *event, gpointer data)
@@ -1962,6 +2144,7 @@ int main(int argc, char **argv)
     poptFreeContext(ctx);
     verbose =  (v ? 1 : 0) | (g ? 2 : 0);
     prefs_load();
+    ccd_workspace_budget(prefs.WorkspaceBudget * 1024UL * 1024UL);
     chdir(prefs.WorkingDirectory);
     getcwd(prefs.WorkingDirectory, DIR_STRING_LENGTH);
     create_view_palette();
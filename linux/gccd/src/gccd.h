@@ -25,9 +25,12 @@
 #include <error.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <gnome.h>
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #include "config.h"
+#include "ccd_combine.h"
+#include "aip.h"
 #ifndef min
 #define min(a,b)    (((a)<(b))?(a):(b))
 #endif
@@ -119,6 +122,7 @@ struct ccd_image
     unsigned int      ybin;
     float             zero;
     float             scale;
+    float             pedestal;
     float             pixel_width;
     float             pixel_height;
     char              date[DATE_STRING_LENGTH+1];
@@ -137,12 +141,36 @@ struct ccd_image
     unsigned long     histogram[HISTOGRAM_BINS];
     struct ccd_image *next;
     struct view_prefs view;
+    struct scaler     scaler;
+    struct ccd_pixels *store;
+    unsigned long     last_use;
+    struct ccd_op    *op;
     GtkWidget        *histogram_view;
     GtkWidget        *histogram_label;
     GdkPixmap        *pixmap;
     GtkWidget        *draw_area;
+    guint             update_idle;
     GnomeMDIGenericChild *child;
 };
+/*
+ * Processing history node.  The first node of a history is the source image,
+ * every following one applies an operation to the result of its parent.
+ */
+struct ccd_op
+{
+    void            (*apply)(struct ccd_image *image, struct ccd_op *op);
+    unsigned long     arg;
+    char              name[HISTORY_STRING_LENGTH+1];
+    int               slot;
+    unsigned int      width;
+    unsigned int      height;
+    float             pixel_width;
+    float             pixel_height;
+    struct ccd_pixels *cache;
+    unsigned long     last_use;
+    struct ccd_op    *prev;
+    struct ccd_op    *next;
+};
 struct ccd_dev
 {
     char            filename[NAME_STRING_LENGTH];
@@ -177,10 +205,20 @@ struct ccd_exp
     unsigned int      msec;
     unsigned int      start;
     unsigned int      read_row;
+    unsigned int      read_bytes;
     gint              input_tag;
     guint             timeout_id;
     int               downloading;
 };
+struct ccd_reader
+{
+    pthread_t         thread;
+    struct ccd_exp   *exposure;
+    int               notify[2];
+    volatile int      active;
+    volatile int      cancel;
+    int               loaded;
+};
 struct scope_dev
 {
     char           filename[NAME_STRING_LENGTH];
@@ -226,6 +264,8 @@ struct _prefs
     gint         RegXRange;
     gint         RegYRange;
     gint         TrackTrain;
+    gfloat       TrackDither;
+    gint         TrackAggression;
     gfloat       TrackFieldOffset;
     gfloat       TrackMin;
     gint         TrackMsec;
@@ -236,25 +276,31 @@ struct _prefs
     gfloat       TrackRight;
     gint         Filter[7];
     gint         FilterExp[7];
+    gint         WorkspaceBudget;
 };
 extern struct _prefs prefs;
 /*
  * Image Object.
  */
-#define CCD_IMAGE_COMBINE_MEDIAN        1
-#define CCD_IMAGE_COMBINE_MIN           2
-#define CCD_IMAGE_COMBINE_MAX           3
-#define CCD_IMAGE_COMBINE_MEAN          4
-#define CCD_IMAGE_COMBINE_DIFF          5
-#define CCD_IMAGE_COMBINE_SUM           6
-#define CCD_IMAGE_COMBINE_INTERLEAVE    7
 #define CCD_IMAGE_DECONVOLVE_RICHARDSON_LUCY    1
 #define CCD_IMAGE_DECONVOLVE_VAN_CITTERT        2
+#define CCD_DEBAYER_BILINEAR            0
+#define CCD_DEBAYER_EDGE                1
 struct ccd_image *ccd_image_new(char *path);
 struct ccd_image *ccd_image_new_from_file(char *path);
 struct ccd_image *ccd_image_dup(struct ccd_image *image_orig);
 void ccd_image_delete(struct ccd_image *image);
 int ccd_image_set_dir_name_ext(struct ccd_image *image, char *path);
+int ccd_image_pixels(struct ccd_image *image);
+int ccd_image_modify(struct ccd_image *image);
+void ccd_image_set_pixels(struct ccd_image *image, unsigned char *pixels);
+void ccd_workspace_budget(unsigned long bytes);
+void ccd_workspace_trim(struct ccd_image *keep);
+int ccd_image_apply(struct ccd_image *image, void (*apply)(struct ccd_image *image, struct ccd_op *op), unsigned long arg, char *name);
+int ccd_image_undo(struct ccd_image *image);
+int ccd_image_redo(struct ccd_image *image);
+struct ccd_image *ccd_image_preview(struct ccd_image *image, unsigned int size, float *zoom);
+void ccd_image_preview_delete(struct ccd_image *preview);
 void ccd_image_histogram(struct ccd_image *image);
 int ccd_image_save_fits(struct ccd_image *image);
 int ccd_image_load_fits(struct ccd_image *image);
@@ -263,19 +309,43 @@ void ccd_image_flip_horiz(struct ccd_image *image);
 void ccd_image_flip_vert(struct ccd_image *image);
 void ccd_image_rotate(struct ccd_image *image, int angle);
 void ccd_image_scale(struct ccd_image *image, unsigned int scale_width, unsigned int scale_height);
+GdkPixbuf *ccd_pixbuf_scale(GdkPixbuf *pixbuf, int width, int height, struct scaler *scaler);
 unsigned char *ccd_image_convolve(struct ccd_image *image, unsigned char *conv_frame, unsigned xradius, unsigned yradius, float *kernel);
 unsigned char *ccd_image_deconvolve(struct ccd_image *image, unsigned char *current_frame, unsigned char *next_frame, unsigned xradius, unsigned yradius, float *kernel, float noise_adj, int op);
 void ccd_image_calibrate(struct ccd_image *raw, struct ccd_image *bias, struct ccd_image *dark, struct ccd_image *flat);
+struct ccd_calibrate *ccd_calibrate_new(struct ccd_image *bias, struct ccd_image *dark, struct ccd_image *flat);
+int ccd_calibrate_image(struct ccd_calibrate *calibrate, struct ccd_image *raw);
+void ccd_calibrate_delete(struct ccd_calibrate *calibrate);
 unsigned long ccd_image_average(struct ccd_image *image);
 void ccd_image_add(struct ccd_image *image, unsigned long offset);
 void ccd_image_sub(struct ccd_image *image, unsigned long offset);
 void ccd_image_mul(struct ccd_image *image, unsigned long factor);
 void ccd_image_div(struct ccd_image *image, unsigned long factor);
 void ccd_image_fmul(struct ccd_image *image, float factor);
+struct ccd_star
+{
+    float x_centroid;
+    float y_centroid;
+    float flux;
+    int   x_radius;
+    int   y_radius;
+};
+int ccd_image_find_stars(struct ccd_image *image, unsigned char *pixels, struct ccd_star *stars, int max_stars, int x_max_radius, int y_max_radius, float sigs);
 int ccd_image_find_best_centroid(struct ccd_image *image, unsigned char *pixels, float *x_centroid, float *y_centroid, int x_range, int y_range, int *x_max_radius, int *y_max_radius, float sigs);
 unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned char *pixels, float x_centroid, float y_centroid, float *x_prev, float *y_prev, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, int frame_num);
 int ccd_image_register_frames(struct ccd_image *image, unsigned char **pixels, unsigned char **registered_pixels, float *x_centroid, float *y_centroid, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, unsigned int frame_count);
 void ccd_image_combine_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count, int op);
+int ccd_image_combine_stream(struct ccd_image *image, int (*read_rows)(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst), void *source, unsigned int frame_count, int op);
+struct ccd_stack *ccd_stack_new(struct ccd_image *image, int op);
+void ccd_stack_register(struct ccd_stack *stack, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs);
+int ccd_stack_add_pixels(struct ccd_stack *stack, unsigned char *pixels);
+int ccd_stack_add_fits(struct ccd_stack *stack, char *filename);
+unsigned int ccd_stack_count(struct ccd_stack *stack);
+int ccd_stack_combine(struct ccd_stack *stack, struct ccd_image *image);
+void ccd_stack_delete(struct ccd_stack *stack);
+struct ccd_debayer *ccd_debayer_new(void);
+int ccd_debayer_image(struct ccd_debayer *debayer, struct ccd_image *image, int method, int interleaved, unsigned char *out[3]);
+void ccd_debayer_delete(struct ccd_debayer *debayer);
 int ccd_image_split_frames(struct ccd_image *image, unsigned char *pixels[5], unsigned int colors[5], unsigned int lrgb_split);
 struct ccd_image *ccd_image_first(void);
 struct ccd_image *ccd_image_next(struct ccd_image *image);
@@ -311,6 +381,9 @@ int  ccd_release(struct ccd_dev *ccd);
 void ccd_expose_frame(struct ccd_exp *exposure);
 int  ccd_load_frame(struct ccd_exp *exposure);
 void ccd_abort_exposures(struct ccd_exp *exposure);
+int  ccd_reader_start(struct ccd_reader *reader, struct ccd_exp *exposure);
+int  ccd_reader_finish(struct ccd_reader *reader);
+void ccd_reader_cancel(struct ccd_reader *reader);
 int  scope_connect(struct scope_dev *scope);
 int  scope_release(struct scope_dev *scope);
 void scope_move(struct scope_dev *scope, unsigned int dir);
@@ -22,6 +22,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "gccd.h"
 #define DUPLICATE_FIRST_REGISTERED_IMAGE
 //#define CCD_DEBUG
@@ -100,6 +102,493 @@ struct ccd_image *ccd_image_find_by_path(char *path)
     }
     return (NULL);
 }
+/*
+ * Image workspace.  Pixels live in reference counted stores shared by an
+ * image and its duplicates until one of them writes to them.  Stores read
+ * from a FITS file remember where the data lives in the file, so their pixels
+ * can be dropped when the workspace grows past its budget and mapped back in
+ * on the next access.
+ */
+struct ccd_pixels
+{
+    int                refs;
+    unsigned char     *pixels;
+    unsigned int       size;
+    unsigned int       width;
+    unsigned int       pixel_size;
+    unsigned int       sign_bit;
+    char              *path;
+    off_t              offset;
+    time_t             mtime;
+    unsigned long      last_use;
+    struct ccd_pixels *next;
+};
+static struct ccd_pixels *store_list_head  = NULL;
+static unsigned long      workspace_budget = 0;
+static unsigned long      workspace_clock  = 0;
+static void convert_pixels(unsigned char *src, unsigned char *dst, unsigned int sign_bit, int pixel_size, int count);
+static int ccd_history_evaluate(struct ccd_image *image);
+static void ccd_history_free(struct ccd_image *image);
+static struct ccd_pixels *ccd_pixels_new(struct ccd_image *image, unsigned char *pixels)
+{
+    struct ccd_pixels *store;
+
+    if (!(store = calloc(1, sizeof(struct ccd_pixels))))
+        return (NULL);
+    store->refs       = 1;
+    store->pixels     = pixels;
+    store->pixel_size = (image->depth + 7) / 8;
+    store->width      = image->width;
+    store->size       = image->height * image->width * store->pixel_size;
+    store->next       = store_list_head;
+    store_list_head   = store;
+    return (store);
+}
+static void ccd_pixels_release(struct ccd_pixels *store)
+{
+    struct ccd_pixels **prev;
+
+    if (--store->refs > 0)
+        return;
+    for (prev = &store_list_head; *prev != store; prev = &(*prev)->next);
+    *prev = store->next;
+    if (store->pixels)
+        free(store->pixels);
+    if (store->path)
+        free(store->path);
+    free(store);
+}
+/*
+ * Point a store at the FITS data it can be paged in from.
+ */
+static int ccd_pixels_back(struct ccd_pixels *store, char *path, off_t offset, unsigned int sign_bit)
+{
+    struct stat st;
+
+    if (stat(path, &st) < 0 || st.st_size < offset + store->size)
+        return (-1);
+    if (store->path)
+        free(store->path);
+    store->path     = strdup(path);
+    store->offset   = offset;
+    store->mtime    = st.st_mtime;
+    store->sign_bit = sign_bit;
+    return (0);
+}
+/*
+ * Map the FITS data and convert the scanlines bottom up into a fresh buffer.
+ * A file changed behind our back is refused rather than read as garbage.
+ */
+static int ccd_pixels_map(struct ccd_pixels *store)
+{
+    struct stat    st;
+    unsigned char *map, *pixels;
+    unsigned int   pitch, i;
+    off_t          base;
+    size_t         length;
+    int            fd;
+
+    if (store->pixels)
+        return (0);
+    if (!store->path || (fd = open(store->path, O_RDONLY, 0)) < 0)
+        return (-1);
+    if (fstat(fd, &st) < 0 || st.st_mtime != store->mtime || st.st_size < store->offset + store->size
+     || !(pixels = malloc(store->size)))
+    {
+        close(fd);
+        return (-1);
+    }
+    base   = store->offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+    length = store->offset - base + store->size;
+    map    = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, base);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        free(pixels);
+        return (-1);
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+    pitch = store->width * store->pixel_size;
+    for (i = 0; i < store->size / pitch; i++)
+        convert_pixels(map + (store->offset - base) + i * pitch, pixels + store->size - (i+1) * pitch, store->sign_bit, store->pixel_size, store->width);
+    munmap(map, length);
+    store->pixels = pixels;
+    return (0);
+}
+/*
+ * Drop the pixels of a file backed store from every image sharing it.
+ */
+static void ccd_pixels_evict(struct ccd_pixels *store)
+{
+    struct ccd_image *image_list;
+
+    for (image_list = image_list_head; image_list; image_list = image_list->next)
+        if (image_list->store == store)
+            image_list->pixels = NULL;
+    free(store->pixels);
+    store->pixels = NULL;
+}
+/*
+ * Make sure the image pixels are resident.
+ */
+int ccd_image_pixels(struct ccd_image *image)
+{
+    image->last_use = ++workspace_clock;
+    if (image->op && (!image->op->cache || image->store != image->op->cache) && ccd_history_evaluate(image) < 0)
+        return (-1);
+    if (!image->store)
+        return (image->pixels ? 0 : -1);
+    if (ccd_pixels_map(image->store) < 0)
+        return (-1);
+    image->store->last_use = workspace_clock;
+    image->pixels          = image->store->pixels;
+    return (0);
+}
+/*
+ * Get a private copy of the pixels before writing to them.  The last image
+ * holding a store simply takes its buffer over.  Writing outside of the
+ * processing history flattens it.
+ */
+int ccd_image_modify(struct ccd_image *image)
+{
+    struct ccd_pixels *store;
+    unsigned char     *pixels;
+
+    if (ccd_image_pixels(image) < 0)
+        return (-1);
+    if (image->op)
+        ccd_history_free(image);
+    if (!(store = image->store))
+        return (0);
+    if (store->refs > 1)
+    {
+        if (!(pixels = malloc(store->size)))
+            return (-1);
+        memcpy(pixels, store->pixels, store->size);
+    }
+    else
+    {
+        pixels        = store->pixels;
+        store->pixels = NULL;
+    }
+    ccd_pixels_release(store);
+    image->store  = NULL;
+    image->pixels = pixels;
+    return (0);
+}
+/*
+ * Replace the image pixels with a buffer the image owns.
+ */
+void ccd_image_set_pixels(struct ccd_image *image, unsigned char *pixels)
+{
+    if (image->op)
+        ccd_history_free(image);
+    if (image->store)
+    {
+        ccd_pixels_release(image->store);
+        image->store = NULL;
+    }
+    else if (image->pixels && image->pixels != pixels)
+        free(image->pixels);
+    image->pixels = pixels;
+}
+void ccd_workspace_budget(unsigned long bytes)
+{
+    workspace_budget = bytes;
+}
+/*
+ * Evict the least recently used pixmaps and file backed pixels until the
+ * workspace fits its budget.  The kept image, private pixels and pixels
+ * without a file to page in from stay resident.
+ */
+void ccd_workspace_trim(struct ccd_image *keep)
+{
+    struct ccd_image  *image_list, *lru_image;
+    struct ccd_pixels *store, *lru_store;
+    struct ccd_op     *op, *lru_op;
+    unsigned long      total, lru;
+    gint               width, height;
+
+    if (!workspace_budget)
+        return;
+    total = 0;
+    for (store = store_list_head; store; store = store->next)
+        if (store->pixels)
+            total += store->size;
+    for (image_list = image_list_head; image_list; image_list = image_list->next)
+    {
+        if (!image_list->store && image_list->pixels)
+            total += image_list->width * image_list->height * ((image_list->depth + 7) / 8);
+        if (image_list->pixmap)
+        {
+            gdk_window_get_size(image_list->pixmap, &width, &height);
+            total += width * height * 4;
+        }
+    }
+    while (total > workspace_budget)
+    {
+        lru       = ~0UL;
+        lru_image = NULL;
+        lru_store = NULL;
+        lru_op    = NULL;
+        for (image_list = image_list_head; image_list; image_list = image_list->next)
+        {
+            if (image_list != keep && image_list->child && image_list->pixmap && image_list->last_use < lru)
+            {
+                lru       = image_list->last_use;
+                lru_image = image_list;
+                lru_op    = NULL;
+            }
+            /*
+             * Intermediate results only held by the history can be recomputed.
+             */
+            if (image_list->op)
+            {
+                for (op = image_list->op; op->prev; op = op->prev);
+                for (op = op->next; op; op = op->next)
+                    if (op->cache && op->cache->refs == 1 && op->cache->pixels && op->last_use < lru)
+                    {
+                        lru       = op->last_use;
+                        lru_op    = op;
+                        lru_image = NULL;
+                    }
+            }
+        }
+        for (store = store_list_head; store; store = store->next)
+            if (store->pixels && store->path && (!keep || keep->store != store) && store->last_use < lru)
+            {
+                lru       = store->last_use;
+                lru_store = store;
+            }
+        if (lru_store)
+        {
+            /*
+             * Only picked when older than any pixmap or result above.
+             */
+            total -= lru_store->size;
+            ccd_pixels_evict(lru_store);
+        }
+        else if (lru_op)
+        {
+            total -= lru_op->cache->size;
+            ccd_pixels_release(lru_op->cache);
+            lru_op->cache = NULL;
+        }
+        else if (lru_image)
+        {
+            gdk_window_get_size(lru_image->pixmap, &width, &height);
+            total -= width * height * 4;
+            gdk_pixmap_unref(lru_image->pixmap);
+            lru_image->pixmap = NULL;
+        }
+        else
+            break;
+    }
+}
+/*
+ * Processing history.  An image with a history is its source pixels plus a
+ * chain of operations.  Applying an operation only records it; the result is
+ * computed on the next pixel access, starting from the closest node that
+ * still has a cached result.  Undo and redo just move along the chain.
+ */
+static void ccd_history_free(struct ccd_image *image)
+{
+    struct ccd_op *op, *next;
+
+    for (op = image->op; op->prev; op = op->prev);
+    for (; op; op = next)
+    {
+        next = op->next;
+        if (op->cache)
+            ccd_pixels_release(op->cache);
+        free(op);
+    }
+    image->op = NULL;
+}
+static void ccd_op_result(struct ccd_op *op, struct ccd_image *image)
+{
+    op->cache        = image->store;
+    op->cache->refs++;
+    op->width        = image->width;
+    op->height       = image->height;
+    op->pixel_width  = image->pixel_width;
+    op->pixel_height = image->pixel_height;
+    op->last_use     = workspace_clock;
+}
+static void ccd_op_attach(struct ccd_op *op, struct ccd_image *image)
+{
+    image->store        = op->cache;
+    image->store->refs++;
+    image->pixels       = op->cache->pixels;
+    image->width        = op->width;
+    image->height       = op->height;
+    image->pixel_width  = op->pixel_width;
+    image->pixel_height = op->pixel_height;
+    image->pixmin       = 0;
+    image->pixmax       = 0;
+    op->last_use        = workspace_clock;
+}
+static int ccd_history_evaluate(struct ccd_image *image)
+{
+    struct ccd_image  work;
+    struct ccd_op    *start, *op;
+
+    for (start = image->op; !start->cache; start = start->prev);
+    if (start != image->op)
+    {
+        /*
+         * Run the operations on a scratch copy of the image, keeping every
+         * intermediate result.
+         */
+        memcpy(&work, image, sizeof(struct ccd_image));
+        memset(&work.scaler, 0, sizeof(struct scaler));
+        work.op    = NULL;
+        work.store = NULL;
+        ccd_op_attach(start, &work);
+        if (ccd_image_pixels(&work) < 0)
+        {
+            ccd_image_set_pixels(&work, NULL);
+            return (-1);
+        }
+        for (op = start->next; op != image->op->next; op = op->next)
+        {
+            op->apply(&work, op);
+            if (!work.store && !(work.store = ccd_pixels_new(&work, work.pixels)))
+            {
+                ccd_image_set_pixels(&work, NULL);
+                freeScaler(&work.scaler);
+                return (-1);
+            }
+            ccd_op_result(op, &work);
+        }
+        ccd_image_set_pixels(&work, NULL);
+        freeScaler(&work.scaler);
+    }
+    if (image->store)
+        ccd_pixels_release(image->store);
+    else if (image->pixels)
+        free(image->pixels);
+    ccd_op_attach(image->op, image);
+    return (0);
+}
+/*
+ * Record an operation on the image.  The pixels as they are when the first
+ * operation is applied become the source of the history.
+ */
+int ccd_image_apply(struct ccd_image *image, void (*apply)(struct ccd_image *image, struct ccd_op *op), unsigned long arg, char *name)
+{
+    struct ccd_op *op, *next;
+    int            i;
+
+    if (!image->op)
+    {
+        if ((!image->store && !image->pixels) || !(op = calloc(1, sizeof(struct ccd_op))))
+            return (-1);
+        if (!image->store && !(image->store = ccd_pixels_new(image, image->pixels)))
+        {
+            free(op);
+            return (-1);
+        }
+        op->slot  = -1;
+        ccd_op_result(op, image);
+        image->op = op;
+    }
+    if (!(op = calloc(1, sizeof(struct ccd_op))))
+        return (-1);
+    /*
+     * Anything undone is dropped.
+     */
+    while ((next = image->op->next))
+    {
+        image->op->next = next->next;
+        if (next->cache)
+            ccd_pixels_release(next->cache);
+        free(next);
+    }
+    op->apply       = apply;
+    op->arg         = arg;
+    op->prev        = image->op;
+    op->next        = NULL;
+    image->op->next = op;
+    image->op       = op;
+    strncat(op->name, name, HISTORY_STRING_LENGTH);
+    for (i = 0; i < MAX_PROCESS_HISTORY && image->history[i][0]; i++);
+    if ((op->slot = i < MAX_PROCESS_HISTORY ? i : -1) >= 0)
+        strcpy(image->history[i], op->name);
+    return (0);
+}
+int ccd_image_undo(struct ccd_image *image)
+{
+    if (!image->op || !image->op->prev)
+        return (-1);
+    if (image->op->slot >= 0)
+        image->history[image->op->slot][0] = '\0';
+    image->op = image->op->prev;
+    return (0);
+}
+int ccd_image_redo(struct ccd_image *image)
+{
+    if (!image->op || !image->op->next)
+        return (-1);
+    image->op = image->op->next;
+    if (image->op->slot >= 0)
+        strcpy(image->history[image->op->slot], image->op->name);
+    return (0);
+}
+/*
+ * Quick look at an image whose operations are still pending.  The closest
+ * cached result is area sampled down so its longest side is size pixels and
+ * the pending operations run on that.  Zoom returns the scale back up to the
+ * full result.  NULL if there is nothing pending or the image is small.
+ */
+struct ccd_image *ccd_image_preview(struct ccd_image *image, unsigned int size, float *zoom)
+{
+    struct ccd_image *preview;
+    struct ccd_op    *start, *op;
+    unsigned int      pixel_size, longest;
+
+    if (!image->op || (image->op->cache && image->store == image->op->cache))
+        return (NULL);
+    for (start = image->op; !start->cache; start = start->prev);
+    longest = start->width > start->height ? start->width : start->height;
+    if (start == image->op || longest <= size || ccd_pixels_map(start->cache) < 0)
+        return (NULL);
+    if (!(preview = malloc(sizeof(struct ccd_image))))
+        return (NULL);
+    memcpy(preview, image, sizeof(struct ccd_image));
+    memset(&preview->scaler, 0, sizeof(struct scaler));
+    pixel_size             = (image->depth + 7) / 8;
+    preview->op            = NULL;
+    preview->store         = NULL;
+    preview->pixmap        = NULL;
+    preview->width         = start->width  * size / longest;
+    preview->height        = start->height * size / longest;
+    preview->pixel_width   = start->pixel_width;
+    preview->pixel_height  = start->pixel_height;
+    preview->pixmin        = 0;
+    preview->pixmax        = 0;
+    if (!preview->width)
+        preview->width = 1;
+    if (!preview->height)
+        preview->height = 1;
+    if (!(preview->pixels = malloc(preview->width * preview->height * pixel_size))
+     || scalePixels(&preview->scaler, SCALE_AREA, start->cache->pixels, start->width, start->height, start->width * pixel_size,
+                    preview->pixels, preview->width, preview->height, preview->width * pixel_size, pixel_size, 1))
+    {
+        ccd_image_preview_delete(preview);
+        return (NULL);
+    }
+    for (op = start->next; op != image->op->next; op = op->next)
+        op->apply(preview, op);
+    *zoom = (float)longest / size;
+    return (preview);
+}
+void ccd_image_preview_delete(struct ccd_image *preview)
+{
+    ccd_image_set_pixels(preview, NULL);
+    freeScaler(&preview->scaler);
+    free(preview);
+}
 /*
  * Constructors and destructors.
  */
@@ -130,15 +619,32 @@ struct ccd_image *ccd_image_new_from_file(char *path)
 struct ccd_image *ccd_image_dup(struct ccd_image *image_orig)
 {
     struct ccd_image *image = (struct ccd_image *)malloc(sizeof(struct ccd_image));
+    /*
+     * The duplicate starts out with the current result and no history.
+     */
+    if (image_orig->op)
+        ccd_image_pixels(image_orig);
     memcpy(image, image_orig, sizeof(struct ccd_image));
+    memset(&image->scaler, 0, sizeof(struct scaler));
+    image->op          = NULL;
+    image->update_idle = 0;
+    /*
+     * Share the pixels until either image writes to them.
+     */
+    if (!image_orig->store && image_orig->pixels)
+        image_orig->store = ccd_pixels_new(image_orig, image_orig->pixels);
+    if ((image->store = image_orig->store))
+        image->store->refs++;
+    else
+        image->pixels = NULL;
     ccd_image_append_list(image);
     return (image);
 }
 void ccd_image_delete(struct ccd_image *image)
 {
     ccd_image_remove_list(image);
-    if (image->pixels)
-        free(image->pixels);
+    ccd_image_set_pixels(image, NULL);
+    freeScaler(&image->scaler);
     free(image);
 }
 /*
@@ -184,7 +690,7 @@ void ccd_image_histogram(struct ccd_image *image)
     /*
      * Find min/ave/max values.
      */
-    if (image->pixmax == 0)
+    if (image->pixmax == 0 && ccd_image_pixels(image) == 0)
     {
         image->pixmin = ~0;
         pixel_sum     = 0;
@@ -282,7 +788,10 @@ int ccd_image_save_fits(struct ccd_image *image)
     char           filename[PATH_MAX];
     char           record[FITS_CARD_COUNT][FITS_CARD_SIZE];
     unsigned char *fits_pixels;
+    unsigned int   sign_bit;
+    off_t          offset;
     int            i, j, k, image_size, image_pitch, pixel_size, fd;
+    struct ccd_pixels *store;
 
     /*
      * Create file.
@@ -296,6 +805,19 @@ int ccd_image_save_fits(struct ccd_image *image)
         strcat(filename, ".");
         strcat(filename, image->ext);
     }
+    if (ccd_image_pixels(image) < 0)
+        return (-1);
+    /*
+     * Pull in any pixels still paged from the file about to be overwritten.
+     */
+    for (store = store_list_head; store; store = store->next)
+        if (store->path && !strcmp(store->path, filename))
+        {
+            if (ccd_pixels_map(store) < 0)
+                return (-1);
+            free(store->path);
+            store->path = NULL;
+        }
     fd = creat(filename, 0666);
     /*
      * Fill header records.
@@ -319,6 +841,8 @@ int ccd_image_save_fits(struct ccd_image *image)
     }
     sprintf(record[i++], "DATAMIN = %20u", image->datamin);
     sprintf(record[i++], "DATAMAX = %20u", image->datamax);
+    if (image->pedestal != 0.0)
+        sprintf(record[i++], "PEDESTAL= %20f", image->pedestal);
     if (image->color != CCD_COLOR_MONOCHROME)
         sprintf(record[i++], "CFORMAT = %20d",    image->color);
     if (image->filter != CCD_COLOR_MONOCHROME)
@@ -370,6 +894,7 @@ int ccd_image_save_fits(struct ccd_image *image)
         if (((char *)record)[k] == '\0')
             ((char *)record)[k] = ' ';
     write(fd, record, FITS_RECORD_SIZE);
+    offset = lseek(fd, 0, SEEK_CUR);
     /*
      * Convert and write image data.
      */
@@ -377,9 +902,17 @@ int ccd_image_save_fits(struct ccd_image *image)
     image_pitch = image->width  * pixel_size;
     image_size  = image->height * image_pitch;
     fits_pixels = malloc(image_pitch);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    /*
+     * The sign bit is flipped after the byte swap, so it is in the low byte.
+     */
+    sign_bit    = 0x80;
+#else
+    sign_bit    = 1 << (pixel_size*8-1);
+#endif
     for (i = 0; i < image->height; i++)
     {
-        convert_pixels(image->pixels + image_size - (i+1) * image_pitch, fits_pixels, 1 << (pixel_size*8-1), pixel_size, image->width);
+        convert_pixels(image->pixels + image_size - (i+1) * image_pitch, fits_pixels, sign_bit, pixel_size, image->width);
         write(fd, fits_pixels, image_pitch);
     }
     free(fits_pixels);
@@ -390,6 +923,11 @@ int ccd_image_save_fits(struct ccd_image *image)
     if (image_size % FITS_RECORD_SIZE)
         write(fd, record, FITS_RECORD_SIZE - (image_size % FITS_RECORD_SIZE));
     close(fd);
+    /*
+     * Shared pixels can now be paged from the saved file.
+     */
+    if (image->store && !image->store->path)
+        ccd_pixels_back(image->store, filename, offset, 1 << (pixel_size*8-1));
     return (0);
 }
 /*
@@ -400,8 +938,8 @@ int ccd_image_load_fits(struct ccd_image *image)
     char           filename[PATH_MAX];
     char           record[FITS_CARD_COUNT+1][FITS_CARD_SIZE];
     char           key[10];
-    unsigned char *fits_pixels;
-    int            i, j, k, l, image_size, image_pitch, pixel_size, fd, done;
+    off_t          offset;
+    int            i, j, k, l, pixel_size, fd, done;
 
     /*
      * Clear out all image fields.
@@ -460,6 +998,8 @@ int ccd_image_load_fits(struct ccd_image *image)
                 sscanf(&record[i++][10], "%f", &image->zero);
             else if (!strcmp(key, "BSCALE"))
                 sscanf(&record[i++][10], "%f", &image->scale);
+            else if (!strcmp(key, "PEDESTAL"))
+                sscanf(&record[i++][10], "%f", &image->pedestal);
             else if (!strcmp(key, "NAXIS1"))
                 sscanf(&record[i++][10], "%d", &image->width);
             else if (!strcmp(key, "NAXIS2"))
@@ -525,21 +1065,21 @@ int ccd_image_load_fits(struct ccd_image *image)
 
         } while (!done);
         /*
-         * Read and convert image data.
+         * Leave the image data in the file, it is paged in on first use.
+         * The histogram waits until then too.
          */
-        pixel_size    = ((image->depth + 7) / 8);
-        image_pitch   = image->width  * pixel_size;
-        image_size    = image->height * image_pitch;
-        image->pixels = malloc(image_size);
-        fits_pixels   = malloc(image_pitch);
-        for (i = 0; i < image->height; i++)
+        pixel_size = ((image->depth + 7) / 8);
+        offset     = lseek(fd, 0, SEEK_CUR);
+        close(fd);
+        if (!(image->store = ccd_pixels_new(image, NULL)))
+            return (-1);
+        if (ccd_pixels_back(image->store, filename, offset, image->zero == 0.0 ? 0 : 1 << (pixel_size*8-1)) < 0)
         {
-            read(fd, fits_pixels, image_pitch);
-            convert_pixels(fits_pixels, image->pixels + image_size - (i+1) * image_pitch, image->zero == 0.0 ? 0 : 1 << (pixel_size*8-1), pixel_size, image->width);
+            ccd_image_set_pixels(image, NULL);
+            return (-1);
         }
-        free(fits_pixels);
-        close(fd);
-        ccd_image_histogram(image);
+        if (image->datamax == 0)
+            image->datamax = ~0UL >> (32 - image->depth);
     }
     else
         return (-1);
@@ -601,6 +1141,9 @@ void ccd_image_invert(struct ccd_image *image)
 {
     unsigned int x, y;
 
+    if (ccd_image_modify(image) < 0)
+        return;
+
 #define PIXEL_LOOP(pixel_type)                                                                                          \
     for (y = 0; y < image->height; y++)                                                                                 \
         for (x = 0; x < image->width; x++)                                                                              \
@@ -617,213 +1160,598 @@ void ccd_image_invert(struct ccd_image *image)
  */
 void ccd_image_flip_vert(struct ccd_image *image)
 {
-    unsigned int   pixel_size, image_pitch, x, y;
-    unsigned long  tmp;
-    unsigned char *top, *bottom;
-
-    pixel_size  = ((image->depth + 7) / 8);
-    image_pitch = image->width  * pixel_size;
-    top         = image->pixels;
-    bottom      = top + (image->height - 1) * image_pitch;
-
-#define PIXEL_LOOP(pixel_type)                                      \
-    for (y = 0; y < image->height / 2; y++)                         \
-    {                                                               \
-        for (x = 0; x < image->width; x++)                          \
-        {                                                           \
-            tmp                       = ((pixel_type *)top)[x];     \
-            ((pixel_type *)top)[x]    = ((pixel_type *)bottom)[x];  \
-            ((pixel_type *)bottom)[x] = tmp;                        \
-        }                                                           \
-        top    += image_pitch;                                      \
-        bottom -= image_pitch;                                      \
-    }
-
-    PIXEL_SIZE_CASE(pixel_size);
-#undef PIXEL_LOOP
-
+    if (ccd_image_modify(image) < 0)
+        return;
+    flipPixels(image->width, image->height, (image->depth + 7) / 8, image->pixels, image->width, FALSE, TRUE);
 }
 /*
  * Reverse scanline pixel order.
  */
 void ccd_image_flip_horiz(struct ccd_image *image)
 {
-    unsigned int   pixel_size, image_pitch, x, y;
-    unsigned long  tmp;
-    unsigned char *scanline;
-
-    pixel_size  = ((image->depth + 7) / 8);
-    image_pitch = image->width  * pixel_size;
-    scanline    = image->pixels;
+    if (ccd_image_modify(image) < 0)
+        return;
+    flipPixels(image->width, image->height, (image->depth + 7) / 8, image->pixels, image->width, TRUE, FALSE);
+}
+/*
+ * Rotate image in   one of 90 degree directions. Square images and half turns
+ * rotate in place, otherwise the cache blocked rotation copies to a new buffer.
+ */
+void ccd_image_rotate(struct ccd_image *image, int angle)
+{
+    unsigned int   pixel_size = (image->depth + 7) / 8, tmp;
+    unsigned char *rot_pixels;
 
-#define PIXEL_LOOP(pixel_type)                                                                              \
-    for (y = 0; y < image->height; y++)                                                                     \
-    {                                                                                                       \
-        for (x = 0; x < image->width / 2; x++)                                                              \
-        {                                                                                                   \
-            tmp                                            = ((pixel_type *)scanline)[x];                   \
-            ((pixel_type *)scanline)[x]                    = ((pixel_type *)scanline)[image->width - x - 1];\
-            ((pixel_type *)scanline)[image->width - x - 1] = tmp;                                           \
-        }                                                                                                   \
-        scanline += image_pitch;                                                                            \
+    if (image->width == image->height || angle % 180 == 0)
+    {
+        if (ccd_image_modify(image) == 0)
+            rotatePixelsInPlace(image->width, image->height, pixel_size, image->pixels, angle);
+        return;
     }
+    if (ccd_image_pixels(image) < 0 || (rot_pixels = malloc(image->width * image->height * pixel_size)) == NULL)
+        return;
+    rotatePixels(image->width, image->height, pixel_size, image->pixels, image->width, rot_pixels, image->height, angle);
+    ccd_image_set_pixels(image, rot_pixels);
+    tmp           = image->width;
+    image->width  = image->height;
+    image->height = tmp;
+}
+/*
+ * Scale image.
+ */
+void ccd_image_scale(struct ccd_image *image, unsigned int scale_width, unsigned int scale_height)
+{
+    unsigned int   pixel_size = (image->depth + 7) / 8;
+    unsigned char *scale_pixels;
+    struct scaler  scaler;
 
-    PIXEL_SIZE_CASE(pixel_size);
-#undef PIXEL_LOOP
-
+    if (ccd_image_pixels(image) < 0 || (scale_pixels = malloc(scale_width * scale_height * pixel_size)) == NULL)
+        return;
+    memset(&scaler, 0, sizeof(struct scaler));
+    if (scalePixels(&scaler, SCALE_BILINEAR, image->pixels, image->width, image->height, image->width * pixel_size,
+                    scale_pixels, scale_width, scale_height, scale_width * pixel_size, pixel_size, 1) == 0)
+    {
+        ccd_image_set_pixels(image, scale_pixels);
+        image->width  = scale_width;
+        image->height = scale_height;
+    }
+    else
+        free(scale_pixels);
+    freeScaler(&scaler);
 }
 /*
- * Rotate image in   one of 90 degree directions.
+ * Scale an RGB pixbuf for display. The scaler keeps the weights for the
+ * next redraw at the same size.
  */
-void ccd_image_rotate(struct ccd_image *image, int angle)
+GdkPixbuf *ccd_pixbuf_scale(GdkPixbuf *pixbuf, int width, int height, struct scaler *scaler)
 {
-    int            x, y;
-    unsigned char *rot_pixels = malloc(image->width * image->height * ((image->depth + 7) / 8));
-    switch (angle)
+    GdkPixbuf *scale_pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+
+    if (scale_pixbuf && scalePixels(scaler, SCALE_BILINEAR,
+                                    gdk_pixbuf_get_pixels(pixbuf), gdk_pixbuf_get_width(pixbuf), gdk_pixbuf_get_height(pixbuf), gdk_pixbuf_get_rowstride(pixbuf),
+                                    gdk_pixbuf_get_pixels(scale_pixbuf), width, height, gdk_pixbuf_get_rowstride(scale_pixbuf), 1, 3))
     {
-        case 270:
-        case -90:
-#define PIXEL_LOOP(pixel_type)                                                                                                                                              \
-            for (y = 0; y < image->height; y++)                                                                                                                         \
-                for (x = 0; x < image->width; x++)                                                                                                                      \
-                    ((pixel_type *)rot_pixels)[x * image->height + (image->height - 1 - y)] = ((pixel_type *)image->pixels)[y * image->width + x];  \
+        gdk_pixbuf_unref(scale_pixbuf);
+        scale_pixbuf = gdk_pixbuf_scale_simple(pixbuf, width, height, GDK_INTERP_BILINEAR);
+    }
+    return (scale_pixbuf);
+}
+/*
+ * Row-parallel helpers.
+ * Work is split into bands of rows claimed by worker threads in turn; the
+ * calling thread takes bands as well.
+ */
+#define MAX_WORKER_THREADS      16
+#define WORKER_BAND_ROWS        16
+struct row_job
+{
+    void          (*rows)(void *ctx, unsigned int first, unsigned int count);
+    void           *ctx;
+    unsigned int    count;
+    unsigned int    next;
+    pthread_mutex_t lock;
+};
+static unsigned int worker_count(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-            PIXEL_SIZE_CASE((image->depth + 7) / 8);
-#undef PIXEL_LOOP
-            free(image->pixels);
-            image->pixels = rot_pixels;
-            x             = image->width;
-            image->width  = image->height;
-            image->height = x;
-            break;
-        case 180:
-        case -180:
-#define PIXEL_LOOP(pixel_type)                                                                                                                                              \
-            for (y = 0; y < image->height; y++)                                                                                                                         \
-                for (x = 0; x < image->width; x++)                                                                                                                      \
-                    ((pixel_type *)rot_pixels)[(image->height - 1 - y) * image->width + (image->width - 1 - x)] = ((pixel_type *)image->pixels)[y * image->width + x];  \
-
-            PIXEL_SIZE_CASE((image->depth + 7) / 8);
-#undef PIXEL_LOOP
-            free(image->pixels);
-            image->pixels = rot_pixels;
-            break;
-        case 90:
-        case -270:
-#define PIXEL_LOOP(pixel_type)                                                                                                                          \
-            for (y = 0; y < image->height; y++)                                                                                                     \
-                for (x = 0; x < image->width; x++)                                                                                                  \
-                    ((pixel_type *)rot_pixels)[(image->width - 1 - x) * image->height + y] = ((pixel_type *)image->pixels)[y * image->width + x];   \
-
-            PIXEL_SIZE_CASE((image->depth + 7) / 8);
-#undef PIXEL_LOOP
-            free(image->pixels);
-            image->pixels = rot_pixels;
-            x             = image->width;
-            image->width  = image->height;
-            image->height = x;
-            break;
-        case 0:
-        default:
-            free(rot_pixels);
+    return (min(max(cpus, 1), MAX_WORKER_THREADS));
+}
+static void *row_worker(void *arg)
+{
+    struct row_job *job = arg;
+    unsigned int    first;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&job->lock);
+        first      = job->next;
+        job->next += WORKER_BAND_ROWS;
+        pthread_mutex_unlock(&job->lock);
+        if (first >= job->count)
             break;
+        job->rows(job->ctx, first, min(WORKER_BAND_ROWS, job->count - first));
     }
+    return (NULL);
+}
+static void parallel_rows(unsigned int count, void (*rows)(void *ctx, unsigned int first, unsigned int count), void *ctx)
+{
+    struct row_job job;
+    pthread_t      threads[MAX_WORKER_THREADS];
+    unsigned int   i, thread_count;
+
+    job.rows  = rows;
+    job.ctx   = ctx;
+    job.count = count;
+    job.next  = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    thread_count = min(worker_count(), (count + WORKER_BAND_ROWS - 1) / WORKER_BAND_ROWS);
+    for (i = 1; i < thread_count; i++)
+        if (pthread_create(&threads[i], NULL, row_worker, &job))
+            break;
+    thread_count = i;
+    row_worker(&job);
+    for (i = 1; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
 }
 /*
- * Scale image.
+ * Convolution engine.
+ * The frame is converted to a float plane once. Separable kernels run as a
+ * horizontal and a vertical 1D pass, large kernels are multiplied in the
+ * frequency domain with the kernel's transform cached between calls (so
+ * deconvolution iterations only pay for the image transforms), and anything
+ * else is a direct sum over a zero padded plane with no per-tap bounds test.
+ * Taps falling outside the frame contribute zero in every case.
  */
-void ccd_image_scale(struct ccd_image *image, unsigned int scale_width, unsigned int scale_height)
+#define CONV_FFT_COST           4
+#define CONV_SEPARABLE_EPSILON  1.0e-6
+struct conv_job
 {
-    float             scale_x, scale_y, x, y, x_frac, y_frac;
-    unsigned int      x_int, y_int, x_scale, y_scale;
-    unsigned char    *scale_pixels;
+    float        *src;
+    float        *dst;
+    float        *kernel;
+    float        *row_kernel;
+    float        *col_kernel;
+    int           width;
+    int           height;
+    int           src_pitch;
+    int           xradius;
+    int           yradius;
+    float        *fft_data;
+    float        *fft_filter;
+    float        *twiddle;
+    unsigned int  fft_width;
+    unsigned int  fft_height;
+    int           inverse;
+};
+static float *load_plane(struct ccd_image *image, unsigned char *pixels, int xpad, int ypad)
+{
+    int    x, y, pitch;
+    float *plane;
 
-    scale_pixels = malloc(scale_width * scale_height * ((image->depth + 7) / 8));
-    scale_x      = (float)image->width  / (float)scale_width;
-    scale_y      = (float)image->height / (float)scale_height;
-    /*
-     * LERP the scaled pixel from the original.
-     */
+    pitch = image->width + xpad * 2;
+    if (!(plane = calloc(pitch * (image->height + ypad * 2), sizeof(float))))
+        return (NULL);
 
-#define PIXEL_LOOP(pixel_type)                                                                                                                                                                  \
-    for (y_scale = 0; y_scale < scale_height; y_scale++)                                                                                                                                    \
-    {                                                                                                                                                                                       \
-        y      = y_scale * scale_y;                                                                                                                                                         \
-        y_frac = y - floor(y);                                                                                                                                                              \
-        y_int  = (unsigned int)y;                                                                                                                                                           \
-        for (x_scale = 0; x_scale < scale_width; x_scale++)                                                                                                                                 \
-        {                                                                                                                                                                                   \
-            x      = x_scale * scale_x;                                                                                                                                                     \
-            x_frac = x - floor(x);                                                                                                                                                          \
-            x_int  = (unsigned int)x;                                                                                                                                                       \
-            if ((y_int < image->height - 1) && (x_int < image->width - 1))                                                                                                                  \
-                ((pixel_type *)scale_pixels)[y_scale * scale_width + x_scale] = ((1.0 - x_frac) * (1.0 - y_frac)) * ((pixel_type *)image->pixels)[y_int * image->width       + x_int]       \
-                                                                              + (       x_frac  * (1.0 - y_frac)) * ((pixel_type *)image->pixels)[y_int * image->width       + x_int + 1]   \
-                                                                              + ((1.0 - x_frac) *        y_frac)  * ((pixel_type *)image->pixels)[(y_int + 1) * image->width + x_int]       \
-                                                                              + (       x_frac  *        y_frac)  * ((pixel_type *)image->pixels)[(y_int + 1) * image->width + x_int + 1];  \
-            else if ((y_int == image->height - 1) && (x_int == image->width - 1))                                                                                                           \
-                ((pixel_type *)scale_pixels)[y_scale * scale_width + x_scale] = ((pixel_type *)image->pixels)[y_int * image->width + x_int];                                                \
-            else if (y_int == image->height - 1)                                                                                                                                            \
-                ((pixel_type *)scale_pixels)[y_scale * scale_width + x_scale] = (1.0 - x_frac) * ((pixel_type *)image->pixels)[y_int * image->width + x_int]                                \
-                                                                              + (      x_frac) * ((pixel_type *)image->pixels)[y_int * image->width + x_int + 1];                           \
-            else /*if (x_int == image->width - 1) */                                                                                                                                        \
-                ((pixel_type *)scale_pixels)[y_scale * scale_width + x_scale] = (1.0 - y_frac) * ((pixel_type *)image->pixels)[y_int * image->width       + x_int]                          \
-                                                                              + (      y_frac) * ((pixel_type *)image->pixels)[(y_int + 1) * image->width + x_int];                         \
-        }                                                                                                                                                                                   \
-    }
+#define PIXEL_LOOP(pixel_type)                                                                      \
+    for (y = 0; y < image->height; y++)                                                             \
+        for (x = 0; x < image->width; x++)                                                          \
+            plane[(y + ypad) * pitch + x + xpad] = ((pixel_type *)pixels)[y * image->width + x];
 
     PIXEL_SIZE_CASE((image->depth + 7) / 8);
 #undef PIXEL_LOOP
 
-    free(image->pixels);
-    image->pixels = scale_pixels;
-    image->width  = scale_width;
-    image->height = scale_height;
+    return (plane);
 }
 /*
- * Convolve image with kernel and return resultant frame.
+ * Split a kernel into a column and a row vector when it is their outer product.
  */
-unsigned char *ccd_image_convolve(struct ccd_image *image, unsigned char *conv_frame, unsigned xradius, unsigned yradius, float *kernel)
+static int separate_kernel(float *kernel, int kwidth, int kheight, float *col_kernel, float *row_kernel)
 {
-    unsigned int pixel_size, image_pitch, image_size;
-    int          x, y, i, j, kwidth, kheight, kx, ky;
-    float        ksum, pixel;
+    int   i, j, pi, pj;
+    float peak;
 
-    pixel_size    = ((image->depth + 7) / 8);
-    image_pitch   = image->width  * pixel_size;
-    image_size    = image->height * image_pitch;
-    if (conv_frame == NULL)
-        conv_frame = malloc(image_size);
-    kwidth        = xradius * 2 + 1;
-    kheight       = yradius * 2 + 1;
-    ksum          = 0.0;
+    pi = pj = 0;
+    for (j = 0; j < kheight; j++)
+        for (i = 0; i < kwidth; i++)
+            if (fabs(kernel[j * kwidth + i]) > fabs(kernel[pj * kwidth + pi]))
+            {
+                pi = i;
+                pj = j;
+            }
+    peak = kernel[pj * kwidth + pi];
+    if (peak == 0.0)
+        return (0);
+    for (j = 0; j < kheight; j++)
+        col_kernel[j] = kernel[j * kwidth + pi];
+    for (i = 0; i < kwidth; i++)
+        row_kernel[i] = kernel[pj * kwidth + i] / peak;
+    for (j = 0; j < kheight; j++)
+        for (i = 0; i < kwidth; i++)
+            if (fabs(kernel[j * kwidth + i] - col_kernel[j] * row_kernel[i]) > CONV_SEPARABLE_EPSILON * fabs(peak))
+                return (0);
+    return (1);
+}
+static void conv_rows_horiz(void *ctx, unsigned int first, unsigned int count)
+{
+    struct conv_job *job = ctx;
+    int              x, y, i, i_first, i_last;
+    float           *src, pixel;
+
+    for (y = first; y < first + count; y++)
+    {
+        src = job->src + y * job->width - job->xradius;
+        for (x = 0; x < job->width; x++)
+        {
+            i_first = max(0, job->xradius - x);
+            i_last  = min(job->xradius * 2, job->width - 1 - x + job->xradius);
+            pixel   = 0.0;
+            for (i = i_first; i <= i_last; i++)
+                pixel += src[x + i] * job->row_kernel[i];
+            job->dst[y * job->width + x] = pixel;
+        }
+    }
+}
+static void conv_rows_vert(void *ctx, unsigned int first, unsigned int count)
+{
+    struct conv_job *job = ctx;
+    int              x, y, j, j_first, j_last;
+    float           *dst, *src, k;
+
+    for (y = first; y < first + count; y++)
+    {
+        dst     = job->dst + y * job->width;
+        j_first = max(0, job->yradius - y);
+        j_last  = min(job->yradius * 2, job->height - 1 - y + job->yradius);
+        for (x = 0; x < job->width; x++)
+            dst[x] = 0.0;
+        for (j = j_first; j <= j_last; j++)
+        {
+            src = job->src + (y + j - job->yradius) * job->width;
+            k   = job->col_kernel[j];
+            for (x = 0; x < job->width; x++)
+                dst[x] += src[x] * k;
+        }
+    }
+}
+static void conv_rows_direct(void *ctx, unsigned int first, unsigned int count)
+{
+    struct conv_job *job = ctx;
+    int              x, y, i, j, kwidth;
+    float           *src, *kernel, pixel;
+
+    kwidth = job->xradius * 2 + 1;
+    for (y = first; y < first + count; y++)
+        for (x = 0; x < job->width; x++)
+        {
+            pixel = 0.0;
+            for (j = 0; j <= job->yradius * 2; j++)
+            {
+                src    = job->src + (y + j) * job->src_pitch + x;
+                kernel = job->kernel + j * kwidth;
+                for (i = 0; i < kwidth; i++)
+                    pixel += src[i] * kernel[i];
+            }
+            job->dst[y * job->width + x] = pixel;
+        }
+}
+/*
+ * In place radix-2 FFT of n interleaved complex values, n a power of two.
+ * The twiddle table holds cos/sin of -2*pi*k/n for k < n/2.
+ */
+static void fft(float *data, unsigned int n, float *twiddle, int inverse)
+{
+    unsigned int i, j, k, a, b, bit, len, half, step;
+    float        tr, ti, wr, wi;
+
+    for (i = 1, j = 0; i < n; i++)
+    {
+        for (bit = n >> 1; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            tr = data[i * 2];     data[i * 2]     = data[j * 2];     data[j * 2]     = tr;
+            ti = data[i * 2 + 1]; data[i * 2 + 1] = data[j * 2 + 1]; data[j * 2 + 1] = ti;
+        }
+    }
+    for (len = 2; len <= n; len <<= 1)
+    {
+        half = len >> 1;
+        step = n / len;
+        for (i = 0; i < n; i += len)
+            for (k = 0; k < half; k++)
+            {
+                wr = twiddle[k * step * 2];
+                wi = inverse ? -twiddle[k * step * 2 + 1] : twiddle[k * step * 2 + 1];
+                a  = i + k;
+                b  = a + half;
+                tr = data[b * 2] * wr - data[b * 2 + 1] * wi;
+                ti = data[b * 2] * wi + data[b * 2 + 1] * wr;
+                data[b * 2]      = data[a * 2]     - tr;
+                data[b * 2 + 1]  = data[a * 2 + 1] - ti;
+                data[a * 2]     += tr;
+                data[a * 2 + 1] += ti;
+            }
+    }
+}
+static float *fft_twiddle(unsigned int n)
+{
+    unsigned int k;
+    float       *twiddle;
+
+    if ((twiddle = malloc(sizeof(float) * n)))
+        for (k = 0; k < n / 2; k++)
+        {
+            twiddle[k * 2]     = cos(-2.0 * M_PI * k / n);
+            twiddle[k * 2 + 1] = sin(-2.0 * M_PI * k / n);
+        }
+    return (twiddle);
+}
+static void fft_rows(void *ctx, unsigned int first, unsigned int count)
+{
+    struct conv_job *job = ctx;
+    unsigned int     y;
+
+    for (y = first; y < first + count; y++)
+        fft(job->fft_data + y * job->fft_width * 2, job->fft_width, job->twiddle, job->inverse);
+}
+/*
+ * Column transforms work on a gathered copy of each column. When filtering,
+ * the forward column pass also multiplies by the cached kernel transform.
+ */
+static void fft_cols(void *ctx, unsigned int first, unsigned int count)
+{
+    struct conv_job *job = ctx;
+    unsigned int     x, y, n;
+    float           *col, *data, re;
+
+    if (!(col = malloc(sizeof(float) * job->fft_height * 2)))
+        return;
+    n = job->fft_width * 2;
+    for (x = first; x < first + count; x++)
+    {
+        data = job->fft_data + x * 2;
+        for (y = 0; y < job->fft_height; y++)
+        {
+            col[y * 2]     = data[y * n];
+            col[y * 2 + 1] = data[y * n + 1];
+        }
+        fft(col, job->fft_height, job->twiddle, job->inverse);
+        if (job->fft_filter)
+            for (y = 0; y < job->fft_height; y++)
+            {
+                float *h = job->fft_filter + (y * job->fft_width + x) * 2;
+                re             = col[y * 2] * h[0] - col[y * 2 + 1] * h[1];
+                col[y * 2 + 1] = col[y * 2] * h[1] + col[y * 2 + 1] * h[0];
+                col[y * 2]     = re;
+            }
+        for (y = 0; y < job->fft_height; y++)
+        {
+            data[y * n]     = col[y * 2];
+            data[y * n + 1] = col[y * 2 + 1];
+        }
+    }
+    free(col);
+}
+static void fft_2d(struct conv_job *job, float *data, float *filter, int inverse)
+{
+    float *row_twiddle, *col_twiddle;
+
+    row_twiddle     = fft_twiddle(job->fft_width);
+    col_twiddle     = fft_twiddle(job->fft_height);
+    job->fft_data   = data;
+    job->inverse    = inverse;
+    job->fft_filter = NULL;
+    job->twiddle    = row_twiddle;
+    if (inverse)
+    {
+        /*
+         * Columns first on the way back, undoing the forward order.
+         */
+        job->twiddle = col_twiddle;
+        parallel_rows(job->fft_width, fft_cols, job);
+        job->twiddle = row_twiddle;
+        parallel_rows(job->fft_height, fft_rows, job);
+    }
+    else
+    {
+        parallel_rows(job->fft_height, fft_rows, job);
+        job->twiddle    = col_twiddle;
+        job->fft_filter = filter;
+        parallel_rows(job->fft_width, fft_cols, job);
+    }
+    job->fft_filter = NULL;
+    free(row_twiddle);
+    free(col_twiddle);
+}
+/*
+ * Most recent kernel transform, reused while the kernel and frame size match.
+ */
+static struct
+{
+    int           kwidth;
+    int           kheight;
+    unsigned int  fft_width;
+    unsigned int  fft_height;
+    float        *kernel;
+    float        *transform;
+} psf_cache;
+static float *psf_transform(struct conv_job *job, float *kernel)
+{
+    int    i, j, kwidth, kheight;
+    float *psf;
+
+    kwidth  = job->xradius * 2 + 1;
+    kheight = job->yradius * 2 + 1;
+    if (psf_cache.transform
+     && psf_cache.kwidth == kwidth && psf_cache.kheight == kheight
+     && psf_cache.fft_width == job->fft_width && psf_cache.fft_height == job->fft_height
+     && !memcmp(psf_cache.kernel, kernel, sizeof(float) * kwidth * kheight))
+        return (psf_cache.transform);
+    free(psf_cache.transform);
+    free(psf_cache.kernel);
+    psf_cache.transform = NULL;
+    psf_cache.kernel    = malloc(sizeof(float) * kwidth * kheight);
+    if (!psf_cache.kernel || !(psf = calloc(job->fft_width * job->fft_height * 2, sizeof(float))))
+        return (NULL);
+    memcpy(psf_cache.kernel, kernel, sizeof(float) * kwidth * kheight);
+    /*
+     * The kernel is applied as a correlation, so place it mirrored about the origin.
+     */
     for (j = 0; j < kheight; j++)
         for (i = 0; i < kwidth; i++)
-            ksum += kernel[j * kwidth + i];
+            psf[(((job->yradius - j) & (job->fft_height - 1)) * job->fft_width + ((job->xradius - i) & (job->fft_width - 1))) * 2] = kernel[j * kwidth + i];
+    fft_2d(job, psf, NULL, 0);
+    psf_cache.kwidth     = kwidth;
+    psf_cache.kheight    = kheight;
+    psf_cache.fft_width  = job->fft_width;
+    psf_cache.fft_height = job->fft_height;
+    psf_cache.transform  = psf;
+    return (psf);
+}
+static int conv_fft(struct conv_job *job, float *kernel)
+{
+    unsigned int x, y;
+    float       *data, *filter, scale;
+
+    for (job->fft_width = 1; job->fft_width < job->width + job->xradius * 2; job->fft_width <<= 1);
+    for (job->fft_height = 1; job->fft_height < job->height + job->yradius * 2; job->fft_height <<= 1);
+    if (!(filter = psf_transform(job, kernel)))
+        return (-1);
+    if (!(data = calloc(job->fft_width * job->fft_height * 2, sizeof(float))))
+        return (-1);
+    for (y = 0; y < job->height; y++)
+        for (x = 0; x < job->width; x++)
+            data[(y * job->fft_width + x) * 2] = job->src[y * job->width + x];
+    fft_2d(job, data, filter, 0);
+    fft_2d(job, data, NULL, 1);
+    scale = 1.0 / (job->fft_width * job->fft_height);
+    for (y = 0; y < job->height; y++)
+        for (x = 0; x < job->width; x++)
+            job->dst[y * job->width + x] = data[(y * job->fft_width + x) * 2] * scale;
+    free(data);
+    return (0);
+}
+/*
+ * Direct convolution costs a multiply per tap per pixel. The transforms cost
+ * roughly CONV_FFT_COST times n*log2(n) for the padded size n, paid twice.
+ */
+static int conv_use_fft(unsigned int width, unsigned int height, int kwidth, int kheight)
+{
+    unsigned int fft_width, fft_height;
+    double       fft_size;
+
+    for (fft_width = 1; fft_width < width + kwidth - 1; fft_width <<= 1);
+    for (fft_height = 1; fft_height < height + kheight - 1; fft_height <<= 1);
+    fft_size = (double)fft_width * fft_height;
+    return ((double)kwidth * kheight * width * height > CONV_FFT_COST * 2.0 * fft_size * log2(fft_size));
+}
+/*
+ * Convolve pixels with the kernel, normalized by the kernel sum, into a new
+ * float plane.
+ */
+static float *conv_plane(struct ccd_image *image, unsigned char *pixels, unsigned xradius, unsigned yradius, float *kernel)
+{
+    struct conv_job job;
+    int             i, kwidth, kheight, err;
+    float          *conv, *tmp, ksum;
+
+    kwidth  = xradius * 2 + 1;
+    kheight = yradius * 2 + 1;
+    ksum    = 0.0;
+    for (i = 0; i < kwidth * kheight; i++)
+        ksum += kernel[i];
     if (fabs(ksum) < 1.0e-9)
         ksum = (ksum < 0.0) ? -1.0e-9 : 1.0e-9;
     ksum = 1.0 / ksum;
-
-#define PIXEL_LOOP(pixel_type)                                                                                                                  \
-    for (y = 0; y < image->height; y++)                                                                                                         \
-        for (x = 0; x < image->width; x++)                                                                                                      \
-        {                                                                                                                                       \
-            pixel = 0.0;                                                                                                                        \
-            for (j = 0; j < kheight; j++)                                                                                                       \
-                for (i = 0; i < kwidth; i++)                                                                                                    \
-                {                                                                                                                               \
-                    ky = y + j - yradius;                                                                                                       \
-                    kx = x + i - xradius;                                                                                                       \
-                    if (ky > 0 && ky < image->height && kx > 0 && kx < image->width)                                                            \
-                        pixel += ((pixel_type *)image->pixels)[ky * image->width + kx] * kernel[j * kwidth + i];                                \
-                }                                                                                                                               \
-            pixel *= ksum;                                                                                                                      \
-            ((pixel_type *)conv_frame)[y * image->width + x] = min(max(0, pixel), image->datamax);                                              \
+    memset(&job, 0, sizeof(job));
+    job.width      = image->width;
+    job.height     = image->height;
+    job.xradius    = xradius;
+    job.yradius    = yradius;
+    job.kernel     = kernel;
+    job.row_kernel = malloc(sizeof(float) * kwidth);
+    job.col_kernel = malloc(sizeof(float) * kheight);
+    if (!(conv = malloc(sizeof(float) * image->width * image->height)) || !job.row_kernel || !job.col_kernel)
+    {
+        free(job.row_kernel);
+        free(job.col_kernel);
+        free(conv);
+        return (NULL);
+    }
+    err = 0;
+    if (separate_kernel(kernel, kwidth, kheight, job.col_kernel, job.row_kernel))
+    {
+        job.src = load_plane(image, pixels, 0, 0);
+        tmp     = malloc(sizeof(float) * image->width * image->height);
+        if (job.src && tmp)
+        {
+            job.dst = tmp;
+            parallel_rows(image->height, conv_rows_horiz, &job);
+            free(job.src);
+            job.src = tmp;
+            job.dst = conv;
+            parallel_rows(image->height, conv_rows_vert, &job);
         }
+        else
+        {
+            free(tmp);
+            err = 1;
+        }
+    }
+    else if (conv_use_fft(image->width, image->height, kwidth, kheight))
+    {
+        job.src = load_plane(image, pixels, 0, 0);
+        job.dst = conv;
+        err     = !job.src || conv_fft(&job, kernel);
+    }
+    else
+    {
+        job.src       = load_plane(image, pixels, xradius, yradius);
+        job.src_pitch = image->width + xradius * 2;
+        job.dst       = conv;
+        if (job.src)
+            parallel_rows(image->height, conv_rows_direct, &job);
+        else
+            err = 1;
+    }
+    free(job.src);
+    free(job.row_kernel);
+    free(job.col_kernel);
+    if (err)
+    {
+        free(conv);
+        return (NULL);
+    }
+    for (i = 0; i < image->width * image->height; i++)
+        conv[i] *= ksum;
+    return (conv);
+}
+/*
+ * Convolve image with kernel and return resultant frame.
+ */
+unsigned char *ccd_image_convolve(struct ccd_image *image, unsigned char *conv_frame, unsigned xradius, unsigned yradius, float *kernel)
+{
+    unsigned int p, pixel_size, image_size;
+    float       *conv;
+
+    pixel_size    = ((image->depth + 7) / 8);
+    image_size    = image->height * image->width * pixel_size;
+    if (!(conv = conv_plane(image, image->pixels, xradius, yradius, kernel)))
+        return (conv_frame);
+    if (conv_frame == NULL)
+        conv_frame = malloc(image_size);
+
+#define PIXEL_LOOP(pixel_type)                                                                  \
+    for (p = 0; p < image->width * image->height; p++)                                          \
+        ((pixel_type *)conv_frame)[p] = min(max(0, conv[p]), image->datamax);
 
     PIXEL_SIZE_CASE(pixel_size);
 #undef PIXEL_LOOP
 
+    free(conv);
     return (conv_frame);
 }
 /*
@@ -832,69 +1760,50 @@ unsigned char *ccd_image_convolve(struct ccd_image *image, unsigned char *conv_f
  */
 unsigned char *ccd_image_deconvolve(struct ccd_image *image, unsigned char *current_frame, unsigned char *next_frame, unsigned xradius, unsigned yradius, float *kernel, float noise_adj, int op)
 {
-    unsigned int pixel_size, image_pitch, image_size, kwidth, kheight;
-    int          x, y, kx, ky, i, j;
-    float        ksum, pixel, w;
+    unsigned int p, pixel_size, image_size;
+    float        pixel, w, *conv;
 
     pixel_size    = ((image->depth + 7) / 8);
-    image_pitch   = image->width  * pixel_size;
-    image_size    = image->height * image_pitch;
-    if (next_frame == NULL)
-        next_frame = malloc(image_size);
+    image_size    = image->height * image->width * pixel_size;
     if (current_frame == NULL)
         current_frame = image->pixels;
-    kwidth        = xradius * 2 + 1;
-    kheight       = yradius * 2 + 1;
-    ksum          = 0.0;
-    for (j = 0; j < kheight; j++)
-        for (i = 0; i < kwidth; i++)
-            ksum += kernel[j * kwidth + i];
-    if (fabs(ksum) < 1.0e-9)
-        ksum = (ksum < 0.0) ? -1.0e-9 : 1.0e-9;
-    ksum = 1.0 / ksum;
+    if (!(conv = conv_plane(image, current_frame, xradius, yradius, kernel)))
+        return (next_frame);
+    if (next_frame == NULL)
+        next_frame = malloc(image_size);
 
 #define PIXEL_LOOP(pixel_type)                                                                                                                  \
-    for (y = 0; y < image->height; y++)                                                                                                         \
-        for (x = 0; x < image->width; x++)                                                                                                      \
+    for (p = 0; p < image->width * image->height; p++)                                                                                          \
+    {                                                                                                                                           \
+        pixel = min(max(0, conv[p]), image->datamax);                                                                                           \
+        if (op == CCD_IMAGE_DECONVOLVE_VAN_CITTERT)                                                                                             \
         {                                                                                                                                       \
-            pixel = 0.0;                                                                                                                        \
-            for (j = 0; j < kheight; j++)                                                                                                       \
-                for (i = 0; i < kwidth; i++)                                                                                                    \
-                {                                                                                                                               \
-                    ky = y + j - yradius;                                                                                                       \
-                    kx = x + i - xradius;                                                                                                       \
-                    if (ky > 0 && ky < image->height && kx > 0 && kx < image->width)                                                            \
-                        pixel += ((pixel_type *)current_frame)[ky * image->width + kx] * kernel[j * kwidth + i];                                \
-                }                                                                                                                               \
-            pixel *= ksum;                                                                                                                      \
-            pixel = min(max(0, pixel), image->datamax);                                                                                         \
-            if (op == CCD_IMAGE_DECONVOLVE_VAN_CITTERT)                                                                                         \
-            {                                                                                                                                   \
-                pixel = ((pixel_type *)image->pixels)[y * image->width + x] - pixel;                                                            \
-                if (pixel <= image->pixmin)                                                                                                     \
-                    w = 0.0;                                                                                                                    \
-                else if (pixel >= image->pixmax)                                                                                                \
-                    w = 1.0;                                                                                                                    \
-                else                                                                                                                            \
-                    w = pow(sin(M_PI_2 * (pixel - image->pixmin) / (image->pixmax - image->pixmin)), noise_adj);                                \
-                ((pixel_type *)next_frame)[y * image->width + x] = ((pixel_type *)current_frame)[y * image->width + x] + w;                     \
-            }                                                                                                                                   \
-            else /* RICHARDSON_LUCY */                                                                                                          \
-            {                                                                                                                                   \
-                pixel = (pixel > 1.0e-9) ? ((pixel_type *)image->pixels)[y * image->width + x] / pixel : 1.0;                                   \
-                if (((pixel_type *)current_frame)[y * image->width + x] <= image->pixmin)                                                       \
-                    w = 0.0;                                                                                                                    \
-                else if (((pixel_type *)current_frame)[y * image->width + x] >= image->pixmax)                                                  \
-                    w = 1.0;                                                                                                                    \
-                else                                                                                                                            \
-                    w = pow(sin(M_PI_2 * (((pixel_type *)current_frame)[y * image->width + x] - image->pixmin) / (image->pixmax - image->pixmin)), noise_adj);\
-                ((pixel_type *)next_frame)[y * image->width + x] = ((pixel_type *)current_frame)[y * image->width + x] * (w * (pixel - 1.0) + 1.0);\
-            }                                                                                                                                   \
-        }
+            pixel = ((pixel_type *)image->pixels)[p] - pixel;                                                                                   \
+            if (pixel <= image->pixmin)                                                                                                         \
+                w = 0.0;                                                                                                                        \
+            else if (pixel >= image->pixmax)                                                                                                    \
+                w = 1.0;                                                                                                                        \
+            else                                                                                                                                \
+                w = pow(sin(M_PI_2 * (pixel - image->pixmin) / (image->pixmax - image->pixmin)), noise_adj);                                    \
+            ((pixel_type *)next_frame)[p] = ((pixel_type *)current_frame)[p] + w;                                                               \
+        }                                                                                                                                       \
+        else /* RICHARDSON_LUCY */                                                                                                              \
+        {                                                                                                                                       \
+            pixel = (pixel > 1.0e-9) ? ((pixel_type *)image->pixels)[p] / pixel : 1.0;                                                          \
+            if (((pixel_type *)current_frame)[p] <= image->pixmin)                                                                              \
+                w = 0.0;                                                                                                                        \
+            else if (((pixel_type *)current_frame)[p] >= image->pixmax)                                                                         \
+                w = 1.0;                                                                                                                        \
+            else                                                                                                                                \
+                w = pow(sin(M_PI_2 * (((pixel_type *)current_frame)[p] - image->pixmin) / (image->pixmax - image->pixmin)), noise_adj);         \
+            ((pixel_type *)next_frame)[p] = ((pixel_type *)current_frame)[p] * (w * (pixel - 1.0) + 1.0);                                       \
+        }                                                                                                                                       \
+    }
 
     PIXEL_SIZE_CASE(pixel_size);
 #undef PIXEL_LOOP
 
+    free(conv);
     return (next_frame);
 }
 /*
@@ -1038,18 +1947,98 @@ int ccd_image_find_best_centroid(struct ccd_image *image, unsigned char *pixels,
 #endif
     return (x >= 0 || y >= 0);
 }
-unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned char *pixels, float x_centroid, float y_centroid, float *x_prev, float *y_prev, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, int frame_num)
+/*
+ * Find up to max_stars stars, brightest first. Returns the number found.
+ */
+int ccd_image_find_stars(struct ccd_image *image, unsigned char *pixels, struct ccd_star *stars, int max_stars, int x_max_radius, int y_max_radius, float sigs)
 {
-    int            x, y, x_offset, y_offset, x_min, y_min, x_max, y_max;
-    unsigned int   pixel_size, image_pitch, image_size;
-    unsigned char *registered_pixels;
-    float          x_reg_centroid, y_reg_centroid, x_frac, y_frac, lerp[2][2];
+    int           i, j, k, n, num_stars, x_radius, y_radius, x_border, y_border;
+    unsigned long pixel, pixel_min;
+    float         pixel_ave, pixel_sig, x_centroid, y_centroid, flux;
+
+    x_border  = x_max_radius + 1;
+    y_border  = y_max_radius + 1;
+    num_stars = 0;
+    pixel_ave = 0.0;
+    pixel_sig = 0.0;
+    if (image->width <= 2 * x_border || image->height <= 2 * y_border)
+        return (0);
+
+#define PIXEL_LOOP(pixel_type)                                                                                                          \
+    for (j = 0; j < image->height; j++)                                                                                                 \
+        for (i = 0; i < image->width; i++)                                                                                              \
+            pixel_ave += ((pixel_type *)pixels)[j * image->width + i];                                                                  \
+    pixel_ave /= image->height * image->width;                                                                                          \
+    for (j = 0; j < image->height; j++)                                                                                                 \
+        for (i = 0; i < image->width; i++)                                                                                              \
+            pixel_sig += (pixel_ave - ((pixel_type *)pixels)[j * image->width + i]) * (pixel_ave - ((pixel_type *)pixels)[j * image->width + i]);\
+    pixel_sig = sqrt(pixel_sig / (image->height * image->width - 1));                                                                   \
+    pixel_min = pixel_ave + pixel_sig * sigs;                                                                                           \
+    for (j = y_border; j < image->height - y_border; j++)                                                                               \
+        for (i = x_border; i < image->width - x_border; i++)                                                                            \
+        {                                                                                                                               \
+            pixel = ((pixel_type *)pixels)[j * image->width + i];                                                                       \
+            /*                                                                                                                          \
+             * Local maxima above the noise.                                                                                            \
+             */                                                                                                                         \
+            if (pixel <= pixel_min                                                                                                      \
+             || pixel <  ((pixel_type *)pixels)[j * image->width + i + 1]                                                               \
+             || pixel <  ((pixel_type *)pixels)[j * image->width + i - 1]                                                               \
+             || pixel <  ((pixel_type *)pixels)[(j + 1) * image->width + i]                                                             \
+             || pixel <  ((pixel_type *)pixels)[(j - 1) * image->width + i])                                                            \
+                continue;                                                                                                               \
+            for (y_radius = 1; (y_radius <= y_max_radius)                                                                               \
+                            && ((((pixel_type *)pixels)[(j + y_radius) * image->width + i] > pixel_min)                                 \
+                             || (((pixel_type *)pixels)[(j - y_radius) * image->width + i] > pixel_min)); y_radius++);                  \
+            for (x_radius = 1; (x_radius <= x_max_radius)                                                                               \
+                            && ((((pixel_type *)pixels)[j * image->width + i + x_radius] > pixel_min)                                   \
+                             || (((pixel_type *)pixels)[j * image->width + i - x_radius] > pixel_min)); x_radius++);                    \
+            /*                                                                                                                          \
+             * If its really big, skip it.                                                                                              \
+             */                                                                                                                         \
+            if (x_radius >= x_max_radius || y_radius >= y_max_radius)                                                                   \
+                continue;                                                                                                               \
+            calc_centroid(image, pixels, i, j, x_radius, y_radius, &x_centroid, &y_centroid, pixel_min);                                \
+            flux = pixel - pixel_ave;                                                                                                   \
+            /*                                                                                                                          \
+             * Flat topped stars have more than one maximum, keep the first.                                                            \
+             */                                                                                                                         \
+            for (k = 0; k < num_stars; k++)                                                                                             \
+                if (fabs(stars[k].x_centroid - x_centroid) <= max(x_radius, stars[k].x_radius)                                          \
+                 && fabs(stars[k].y_centroid - y_centroid) <= max(y_radius, stars[k].y_radius))                                         \
+                    break;                                                                                                              \
+            if (k < num_stars)                                                                                                          \
+                continue;                                                                                                               \
+            /*                                                                                                                          \
+             * Insert by brightness.                                                                                                    \
+             */                                                                                                                         \
+            for (k = 0; k < num_stars && stars[k].flux >= flux; k++);                                                                   \
+            if (k >= max_stars)                                                                                                         \
+                continue;                                                                                                               \
+            for (n = min(num_stars, max_stars - 1); n > k; n--)                                                                         \
+                stars[n] = stars[n - 1];                                                                                                \
+            stars[k].x_centroid = x_centroid;                                                                                           \
+            stars[k].y_centroid = y_centroid;                                                                                           \
+            stars[k].flux       = flux;                                                                                                 \
+            stars[k].x_radius   = x_radius;                                                                                             \
+            stars[k].y_radius   = y_radius;                                                                                             \
+            if (num_stars < max_stars)                                                                                                  \
+                num_stars++;                                                                                                            \
+        }
+
+    PIXEL_SIZE_CASE((image->depth + 7) / 8);
+#undef PIXEL_LOOP
+
+    return (num_stars);
+}
+/*
+ * Find the integer offset and interpolation weights that move this frame's
+ * star back onto the reference centroid.
+ */
+static void register_offsets(struct ccd_image *image, unsigned char *pixels, float x_centroid, float y_centroid, float *x_prev, float *y_prev, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, int frame_num, int *x_offset, int *y_offset, float lerp[2][2])
+{
+    float x_reg_centroid, y_reg_centroid, x_frac, y_frac;
 
-    pixel_size        = ((image->depth + 7) / 8);
-    image_pitch       = image->width  * pixel_size;
-    image_size        = image->height * image_pitch;
-    registered_pixels = malloc(image_size);
-    memset(registered_pixels, 0, image_size);
     /*
      * Interpolate where the image might be.
      */
@@ -1067,19 +2056,19 @@ unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned cha
     /*
      * Resample image with current centroid at original centroid.
      */
-    x_offset = floor(x_reg_centroid) - floor(x_centroid);
-    y_offset = floor(y_reg_centroid) - floor(y_centroid);
-    x_frac   = (x_reg_centroid - floor(x_reg_centroid)) - (x_centroid - floor(x_centroid));
-    y_frac   = (y_reg_centroid - floor(y_reg_centroid)) - (y_centroid - floor(y_centroid));
+    *x_offset = floor(x_reg_centroid) - floor(x_centroid);
+    *y_offset = floor(y_reg_centroid) - floor(y_centroid);
+    x_frac    = (x_reg_centroid - floor(x_reg_centroid)) - (x_centroid - floor(x_centroid));
+    y_frac    = (y_reg_centroid - floor(y_reg_centroid)) - (y_centroid - floor(y_centroid));
     if (x_frac < 0.0)
     {
-        x_offset -= 1;
-        x_frac   += 1.0;
+        *x_offset -= 1;
+        x_frac    += 1.0;
     }
     if (y_frac < 0.0)
     {
-        y_offset -= 1;
-        y_frac   += 1.0;
+        *y_offset -= 1;
+        y_frac    += 1.0;
     }
     if (x_frac >= 1.0 || y_frac >= 1.0)
     {
@@ -1089,6 +2078,22 @@ unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned cha
     lerp[0][1] = x_frac         * (1.0 - y_frac);
     lerp[1][0] = (1.0 - x_frac) * y_frac;
     lerp[1][1] = x_frac         * y_frac;
+    *x_prev = x_reg_centroid;
+    *y_prev = y_reg_centroid;
+}
+unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned char *pixels, float x_centroid, float y_centroid, float *x_prev, float *y_prev, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, int frame_num)
+{
+    int            x, y, x_offset, y_offset, x_min, y_min, x_max, y_max;
+    unsigned int   pixel_size, image_pitch, image_size;
+    unsigned char *registered_pixels;
+    float          lerp[2][2];
+
+    pixel_size        = ((image->depth + 7) / 8);
+    image_pitch       = image->width  * pixel_size;
+    image_size        = image->height * image_pitch;
+    registered_pixels = malloc(image_size);
+    memset(registered_pixels, 0, image_size);
+    register_offsets(image, pixels, x_centroid, y_centroid, x_prev, y_prev, x_range, y_range, x_max_radius, y_max_radius, sigs, frame_num, &x_offset, &y_offset, lerp);
     x_min = max(0, x_offset);
     x_max = min(image->width, image->width + x_offset) - 1;
     y_min = max(0, y_offset);
@@ -1105,8 +2110,6 @@ unsigned char *ccd_image_register_centroid(struct ccd_image *image, unsigned cha
     PIXEL_SIZE_CASE(pixel_size);
 #undef PIXEL_LOOP
 
-    *x_prev = x_reg_centroid;
-    *y_prev = y_reg_centroid;
     return (registered_pixels);
 }
 int ccd_image_register_frames(struct ccd_image *image, unsigned char **pixels, unsigned char **registered_pixels, float *x_centroid, float *y_centroid, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs, unsigned int frame_count)
@@ -1149,169 +2152,494 @@ int ccd_image_register_frames(struct ccd_image *image, unsigned char **pixels, u
 }
 /*
  * Image combining.
- * The following combine a number of frames into a single image.
+ * The following combine a number of frames into a single image. The engine
+ * itself lives in ccd_combine.c.
+ */
+int ccd_image_combine_stream(struct ccd_image *image, int (*read_rows)(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst), void *source, unsigned int frame_count, int op)
+{
+    if (frame_count == 0)
+        return (-1);
+    if (!image->pixels && !(image->pixels = malloc(image->width * image->height * ((image->depth + 7) / 8))))
+        return (-1);
+    return (ccd_combine_stream(image->width, image->height, image->depth, image->pixels, NULL, read_rows, source, frame_count, op));
+}
+/*
+ * Band reader for frames already in memory.
  */
-static void image_mean_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count)
+struct resident_frames
+{
+    unsigned int    pitch;
+    unsigned char **pixels;
+};
+static int read_resident_rows(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst)
 {
-    unsigned int    i, x, y, pixel_size, pixel_offset;
-    float           pixel, pixel_scale, pixel_max;
+    struct resident_frames *frames = source;
 
-    pixel_size  = (image->depth + 7) / 8;
-    pixel_scale = 1.0/frame_count;
-    pixel_max   = (1 << image->depth) - 1/*image->datamax*/;
+    memcpy(dst, frames->pixels[frame] + y * frames->pitch, rows * frames->pitch);
+    return (0);
+}
+static void image_interleave_frames(struct ccd_image *image, unsigned char **pixels)
+{
+    unsigned int    x, y;
 
-#define PIXEL_LOOP(pixel_type)                                                      \
-    for (y = 0; y < image->height; y++)                                             \
-    {                                                                               \
-        for (x = 0; x < image->width; x++)                                          \
-        {                                                                           \
-            pixel_offset = y * image->width + x;                                    \
-            pixel        = 0.0;                                                     \
-            for (i = 0; i < frame_count; i++)                                       \
-                pixel += ((pixel_type *)pixels[i])[pixel_offset];                   \
-            pixel *= pixel_scale;                                                   \
-            ((pixel_type *)image->pixels)[pixel_offset] = min(pixel, pixel_max);    \
-        }                                                                           \
-    }
+    image->height       *= 2;
+    image->pixel_height /= 2.0;
 
-    PIXEL_SIZE_CASE(pixel_size);
+#define PIXEL_LOOP(pixel_type)                                                                                              \
+    for (y = 0; y < image->height; y++)                                                                                     \
+        for (x = 0; x < image->width; x++)                                                                                  \
+            ((pixel_type *)image->pixels)[y * image->width + x] = ((pixel_type *)pixels[y & 1])[(y / 2) * image->width + x];\
+
+    PIXEL_SIZE_CASE((image->depth + 7) / 8);
 #undef PIXEL_LOOP
 
 }
-static void image_rank_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count, unsigned int rank)
+/*
+ * Combine images into one.
+ */
+void ccd_image_combine_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count, int op)
 {
-    unsigned int    i, j, k, x, y, pixel_size, pixel_offset, image_pitch;
-    unsigned long  *sorted_pixels, *median_pixel;
+    if (frame_count > 0)
+    {
+        image->pixels = malloc(image->height * (op == CCD_IMAGE_COMBINE_INTERLEAVE ? 2 : 1) * image->width * ((image->depth + 7) / 8));
+        if (op == CCD_IMAGE_COMBINE_INTERLEAVE)
+        {
+            if (frame_count  >= 2)
+                image_interleave_frames(image, pixels);
+        }
+        else
+        {
+            struct resident_frames frames;
+            frames.pitch  = image->width * ((image->depth + 7) / 8);
+            frames.pixels = pixels;
+            ccd_image_combine_stream(image, read_resident_rows, &frames, frame_count, op);
+        }
+        image->pixmin = image->pixmax = 0;
+        ccd_image_histogram(image);
+    }
+}
+/*
+ * Out-of-core stacking.
+ * A stack never holds a whole frame for longer than it takes to add it.
+ * Frames handed over from memory are spilled to an unlinked temporary file
+ * and FITS frames are read in place; the combine engine then pulls one band
+ * of every frame at a time, registering it on the way. A FITS frame is only
+ * held open while it is being added and is reopened by name for each band
+ * after that, so a long series never runs out of file descriptors. Mean and
+ * sum stacks accumulate each frame as it arrives and keep nothing but the
+ * running sum.
+ */
+struct ccd_stack_frame
+{
+    int            fd;
+    off_t          offset;
+    unsigned char *pixels;
+    char          *name;
+    unsigned int   sign_bit;
+    int            x_offset;
+    int            y_offset;
+    float          lerp[2][2];
+};
+struct ccd_stack
+{
+    struct ccd_image        geometry;
+    int                     op;
+    unsigned int            frame_count;
+    unsigned int            frame_alloc;
+    struct ccd_stack_frame *frames;
+    double                 *accum;
+    int                     spill_fd;
+    off_t                   spill_size;
+    int                     registering;
+    float                   x_centroid;
+    float                   y_centroid;
+    float                   x_prev;
+    float                   y_prev;
+    int                     x_range;
+    int                     y_range;
+    int                     x_max_radius;
+    int                     y_max_radius;
+    float                   sigs;
+};
+/*
+ * Read unregistered rows of a frame, top row first.
+ */
+static int stack_read_rows(struct ccd_stack *stack, struct ccd_stack_frame *frame, unsigned int y, unsigned int rows, unsigned char *dst)
+{
+    unsigned int   i, pitch, pixel_size;
+    unsigned char *raw;
+    int            fd, err;
 
-    pixel_size    = ((image->depth + 7) / 8);
-    image_pitch   = image->width  * pixel_size;
-    sorted_pixels = malloc(sizeof(unsigned long) * (frame_count + 1));
-    median_pixel = &sorted_pixels[rank];
-
-#define PIXEL_LOOP(pixel_type)                                                      \
-    for (y = 0; y < image->height; y++)                                             \
-    {                                                                               \
-        for (x = 0; x < image->width; x++)                                          \
-        {                                                                           \
-            pixel_offset = y * image->width + x;                                    \
-            for (i = 0; i < frame_count; i++)                                       \
-                sorted_pixels[i] = 0xFFFFFFFF;                                      \
-            for (i = 0; i < frame_count; i++)                                       \
-                for (j = 0; j <= i; j++)                                            \
-                    if (((pixel_type *)pixels[i])[pixel_offset] < sorted_pixels[j]) \
-                    {                                                               \
-                        for (k = i; k > j; k--)                                     \
-                            sorted_pixels[k] = sorted_pixels[k - 1];                \
-                        sorted_pixels[j] = ((pixel_type *)pixels[i])[pixel_offset]; \
-                        break;                                                      \
-                    }                                                               \
-            ((pixel_type *)image->pixels)[pixel_offset] = *median_pixel;            \
-        }                                                                           \
+    pixel_size = (stack->geometry.depth + 7) / 8;
+    pitch      = stack->geometry.width * pixel_size;
+    if (frame->pixels)
+    {
+        memcpy(dst, frame->pixels + y * pitch, rows * pitch);
+        return (0);
+    }
+    if (!frame->name)
+        return (pread(frame->fd, dst, rows * pitch, frame->offset + (off_t)y * pitch) == rows * pitch ? 0 : -1);
+    /*
+     * FITS rows are stored bottom up and big endian.
+     */
+    if (!(raw = malloc(rows * pitch)))
+        return (-1);
+    if ((fd = frame->fd >= 0 ? frame->fd : open(frame->name, O_RDONLY, 0)) < 0)
+    {
+        free(raw);
+        return (-1);
+    }
+    err = pread(fd, raw, rows * pitch, frame->offset + (off_t)(stack->geometry.height - y - rows) * pitch) == rows * pitch ? 0 : -1;
+    if (fd != frame->fd)
+        close(fd);
+    if (!err)
+        for (i = 0; i < rows; i++)
+            convert_pixels(raw + i * pitch, dst + (rows - 1 - i) * pitch, frame->sign_bit, pixel_size, stack->geometry.width);
+    free(raw);
+    return (err);
+}
+/*
+ * Read registered rows of a frame. Pixels shifted in from outside the frame
+ * are zero, matching ccd_image_register_centroid().
+ */
+static int stack_frame_rows(struct ccd_stack *stack, struct ccd_stack_frame *frame, unsigned int y, unsigned int rows, unsigned char *dst)
+{
+    int            x, sx, sy, r, first, last, src_first, width, height;
+    unsigned int   pitch;
+    unsigned char *src;
+
+    if (frame->x_offset == 0 && frame->y_offset == 0 && frame->lerp[0][0] == 1.0)
+        return (stack_read_rows(stack, frame, y, rows, dst));
+    width     = stack->geometry.width;
+    height    = stack->geometry.height;
+    pitch     = width * ((stack->geometry.depth + 7) / 8);
+    memset(dst, 0, rows * pitch);
+    /*
+     * Source rows needed, plus one below for the interpolation.
+     */
+    src_first = (int)y + frame->y_offset;
+    first     = max(src_first, 0);
+    last      = min(src_first + (int)rows, height - 1);
+    if (first >= last)
+        return (0);
+    if (!(src = malloc((last - first + 1) * pitch)))
+        return (-1);
+    if (stack_read_rows(stack, frame, first, last - first + 1, src))
+    {
+        free(src);
+        return (-1);
     }
 
-    PIXEL_SIZE_CASE(pixel_size);
+#define PIXEL_LOOP(pixel_type)                                                                          \
+    for (r = 0; r < rows; r++)                                                                          \
+    {                                                                                                   \
+        pixel_type *s0, *s1, *d;                                                                        \
+        sy = src_first + r;                                                                             \
+        if (sy < first || sy + 1 > last)                                                                \
+            continue;                                                                                   \
+        s0 = (pixel_type *)src + (sy - first) * width;                                                  \
+        s1 = s0 + width;                                                                                \
+        d  = (pixel_type *)dst + r * width;                                                             \
+        for (x = max(0, -frame->x_offset); x < width; x++)                                              \
+        {                                                                                               \
+            sx = x + frame->x_offset;                                                                   \
+            if (sx + 1 >= width)                                                                        \
+                break;                                                                                  \
+            d[x] = frame->lerp[0][0] * s0[sx] + frame->lerp[0][1] * s0[sx + 1]                          \
+                 + frame->lerp[1][0] * s1[sx] + frame->lerp[1][1] * s1[sx + 1];                         \
+        }                                                                                               \
+    }
+
+    PIXEL_SIZE_CASE((stack->geometry.depth + 7) / 8);
 #undef PIXEL_LOOP
 
-    free (sorted_pixels);
+    free(src);
+    return (0);
 }
-static void image_sum_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count)
+static int read_stack_rows(void *source, unsigned int frame, unsigned int y, unsigned int rows, unsigned char *dst)
 {
-    unsigned int    i, x, y, pixel_size, pixel_offset;
-    float           pixel, pixel_max;
+    struct ccd_stack *stack = source;
 
-    pixel_size = ((image->depth + 7) / 8);
-    pixel_max  = (1 << image->depth) - 1/*image->datamax*/;
+    return (stack_frame_rows(stack, &stack->frames[frame], y, rows, dst));
+}
+/*
+ * Measure a frame's offset from the reference star while it is resident.
+ */
+static void stack_register_frame(struct ccd_stack *stack, struct ccd_stack_frame *frame, unsigned char *pixels)
+{
+    int x_radius, y_radius;
 
-#define PIXEL_LOOP(pixel_type)                                                      \
-    for (y = 0; y < image->height; y++)                                             \
-        for (x = 0; x < image->width; x++)                                          \
-        {                                                                           \
-            pixel_offset = y * image->width + x;                                    \
-            pixel        = 0.0;                                                     \
-            for (i = 0; i < frame_count; i++)                                       \
-                pixel += ((pixel_type *)pixels[i])[pixel_offset];                   \
-            ((pixel_type *)image->pixels)[pixel_offset] = min(pixel, pixel_max);    \
+    frame->x_offset   = 0;
+    frame->y_offset   = 0;
+    frame->lerp[0][0] = 1.0;
+    frame->lerp[0][1] = frame->lerp[1][0] = frame->lerp[1][1] = 0.0;
+    if (!stack->registering)
+        return;
+    if (stack->frame_count == 0)
+    {
+        stack->x_centroid = stack->geometry.width  / 2;
+        stack->y_centroid = stack->geometry.height / 2;
+        x_radius          = stack->x_max_radius;
+        y_radius          = stack->y_max_radius;
+        if (!ccd_image_find_best_centroid(&stack->geometry, pixels, &stack->x_centroid, &stack->y_centroid, stack->geometry.width*3/8, stack->geometry.height*3/8, &x_radius, &y_radius, stack->sigs))
+        {
+            fprintf(stderr, "No registration star found, stacking unregistered.\n");
+            stack->registering = 0;
+            return;
         }
+        stack->x_prev = stack->x_centroid;
+        stack->y_prev = stack->y_centroid;
+    }
+    else
+        register_offsets(&stack->geometry, pixels, stack->x_centroid, stack->y_centroid, &stack->x_prev, &stack->y_prev, stack->x_range, stack->y_range, stack->x_max_radius, stack->y_max_radius, stack->sigs, stack->frame_count, &frame->x_offset, &frame->y_offset, frame->lerp);
+}
+/*
+ * Add a registered frame: accumulate it now for mean and sum, otherwise
+ * remember where to read it back from.
+ */
+static int stack_add_frame(struct ccd_stack *stack, struct ccd_stack_frame *frame)
+{
+    unsigned int           p, y, rows, band_rows, pitch;
+    unsigned char         *band;
+    struct ccd_stack_frame *frames;
 
-    PIXEL_SIZE_CASE(pixel_size);
+    if (stack->accum)
+    {
+        pitch     = stack->geometry.width * ((stack->geometry.depth + 7) / 8);
+        band_rows = max(1, CCD_COMBINE_BAND_BYTES / pitch);
+        if (!(band = malloc(band_rows * pitch)))
+            return (-1);
+        for (y = 0; y < stack->geometry.height; y += band_rows)
+        {
+            rows = min(band_rows, stack->geometry.height - y);
+            if (stack_frame_rows(stack, frame, y, rows, band))
+            {
+                free(band);
+                return (-1);
+            }
+
+#define PIXEL_LOOP(pixel_type)                                                                  \
+            for (p = 0; p < rows * stack->geometry.width; p++)                                  \
+                stack->accum[y * stack->geometry.width + p] += ((pixel_type *)band)[p];
+
+            PIXEL_SIZE_CASE((stack->geometry.depth + 7) / 8);
 #undef PIXEL_LOOP
 
+        }
+        free(band);
+    }
+    else
+    {
+        if (stack->frame_count == stack->frame_alloc)
+        {
+            if (!(frames = realloc(stack->frames, sizeof(struct ccd_stack_frame) * (stack->frame_alloc + 64))))
+                return (-1);
+            stack->frames       = frames;
+            stack->frame_alloc += 64;
+        }
+        frame->pixels = NULL;
+        stack->frames[stack->frame_count] = *frame;
+        if (frame->name)
+            stack->frames[stack->frame_count].fd = -1;
+    }
+    stack->frame_count++;
+    return (0);
+}
+struct ccd_stack *ccd_stack_new(struct ccd_image *image, int op)
+{
+    struct ccd_stack *stack;
+
+    if (op == CCD_IMAGE_COMBINE_INTERLEAVE || !(stack = calloc(1, sizeof(struct ccd_stack))))
+        return (NULL);
+    stack->geometry.width  = image->width;
+    stack->geometry.height = image->height;
+    stack->geometry.depth  = image->depth;
+    stack->op              = op;
+    stack->spill_fd        = -1;
+    if (op == CCD_IMAGE_COMBINE_MEAN || op == CCD_IMAGE_COMBINE_SUM)
+    {
+        if (!(stack->accum = calloc(image->width * image->height, sizeof(double))))
+        {
+            free(stack);
+            return (NULL);
+        }
+    }
+    return (stack);
+}
+/*
+ * Register every frame to the best star found in the first one.
+ */
+void ccd_stack_register(struct ccd_stack *stack, int x_range, int y_range, int x_max_radius, int y_max_radius, float sigs)
+{
+    stack->registering  = stack->frame_count == 0;
+    stack->x_range      = x_range;
+    stack->y_range      = y_range;
+    stack->x_max_radius = x_max_radius;
+    stack->y_max_radius = y_max_radius;
+    stack->sigs         = sigs;
+}
+/*
+ * Add a frame from memory. The caller keeps ownership of the pixels.
+ */
+int ccd_stack_add_pixels(struct ccd_stack *stack, unsigned char *pixels)
+{
+    struct ccd_stack_frame frame;
+    unsigned int           frame_size;
+    char                   spill_name[PATH_MAX];
+
+    frame_size   = stack->geometry.width * stack->geometry.height * ((stack->geometry.depth + 7) / 8);
+    frame.fd       = -1;
+    frame.offset   = 0;
+    frame.pixels   = pixels;
+    frame.name     = NULL;
+    frame.sign_bit = 0;
+    stack_register_frame(stack, &frame, pixels);
+    if (!stack->accum)
+    {
+        if (stack->spill_fd < 0)
+        {
+            sprintf(spill_name, "%s/gccdXXXXXX", g_get_tmp_dir());
+            if ((stack->spill_fd = mkstemp(spill_name)) < 0)
+                return (-1);
+            unlink(spill_name);
+        }
+        if (pwrite(stack->spill_fd, pixels, frame_size, stack->spill_size) != frame_size)
+            return (-1);
+        frame.fd           = stack->spill_fd;
+        frame.offset       = stack->spill_size;
+        stack->spill_size += frame_size;
+    }
+    return (stack_add_frame(stack, &frame));
+}
+/*
+ * Add a frame from a FITS file of the same geometry as the stack.
+ */
+int ccd_stack_add_fits(struct ccd_stack *stack, char *filename)
+{
+    char                   record[FITS_CARD_COUNT][FITS_CARD_SIZE];
+    char                   key[10];
+    struct ccd_stack_frame frame;
+    unsigned char         *pixels;
+    unsigned int           width, height, depth, records;
+    float                  zero;
+    int                    i, fd, done, err;
+
+    if ((fd = open(filename, O_RDONLY, 0)) < 0)
+        return (-1);
+    width = height = depth = records = done = 0;
+    zero  = 0.0;
+    while (!done && read(fd, record, FITS_RECORD_SIZE) == FITS_RECORD_SIZE)
+    {
+        for (i = 0; i < FITS_CARD_COUNT && !done; i++)
+        {
+            record[i][FITS_CARD_SIZE-1] = '\0';
+            key[0] = '\0';
+            sscanf(record[i], "%9s", key);
+            key[8] = '\0';
+            if (records == 0 && i == 0 && strcmp(key, "SIMPLE"))
+                break;
+            if (!strcmp(key, "BITPIX"))
+                sscanf(&record[i][10], "%u", &depth);
+            else if (!strcmp(key, "NAXIS1"))
+                sscanf(&record[i][10], "%u", &width);
+            else if (!strcmp(key, "NAXIS2"))
+                sscanf(&record[i][10], "%u", &height);
+            else if (!strcmp(key, "BZERO"))
+                sscanf(&record[i][10], "%f", &zero);
+            else if (!strcmp(key, "END"))
+                done = 1;
+        }
+        if (i == 0)
+            break;
+        records++;
+    }
+    if (!done || width != stack->geometry.width || height != stack->geometry.height || depth != stack->geometry.depth
+     || !(frame.name = strdup(filename)))
+    {
+        close(fd);
+        return (-1);
+    }
+    frame.fd       = fd;
+    frame.offset   = (off_t)records * FITS_RECORD_SIZE;
+    frame.pixels   = NULL;
+    frame.sign_bit = zero == 0.0 ? 0 : 1 << (((depth + 7) / 8) * 8 - 1);
+    frame.x_offset = frame.y_offset = 0;
+    frame.lerp[0][0] = 1.0;
+    frame.lerp[0][1] = frame.lerp[1][0] = frame.lerp[1][1] = 0.0;
+    if (stack->registering)
+    {
+        /*
+         * Finding the star needs the whole frame, but only until it is found.
+         */
+        if (!(pixels = malloc(width * height * ((depth + 7) / 8))) || stack_read_rows(stack, &frame, 0, height, pixels))
+        {
+            free(pixels);
+            free(frame.name);
+            close(fd);
+            return (-1);
+        }
+        stack_register_frame(stack, &frame, pixels);
+        free(pixels);
+    }
+    /*
+     * Kept frames are reopened by name when the stack is combined.
+     */
+    err = stack_add_frame(stack, &frame);
+    close(fd);
+    if (err || stack->accum)
+        free(frame.name);
+    return (err ? -1 : 0);
 }
-static void image_diff_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count)
+unsigned int ccd_stack_count(struct ccd_stack *stack)
 {
-    unsigned int    i, x, y, pixel_size, pixel_offset;
-    float           pixel, pixel_max;
-
-    pixel_size = ((image->depth + 7) / 8);
-    pixel_max  = (1 << image->depth) - 1/*image->datamax*/;
-
-#define PIXEL_LOOP(pixel_type)                                                      \
-    for (y = 0; y < image->height; y++)                                             \
-        for (x = 0; x < image->width; x++)                                          \
-        {                                                                           \
-            pixel_offset = y * image->width + x;                                    \
-            pixel        = 0.0;                                                     \
-            for (i = 0; i < frame_count; i++)                                       \
-                pixel = abs(pixel - ((pixel_type *)pixels[i])[pixel_offset]);       \
-            ((pixel_type *)image->pixels)[pixel_offset] = pixel;                    \
-        }
-
-    PIXEL_SIZE_CASE(pixel_size);
-#undef PIXEL_LOOP
-
+    return (stack->frame_count);
 }
-static void image_interleave_frames(struct ccd_image *image, unsigned char **pixels)
+/*
+ * Combine the stack into the image, which must match the stack geometry.
+ */
+int ccd_stack_combine(struct ccd_stack *stack, struct ccd_image *image)
 {
-    unsigned int    x, y;
+    unsigned int p, pixel_size;
+    double       pixel, pixel_scale, pixel_max;
 
-    image->height       *= 2;
-    image->pixel_height /= 2.0;
+    if (stack->frame_count == 0 || image->width != stack->geometry.width || image->height != stack->geometry.height || image->depth != stack->geometry.depth)
+        return (-1);
+    pixel_size = (image->depth + 7) / 8;
+    if (stack->accum)
+    {
+        if (!image->pixels && !(image->pixels = malloc(image->width * image->height * pixel_size)))
+            return (-1);
+        pixel_scale = stack->op == CCD_IMAGE_COMBINE_MEAN ? 1.0 / stack->frame_count : 1.0;
+        pixel_max   = (double)((1UL << image->depth) - 1);
 
-#define PIXEL_LOOP(pixel_type)                                                                                              \
-    for (y = 0; y < image->height; y++)                                                                                     \
-        for (x = 0; x < image->width; x++)                                                                                  \
-            ((pixel_type *)image->pixels)[y * image->width + x] = ((pixel_type *)pixels[y & 1])[(y / 2) * image->width + x];\
+#define PIXEL_LOOP(pixel_type)                                                  \
+        for (p = 0; p < image->width * image->height; p++)                      \
+        {                                                                       \
+            pixel = stack->accum[p] * pixel_scale;                              \
+            ((pixel_type *)image->pixels)[p] = min(pixel, pixel_max);           \
+        }
 
-    PIXEL_SIZE_CASE((image->depth + 7) / 8);
+        PIXEL_SIZE_CASE(pixel_size);
 #undef PIXEL_LOOP
 
+    }
+    else if (ccd_image_combine_stream(image, read_stack_rows, stack, stack->frame_count, stack->op))
+        return (-1);
+    image->pixmin = image->pixmax = 0;
+    ccd_image_histogram(image);
+    return (0);
 }
-/*
- * Combine images into one.
- */
-void ccd_image_combine_frames(struct ccd_image *image, unsigned char **pixels, unsigned int frame_count, int op)
+void ccd_stack_delete(struct ccd_stack *stack)
 {
-    if (frame_count > 0)
-    {
-        image->pixels = malloc(image->height * (op == CCD_IMAGE_COMBINE_INTERLEAVE ? 2 : 1) * image->width * ((image->depth + 7) / 8));
-        switch (op)
-        {
-            case CCD_IMAGE_COMBINE_MEDIAN:
-                image_rank_frames(image, pixels, frame_count, frame_count/2);
-                break;
-            case CCD_IMAGE_COMBINE_MIN:
-                image_rank_frames(image, pixels, frame_count, 0);
-                break;
-            case CCD_IMAGE_COMBINE_MAX:
-                image_rank_frames(image, pixels, frame_count, frame_count - 1);
-                break;
-            case CCD_IMAGE_COMBINE_MEAN:
-                image_mean_frames(image, pixels, frame_count);
-                break;
-            case CCD_IMAGE_COMBINE_DIFF:
-                image_diff_frames(image, pixels, frame_count);
-                break;
-            case CCD_IMAGE_COMBINE_SUM:
-                image_sum_frames(image, pixels, frame_count);
-                break;
-            case CCD_IMAGE_COMBINE_INTERLEAVE:
-                if (frame_count  >= 2)
-                    image_interleave_frames(image, pixels);
-                break;
-        }
-        image->pixmin = image->pixmax = 0;
-        ccd_image_histogram(image);
-    }
+    unsigned int i;
+
+    for (i = 0; i < stack->frame_count && stack->frames; i++)
+        free(stack->frames[i].name);
+    if (stack->spill_fd >= 0)
+        close(stack->spill_fd);
+    free(stack->frames);
+    free(stack->accum);
+    free(stack);
 }
 static int set_color_matrix_filter(unsigned int filter[4][2], unsigned int color, unsigned int mask)
 {
@@ -1368,6 +2696,293 @@ static int set_color_matrix_filter(unsigned int filter[4][2], unsigned int color
     }
     return (1);
 }
+/*
+ * Color matrix engine.
+ * Demosaics any of the 2x2 or alternating interlaced color matrices into full
+ * resolution red, green and blue. Every distinct filter color is interpolated
+ * at each pixel from the same colored neighbours in its 3x3 window, either
+ * all of them (bilinear) or, when they lie both across and along the row,
+ * only those in the direction of least change (edge-directed). The filter
+ * colors are then mapped to RGB by the least squares inverse of their masks,
+ * which is the identity for primary matrices and also unmixes complementary
+ * (CMYG) ones. Neighbour tables are built once per matrix layout so the
+ * inner loop does no filter lookups, rows are split across threads, and the
+ * output buffers are kept for the next frame of the same size.
+ */
+#define DEBAYER_MAX_COLORS      8
+struct debayer_taps
+{
+    int         count;
+    int         h_count;
+    int         v_count;
+    signed char dx[8];
+    signed char dy[8];
+    signed char h_dx[2];
+    signed char v_dy[2];
+};
+struct ccd_debayer
+{
+    unsigned int        width;
+    unsigned int        height;
+    unsigned int        pixel_size;
+    unsigned int        color;
+    unsigned int        mask;
+    unsigned char      *planes[3];
+    unsigned char      *interleaved;
+    int                 num_colors;
+    int                 cell[4][2];
+    struct debayer_taps taps[4][2][DEBAYER_MAX_COLORS];
+    float               to_rgb[3][DEBAYER_MAX_COLORS];
+};
+struct debayer_job
+{
+    struct ccd_debayer *debayer;
+    float              *plane;
+    int                 pitch;
+    int                 width;
+    int                 height;
+    int                 method;
+    unsigned char      *out[3];
+    unsigned char      *interleaved;
+    float               pixel_max;
+};
+/*
+ * Build the per-cell neighbour tables and the filter to RGB matrix.
+ */
+static int debayer_layout(struct ccd_debayer *debayer, unsigned int color, unsigned int mask)
+{
+    unsigned int         filter[4][2], colors[DEBAYER_MAX_COLORS];
+    int                  px, py, dx, dy, c, i, j, k;
+    double               ata[3][3], inv[3][3], a[DEBAYER_MAX_COLORS][3], det;
+    struct debayer_taps *taps;
+
+    if (!set_color_matrix_filter(filter, color, mask))
+        return (0);
+    debayer->num_colors = 0;
+    for (py = 0; py < 4; py++)
+        for (px = 0; px < 2; px++)
+        {
+            for (c = 0; c < debayer->num_colors && colors[c] != filter[py][px]; c++);
+            if (c == debayer->num_colors)
+                colors[debayer->num_colors++] = filter[py][px];
+            debayer->cell[py][px] = c;
+        }
+    for (py = 0; py < 4; py++)
+        for (px = 0; px < 2; px++)
+            for (c = 0; c < debayer->num_colors; c++)
+            {
+                taps = &debayer->taps[py][px][c];
+                taps->count = taps->h_count = taps->v_count = 0;
+                for (dy = -1; dy <= 1; dy++)
+                    for (dx = -1; dx <= 1; dx++)
+                        if ((dx || dy) && debayer->cell[(py + dy) & 3][(px + dx) & 1] == c)
+                        {
+                            taps->dx[taps->count]   = dx;
+                            taps->dy[taps->count++] = dy;
+                            if (dy == 0)
+                                taps->h_dx[taps->h_count++] = dx;
+                            if (dx == 0)
+                                taps->v_dy[taps->v_count++] = dy;
+                        }
+            }
+    /*
+     * Each filter passes the sum of the primaries in its mask. Invert that
+     * in the least squares sense: to_rgb = (A'A)^-1 A'.
+     */
+    for (c = 0; c < debayer->num_colors; c++)
+    {
+        a[c][0] = colors[c] & 0xF00 ? 1.0 : 0.0;
+        a[c][1] = colors[c] & 0x0F0 ? 1.0 : 0.0;
+        a[c][2] = colors[c] & 0x00F ? 1.0 : 0.0;
+    }
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++)
+            for (ata[i][j] = 0.0, c = 0; c < debayer->num_colors; c++)
+                ata[i][j] += a[c][i] * a[c][j];
+    det = ata[0][0] * (ata[1][1] * ata[2][2] - ata[1][2] * ata[2][1])
+        - ata[0][1] * (ata[1][0] * ata[2][2] - ata[1][2] * ata[2][0])
+        + ata[0][2] * (ata[1][0] * ata[2][1] - ata[1][1] * ata[2][0]);
+    if (fabs(det) < 1.0e-6)
+        return (0);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 3; j++)
+        {
+            /*
+             * Cofactor of the transposed element.
+             */
+            int r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+            inv[i][j] = (ata[r0][c0] * ata[r1][c1] - ata[r0][c1] * ata[r1][c0]) / det;
+        }
+    for (i = 0; i < 3; i++)
+        for (c = 0; c < debayer->num_colors; c++)
+            for (debayer->to_rgb[i][c] = 0.0, k = 0; k < 3; k++)
+                debayer->to_rgb[i][c] += inv[i][k] * a[c][k];
+    debayer->color = color;
+    debayer->mask  = mask;
+    return (1);
+}
+static void debayer_rows(void *ctx, unsigned int first, unsigned int count)
+{
+    struct debayer_job  *job     = ctx;
+    struct ccd_debayer  *debayer = job->debayer;
+    struct debayer_taps *taps;
+    int                  x, y, c, i, n, own, border;
+    float               *p, *rgb, sum, gh, gv, value[DEBAYER_MAX_COLORS];
+
+    if (!(rgb = malloc(sizeof(float) * job->width * 3)))
+        return;
+    for (y = first; y < first + count; y++)
+    {
+        for (x = 0; x < job->width; x++)
+        {
+            /*
+             * The plane has a one pixel zero border, so neighbours can always
+             * be read; at the frame edge they are just left out.
+             */
+            p      = job->plane + (y + 1) * job->pitch + x + 1;
+            border = x == 0 || y == 0 || x == job->width - 1 || y == job->height - 1;
+            own    = debayer->cell[y & 3][x & 1];
+            gh     = fabs(p[-1] - p[1]);
+            gv     = fabs(p[-job->pitch] - p[job->pitch]);
+            for (c = 0; c < debayer->num_colors; c++)
+            {
+                taps = &debayer->taps[y & 3][x & 1][c];
+                sum  = 0.0;
+                n    = 0;
+                if (c == own)
+                {
+                    sum = p[0];
+                    n   = 1;
+                }
+                else if (job->method == CCD_DEBAYER_EDGE && !border && taps->h_count && taps->v_count && gh != gv)
+                {
+                    if (gh < gv)
+                        for (i = 0; i < taps->h_count; i++, n++)
+                            sum += p[taps->h_dx[i]];
+                    else
+                        for (i = 0; i < taps->v_count; i++, n++)
+                            sum += p[taps->v_dy[i] * job->pitch];
+                }
+                else if (!border)
+                    for (i = 0; i < taps->count; i++, n++)
+                        sum += p[taps->dy[i] * job->pitch + taps->dx[i]];
+                else
+                    for (i = 0; i < taps->count; i++)
+                        if (x + taps->dx[i] >= 0 && x + taps->dx[i] < job->width
+                         && y + taps->dy[i] >= 0 && y + taps->dy[i] < job->height)
+                        {
+                            sum += p[taps->dy[i] * job->pitch + taps->dx[i]];
+                            n++;
+                        }
+                value[c] = n ? sum / n : 0.0;
+            }
+            for (i = 0; i < 3; i++)
+            {
+                for (sum = 0.0, c = 0; c < debayer->num_colors; c++)
+                    sum += debayer->to_rgb[i][c] * value[c];
+                rgb[x * 3 + i] = min(max(0.0, sum), job->pixel_max);
+            }
+        }
+
+#define PIXEL_LOOP(pixel_type)                                                                  \
+        if (job->interleaved)                                                                   \
+            for (x = 0; x < job->width * 3; x++)                                                \
+                ((pixel_type *)job->interleaved)[y * job->width * 3 + x] = rgb[x] + 0.5;        \
+        else                                                                                    \
+            for (i = 0; i < 3; i++)                                                             \
+                for (x = 0; x < job->width; x++)                                                \
+                    ((pixel_type *)job->out[i])[y * job->width + x] = rgb[x * 3 + i] + 0.5;
+
+        PIXEL_SIZE_CASE(debayer->pixel_size);
+#undef PIXEL_LOOP
+
+    }
+    free(rgb);
+}
+struct ccd_debayer *ccd_debayer_new(void)
+{
+    return (calloc(1, sizeof(struct ccd_debayer)));
+}
+void ccd_debayer_delete(struct ccd_debayer *debayer)
+{
+    if (debayer)
+    {
+        free(debayer->planes[0]);
+        free(debayer->planes[1]);
+        free(debayer->planes[2]);
+        free(debayer->interleaved);
+        free(debayer);
+    }
+}
+/*
+ * Demosaic the image. Output goes to the caller's buffers when given, else to
+ * buffers owned by the engine that stay valid until the next call. Returns 0
+ * when the image has no usable color matrix.
+ */
+int ccd_debayer_image(struct ccd_debayer *debayer, struct ccd_image *image, int method, int interleaved, unsigned char *out[3])
+{
+    struct debayer_job job;
+    unsigned int       i, frame_size;
+
+    if ((image->color & 0xC000) != CCD_COLOR_MATRIX_2X2)
+        return (0);
+    if ((debayer->color != image->color || debayer->mask != (image->color & image->filter))
+     && !debayer_layout(debayer, image->color, image->color & image->filter))
+    {
+        debayer->color = debayer->mask = 0;
+        return (0);
+    }
+    if (debayer->width != image->width || debayer->height != image->height || debayer->pixel_size != (image->depth + 7) / 8)
+    {
+        for (i = 0; i < 3; i++)
+        {
+            free(debayer->planes[i]);
+            debayer->planes[i] = NULL;
+        }
+        free(debayer->interleaved);
+        debayer->interleaved = NULL;
+        debayer->width       = image->width;
+        debayer->height      = image->height;
+        debayer->pixel_size  = (image->depth + 7) / 8;
+    }
+    frame_size = image->width * image->height * debayer->pixel_size;
+    memset(&job, 0, sizeof(job));
+    if (interleaved)
+    {
+        if (!out || !(job.interleaved = out[0]))
+        {
+            if (!debayer->interleaved && !(debayer->interleaved = malloc(frame_size * 3)))
+                return (0);
+            job.interleaved = debayer->interleaved;
+            if (out)
+                out[0] = job.interleaved;
+        }
+    }
+    else
+        for (i = 0; i < 3; i++)
+        {
+            if (!out || !(job.out[i] = out[i]))
+            {
+                if (!debayer->planes[i] && !(debayer->planes[i] = malloc(frame_size)))
+                    return (0);
+                job.out[i] = debayer->planes[i];
+                if (out)
+                    out[i] = job.out[i];
+            }
+        }
+    if (!(job.plane = load_plane(image, image->pixels, 1, 1)))
+        return (0);
+    job.debayer   = debayer;
+    job.pitch     = image->width + 2;
+    job.width     = image->width;
+    job.height    = image->height;
+    job.method    = method;
+    job.pixel_max = image->datamax ? image->datamax : (float)((1UL << image->depth) - 1);
+    parallel_rows(image->height, debayer_rows, &job);
+    free(job.plane);
+    return (1);
+}
+static struct ccd_debayer *split_debayer = NULL;
 /*
  * Split image into color components.
  */
@@ -1403,6 +3018,44 @@ int ccd_image_split_frames(struct ccd_image *image, unsigned char *pixels[5], un
          */
         if (!set_color_matrix_filter(filter, image->color, image->color & image->filter))
             return (0);
+        if (lrgb_split)
+        {
+            /*
+             * Full resolution RGB from the color engine, with their sum as luminance.
+             */
+            if (!split_debayer && !(split_debayer = ccd_debayer_new()))
+                return (0);
+            for (i = 0; i < 4; i++)
+                pixels[i] = malloc(image_size);
+            if (!pixels[0] || !pixels[1] || !pixels[2] || !pixels[3]
+             || !ccd_debayer_image(split_debayer, image, CCD_DEBAYER_EDGE, 0, pixels))
+            {
+                for (i = 0; i < 4; i++)
+                {
+                    free(pixels[i]);
+                    pixels[i] = NULL;
+                }
+                return (0);
+            }
+            colors[0] = 0xF00;
+            colors[1] = 0x0F0;
+            colors[2] = 0x00F;
+            colors[3] = CCD_COLOR_MONOCHROME;
+
+#define PIXEL_LOOP(pixel_type)                                                                  \
+            for (pixel_offset = 0; pixel_offset < image->width * image->height; pixel_offset++) \
+            {                                                                                   \
+                sum = (float)((pixel_type *)pixels[0])[pixel_offset]                            \
+                    + (float)((pixel_type *)pixels[1])[pixel_offset]                            \
+                    + (float)((pixel_type *)pixels[2])[pixel_offset];                           \
+                ((pixel_type *)pixels[3])[pixel_offset] = min(sum, pixel_max);                  \
+            }
+
+            PIXEL_SIZE_CASE(pixel_size);
+#undef PIXEL_LOOP
+
+            return (4);
+        }
         for (y_matrix = 0; y_matrix < 2; y_matrix++)
             for (x_matrix = 0; x_matrix < 2; x_matrix++)
                 /*
@@ -1457,91 +3110,6 @@ int ccd_image_split_frames(struct ccd_image *image, unsigned char *pixels[5], un
             pixels[i]  = ccd_image_convolve(&scaled_image, NULL, 1, 1, (float *)kernel);
             free(scaled_image.pixels);
         }
-        /*
-         * Convert CMY to RGB.
-         */
-        if (lrgb_split)
-        {
-//            float cyan_ave = 0.0, yellow_ave = 0.0, magenta_ave = 0.0;
-            int   cyan     = -1,  yellow     = -1,  magenta     = -1;
-            for (i = 0; i < num_colors; i++)
-                switch (colors[i])
-                {
-                    case 0xFF0: // Yellow
-//                        scaled_image.pixels = pixels[i];
-//                        scaled_image.pixmin = scaled_image.pixmax = 0;
-//                        ccd_image_histogram(&scaled_image);
-//                        yellow_ave = scaled_image.pixave;
-                        yellow     = i;
-                        break;
-                    case 0x0FF: // Cyan
-//                        scaled_image.pixels = pixels[i];
-//                        scaled_image.pixmin = scaled_image.pixmax = 0;
-//                        ccd_image_histogram(&scaled_image);
-//                        cyan_ave = scaled_image.pixave;
-                        cyan     = i;
-                        break;
-                    case 0xF0F: // Magenta
-//                        scaled_image.pixels = pixels[i];
-//                        scaled_image.pixmin = scaled_image.pixmax = 0;
-//                        ccd_image_histogram(&scaled_image);
-//                        magenta_ave = scaled_image.pixave;
-                        magenta     = i;
-                        break;
-                }
-            if (cyan >= 0 && yellow >= 0 && magenta >= 0)
-            {
-                unsigned char *red, *green, *blue, *color_pixels, *add1_pixels, *add2_pixels, *sub_pixels;
-//                float          add1_scale, add2_scale, sub_scale, ave_scale;
-
-#define PIXEL_LOOP(pixel_type)                                                                                  \
-                for (y = 0; y < image->height/2; y++)                                                           \
-                    for (x = 0; x < image->width/2; x++)                                                        \
-                    {                                                                                           \
-                        sum = /*add1_scale * */(float)((pixel_type *)add1_pixels)[y * (image->width/2) + x]         \
-                            + /*add2_scale * */(float)((pixel_type *)add2_pixels)[y * (image->width/2) + x]         \
-                            - /*sub_scale  * */(float)((pixel_type *)sub_pixels) [y * (image->width/2) + x];        \
-                        ((pixel_type *)color_pixels)[y * (image->width/2) + x] = max(0, min(pixel_max, sum));   \
-                    }
-
-//                ave_scale    = (cyan_ave + yellow_ave + magenta_ave) / 3.0;
-                color_pixels = red = malloc(color_size);
-//                add1_scale   = ave_scale / yellow_ave;
-//                add2_scale   = ave_scale / magenta_ave;
-//                sub_scale    = ave_scale / cyan_ave;
-                add1_pixels  = pixels[yellow];
-                add2_pixels  = pixels[magenta];
-                sub_pixels   = pixels[cyan];
-                PIXEL_SIZE_CASE(pixel_size);
-                color_pixels = green = malloc(color_size);
-//                add1_scale   = ave_scale / yellow_ave;
-//                add2_scale   = ave_scale / cyan_ave;
-//                sub_scale    = ave_scale / magenta_ave;
-                add1_pixels  = pixels[yellow];
-                add2_pixels  = pixels[cyan];
-                sub_pixels   = pixels[magenta];
-                PIXEL_SIZE_CASE(pixel_size);
-                color_pixels = blue = malloc(color_size);
-//                add1_scale   = ave_scale / magenta_ave;
-//                add2_scale   = ave_scale / cyan_ave;
-//                sub_scale    = ave_scale / yellow_ave;
-                add1_pixels  = pixels[magenta];
-                add2_pixels  = pixels[cyan];
-                sub_pixels   = pixels[yellow];
-                PIXEL_SIZE_CASE(pixel_size);
-#undef PIXEL_LOOP
-
-                free(pixels[cyan]);
-                free(pixels[magenta]);
-                free(pixels[yellow]);
-                pixels[cyan]    = red;
-                colors[cyan]    = 0xF00;
-                pixels[magenta] = green;
-                colors[magenta] = 0x0F0;
-                pixels[yellow]  = blue;
-                colors[yellow]  = 0x00F;
-            }
-        }
         /*
          * Combine duplicates.
          */
@@ -1590,139 +3158,6 @@ int ccd_image_split_frames(struct ccd_image *image, unsigned char *pixels[5], un
                 ccd_image_scale(&scaled_image, image->width, image->height);
                 pixels[i] = scaled_image.pixels;
             }
-        if (lrgb_split)
-        {
-            struct ccd_image lum;
-#if 0
-            float filter_weight[4][2], color_weight[7];
-
-            for (i = 0; i < num_colors; i++)
-            {
-                switch (colors[i])
-                {
-                    case 0xFFF:
-                        color_weight[i] = 1.0;
-                        break;
-                    case 0x00F:
-                        color_weight[i] = 0.333;
-                        break;
-                    case 0x0F0:
-                        color_weight[i] = 0.333;
-                        break;
-                    case 0xF00:
-                        color_weight[i] = 0.333;
-                        break;
-                    case 0x0FF:
-                        color_weight[i] = 0.667;
-                        break;
-                    case 0xFF0:
-                        color_weight[i] = 0.667;
-                        break;
-                    case 0xF0F:
-                        color_weight[i] = 0.667;
-                        break;
-                    default:
-                        color_weight[i] = 0.0;
-                        break;
-                }
-            }
-            for (y = 0; y < 4; y++)
-                for (x = 0; x < 2; x++)
-                    switch (filter[y][x])
-                    {
-                        case 0xFFF:
-                            filter_weight[y][x] = 1.0;
-                            break;
-                        case 0x00F:
-                            filter_weight[y][x] = 0.333;
-                            break;
-                        case 0x0F0:
-                            filter_weight[y][x] = 0.333;
-                            break;
-                        case 0xF00:
-                            filter_weight[y][x] = 0.333;
-                            break;
-                        case 0x0FF:
-                            filter_weight[y][x] = 0.667;
-                            break;
-                        case 0xFF0:
-                            filter_weight[y][x] = 0.667;
-                            break;
-                        case 0xF0F:
-                            filter_weight[y][x] = 0.667;
-                            break;
-                        default:
-                            filter_weight[y][x] = 0.0;
-                            break;
-                    }
-            /*
-             * Create luminance frame.
-             */
-            pixels[num_colors] = malloc(image_size);
-            colors[num_colors] = CCD_COLOR_MONOCHROME;
-
-#define PIXEL_LOOP(pixel_type)                                                                                                                                  \
-            for (y = 0; y < image->height; y++)                                                                                                                 \
-                for (x = 0; x < image->width; x++)                                                                                                              \
-                {                                                                                                                                               \
-                    pixel_offset = y * image->width + x;                                                                                                        \
-                    for (i = 0; i < num_colors; i++)                                                                                                            \
-                        if ((filter[y&3][x&1] & colors[i]) == 0)                                                                                                \
-                            ((pixel_type *)pixels[num_colors])[pixel_offset] = min(((pixel_type *)image->pixels)[pixel_offset] * filter_weight[y&3][x&1] + ((pixel_type *)pixels[i])[pixel_offset] * color_weight[i], pixel_max);\
-                }
-
-            PIXEL_SIZE_CASE(pixel_size);
-#else
-            /*
-             * Create luminance frame.
-             */
-            pixels[num_colors] = malloc(image_size);
-            colors[num_colors] = CCD_COLOR_MONOCHROME;
-
-#define PIXEL_LOOP(pixel_type)                                                                                                                                  \
-            for (y = 0; y < image->height; y++)                                                                                                                 \
-                for (x = 0; x < image->width; x++)                                                                                                              \
-                {                                                                                                                                               \
-                    pixel_offset = y * image->width + x;                                                                                                        \
-                    for (i = 0; i < num_colors; i++)                                                                                                            \
-                        if ((filter[y&3][x&1] & colors[i]) == 0)                                                                                                \
-                            ((pixel_type *)pixels[num_colors])[pixel_offset] = min(((pixel_type *)image->pixels)[pixel_offset] + ((pixel_type *)pixels[i])[pixel_offset], pixel_max);\
-                }
-
-            PIXEL_SIZE_CASE(pixel_size);
-#endif
-#undef PIXEL_LOOP
-
-            /*
-             * Run luminance frame through a slight blur and slight enhance to smooth out the color matrix artifacts.
-             */
-            memcpy(&lum, image, sizeof(struct ccd_image));
-            lum.pixels   = pixels[num_colors];
-            kernel[0][0] =
-            kernel[0][2] =
-            kernel[2][0] =
-            kernel[2][2] = 1.0;
-            kernel[0][1] =
-            kernel[1][0] =
-            kernel[1][2] =
-            kernel[2][1] = 2.0;
-            kernel[1][1] = 4.0;
-            pixels[num_colors] = ccd_image_convolve(&lum, NULL, 1, 1, (float *)kernel);
-            free(lum.pixels);
-            lum.pixels   = pixels[num_colors];
-            kernel[0][0] =
-            kernel[0][2] =
-            kernel[2][0] =
-            kernel[2][2] = 0.0;
-            kernel[0][1] =
-            kernel[1][0] =
-            kernel[1][2] =
-            kernel[2][1] = -1.0;
-            kernel[1][1] = 5.0;
-            pixels[num_colors] = ccd_image_convolve(&lum, NULL, 1, 1, (float *)kernel);
-            free(lum.pixels);
-            num_colors++;
-        }
     }
     return (num_colors);
 }
@@ -1751,6 +3186,8 @@ void ccd_image_add(struct ccd_image *image, unsigned long offset)
 {
     unsigned int  pixel_size, pixel_max, x, y;
 
+    if (ccd_image_modify(image) < 0)
+        return;
     pixel_size  = ((image->depth + 7) / 8);
     pixel_max   = image->datamax;
 
@@ -1769,6 +3206,8 @@ void ccd_image_sub(struct ccd_image *image, unsigned long offset)
 {
     unsigned int x, y;
 
+    if (ccd_image_modify(image) < 0)
+        return;
 
 #define PIXEL_LOOP(pixel_type)                                                                                                                  \
     for (y = 0; y < image->height; y++)                                                                                                         \
@@ -1785,6 +3224,8 @@ void ccd_image_mul(struct ccd_image *image, unsigned long factor)
 {
     unsigned int x, y;
 
+    if (ccd_image_modify(image) < 0)
+        return;
     if (factor == 0)
         factor = 1;
 
@@ -1803,6 +3244,8 @@ void ccd_image_div(struct ccd_image *image, unsigned long factor)
 {
     unsigned int x, y;
 
+    if (ccd_image_modify(image) < 0)
+        return;
     if (factor == 0)
         factor = 1;
 
@@ -1821,7 +3264,7 @@ void ccd_image_fmul(struct ccd_image *image, float factor)
 {
     unsigned int  pixel_size, pixel_max, x, y;
 
-    if (factor < 0.0)
+    if (factor < 0.0 || ccd_image_modify(image) < 0)
         return;
     pixel_size  = ((image->depth + 7) / 8);
     pixel_max   = image->datamax;
@@ -1840,65 +3283,268 @@ void ccd_image_fmul(struct ccd_image *image, float factor)
     ccd_image_histogram(image);
 }
 /*
- * Calibrate raw image.
+ * Calibration engine.
+ * The master frames are reduced once: the flat becomes a per pixel gain
+ * normalized to its central average, the bias and the exposure scaled dark
+ * are fused into one offset plane (rebuilt only when the raw exposure
+ * changes), and pixels hot in the dark or dead in the flat are collected in
+ * a defect map. A raw frame is then one branch free (raw - offset) * gain
+ * pass split across threads, after which the defects are filled in from
+ * their neighbours of the same color. The masters are copied in, so the
+ * source frames may be closed while the engine is in use.
  */
-void ccd_image_calibrate(struct ccd_image *raw, struct ccd_image *bias, struct ccd_image *dark, struct ccd_image *flat)
+#define CALIBRATE_HOT_SIGS      8.0
+#define CALIBRATE_DEAD_FLAT     0.5
+struct ccd_calibrate
 {
-    unsigned int  pixel_size, pixel_offset, x, y;
-    float         pixel, pixel_max, dark_scale;
-    static float  flat_ave;
-    static struct ccd_image *prev_flat = NULL;
-
-    if (!bias && !dark && !flat)
-        return;
-    pixel_size = ((raw->depth + 7) / 8);
-    pixel_max  = raw->datamax;
-    /*
-     * Calc dark scale factor based on exposure ratio.
-     */
-    dark_scale = (dark && dark->exposure) ? ((float)raw->exposure / (float)dark->exposure) : 1.0;
+    unsigned int   width;
+    unsigned int   height;
+    float         *bias;
+    float         *dark;
+    unsigned int   dark_exposure;
+    float         *offset;
+    int            offset_exposure;
+    float         *gain;
+    unsigned char *defect_map;
+    unsigned int  *defects;
+    unsigned int   num_defects;
+};
+struct calibrate_job
+{
+    struct ccd_calibrate *calibrate;
+    struct ccd_image     *raw;
+    float                 pixel_max;
+};
+/*
+ * Build the master context. Any of the frames may be NULL, those that are
+ * given must all be the same size.
+ */
+struct ccd_calibrate *ccd_calibrate_new(struct ccd_image *bias, struct ccd_image *dark, struct ccd_image *flat)
+{
+    struct ccd_calibrate *calibrate;
+    struct ccd_image     *master;
+    unsigned int          i, x, y, quarterx, quartery, size;
+    float                 flat_ave, dark_ave, dark_sig, hot;
+
+    master = bias ? bias : dark ? dark : flat;
+    if (!master
+     || (bias && (bias->width != master->width || bias->height != master->height))
+     || (dark && (dark->width != master->width || dark->height != master->height))
+     || (flat && (flat->width != master->width || flat->height != master->height))
+     || (bias && ccd_image_pixels(bias) < 0)
+     || (dark && ccd_image_pixels(dark) < 0)
+     || (flat && ccd_image_pixels(flat) < 0))
+        return (NULL);
+    if (!(calibrate = calloc(1, sizeof(struct ccd_calibrate))))
+        return (NULL);
+    calibrate->width           = master->width;
+    calibrate->height          = master->height;
+    calibrate->offset_exposure = -1;
+    size = master->width * master->height;
+    if (!(calibrate->defect_map = calloc(size, 1))
+     || (bias && !(calibrate->bias = load_plane(bias, bias->pixels, 0, 0)))
+     || (dark && !(calibrate->dark = load_plane(dark, dark->pixels, 0, 0)))
+     || (flat && !(calibrate->gain = load_plane(flat, flat->pixels, 0, 0)))
+     || ((bias || dark) && !(calibrate->offset = malloc(size * sizeof(float)))))
+    {
+        ccd_calibrate_delete(calibrate);
+        return (NULL);
+    }
     /*
-     * Find flat average. Do a little optimization to avoid doing this for the same flat over and over.
+     * Masters written with a pedestal (sxmaster's bias subtracted darks)
+     * get it taken off here.
      */
-    if (flat && prev_flat != flat)
+    for (i = 0; i < size; i++)
+    {
+        if (calibrate->bias) calibrate->bias[i] -= bias->pedestal;
+        if (calibrate->dark) calibrate->dark[i] -= dark->pedestal;
+        if (calibrate->gain) calibrate->gain[i] -= flat->pedestal;
+    }
+    if (dark)
+    {
+        /*
+         * Hot pixels stand well clear of the dark's noise.
+         */
+        calibrate->dark_exposure = dark->exposure;
+        dark_ave = 0.0;
+        dark_sig = 0.0;
+        for (i = 0; i < size; i++)
+            dark_ave += calibrate->dark[i];
+        dark_ave /= size;
+        for (i = 0; i < size; i++)
+            dark_sig += (calibrate->dark[i] - dark_ave) * (calibrate->dark[i] - dark_ave);
+        dark_sig = sqrt(dark_sig / max(size - 1, 1));
+        hot      = dark_ave + dark_sig * CALIBRATE_HOT_SIGS;
+        for (i = 0; i < size; i++)
+            if (dark_sig > 0.0 && calibrate->dark[i] > hot)
+                calibrate->defect_map[i] = 1;
+    }
+    if (flat)
     {
-        unsigned int quartery = flat->height / 4;
-        unsigned int quarterx = flat->width  / 4;
+        /*
+         * Normalize to the average of the central quarter, and mark the
+         * pixels that barely respond as dead.
+         */
+        quartery = flat->height / 4;
+        quarterx = flat->width  / 4;
         flat_ave = 0.0;
+        for (y = quartery; y < flat->height - quartery; y++)
+            for (x = quarterx; x < flat->width - quarterx; x++)
+                flat_ave += calibrate->gain[y * flat->width + x];
+        flat_ave /= (flat->height - quartery * 2) * (flat->width - quarterx * 2);
+        for (i = 0; i < size; i++)
+        {
+            if (calibrate->gain[i] < flat_ave * CALIBRATE_DEAD_FLAT)
+                calibrate->defect_map[i] = 1;
+            calibrate->gain[i] = flat_ave / (calibrate->gain[i] ? calibrate->gain[i] : 1.0);
+        }
+    }
+    for (i = 0; i < size; i++)
+        calibrate->num_defects += calibrate->defect_map[i];
+    if (calibrate->num_defects)
+    {
+        if (!(calibrate->defects = malloc(calibrate->num_defects * sizeof(unsigned int))))
+        {
+            ccd_calibrate_delete(calibrate);
+            return (NULL);
+        }
+        for (i = 0, calibrate->num_defects = 0; i < size; i++)
+            if (calibrate->defect_map[i])
+                calibrate->defects[calibrate->num_defects++] = i;
+    }
+    if (!dark && bias)
+    {
+        /*
+         * The offset never changes, it is just the bias.
+         */
+        memcpy(calibrate->offset, calibrate->bias, size * sizeof(float));
+        calibrate->offset_exposure = 0;
+        free(calibrate->bias);
+        calibrate->bias = NULL;
+    }
+    return (calibrate);
+}
+void ccd_calibrate_delete(struct ccd_calibrate *calibrate)
+{
+    if (calibrate)
+    {
+        if (calibrate->bias)       free(calibrate->bias);
+        if (calibrate->dark)       free(calibrate->dark);
+        if (calibrate->offset)     free(calibrate->offset);
+        if (calibrate->gain)       free(calibrate->gain);
+        if (calibrate->defect_map) free(calibrate->defect_map);
+        if (calibrate->defects)    free(calibrate->defects);
+        free(calibrate);
+    }
+}
+static void calibrate_rows(void *ctx, unsigned int first, unsigned int count)
+{
+    struct calibrate_job *job = ctx;
+    unsigned int          x, y, width;
+    float                 pixel, pixel_max, *offset, *gain;
+
+    width     = job->raw->width;
+    pixel_max = job->pixel_max;
+
+#define PIXEL_LOOP(pixel_type)                                                                          \
+    for (y = first; y < first + count; y++)                                                             \
+    {                                                                                                   \
+        pixel_type *row = (pixel_type *)job->raw->pixels + y * width;                                   \
+        offset = job->calibrate->offset ? job->calibrate->offset + y * width : NULL;                    \
+        gain   = job->calibrate->gain   ? job->calibrate->gain   + y * width : NULL;                    \
+        if (offset && gain)                                                                             \
+            for (x = 0; x < width; x++)                                                                 \
+            {                                                                                           \
+                pixel  = (row[x] - offset[x]) * gain[x];                                                \
+                row[x] = pixel <= 0.0 ? 0 : pixel > pixel_max ? (pixel_type)~0UL : (pixel_type)pixel;   \
+            }                                                                                           \
+        else if (offset)                                                                                \
+            for (x = 0; x < width; x++)                                                                 \
+            {                                                                                           \
+                pixel  = row[x] - offset[x];                                                            \
+                row[x] = pixel <= 0.0 ? 0 : pixel > pixel_max ? (pixel_type)~0UL : (pixel_type)pixel;   \
+            }                                                                                           \
+        else                                                                                            \
+            for (x = 0; x < width; x++)                                                                 \
+            {                                                                                           \
+                pixel  = row[x] * gain[x];                                                              \
+                row[x] = pixel > pixel_max ? (pixel_type)~0UL : (pixel_type)pixel;                      \
+            }                                                                                           \
+    }
 
-#define PIXEL_LOOP(pixel_type)                                                  \
-        for (y = quartery; y < flat->height - quartery; y++)                    \
-            for (x = quarterx; x < flat->width - quarterx; x++)                 \
-                flat_ave += ((pixel_type *)flat->pixels)[y * flat->width + x];
-
-        PIXEL_SIZE_CASE(pixel_size);
+    PIXEL_SIZE_CASE((job->raw->depth + 7) / 8);
 #undef PIXEL_LOOP
-
-        flat_ave /= (flat->height - quartery * 2) * (flat->width - quarterx * 2);
-        prev_flat = flat;
+}
+/*
+ * Calibrate a raw frame in place. Returns FALSE if it doesn't match the masters.
+ */
+int ccd_calibrate_image(struct ccd_calibrate *calibrate, struct ccd_image *raw)
+{
+    struct calibrate_job job;
+    unsigned int         i, x, size, step, left, right;
+    float                dark_scale;
+
+    if (!calibrate || raw->width != calibrate->width || raw->height != calibrate->height || ccd_image_modify(raw) < 0)
+        return (FALSE);
+    size = raw->width * raw->height;
+    if (calibrate->dark && calibrate->offset_exposure != raw->exposure)
+    {
+        /*
+         * Fuse bias and dark for this exposure time.
+         */
+        dark_scale = calibrate->dark_exposure ? ((float)raw->exposure / (float)calibrate->dark_exposure) : 1.0;
+        if (calibrate->bias)
+            for (i = 0; i < size; i++)
+                calibrate->offset[i] = calibrate->bias[i] + calibrate->dark[i] * dark_scale;
+        else
+            for (i = 0; i < size; i++)
+                calibrate->offset[i] = calibrate->dark[i] * dark_scale;
+        calibrate->offset_exposure = raw->exposure;
     }
+    job.calibrate = calibrate;
+    job.raw       = raw;
+    job.pixel_max = raw->datamax;
+    parallel_rows(raw->height, calibrate_rows, &job);
     /*
-     * Apply calibration to raw image.
+     * Fill defects from the nearest good pixels of the same color on the row.
      */
-
-#define PIXEL_LOOP(pixel_type)                                                                                                                                          \
-    for (y = 0; y < raw->height; y++)                                                                                                                                   \
-    {                                                                                                                                                                   \
-        for (x = 0; x < raw->width; x++)                                                                                                                                \
-        {                                                                                                                                                               \
-            pixel_offset = y * raw->width + x;                                                                                                                          \
-            pixel = ((pixel_type *)raw->pixels)[pixel_offset];                                                                                                          \
-            if (bias) pixel  = ((pixel_type *)bias->pixels)[pixel_offset]              > pixel ? 0.0 : pixel - ((pixel_type *)bias->pixels)[pixel_offset];              \
-            if (dark) pixel  = ((pixel_type *)dark->pixels)[pixel_offset] * dark_scale > pixel ? 0.0 : pixel - ((pixel_type *)dark->pixels)[pixel_offset] * dark_scale; \
-            if (flat) pixel *= flat_ave / (((pixel_type *)flat->pixels)[pixel_offset] ? ((pixel_type *)flat->pixels)[pixel_offset] : 1.0);                              \
-            ((pixel_type *)raw->pixels)[pixel_offset] = pixel > pixel_max ? ~0UL : (pixel_type)pixel;                                                                   \
-        }                                                                                                                                                               \
+    step = (raw->color != CCD_COLOR_MONOCHROME && (raw->color & 0xC000) == CCD_COLOR_MATRIX_2X2) ? 2 : 1;
+
+#define PIXEL_LOOP(pixel_type)                                                                          \
+    for (i = 0; i < calibrate->num_defects; i++)                                                        \
+    {                                                                                                   \
+        x     = calibrate->defects[i] % raw->width;                                                     \
+        left  = (x >= step && !calibrate->defect_map[calibrate->defects[i] - step]);                    \
+        right = (x + step < raw->width && !calibrate->defect_map[calibrate->defects[i] + step]);        \
+        if (left && right)                                                                              \
+            ((pixel_type *)raw->pixels)[calibrate->defects[i]] = ((unsigned long)((pixel_type *)raw->pixels)[calibrate->defects[i] - step]\
+                                                                + ((pixel_type *)raw->pixels)[calibrate->defects[i] + step]) / 2;\
+        else if (left)                                                                                  \
+            ((pixel_type *)raw->pixels)[calibrate->defects[i]] = ((pixel_type *)raw->pixels)[calibrate->defects[i] - step];\
+        else if (right)                                                                                 \
+            ((pixel_type *)raw->pixels)[calibrate->defects[i]] = ((pixel_type *)raw->pixels)[calibrate->defects[i] + step];\
     }
 
-    PIXEL_SIZE_CASE(pixel_size);
+    PIXEL_SIZE_CASE((raw->depth + 7) / 8);
 #undef PIXEL_LOOP
 
     raw->pixmin = raw->pixmax = 0;
     ccd_image_histogram(raw);
+    return (TRUE);
+}
+/*
+ * Calibrate raw image against one off masters.
+ */
+void ccd_image_calibrate(struct ccd_image *raw, struct ccd_image *bias, struct ccd_image *dark, struct ccd_image *flat)
+{
+    struct ccd_calibrate *calibrate;
+
+    if (!bias && !dark && !flat)
+        return;
+    if ((calibrate = ccd_calibrate_new(bias, dark, flat)))
+    {
+        ccd_calibrate_image(calibrate, raw);
+        ccd_calibrate_delete(calibrate);
+    }
 }
 
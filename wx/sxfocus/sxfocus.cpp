@@ -36,6 +36,7 @@
 #endif
 #include <wx/cmdline.h>
 #include <wx/config.h>
+#include <wx/thread.h>
 #include "sxfocus.h"
 #define MIN_ZOOM        -4
 #define MAX_ZOOM        4
@@ -49,6 +50,10 @@
 #define INC_EXPOSURE    100
 #define MIN_EXPOSURE    10
 #define MAX_EXPOSURE    (INC_EXPOSURE*21)
+#define RING_SIZE       3
+#define RING_FRESH      0x10
+#define FOCUS_OK        ((wxThread::ExitCode)0)
+#define FOCUS_ERR_CAMERA ((wxThread::ExitCode)-1)
 /*
  * Camera Model Overrired for generic USB/USB2 interface
  */
@@ -72,6 +77,27 @@ int FixedModels[] = {SXCCD_HX5,
 int     camUSBType      = 0;
 long    initialCamIndex = 0;
 int     ccdModel = SXCCD_MX5;
+/*
+ * Frame ring slot with the geometry it was captured at
+ */
+struct RingFrame
+{
+    uint16_t *pixels;
+    int       zoom, xOffset, yOffset, width, height, exposure;
+};
+/*
+ * CCD Acquisition Thread
+ */
+class FocusFrame;
+class FocusThread : public wxThread
+{
+public:
+    FocusThread(FocusFrame *param);
+protected:
+    virtual ExitCode Entry();
+private:
+    FocusFrame *focus;
+};
 /*
  * Focus App class
  */
@@ -86,13 +112,29 @@ class FocusFrame : public wxFrame
 {
 public:
     FocusFrame();
-private:
+protected:
+    friend class FocusThread;
+    FocusThread   *focusThread;
+    wxCriticalSection focusLock;    // Guards the capture geometry and exposure
+    bool           focusRunning;
+    /*
+     * Single producer/single consumer triple buffer. The acquisition thread
+     * reads into the slot it owns and swaps it into ringReady, flagged fresh.
+     * The display swaps the slot it holds for a fresh ringReady and keeps the
+     * new one until the next swap. A fresh frame that gets replaced before
+     * the display took it is the oldest unconsumed one, so that's the drop.
+     */
+    RingFrame      ringFrames[RING_SIZE];
+    long           ringReady, ringFront;
+    long           ringHead, ringDropped;
+    long           statsHead;
+    wxStopWatch    statsWatch;
+    RingFrame     *shownFrame;
 	HANDLE         camHandles[SXCCD_MAX_CAMS];
     t_sxccd_params camParams[SXCCD_MAX_CAMS];
     int            camSelect, camCount;
     unsigned int   ccdFrameWidth, ccdFrameHeight, ccdFrameDepth, ccdPixelCount;
     float          ccdPixelWidth, ccdPixelHeight;
-    uint16_t      *ccdFrame;
     float          xBestCentroid, yBestCentroid;
     int            xOffset, yOffset;
     int            focusZoom, focusExposure;
@@ -104,12 +146,17 @@ private:
     bool           pixelFilter, autoLevels, snapped;
     int            snapCount;
     wxImage       *focusImage;
+    struct scaler  viewScaler;
     wxTimer        focusTimer;
     void InitLevels();
+    void StartFocus();
+    void StopFocus();
     bool ConnectCamera(int index);
     void CenterCentroid(float x, float y, int width, int height);
     void OnSnapImage(wxCommandEvent& event);
     void OnTimer(wxTimerEvent& event);
+    void OnFocusFrame(wxThreadEvent& event);
+    void OnFocusError(wxThreadEvent& event);
     void OnBackground(wxEraseEvent& event);
     void OnPaint(wxPaintEvent& event);
     void OnConnect(wxCommandEvent& event);
@@ -153,9 +200,13 @@ enum
     ID_GAMMA_DEC,
     ID_EXPOSE_INC,
     ID_EXPOSE_DEC,
+    ID_FOCUS_FRAME,
+    ID_FOCUS_ERROR,
 };
 wxBEGIN_EVENT_TABLE(FocusFrame, wxFrame)
     EVT_TIMER(ID_TIMER,      FocusFrame::OnTimer)
+    EVT_THREAD(ID_FOCUS_FRAME, FocusFrame::OnFocusFrame)
+    EVT_THREAD(ID_FOCUS_ERROR, FocusFrame::OnFocusError)
     EVT_MENU(ID_CONNECT,     FocusFrame::OnConnect)
     EVT_MENU(ID_OVERRIDE,    FocusFrame::OnOverride)
     EVT_MENU(ID_SNAP,        FocusFrame::OnSnapImage)
@@ -240,12 +291,28 @@ bool FocusApp::OnInit()
     }
     return false;
 }
+/*
+ * Scale the display image to the window. The scaler keeps its weights while
+ * the window size stays the same, so redraws only pay for the filtering.
+ */
+static wxBitmap scaleBitmap(wxImage *image, int width, int height, struct scaler *viewScaler)
+{
+    wxImage scaled(width, height, false);
+    if (scalePixels(viewScaler, SCALE_BILINEAR, image->GetData(), image->GetWidth(), image->GetHeight(), image->GetWidth() * 3,
+                    scaled.GetData(), width, height, width * 3, 1, 3))
+        return wxBitmap(image->Scale(width, height, wxIMAGE_QUALITY_BILINEAR));
+    return wxBitmap(scaled);
+}
 FocusFrame::FocusFrame() : wxFrame(NULL, wxID_ANY, "SX Focus"), focusTimer(this, ID_TIMER)
 {
-    CreateStatusBar(4);
+    CreateStatusBar(5);
     snapCount    = 0;
     focusImage   = NULL;
-    ccdFrame     = NULL;
+    memset(&viewScaler, 0, sizeof(viewScaler));
+    focusThread  = NULL;
+    focusRunning = false;
+    shownFrame   = NULL;
+    memset(ringFrames, 0, sizeof(ringFrames));
     autoLevels   = false;
     pixelFilter  = false;
     pixelGamma   = 1.5;
@@ -313,7 +380,7 @@ void FocusFrame::OnPaint(wxPaintEvent& WXUNUSED(event))
         wxClientDC dc(this);
         if (focusImage)
         {
-            wxBitmap bitmap(focusImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+            wxBitmap bitmap(scaleBitmap(focusImage, winWidth, winHeight, &viewScaler));
             dc.DrawBitmap(bitmap, 0, 0);
         }
         else
@@ -329,8 +396,13 @@ bool FocusFrame::ConnectCamera(int index)
     int focusWinWidth, focusWinHeight;
     xOffset = yOffset = 0;
     InitLevels();
-    if (ccdFrame)
-        free(ccdFrame);
+    for (int i = 0; i < RING_SIZE; i++)
+        if (ringFrames[i].pixels)
+        {
+            free(ringFrames[i].pixels);
+            ringFrames[i].pixels = NULL;
+        }
+    shownFrame = NULL;
     if (focusImage)
         delete focusImage;
     if (camCount)
@@ -345,9 +417,8 @@ bool FocusFrame::ConnectCamera(int index)
         ccdPixelWidth  = camParams[camSelect].pix_width;
         ccdPixelHeight = camParams[camSelect].pix_height;
         ccdPixelCount  = FRAMEBUF_COUNT(ccdFrameWidth, ccdFrameHeight, 1, 1);
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-        ccdFrame = (uint16_t *)malloc(sizeof(uint16_t) * ccdPixelCount);
-        focusTimer.StartOnce(focusExposure);
+        for (int i = 0; i < RING_SIZE; i++)
+            ringFrames[i].pixels = (uint16_t *)malloc(sizeof(uint16_t) * ccdPixelCount);
         sprintf(statusText, "Attached: %cX-%d[%d]", ccdModel & SXCCD_INTERLEAVE ? 'M' : 'H', ccdModel & 0x3F, camSelect);
     }
     else
@@ -357,7 +428,6 @@ bool FocusFrame::ConnectCamera(int index)
         ccdFrameWidth = ccdFrameHeight = 512;
         ccdFrameDepth = 16;
         ccdPixelWidth = ccdPixelHeight = 1;
-        ccdFrame      = NULL;
         strcpy(statusText, "Attached: None");
     }
     if (!IsMaximized())
@@ -378,12 +448,13 @@ bool FocusFrame::ConnectCamera(int index)
     focusImage = new wxImage(zoomWidth, zoomHeight);
     SetStatusText(statusText, 0);
     SetStatusText("Bin: X2", 1);
+    if (camSelect >= 0)
+        StartFocus();
     return camSelect >= 0;
 }
 void FocusFrame::OnConnect(wxCommandEvent& WXUNUSED(event))
 {
-    if (focusTimer.IsRunning())
-        focusTimer.Stop();
+    StopFocus();
 	if (camCount)   sxRelease(camHandles, camCount);
     if ((camCount = sxProbe(camHandles, camParams, camUSBType)) == 0)
     {
@@ -403,17 +474,13 @@ void FocusFrame::OnConnect(wxCommandEvent& WXUNUSED(event))
                           CamChoices);
     if (dlg.ShowModal() == wxID_OK )
         ConnectCamera(dlg.GetSelection());
-    else if (camSelect)
-    {
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-        focusTimer.StartOnce(focusExposure);
-    }
+    else if (camSelect >= 0)
+        StartFocus();
 }
 void FocusFrame::OnOverride(wxCommandEvent& WXUNUSED(event))
 {
 #ifndef _MSC_VER
-    if (focusTimer.IsRunning())
-        focusTimer.Stop();
+    StopFocus();
 	if (camCount)   sxRelease(camHandles, camCount);
     if ((camCount = sxProbe(camHandles, camParams, camUSBType)) == 0)
     {
@@ -437,10 +504,7 @@ void FocusFrame::OnOverride(wxCommandEvent& WXUNUSED(event))
         config.Write(wxT("USB1Camera"), camUSBType);
     }
     else
-    {
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-        focusTimer.StartOnce(focusExposure);
-    }
+        StartFocus();
 #endif
 }
 void FocusFrame::CenterCentroid(float x, float y, int width, int height)
@@ -461,13 +525,21 @@ void FocusFrame::CenterCentroid(float x, float y, int width, int height)
 }
 void FocusFrame::OnSnapImage(wxCommandEvent& WXUNUSED(event))
 {
-    if (!snapped)
+    if (!snapped && shownFrame)
     {
+        /*
+         * The displayed slot stays reserved until the next frame is shown.
+         */
+        RingFrame *frame = shownFrame;
         char fits_file[30];
         sprintf(fits_file, "sxfocus-%03d.fits", snapCount++);
         if (fits_open(fits_file)
-         || fits_write_image(ccdFrame, zoomWidth, zoomHeight)
-         || fits_write_key_int("EXPOSURE", focusExposure, "Total Exposure Time")
+         || fits_write_image(frame->pixels, frame->width, frame->height)
+         || fits_write_key_int("EXPOSURE", frame->exposure, "Total Exposure Time")
+         || fits_write_key_int("XBINNING", frame->zoom < 1 ? 1 << -frame->zoom : 1, "Horizontal Binning")
+         || fits_write_key_int("YBINNING", frame->zoom < 1 ? 1 << -frame->zoom : 1, "Vertical Binning")
+         || fits_write_key_int("XORGSUBF", frame->zoom < 1 ? 0 : frame->xOffset, "Subframe X Origin")
+         || fits_write_key_int("YORGSUBF", frame->zoom < 1 ? 0 : frame->yOffset, "Subframe Y Origin")
          || fits_write_key_string("CREATOR", "sxFocus", "Imaging Application")
          || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device")
          || fits_close())
@@ -480,54 +552,156 @@ void FocusFrame::OnSnapImage(wxCommandEvent& WXUNUSED(event))
         wxBell();
     }
 }
-void FocusFrame::OnTimer(wxTimerEvent& WXUNUSED(event))
+FocusThread::FocusThread(FocusFrame *param) : wxThread(wxTHREAD_JOINABLE)
 {
-    int focusWinWidth, focusWinHeight;
-    int pixCount;
-    if (focusExposure == MIN_EXPOSURE)
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-    if (focusZoom < 1)
+    focus = param;
+    Create();
+}
+wxThread::ExitCode FocusThread::Entry()
+{
+    HANDLE    cam  = focus->camHandles[focus->camSelect];
+    RingFrame shot, *frame;
+    long      back = 0, ready;
+    int       pixCount;
+    sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
+    while (focus->focusRunning)
     {
-        sxLatchImage(camHandles[camSelect], // cam handle
-                     SXCCD_EXP_FLAGS_FIELD_BOTH, // options
-                     SXCCD_IMAGE_HEAD, // main ccd
-                     0, // xoffset
-                     0, // yoffset
-                     ccdFrameWidth, // width
-                     ccdFrameHeight, // height
-                     1 << -focusZoom, // xbin
-                     1 << -focusZoom); // ybin
-        pixCount = FRAMEBUF_COUNT(ccdFrameWidth, ccdFrameHeight, 1 << -focusZoom, 1 << -focusZoom);
+        /*
+         * Capture geometry is sampled once per frame and travels with it.
+         */
+        focus->focusLock.Enter();
+        shot.zoom     = focus->focusZoom;
+        shot.xOffset  = focus->xOffset;
+        shot.yOffset  = focus->yOffset;
+        shot.width    = focus->zoomWidth;
+        shot.height   = focus->zoomHeight;
+        shot.exposure = focus->focusExposure;
+        focus->focusLock.Leave();
+        wxMilliSleep(shot.exposure);
+        if (shot.exposure == MIN_EXPOSURE)
+            sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
+        /*
+         * Never wait on the display, the back slot is always ours.
+         */
+        frame = &focus->ringFrames[back];
+        if (shot.zoom < 1)
+        {
+            sxLatchImage(cam, // cam handle
+                         SXCCD_EXP_FLAGS_FIELD_BOTH, // options
+                         SXCCD_IMAGE_HEAD, // main ccd
+                         0, // xoffset
+                         0, // yoffset
+                         focus->ccdFrameWidth, // width
+                         focus->ccdFrameHeight, // height
+                         1 << -shot.zoom, // xbin
+                         1 << -shot.zoom); // ybin
+            pixCount = FRAMEBUF_COUNT(focus->ccdFrameWidth, focus->ccdFrameHeight, 1 << -shot.zoom, 1 << -shot.zoom);
+        }
+        else
+        {
+            sxLatchImage(cam, // cam handle
+                         SXCCD_EXP_FLAGS_FIELD_BOTH, // options
+                         SXCCD_IMAGE_HEAD, // main ccd
+                         shot.xOffset, // xoffset
+                         shot.yOffset, // yoffset
+                         shot.width,   // width
+                         shot.height,  // height
+                         1, // xbin
+                         1); // ybin
+            pixCount = FRAMEBUF_COUNT(shot.width, shot.height, 1, 1);
+        }
+        if (!sxReadImage(cam, // cam handle
+                         frame->pixels, //pixbuf
+                         pixCount)) // pix count
+        {
+            wxQueueEvent(focus, new wxThreadEvent(wxEVT_THREAD, ID_FOCUS_ERROR));
+            return FOCUS_ERR_CAMERA;
+        }
+        shot.pixels = frame->pixels;
+        *frame      = shot;
+        /*
+         * Publish the newest frame. If the one it replaces was never shown,
+         * that older frame is the one dropped.
+         */
+        ready = RING_EXCHANGE(focus->ringReady, back | RING_FRESH);
+        back  = ready & ~RING_FRESH;
+        if (ready & RING_FRESH)
+            RING_STORE(focus->ringDropped, focus->ringDropped + 1);
+        RING_STORE(focus->ringHead, focus->ringHead + 1);
+        wxQueueEvent(focus, new wxThreadEvent(wxEVT_THREAD, ID_FOCUS_FRAME));
+        /*
+         * Prep next frame
+         */
+        if (shot.exposure < MAX_EXPOSURE)
+            sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
     }
-    else
+    return FOCUS_OK;
+}
+void FocusFrame::StartFocus()
+{
+    ringReady      = 1;
+    ringFront      = 2;
+    ringHead       = 0;
+    ringDropped    = 0;
+    statsHead      = 0;
+    shownFrame     = NULL;
+    snapped        = true;
+    focusRunning   = true;
+    focusThread    = new FocusThread(this);
+    focusThread->Run();
+    statsWatch.Start();
+    focusTimer.Start(1000); // Frame rate update
+}
+void FocusFrame::StopFocus()
+{
+    if (focusThread)
     {
-        sxLatchImage(camHandles[camSelect], // cam handle
-                     SXCCD_EXP_FLAGS_FIELD_BOTH, // options
-                     SXCCD_IMAGE_HEAD, // main ccd
-                     xOffset,    // xoffset
-                     yOffset,    // yoffset
-                     zoomWidth,  // width
-                     zoomHeight, // height
-                     1, // xbin
-                     1); // ybin
-        pixCount = FRAMEBUF_COUNT(zoomWidth, zoomHeight, 1, 1);
+        focusTimer.Stop();
+        focusRunning = false;
+        focusThread->Wait();
+        delete focusThread;
+        focusThread = NULL;
     }
-    if (!sxReadImage(camHandles[camSelect], // cam handle
-                     ccdFrame, //pixbuf
-                     pixCount)) // pix count
+}
+void FocusFrame::OnTimer(wxTimerEvent& WXUNUSED(event))
+{
+    char statusText[40];
+    long head    = RING_LOAD(ringHead);
+    long elapsed = statsWatch.Time();
+    statsWatch.Start();
+    if (elapsed > 0)
     {
-        wxMessageBox("Camera Error", "SX Focus", wxOK | wxICON_INFORMATION);
-        return;
+        sprintf(statusText, "%.1f fps, %ld dropped", (head - statsHead) * 1000.0 / elapsed, RING_LOAD(ringDropped));
+        SetStatusText(statusText, 4);
+    }
+    statsHead = head;
+}
+void FocusFrame::OnFocusFrame(wxThreadEvent& WXUNUSED(event))
+{
+    int focusWinWidth, focusWinHeight;
+    if (!focusRunning || !(RING_LOAD(ringReady) & RING_FRESH))
+        return; // Already showing the newest frame
+    /*
+     * Take the newest frame and hand the shown slot back.
+     */
+    ringFront = RING_EXCHANGE(ringReady, ringFront) & ~RING_FRESH;
+    RingFrame *frame = &ringFrames[ringFront];
+    shownFrame = frame;
+    snapped    = false;
+    if (!focusImage || focusImage->GetWidth() != frame->width || focusImage->GetHeight() != frame->height)
+    {
+        if (focusImage)
+            delete focusImage;
+        focusImage = new wxImage(frame->width, frame->height);
     }
-    snapped = false;
     /*
      * Convert 16 bit samples to 24 BPP image
      */
     unsigned char *rgb = focusImage->GetData();
-    uint16_t      *m16 = ccdFrame;
+    uint16_t      *m16 = frame->pixels;
     pixelMin = MAX_PIX;
     pixelMax = MIN_PIX;
-    for (int l = 0; l < zoomHeight*zoomWidth; l++)
+    for (int l = 0; l < frame->height*frame->width; l++)
     {
         if (*m16 < pixelMin) pixelMin = *m16;
         if (*m16 > pixelMax) pixelMax = *m16;
@@ -547,29 +721,37 @@ void FocusFrame::OnTimer(wxTimerEvent& WXUNUSED(event))
     if (focusWinWidth > 0 && focusWinHeight > 0)
     {
         wxClientDC dc(this);
-        wxBitmap bitmap(focusImage->Scale(focusWinWidth, focusWinHeight, wxIMAGE_QUALITY_BILINEAR));
+        wxBitmap bitmap(scaleBitmap(focusImage, focusWinWidth, focusWinHeight, &viewScaler));
         dc.DrawBitmap(bitmap, 0, 0);
-        xBestCentroid  = zoomWidth  / 2;
-        yBestCentroid  = zoomHeight / 2;
+        xBestCentroid  = frame->width  / 2;
+        yBestCentroid  = frame->height / 2;
         int xRadius = 100 / ccdPixelWidth;  // Max centroid radius
         int yRadius = 100 / ccdPixelHeight;
-        if (findBestCentroid(zoomWidth,
-                             zoomHeight,
-                             ccdFrame,
+        if (findBestCentroid(frame->width,
+                             frame->height,
+                             frame->pixels,
                              &xBestCentroid, // centroid coordinate
                              &yBestCentroid,
-                             zoomWidth  / 2, // search entire frame
-                             zoomHeight / 2,
+                             frame->width  / 2, // search entire frame
+                             frame->height / 2,
                              &xRadius,
                              &yRadius,
                              1.0))
         {
-            if (zoomTracking) CenterCentroid(xBestCentroid, yBestCentroid, zoomWidth, zoomHeight);
+            if (zoomTracking)
+            {
+                wxCriticalSectionLocker lock(focusLock);
+                /*
+                 * Only steer from a frame taken at the current window position.
+                 */
+                if (frame->zoom == focusZoom && frame->xOffset == xOffset && frame->yOffset == yOffset)
+                    CenterCentroid(xBestCentroid, yBestCentroid, frame->width, frame->height);
+            }
             /*
              * Draw ellipse around best star depicting FWHM
              */
-            float xScale = (float)focusWinWidth  / (float)zoomWidth;
-            float yScale = (float)focusWinHeight / (float)zoomHeight;
+            float xScale = (float)focusWinWidth  / (float)frame->width;
+            float yScale = (float)focusWinHeight / (float)frame->height;
             xRadius *= 2 * xScale;
             yRadius *= 2 * yScale;
             dc.SetPen(wxPen(*wxGREEN, 1, wxSOLID));
@@ -582,12 +764,11 @@ void FocusFrame::OnTimer(wxTimerEvent& WXUNUSED(event))
     SetStatusText(minmax, 2);
     sprintf(minmax, "Max: %d", pixelMax);
     SetStatusText(minmax, 3);
-    /*
-     * Prep next frame
-     */
-    if (focusExposure < MAX_EXPOSURE)
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-    focusTimer.StartOnce(focusExposure);
+}
+void FocusFrame::OnFocusError(wxThreadEvent& WXUNUSED(event))
+{
+    StopFocus();
+    wxMessageBox("Camera Error", "SX Focus", wxOK | wxICON_INFORMATION);
 }
 void FocusFrame::OnFilter(wxCommandEvent& event)
 {
@@ -600,6 +781,7 @@ void FocusFrame::OnAutoLevels(wxCommandEvent& event)
 }
 void FocusFrame::OnResetLevels(wxCommandEvent& WXUNUSED(event))
 {
+    wxCriticalSectionLocker lock(focusLock);
     InitLevels();
 }
 void FocusFrame::OnZoomTracking(wxCommandEvent& event)
@@ -609,6 +791,7 @@ void FocusFrame::OnZoomTracking(wxCommandEvent& event)
 void FocusFrame::OnZoomIn(wxCommandEvent& WXUNUSED(event))
 {
     char statusText[20];
+    wxCriticalSectionLocker lock(focusLock);
 
     if (focusZoom < MAX_ZOOM)
     {
@@ -629,14 +812,12 @@ void FocusFrame::OnZoomIn(wxCommandEvent& WXUNUSED(event))
             sprintf(statusText, "Zoom: %dX", 1 << focusZoom);
         }
         SetStatusText(statusText, 1);
-        if (focusImage)
-            delete focusImage;
-        focusImage = new wxImage(zoomWidth, zoomHeight);
     }
 }
 void FocusFrame::OnZoomOut(wxCommandEvent& WXUNUSED(event))
 {
     char statusText[20];
+    wxCriticalSectionLocker lock(focusLock);
 
     if (focusZoom > MIN_ZOOM)
     {
@@ -658,9 +839,6 @@ void FocusFrame::OnZoomOut(wxCommandEvent& WXUNUSED(event))
             sprintf(statusText, "Zoom: %dX", 1 << focusZoom);
         }
         SetStatusText(statusText, 1);
-        if (focusImage)
-            delete focusImage;
-        focusImage = new wxImage(zoomWidth, zoomHeight);
     }
 }
 void FocusFrame::OnContrastInc(wxCommandEvent& WXUNUSED(event))
@@ -698,16 +876,20 @@ void FocusFrame::OnGammaDec(wxCommandEvent& WXUNUSED(event))
 }
 void FocusFrame::OnExposureInc(wxCommandEvent& WXUNUSED(event))
 {
+    wxCriticalSectionLocker lock(focusLock);
     if (focusExposure < MAX_EXPOSURE) focusExposure += INC_EXPOSURE;
 }
 void FocusFrame::OnExposureDec(wxCommandEvent& WXUNUSED(event))
 {
+    wxCriticalSectionLocker lock(focusLock);
     if (focusExposure > MIN_EXPOSURE) focusExposure -= INC_EXPOSURE;
 }
 void FocusFrame::OnClose(wxCloseEvent& WXUNUSED(event))
 {
-    if (focusTimer.IsRunning())
-        focusTimer.Stop();
+    StopFocus();
+    for (int i = 0; i < RING_SIZE; i++)
+        if (ringFrames[i].pixels)
+            free(ringFrames[i].pixels);
     if (focusImage)
         delete focusImage;
 	if (camCount)
@@ -720,6 +902,7 @@ void FocusFrame::OnClose(wxCloseEvent& WXUNUSED(event))
     config.Write(wxT("AutoLevels"), autoLevels);
     config.Write(wxT("Gamma"),      pixelGamma);
     config.Write(wxT("Tracking"),   zoomTracking);
+    freeScaler(&viewScaler);
     Destroy();
 }
 void FocusFrame::OnExit(wxCommandEvent& WXUNUSED(event))
@@ -7,3 +7,15 @@ typedef signed   char  int8_t;
 typedef unsigned short uint16_t;
 typedef signed   short int16_t;
 #endif
+/*
+ * Acquire/release access to the frame ring indices shared between threads.
+ */
+#ifdef _MSC_VER
+#define RING_LOAD(v)        InterlockedCompareExchange((volatile LONG *)&(v), 0, 0)
+#define RING_STORE(v, n)    InterlockedExchange((volatile LONG *)&(v), (n))
+#define RING_EXCHANGE(v, n) InterlockedExchange((volatile LONG *)&(v), (n))
+#else
+#define RING_LOAD(v)        __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define RING_STORE(v, n)    __atomic_store_n(&(v), (n), __ATOMIC_RELEASE)
+#define RING_EXCHANGE(v, n) __atomic_exchange_n(&(v), (n), __ATOMIC_ACQ_REL)
+#endif
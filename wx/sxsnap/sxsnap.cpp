@@ -38,14 +38,21 @@
 #include <wx/config.h>
 #include <wx/choicdlg.h>
 #include <wx/numdlg.h>
-#include <wx/progdlg.h>
+#include <wx/thread.h>
 #include <wx/filedlg.h>
+#include <wx/datetime.h>
 #include "sxsnap.h"
 #define MAX_SNAPSHOTS   100
 #define MIN_EXPOSURE    1
 #define MAX_WHITE       MAX_PIX
 #define MIN_BLACK       MIN_PIX
 #define MAX_BLACK       MAX_WHITE/2
+#define SAVE_FILES      0
+#define SAVE_CUBE       1
+#define SAVE_EXTENSIONS 2
+#define SNAP_OK         ((wxThread::ExitCode)0)
+#define SNAP_ERR_CAMERA ((wxThread::ExitCode)-1)
+#define SNAP_ERR_ABORT  ((wxThread::ExitCode)-2)
 /*
  * Camera Model Overrired for generic USB/USB2 interface
  */
@@ -72,6 +79,8 @@ long     initialCount    = 1;
 long     initialCamIndex = 0;
 wxString initialBaseName = wxT("sxsnap");
 bool     autonomous      = false;
+bool     initialCompress = false;
+long     initialSave     = SAVE_FILES;
 int      ccdModel        = 0;
 /*
  * Bin choices
@@ -82,6 +91,21 @@ wxString BinChoices[] = {wxT("1x"), wxT("2x"), wxT("4x")};
  */
 wxString GammaChoices[] = {wxT("1.0"), wxT("1.5"), wxT("2.0")};
 float GammaValues[] = {1.0, 1.5, 2.0};
+/*
+ * Capture Engine Thread
+ */
+class SnapFrame;
+class SnapThread : public wxThread
+{
+public:
+    SnapThread(SnapFrame *param);
+protected:
+    virtual ExitCode Entry();
+private:
+    SnapFrame  *snap;
+    wxStopWatch watch;
+    bool WaitUntil(long msec);
+};
 /*
  * SnapShot App class
  */
@@ -97,7 +121,12 @@ class SnapFrame : public wxFrame
 public:
     SnapFrame();
     bool AutoStart(wxString& baseName);
-private:
+protected:
+    friend class SnapThread;
+    SnapThread    *snapThread;
+    wxSemaphore    snapSignal;
+    int            snapState, snapReady;
+    long           snapElapsed;
 	HANDLE         camHandles[SXCCD_MAX_CAMS];
     t_sxccd_params camParams[SXCCD_MAX_CAMS];
     int            camSelect, camCount;
@@ -109,12 +138,16 @@ private:
     int            snapExposure, snapCount, snapView, snapMax;
     uint16_t      *snapShots[MAX_SNAPSHOTS];
     bool           snapSaved[MAX_SNAPSHOTS];
+    wxLongLong     snapStart[MAX_SNAPSHOTS];
+    long           snapSaveFormat;
     int            pixelMax, pixelMin;
     int            pixelBlack, pixelWhite;
     float          pixelGamma;
     bool           pixelFilter, autoLevels;
+    bool           fitsCompress;
     int            calibratedCamera, calibratedDownload;
     wxImage       *snapImage;
+    struct scaler  viewScaler;
     wxStopWatch   *snapWatch;
     void InitLevels();
     bool ConnectCamera(int index);
@@ -130,12 +163,22 @@ private:
     void OnNew(wxCommandEvent& event);
     void OnDelete(wxCommandEvent& event);
     void OnSave(wxCommandEvent& event);
+    wxString StartTime(int i);
+    bool WriteTemplate();
     bool SaveShots(wxString& baseName);
     void OnSaveAll(wxCommandEvent& event);
+    void OnSaveFormat(wxCommandEvent& event);
+    void OnCompress(wxCommandEvent& event);
     void OnFilter(wxCommandEvent& event);
     void OnAutoLevels(wxCommandEvent& event);
     void OnGamma(wxCommandEvent& event);
+    void StartSnap();
+    wxThread::ExitCode StopSnap();
+    int  DutyCycle();
     void OnStart(wxCommandEvent& event);
+    void OnStop(wxCommandEvent& event);
+    void OnSnapFrame(wxThreadEvent& event);
+    void OnSnapDone(wxThreadEvent& event);
     void OnForward(wxCommandEvent& event);
     void OnBackward(wxCommandEvent& event);
     void OnNumber(wxCommandEvent& event);
@@ -151,29 +194,52 @@ enum
     ID_OVERRIDE,
     ID_DELETE,
     ID_SAVE_ALL,
+    ID_SAVE_FILES,
+    ID_SAVE_CUBE,
+    ID_SAVE_EXTENSIONS,
+    ID_COMPRESS,
     ID_FILTER,
     ID_LEVEL_AUTO,
     ID_GAMMA,
     ID_FORWARD,
     ID_BACKWARD,
     ID_START,
+    ID_STOP,
+    ID_SNAP_FRAME,
+    ID_SNAP_DONE,
     ID_NUMBER,
     ID_EXPOSURE,
     ID_DELAY,
     ID_BINX,
     ID_BINY,
 };
+/*
+ * Capture states
+ */
+enum
+{
+    STATE_IDLE = 0,
+    STATE_SNAPPING,
+    STATE_STOPPING
+};
 wxBEGIN_EVENT_TABLE(SnapFrame, wxFrame)
     EVT_MENU(ID_CONNECT,    SnapFrame::OnConnect)
     EVT_MENU(ID_OVERRIDE,   SnapFrame::OnOverride)
     EVT_MENU(ID_DELETE,     SnapFrame::OnDelete)
     EVT_MENU(ID_SAVE_ALL,   SnapFrame::OnSaveAll)
+    EVT_MENU(ID_SAVE_FILES, SnapFrame::OnSaveFormat)
+    EVT_MENU(ID_SAVE_CUBE,  SnapFrame::OnSaveFormat)
+    EVT_MENU(ID_SAVE_EXTENSIONS, SnapFrame::OnSaveFormat)
+    EVT_MENU(ID_COMPRESS,   SnapFrame::OnCompress)
     EVT_MENU(ID_FILTER,     SnapFrame::OnFilter)
     EVT_MENU(ID_LEVEL_AUTO, SnapFrame::OnAutoLevels)
     EVT_MENU(ID_GAMMA,      SnapFrame::OnGamma)
     EVT_MENU(ID_FORWARD,    SnapFrame::OnForward)
     EVT_MENU(ID_BACKWARD,   SnapFrame::OnBackward)
     EVT_MENU(ID_START,      SnapFrame::OnStart)
+    EVT_MENU(ID_STOP,       SnapFrame::OnStop)
+    EVT_THREAD(ID_SNAP_FRAME, SnapFrame::OnSnapFrame)
+    EVT_THREAD(ID_SNAP_DONE,  SnapFrame::OnSnapDone)
     EVT_MENU(ID_NUMBER,     SnapFrame::OnNumber)
     EVT_MENU(ID_EXPOSURE,   SnapFrame::OnExposure)
     EVT_MENU(wxID_NEW,      SnapFrame::OnNew)
@@ -192,7 +258,9 @@ void SnapApp::OnInitCmdLine(wxCmdLineParser &parser)
     parser.AddOption(wxT("m"), wxT("model"),    wxT("USB camera model override"), wxCMD_LINE_VAL_STRING);
     parser.AddOption(wxT("e"), wxT("exposure"), wxT("exposure in msec"), wxCMD_LINE_VAL_NUMBER);
     parser.AddOption(wxT("n"), wxT("number"),   wxT("number of exposures"), wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption(wxT("s"), wxT("save"),     wxT("save format (0=files, 1=cube, 2=extensions)"), wxCMD_LINE_VAL_NUMBER);
     parser.AddSwitch(wxT("a"), wxT("auto"),     wxT("autonomous mode"));
+    parser.AddSwitch(wxT("z"), wxT("compress"), wxT("Rice compress FITS files"));
 }
 bool SnapApp::OnCmdLineParsed(wxCmdLineParser &parser)
 {
@@ -236,7 +304,14 @@ bool SnapApp::OnCmdLineParsed(wxCmdLineParser &parser)
     {}
     if (parser.Found(wxT("n"), &initialCount))
     {}
+    if (parser.Found(wxT("s"), &initialSave))
+    {
+        if (initialSave < SAVE_FILES || initialSave > SAVE_EXTENSIONS)
+            initialSave = SAVE_FILES;
+    }
     autonomous = parser.Found(wxT("a"));
+    if (parser.Found(wxT("z")))
+        initialCompress = true;
     if (parser.GetParamCount() > 0)
         initialBaseName = parser.GetParam(0);
     return wxApp::OnCmdLineParsed(parser);
@@ -246,6 +321,10 @@ bool SnapApp::OnInit()
     wxConfig config(wxT("sxSnapShot"), wxT("sxToys"));
     config.Read(wxT("Exposure"),   &initialExposure);
     config.Read(wxT("Number"),     &initialCount);
+    config.Read(wxT("CompressFITS"), &initialCompress);
+    config.Read(wxT("SaveFormat"), &initialSave);
+    if (initialSave < SAVE_FILES || initialSave > SAVE_EXTENSIONS)
+        initialSave = SAVE_FILES;
 #ifndef _MSC_VER
     config.Read(wxT("USB1Camera"), &camUSBType);
 #endif
@@ -268,10 +347,23 @@ bool SnapApp::OnInit()
     }
     return false;
 }
+/*
+ * Scale the display image to the window. The scaler keeps its weights while
+ * the window size stays the same, so redraws only pay for the filtering.
+ */
+static wxBitmap scaleBitmap(wxImage *image, int width, int height, struct scaler *viewScaler)
+{
+    wxImage scaled(width, height, false);
+    if (scalePixels(viewScaler, SCALE_BILINEAR, image->GetData(), image->GetWidth(), image->GetHeight(), image->GetWidth() * 3,
+                    scaled.GetData(), width, height, width * 3, 1, 3))
+        return wxBitmap(image->Scale(width, height, wxIMAGE_QUALITY_BILINEAR));
+    return wxBitmap(scaled);
+}
 SnapFrame::SnapFrame() : wxFrame(NULL, wxID_ANY, "SX SnapShot")
 {
     CreateStatusBar(3);
     memset(snapShots, 0, sizeof(uint16_t) * MAX_SNAPSHOTS);
+    memset(&viewScaler, 0, sizeof(viewScaler));
     snapFilePath       = wxGetCwd();
     snapBaseName       = initialBaseName;
     snapExposure       = initialExposure;
@@ -279,11 +371,17 @@ SnapFrame::SnapFrame() : wxFrame(NULL, wxID_ANY, "SX SnapShot")
     snapImage          = NULL;
     snapView           = 0;
     snapMax            = 0;
+    snapReady          = 0;
+    snapState          = STATE_IDLE;
+    snapThread         = NULL;
     autoLevels         = false;
     pixelFilter        = false;
     pixelGamma         = 1.5;
     calibratedCamera   = 0;
     calibratedDownload = 0;
+    fitsCompress       = initialCompress;
+    snapSaveFormat     = initialSave;
+    fits_set_compression(fitsCompress ? FITS_COMPRESS_RICE : FITS_COMPRESS_NONE, 0);
     wxConfig config(wxT("sxSnapShot"), wxT("sxToys"));
     config.Read(wxT("AutoLevels"),         &autoLevels);
     config.Read(wxT("RedFilter"),          &pixelFilter);
@@ -303,6 +401,14 @@ SnapFrame::SnapFrame() : wxFrame(NULL, wxID_ANY, "SX SnapShot")
     menuCamera->Append(ID_DELETE,     wxT("&Delete\tCtrl-D"));
     menuCamera->Append(wxID_SAVE,     wxT("&Save...\tCtrl-S"));
     menuCamera->Append(ID_SAVE_ALL,   wxT("Save &All...\tCtrl-A"));
+    wxMenu *menuSaveFormat = new wxMenu;
+    menuSaveFormat->AppendRadioItem(ID_SAVE_FILES,      wxT("Separate Files"));
+    menuSaveFormat->AppendRadioItem(ID_SAVE_CUBE,       wxT("FITS Cube"));
+    menuSaveFormat->AppendRadioItem(ID_SAVE_EXTENSIONS, wxT("Multi-Extension FITS"));
+    menuSaveFormat->Check(ID_SAVE_FILES + snapSaveFormat, true);
+    menuCamera->AppendSubMenu(menuSaveFormat, wxT("Save All &Format"));
+    menuCamera->AppendCheckItem(ID_COMPRESS, wxT("Compress FITS"));
+    menuCamera->Check(ID_COMPRESS,    fitsCompress);
     menuCamera->AppendSeparator();
     menuCamera->Append(wxID_EXIT);
     wxMenu *menuView = new wxMenu;
@@ -315,6 +421,7 @@ SnapFrame::SnapFrame() : wxFrame(NULL, wxID_ANY, "SX SnapShot")
     menuView->Append(ID_BACKWARD,            wxT("&Previous Image\tCTRL-LEFT"));
     wxMenu *menuImage = new wxMenu;
     menuImage->Append(ID_START,    wxT("Snap...\tSPACE"));
+    menuImage->Append(ID_STOP,     wxT("Stop\tESC"));
     menuCamera->AppendSeparator();
     menuImage->Append(ID_NUMBER,   wxT("Number..\tN"));
     menuImage->Append(ID_EXPOSURE, wxT("Exposure..\tE"));
@@ -348,7 +455,7 @@ void SnapFrame::OnPaint(wxPaintEvent& WXUNUSED(event))
         wxClientDC dc(this);
         if (snapImage)
         {
-            wxBitmap bitmap(snapImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+            wxBitmap bitmap(scaleBitmap(snapImage, winWidth, winHeight, &viewScaler));
             dc.DrawBitmap(bitmap, 0, 0);
         }
         else
@@ -433,6 +540,11 @@ bool SnapFrame::ConnectCamera(int index)
 }
 void SnapFrame::OnConnect(wxCommandEvent& WXUNUSED(event))
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
 	if (camCount)   sxRelease(camHandles, camCount);
     if ((camCount = sxProbe(camHandles, camParams, camUSBType)) == 0)
     {
@@ -458,6 +570,11 @@ void SnapFrame::OnConnect(wxCommandEvent& WXUNUSED(event))
 void SnapFrame::OnOverride(wxCommandEvent& WXUNUSED(event))
 {
 #ifndef _MSC_VER
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
 	if (camCount)   sxRelease(camHandles, camCount);
     if ((camCount = sxProbe(camHandles, camParams, camUSBType)) == 0)
     {
@@ -512,6 +629,11 @@ void SnapFrame::FreeShots()
 }
 void SnapFrame::OnNew(wxCommandEvent& event)
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     /*
      * Any unsaved images?
      */
@@ -530,12 +652,18 @@ void SnapFrame::OnNew(wxCommandEvent& event)
 }
 void SnapFrame::OnDelete(wxCommandEvent& event)
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     if (snapShots[snapView] != NULL)
         free(snapShots[snapView]);
     for (int i = snapView; i < snapMax - 1; i++)
     {
         snapShots[i] = snapShots[i + 1];
         snapSaved[i] = snapSaved[i + 1];
+        snapStart[i] = snapStart[i + 1];
     }
     snapMax--;
     snapShots[snapMax] = NULL;
@@ -550,6 +678,11 @@ void SnapFrame::OnDelete(wxCommandEvent& event)
 }
 void SnapFrame::OnSave(wxCommandEvent& WXUNUSED(event))
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     if (snapShots[snapView] != NULL)
     {
         char fits_file[255];
@@ -559,11 +692,11 @@ void SnapFrame::OnSave(wxCommandEvent& WXUNUSED(event))
             snapFilePath  = dlg.GetPath();
             snapBaseName  = dlg.GetFilename();
             strcpy(fits_file, snapFilePath.c_str());
-            if (fits_open(fits_file)
+            if (WriteTemplate()
+             || fits_open(fits_file)
              || fits_write_image(snapShots[snapView], ccdFrameWidth, ccdFrameHeight)
-             || fits_write_key_int("EXPOSURE", snapExposure, "Total Exposure Time")
-             || fits_write_key_string("CREATOR", "sxSnapShot", "Imaging Application")
-             || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device")
+             || fits_write_template()
+             || fits_write_key_string("DATE-OBS", StartTime(snapView).c_str(), "Exposure Start (UTC)")
              || fits_close())
             {
                 fits_cleanup();
@@ -577,33 +710,124 @@ void SnapFrame::OnSave(wxCommandEvent& WXUNUSED(event))
         wxMessageBox("No image to save", "Save Error", wxOK | wxICON_INFORMATION);
     SnapStatus();
 }
+wxString SnapFrame::StartTime(int i)
+{
+    return wxDateTime(snapStart[i]).Format(wxT("%Y-%m-%dT%H:%M:%S.%l"), wxDateTime::UTC);
+}
+bool SnapFrame::WriteTemplate()
+{
+    /*
+     * Keys common to every frame, formatted once and cloned into each header.
+     */
+    return fits_template_begin()
+        || fits_write_key_int("EXPOSURE", snapExposure, "Total Exposure Time")
+        || fits_write_key_int("XBINNING", 1, "Horizontal Binning")
+        || fits_write_key_int("YBINNING", 1, "Vertical Binning")
+        || fits_write_key_float("XPIXSZ", ccdPixelWidth, "Pixel Width (microns)")
+        || fits_write_key_float("YPIXSZ", ccdPixelHeight, "Pixel Height (microns)")
+        || fits_write_key_string("CREATOR", "sxSnapShot", "Imaging Application")
+        || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device")
+        || fits_template_end();
+}
 bool SnapFrame::SaveShots(wxString& baseName)
 {
-    for (int i = 0; i < snapMax; i++)
+    char base[255];
+    char fits_file[255];
+    char frame_key[10];
+    strcpy(base, baseName.c_str());
+    if (WriteTemplate())
+        return false;
+    if (snapSaveFormat == SAVE_CUBE)
     {
-        char base[255];
-        strcpy(base, baseName.c_str());
-        if (!snapSaved[i])
+        /*
+         * All frames in one NAXIS3 array with a start time key per frame.
+         */
+        sprintf(fits_file, "%s.fits", base);
+        if (fits_open(fits_file)
+         || fits_write_cube(snapShots, ccdFrameWidth, ccdFrameHeight, snapMax)
+         || fits_write_template()
+         || fits_write_key_string("DATE-OBS", StartTime(0).c_str(), "First Exposure Start (UTC)"))
         {
-            char fits_file[255];
-            sprintf(fits_file, "%s-%02d.fits", base, i);
-            if (fits_open(fits_file)
-             || fits_write_image(snapShots[i], ccdFrameWidth, ccdFrameHeight)
-             || fits_write_key_int("EXPOSURE", snapExposure, "Total Exposure Time")
-             || fits_write_key_string("CREATOR", "sxSnapShot", "Imaging Application")
-             || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device")
-             || fits_close())
+            fits_cleanup();
+            return false; // Writing FITS file failed
+        }
+        for (int i = 0; i < snapMax; i++)
+        {
+            sprintf(frame_key, "DATE%04d", i + 1);
+            if (fits_write_key_string(frame_key, StartTime(i).c_str(), "Frame Exposure Start (UTC)"))
+            {
+                fits_cleanup();
+                return false;
+            }
+        }
+        if (fits_close())
+        {
+            fits_cleanup();
+            return false;
+        }
+    }
+    else if (snapSaveFormat == SAVE_EXTENSIONS)
+    {
+        /*
+         * Empty primary HDU followed by an IMAGE extension per frame.
+         */
+        sprintf(fits_file, "%s.fits", base);
+        if (fits_open(fits_file)
+         || fits_write_key_int("NFRAMES", snapMax, "Number of Frames")
+         || fits_write_key_string("CREATOR", "sxSnapShot", "Imaging Application")
+         || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device"))
+        {
+            fits_cleanup();
+            return false;
+        }
+        for (int i = 0; i < snapMax; i++)
+        {
+            if (fits_write_extension(snapShots[i], ccdFrameWidth, ccdFrameHeight)
+             || fits_write_template()
+             || fits_write_key_string("DATE-OBS", StartTime(i).c_str(), "Exposure Start (UTC)"))
             {
                 fits_cleanup();
-                return false; // Writing FITS file failed
+                return false;
             }
-            snapSaved[i] = true;
+        }
+        if (fits_close())
+        {
+            fits_cleanup();
+            return false;
         }
     }
+    else
+    {
+        for (int i = 0; i < snapMax; i++)
+        {
+            if (!snapSaved[i])
+            {
+                sprintf(fits_file, "%s-%02d.fits", base, i);
+                if (fits_open(fits_file)
+                 || fits_write_image(snapShots[i], ccdFrameWidth, ccdFrameHeight)
+                 || fits_write_template()
+                 || fits_write_key_string("DATE-OBS", StartTime(i).c_str(), "Exposure Start (UTC)")
+                 || fits_close())
+                {
+                    fits_cleanup();
+                    return false; // Writing FITS file failed
+                }
+                snapSaved[i] = true;
+            }
+        }
+        return true;
+    }
+    for (int i = 0; i < snapMax; i++)
+        snapSaved[i] = true;
     return true; // All good
 }
 void SnapFrame::OnSaveAll(wxCommandEvent& event)
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     if (snapMax)
     {
         wxFileDialog dlg(this, wxT("Save Images"), snapFilePath, snapBaseName, wxT("*"/*"FITS file (*.fits)"*/), wxFD_SAVE);
@@ -619,6 +843,15 @@ void SnapFrame::OnSaveAll(wxCommandEvent& event)
     else
         wxMessageBox("No images to save", "Save Error", wxOK | wxICON_INFORMATION);
 }
+void SnapFrame::OnSaveFormat(wxCommandEvent& event)
+{
+    snapSaveFormat = event.GetId() - ID_SAVE_FILES;
+}
+void SnapFrame::OnCompress(wxCommandEvent& event)
+{
+    fitsCompress = event.IsChecked();
+    fits_set_compression(fitsCompress ? FITS_COMPRESS_RICE : FITS_COMPRESS_NONE, 0);
+}
 void SnapFrame::UpdateView(int view)
 {
     int l;
@@ -665,7 +898,7 @@ void SnapFrame::UpdateView(int view)
     if (winWidth > 0 && winHeight > 0)
     {
         wxClientDC dc(this);
-        wxBitmap bitmap(snapImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+        wxBitmap bitmap(scaleBitmap(snapImage, winWidth, winHeight, &viewScaler));
         Refresh();
     }
 }
@@ -709,161 +942,277 @@ void SnapFrame::OnBackward(wxCommandEvent& WXUNUSED(event))
     UpdateView(snapView - 1);
     SnapStatus();
 }
-bool SnapFrame::AutoStart(wxString& baseName)
+SnapThread::SnapThread(SnapFrame *param) : wxThread(wxTHREAD_JOINABLE)
+{
+    snap = param;
+    Create();
+    SetPriority(wxPRIORITY_MAX); // Keep exposure timing tight
+}
+bool SnapThread::WaitUntil(long msec)
 {
-    uint16_t *interFrame = NULL;
-    wxStopWatch watch;
-    wxMessageOutputStderr progress;
     long timeDelta;
-    ENABLE_HIGH_RES_TIMER();
-    if (ccdModel & SXCCD_INTERLEAVE)
+    while ((timeDelta = msec - watch.Time()) > 1000)
     {
         /*
-         * Measure download time only for interlacrd CCDs.
+         * Clear interline registers every second.
          */
-        interFrame = (uint16_t *)malloc(sizeof(uint16_t) * ccdFieldPixelCount);
-        watch.Start();
-        sxLatchImage(camHandles[camSelect], // cam handle
-                     SXCCD_EXP_FLAGS_FIELD_ODD, // options
+        wxMilliSleep(1000);
+        sxClearImage(snap->camHandles[snap->camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
+        if (snap->snapState != STATE_SNAPPING)
+            return false;
+    }
+    if (timeDelta > 0)
+        wxMilliSleep(timeDelta);
+    return snap->snapState == STATE_SNAPPING;
+}
+wxThread::ExitCode SnapThread::Entry()
+{
+    ExitCode  snapErr    = SNAP_OK;
+    HANDLE    cam        = snap->camHandles[snap->camSelect];
+    uint16_t *interFrame = NULL;
+    bool      interlaced = (ccdModel & SXCCD_INTERLEAVE) != 0;
+    long      exposure   = snap->snapExposure;
+    int       count      = snap->snapCount;
+    long      evenStart  = 0, oddStart = 0, firstStart = 0;
+    long      download;
+    bool      pipelined;
+    watch.Start();
+    if (ccdModel != snap->calibratedCamera)
+    {
+        /*
+         * Measure download time into the first frame buffer.
+         */
+        sxLatchImage(cam, // cam handle
+                     SXCCD_EXP_FLAGS_FIELD_BOTH, // options
                      SXCCD_IMAGE_HEAD, // main ccd
                      0,              // xoffset
                      0,              // yoffset
-                     ccdFrameWidth,  // width
-                     ccdFieldHeight, // height
+                     snap->ccdFrameWidth,  // width
+                     snap->ccdFieldHeight, // height
                      1,              // xbin
                      1);             // ybin
-        if (!sxReadImage(camHandles[camSelect], // cam handle
-                         interFrame, //pixbuf
-                         ccdFieldPixelCount)) // pix count
-        {
-            DISABLE_HIGH_RES_TIMER();
-            free(interFrame);
-            progress.Printf("\nCamera Error!");
-            return false;
-        }
-        //sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_ODD|SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-        calibratedDownload = watch.Time();
-        calibratedCamera   = ccdModel;
+        if (!sxReadImage(cam, // cam handle
+                         snap->snapShots[0], //pixbuf
+                         snap->ccdFieldPixelCount)) // pix count
+            return SNAP_ERR_CAMERA;
+        snap->calibratedDownload = watch.Time();
+        snap->calibratedCamera   = ccdModel;
     }
-    for (int i = 0; i < snapCount; i++)
+    download = snap->calibratedDownload;
+    /*
+     * The photosites start integrating again as soon as their charge is latched
+     * into the transfer registers. If the exposure covers the download (both field
+     * downloads for interlaced sensors), the next frame integrates while the previous
+     * one is read out, displayed and saved. Otherwise, wipe and expose each frame.
+     */
+    pipelined = exposure >= (interlaced ? 2 * download : download);
+    if (interlaced)
+        interFrame = (uint16_t *)malloc(sizeof(uint16_t) * snap->ccdFieldPixelCount);
+    wxLongLong utcBase = wxGetUTCTimeMillis() - watch.Time();
+    for (int i = 0; i < count; i++)
     {
-        /*
-         * Init frame.
-         */
-        snapShots[i] = (uint16_t *)malloc(sizeof(uint16_t) * ccdPixelCount);
-        progress.Printf(wxT("\nIntegrating Image %d of %d: "), i + 1, snapCount);
-        sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-        watch.Start();
-        if (ccdModel & SXCCD_INTERLEAVE && snapExposure >= calibratedDownload)
+        if (i == 0 || !pipelined)
         {
-            /*
-             * Overlap field integrations.
-             */
-            while ((timeDelta = calibratedDownload - watch.Time()) > 1000)
+            sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
+            evenStart = oddStart = watch.Time();
+            if (i == 0)
+                firstStart = evenStart;
+            if (interlaced && exposure >= download)
             {
                 /*
-                 * Clear interline registers every second.
+                 * Overlap field integrations.
+                 */
+                if (!WaitUntil(evenStart + download))
+                {
+                    snapErr = SNAP_ERR_ABORT;
+                    break;
+                }
+                /*
+                 * Clear odd field.
                  */
-                wxMilliSleep(1000);
-                sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
+                sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_ODD|SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
+                oddStart = watch.Time();
             }
-            if (timeDelta > 0)
-                wxMilliSleep(timeDelta);
-            /*
-             * Clear odd field.
-             */
-            sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_ODD|SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
         }
-        while ((timeDelta = snapExposure - watch.Time()) > 1000)
+        snap->snapStart[i] = utcBase + evenStart;
+        if (!WaitUntil(evenStart + exposure))
         {
-            /*
-             * Clear interline registers every second.
-             */
-            wxMilliSleep(1000);
-            sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
+            snapErr = SNAP_ERR_ABORT;
+            break;
         }
-        if (timeDelta > 0)
-            wxMilliSleep(timeDelta);
-        sxLatchImage(camHandles[camSelect], // cam handle
+        sxLatchImage(cam, // cam handle
                      SXCCD_EXP_FLAGS_FIELD_EVEN, // options
                      SXCCD_IMAGE_HEAD, // main ccd
                      0,              // xoffset
                      0,              // yoffset
-                     ccdFrameWidth,  // width
-                     ccdFieldHeight, // height
+                     snap->ccdFrameWidth,  // width
+                     snap->ccdFieldHeight, // height
                      1,              // xbin
                      1);             // ybin
-        if (!sxReadImage(camHandles[camSelect], // cam handle
-                         snapShots[i], //pixbuf
-                         ccdFieldPixelCount)) // pix count
+        if (pipelined)
+            evenStart = watch.Time();
+        if (!sxReadImage(cam, // cam handle
+                         snap->snapShots[i], //pixbuf
+                         snap->ccdFieldPixelCount)) // pix count
         {
-            progress.Printf("\nCamera Error!");
-            return false;
+            snapErr = SNAP_ERR_CAMERA;
+            break;
         }
-        if (ccdModel & SXCCD_INTERLEAVE && snapExposure < calibratedDownload)
+        if (interlaced)
         {
-            /*
-             * Integrate odd field seperately.
-             */
-            sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_ODD, SXCCD_IMAGE_HEAD);
-            watch.Start();
-            while ((timeDelta = snapExposure - watch.Time()) > 1000)
+            if (exposure < download)
             {
                 /*
-                 * Clear registers every second.
+                 * Integrate odd field seperately.
                  */
-                wxMilliSleep(1000);
-                sxClearImage(camHandles[camSelect], 0, SXCCD_IMAGE_HEAD);
+                sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
+                oddStart = watch.Time();
             }
-            if (timeDelta > 0)
-                wxMilliSleep(timeDelta);
-        }
-        if (ccdModel & SXCCD_INTERLEAVE)
-        {
-            sxLatchImage(camHandles[camSelect], // cam handle
+            if (!WaitUntil(oddStart + exposure))
+            {
+                snapErr = SNAP_ERR_ABORT;
+                break;
+            }
+            sxLatchImage(cam, // cam handle
                          SXCCD_EXP_FLAGS_FIELD_ODD, // options
                          SXCCD_IMAGE_HEAD, // main ccd
                          0,              // xoffset
                          0,              // yoffset
-                         ccdFrameWidth,  // width
-                         ccdFieldHeight, // height
+                         snap->ccdFrameWidth,  // width
+                         snap->ccdFieldHeight, // height
                          1,              // xbin
                          1);             // ybin
-            if (!sxReadImage(camHandles[camSelect], // cam handle
+            if (pipelined)
+                oddStart = watch.Time();
+            if (!sxReadImage(cam, // cam handle
                              interFrame, //pixbuf
-                             ccdFieldPixelCount)) // pix count
+                             snap->ccdFieldPixelCount)) // pix count
             {
-                progress.Printf("\nCamera Error!");
-                free(interFrame);
-                return false;
+                snapErr = SNAP_ERR_CAMERA;
+                break;
             }
             /*
              * Interleave the scanlines.
              */
-            for (int l = ccdFieldHeight - 1; l >= 0; l--)
+            uint16_t *frame = snap->snapShots[i];
+            for (int l = snap->ccdFieldHeight - 1; l >= 0; l--)
             {
-                memcpy(snapShots[i] +  2 * l      * ccdFrameWidth, snapShots[i] + l * ccdFrameWidth, sizeof(uint16_t) * ccdFrameWidth);
-                memcpy(snapShots[i] + (2 * l + 1) * ccdFrameWidth, interFrame   + l * ccdFrameWidth, sizeof(uint16_t) * ccdFrameWidth);
+                memcpy(frame +  2 * l      * snap->ccdFrameWidth, frame      + l * snap->ccdFrameWidth, sizeof(uint16_t) * snap->ccdFrameWidth);
+                memcpy(frame + (2 * l + 1) * snap->ccdFrameWidth, interFrame + l * snap->ccdFrameWidth, sizeof(uint16_t) * snap->ccdFrameWidth);
             }
         }
-        snapMax = i + 1;
-        snapSaved[i] = false;
+        /*
+         * Hand the frame off while the next one integrates.
+         */
+        snap->snapSaved[i] = false;
+        snap->snapReady    = i + 1;
+        snap->snapElapsed  = watch.Time() - firstStart;
+        snap->snapSignal.Post();
+        if (!autonomous)
+        {
+            wxThreadEvent *event = new wxThreadEvent(wxEVT_THREAD, ID_SNAP_FRAME);
+            event->SetInt(i);
+            wxQueueEvent(snap, event);
+        }
     }
-    DISABLE_HIGH_RES_TIMER();
     if (interFrame)
         free(interFrame);
+    if (!autonomous)
+        wxQueueEvent(snap, new wxThreadEvent(wxEVT_THREAD, ID_SNAP_DONE));
+    return snapErr;
+}
+void SnapFrame::StartSnap()
+{
+    FreeShots();
+    for (int i = 0; i < snapCount; i++)
+    {
+        snapShots[i] = (uint16_t *)malloc(sizeof(uint16_t) * ccdPixelCount);
+        snapSaved[i] = true;
+    }
+    while (snapSignal.TryWait() == wxSEMA_NO_ERROR); // Drain stale frame signals
+    snapImage   = new wxImage(ccdFrameWidth, ccdFrameHeight);
+    snapReady   = 0;
+    snapElapsed = 0;
+    snapState   = STATE_SNAPPING;
+    ENABLE_HIGH_RES_TIMER();
+    snapThread = new SnapThread(this);
+    snapThread->Run();
+}
+wxThread::ExitCode SnapFrame::StopSnap()
+{
+    snapState = STATE_STOPPING;
+    wxThread::ExitCode snapErr = snapThread->Wait();
+    delete snapThread;
+    snapThread = NULL;
+    DISABLE_HIGH_RES_TIMER();
+    snapState = STATE_IDLE;
+    /*
+     * Keep the frames captured so far, release the rest.
+     */
+    for (int i = snapReady; i < MAX_SNAPSHOTS; i++)
+        if (snapShots[i])
+        {
+            free(snapShots[i]);
+            snapShots[i] = NULL;
+        }
+    snapMax = snapReady;
+    if (snapMax == 0 && snapImage)
+    {
+        delete snapImage;
+        snapImage = NULL;
+    }
+    return snapErr;
+}
+int SnapFrame::DutyCycle()
+{
+    return snapElapsed ? (int)((wxLongLong)snapReady * snapExposure * 100 / snapElapsed).ToLong() : 0;
+}
+bool SnapFrame::AutoStart(wxString& baseName)
+{
+    wxMessageOutputStderr progress;
+    StartSnap();
+    /*
+     * Individual files are written as frames arrive, overlapping the next integration.
+     */
+    while (snapMax < snapCount)
+    {
+        if (snapSignal.WaitTimeout(1000) != wxSEMA_NO_ERROR)
+        {
+            if (snapThread->IsAlive())
+                continue;
+            if (snapSignal.TryWait() != wxSEMA_NO_ERROR)
+                break;
+        }
+        snapMax++;
+        progress.Printf(wxT("\nImage %d of %d"), snapMax, snapCount);
+        if (snapSaveFormat == SAVE_FILES && !SaveShots(baseName))
+        {
+            StopSnap();
+            progress.Printf("\nWriting FITS File Error!");
+            return false;
+        }
+    }
+    wxThread::ExitCode snapErr = StopSnap();
+    if (snapErr == SNAP_ERR_CAMERA)
+    {
+        progress.Printf("\nCamera Error!");
+        return false;
+    }
+    progress.Printf(wxT("\nDuty cycle: %d%%"), DutyCycle());
     if (!SaveShots(baseName))
     {
-        progress.Printf("Writing FITS File Error!");
+        progress.Printf("\nWriting FITS File Error!");
         return false;
     }
     return true;
 }
 void SnapFrame::OnStart(wxCommandEvent& WXUNUSED(event))
 {
-    uint16_t *interFrame = NULL;
-    wxStopWatch watch;
-    wxString progress;
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     if (!AreSaved())
         if (wxMessageBox("Save images before overwriting?", "SnapShot Warning", wxYES_NO | wxICON_INFORMATION) == wxYES)
         {
@@ -872,212 +1221,53 @@ void SnapFrame::OnStart(wxCommandEvent& WXUNUSED(event))
         }
     if (ccdModel)
     {
-        FreeShots();
-        snapImage = new wxImage(ccdFrameWidth, ccdFrameHeight);
-        wxProgressDialog dlg(wxT("SnapShot Progress"),
-                             wxT("Calibrating download..."),
-                             snapCount * (snapExposure + (calibratedDownload ? calibratedDownload : 1500)), // Guess at 1.5 second download
-                             this,
-                             wxPD_CAN_ABORT
-                           | wxPD_APP_MODAL
-                           | wxPD_ELAPSED_TIME
-                           | wxPD_REMAINING_TIME);
-        ENABLE_HIGH_RES_TIMER();
-        if (ccdModel != calibratedCamera)
-        {
-            /*
-             * Measure download time.
-             */
-            uint16_t *dummyFrame = (uint16_t *)malloc(sizeof(uint16_t) * ccdFieldPixelCount);
-            dlg.Update(0);
-            watch.Start();
-            sxLatchImage(camHandles[camSelect], // cam handle
-                         SXCCD_EXP_FLAGS_FIELD_BOTH, // options
-                         SXCCD_IMAGE_HEAD, // main ccd
-                         0,              // xoffset
-                         0,              // yoffset
-                         ccdFrameWidth,  // width
-                         ccdFieldHeight, // height
-                         1,              // xbin
-                         1);             // ybin
-            if (!sxReadImage(camHandles[camSelect], // cam handle
-                             dummyFrame, //pixbuf
-                             ccdFieldPixelCount)) // pix count
-            {
-                free(dummyFrame);
-                DISABLE_HIGH_RES_TIMER();
-                wxMessageBox("Camera Error", "SX SnapShot", wxOK | wxICON_INFORMATION);
-                return;
-            }
-            //sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_ODD|SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-            calibratedDownload = watch.Time();
-            calibratedCamera   = ccdModel;
-            free(dummyFrame);
-        }
-        long timeDelta, timeElapsed = watch.Time(), timeTotal = timeElapsed + snapCount * (snapExposure + calibratedDownload);
-        if (ccdModel & SXCCD_INTERLEAVE)
-        {
-            /*
-             * Two cases for interleaved download: overlap if exposure is longer than download, or serially.
-             */
-            if (snapExposure >= calibratedDownload)
-                timeTotal += calibratedDownload;
-            else
-                timeTotal *= 2;
-            interFrame = (uint16_t *)malloc(sizeof(uint16_t) * ccdFieldPixelCount);
-        }
-        dlg.SetRange(timeTotal);
-        for (int i = 0; i < snapCount; i++)
-        {
-            /*
-             * Init frame.
-             */
-            snapShots[i] = (uint16_t *)malloc(sizeof(uint16_t) * ccdPixelCount);
-            progress.Printf(wxT("Integrating image %d of %d..."), i + 1, snapCount);
-            if (!dlg.Update(timeElapsed, progress))
-                goto cancelled;
-            sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-            watch.Start();
-            if (ccdModel & SXCCD_INTERLEAVE && snapExposure >= calibratedDownload)
-            {
-                /*
-                 * Overlap field integrations.
-                 */
-                while ((timeDelta = calibratedDownload - watch.Time()) > 1000)
-                {
-                    /*
-                     * Clear interline registers every second.
-                     */
-                    wxMilliSleep(1000);
-                    sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-                    /*
-                     * Allow dialog feedback.
-                     */
-                    timeElapsed += 1000;
-                    if (!dlg.Update(timeElapsed))
-                        goto cancelled;
-                }
-                if (timeDelta > 0)
-                {
-                    wxMilliSleep(timeDelta);
-                    timeElapsed += timeDelta;
-                }
-                /*
-                 * Clear odd field.
-                 */
-                sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_ODD|SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-            }
-            while ((timeDelta = snapExposure - watch.Time()) > 1000)
-            {
-                /*
-                 * Clear interline registers every second.
-                 */
-                wxMilliSleep(1000);
-                sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-                /*
-                 * Allow dialog feedback.
-                 */
-                timeElapsed += 1000;
-                if (!dlg.Update(timeElapsed))
-                    goto cancelled;
-            }
-            if (timeDelta > 0)
-            {
-                wxMilliSleep(timeDelta);
-                timeElapsed += timeDelta;
-            }
-            sxLatchImage(camHandles[camSelect], // cam handle
-                         SXCCD_EXP_FLAGS_FIELD_EVEN, // options
-                         SXCCD_IMAGE_HEAD, // main ccd
-                         0,              // xoffset
-                         0,              // yoffset
-                         ccdFrameWidth,  // width
-                         ccdFieldHeight, // height
-                         1,              // xbin
-                         1);             // ybin
-            if (!sxReadImage(camHandles[camSelect], // cam handle
-                             snapShots[i], //pixbuf
-                             ccdFieldPixelCount)) // pix count
-            {
-                wxMessageBox("Camera Error", "SX SnapShot", wxOK | wxICON_INFORMATION);
-                goto cancelled;
-            }
-            timeElapsed += calibratedDownload;
-            if (ccdModel & SXCCD_INTERLEAVE && snapExposure < calibratedDownload)
-            {
-                /*
-                 * Integrate odd field seperately.
-                 */
-                 if (!dlg.Update(timeElapsed, progress))
-                     goto cancelled;
-                sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-                watch.Start();
-                while ((timeDelta = snapExposure - watch.Time()) > 1000)
-                {
-                    /*
-                     * Clear registers every second.
-                     */
-                    wxMilliSleep(1000);
-                    sxClearImage(camHandles[camSelect], SXCCD_EXP_FLAGS_NOWIPE_FRAME, SXCCD_IMAGE_HEAD);
-                    /*
-                     * Allow dialog feedback.
-                     */
-                    timeElapsed += 1000;
-                    if (!dlg.Update(timeElapsed))
-                        goto cancelled;
-                }
-                if (timeDelta > 0)
-                {
-                    wxMilliSleep(timeDelta);
-                    timeElapsed += timeDelta;
-                }
-            }
-            if (ccdModel & SXCCD_INTERLEAVE)
-            {
-                sxLatchImage(camHandles[camSelect], // cam handle
-                             SXCCD_EXP_FLAGS_FIELD_ODD, // options
-                             SXCCD_IMAGE_HEAD, // main ccd
-                             0,              // xoffset
-                             0,              // yoffset
-                             ccdFrameWidth,  // width
-                             ccdFieldHeight, // height
-                             1,              // xbin
-                             1);             // ybin
-                if (!sxReadImage(camHandles[camSelect], // cam handle
-                                 interFrame, //pixbuf
-                                 ccdFieldPixelCount)) // pix count
-                {
-                    wxMessageBox("Camera Error", "SX SnapShot", wxOK | wxICON_INFORMATION);
-                    goto cancelled;
-                }
-                /*
-                 * Interleave the scanlines.
-                 */
-                for (int l = ccdFieldHeight - 1; l >= 0; l--)
-                {
-                    memcpy(snapShots[i] +  2 * l      * ccdFrameWidth, snapShots[i] + l * ccdFrameWidth, sizeof(uint16_t) * ccdFrameWidth);
-                    memcpy(snapShots[i] + (2 * l + 1) * ccdFrameWidth, interFrame   + l * ccdFrameWidth, sizeof(uint16_t) * ccdFrameWidth);
-                }
-                timeElapsed += calibratedDownload;
-            }
-            snapMax = i + 1;
-            UpdateView(i);
-            SnapStatus();
-            snapSaved[i] = false;
-            if (timeElapsed > timeTotal)
-                timeElapsed = timeTotal;
-        }
-cancelled:
-        DISABLE_HIGH_RES_TIMER();
-        dlg.Close();
-        if (interFrame)
-            free(interFrame);
+        StartSnap();
+        SetTitle(wxString::Format(wxT("SX SnapShot: 0 of %d"), snapCount));
     }
     else
         wxMessageBox("Camera Not Connected", "SX SnapShot", wxOK | wxICON_INFORMATION);
 }
+void SnapFrame::OnStop(wxCommandEvent& WXUNUSED(event))
+{
+    if (snapState == STATE_SNAPPING)
+    {
+        StopSnap();
+        UpdateView(snapMax - 1);
+        SnapStatus();
+        SetTitle(wxT("SX SnapShot"));
+    }
+}
+void SnapFrame::OnSnapFrame(wxThreadEvent& event)
+{
+    if (snapState == STATE_SNAPPING)
+    {
+        snapMax = event.GetInt() + 1;
+        UpdateView(snapMax - 1);
+        SnapStatus();
+        SetTitle(wxString::Format(wxT("SX SnapShot: %d of %d"), snapMax, snapCount));
+    }
+}
+void SnapFrame::OnSnapDone(wxThreadEvent& WXUNUSED(event))
+{
+    if (snapThread)
+    {
+        wxThread::ExitCode snapErr = StopSnap();
+        UpdateView(snapMax - 1);
+        SnapStatus();
+        SetTitle(wxT("SX SnapShot"));
+        if (snapErr == SNAP_ERR_CAMERA)
+            wxMessageBox("Camera Error", "SX SnapShot", wxOK | wxICON_INFORMATION);
+        else if (snapMax)
+            SetStatusText(wxString::Format(wxT("%.3f sec, %d%% duty"), snapExposure / 1000.0, DutyCycle()), 2);
+    }
+}
 void SnapFrame::OnNumber(wxCommandEvent& WXUNUSED(event))
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     wxNumberEntryDialog dlg(this,
 							wxT(""),
 							wxT("Images:"),
@@ -1089,6 +1279,11 @@ void SnapFrame::OnNumber(wxCommandEvent& WXUNUSED(event))
 }
 void SnapFrame::OnExposure(wxCommandEvent& WXUNUSED(event))
 {
+    if (snapState != STATE_IDLE)
+    {
+        wxBell();
+        return;
+    }
     wxString exposeText = wxString::Format("%2.3f", snapExposure / 1000.0);
     wxTextEntryDialog dlg(this,
                           wxT("Seconds:"),
@@ -1105,6 +1300,8 @@ void SnapFrame::OnExposure(wxCommandEvent& WXUNUSED(event))
 }
 void SnapFrame::OnClose(wxCloseEvent& event)
 {
+    if (snapState != STATE_IDLE)
+        StopSnap();
     if (!AreSaved())
         if (wxMessageBox("Save images before exiting?", "Exit Warning", wxYES_NO | wxICON_INFORMATION) == wxYES)
         {
@@ -1125,6 +1322,9 @@ void SnapFrame::OnClose(wxCloseEvent& event)
     config.Write(wxT("Number"),             snapCount);
     config.Write(wxT("CalibratedDownload"), calibratedDownload);
     config.Write(wxT("CalibratedCamera"),   calibratedCamera);
+    config.Write(wxT("CompressFITS"),       fitsCompress);
+    config.Write(wxT("SaveFormat"),         snapSaveFormat);
+    freeScaler(&viewScaler);
     Destroy();
 }
 void SnapFrame::OnExit(wxCommandEvent& WXUNUSED(event))
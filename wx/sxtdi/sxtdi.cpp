@@ -40,6 +40,7 @@
 #include <wx/filedlg.h>
 #include <wx/cmdline.h>
 #include <wx/config.h>
+#include <wx/filename.h>
 #include "sxtdi.h"
 #define TRACK_STAR_RADIUS   200 // Tracking star max radius in microns
 #define TRACK_STAR_SIGMA    1.0 // Only track stars 1 sigma over the noise level
@@ -48,6 +49,21 @@
 #define SCAN_OK             ((wxThread::ExitCode)0)
 #define SCAN_ERR_TIME       ((wxThread::ExitCode)-1)
 #define SCAN_ERR_CAMERA     ((wxThread::ExitCode)-2)
+#define SCAN_ERR_DISK       ((wxThread::ExitCode)-3)
+#define RING_SECONDS        30  // Rows kept in memory ahead of the spill writer
+#define SPILL_INTERVAL      100 // Spill writer wakeup in msec
+#define SPILL_CHUNK         256 // Rows copied out of the ring per write
+#define SPILL_GUARD         2   // Rows short of a lap that are already suspect
+#define REDUCE_BINS         2048 // Column background histogram bins
+#define REDUCE_BIN_SHIFT    5    // 32 ADU per bin
+#define REDUCE_FINE_BINS    256  // 1 ADU bins around each column's coarse median
+#define SERVO_INTERVAL      1000   // Rate servo wakeup in msec
+#define SERVO_STRIPS        4      // Star search strips across the scan
+#define SERVO_DITHER        0.001  // Row period offset either side of the estimate
+#define SERVO_FILTER        0.5    // Low pass weight of each new rate error
+#define SERVO_GAIN          0.5    // Fraction of the filtered error corrected per pair
+#define SERVO_MAX_SCALE     0.02   // Row period never strays more than 2% from the measured rate
+#define LATE_ROW_FRACTION   0.1 // Rows latched over 10% of a row period late
 #define MAX_WHITE           MAX_PIX
 #define INC_BLACK           1024
 #define MIN_BLACK           MIN_PIX
@@ -81,6 +97,11 @@ long     initialBinX     = 1;
 long     initialBinY     = 1;
 long     initialCamIndex = 0;
 bool     autonomous      = false;
+bool     initialCompress = false;
+bool     initialReduce   = false;
+bool     initialRealTime = false;
+bool     initialServo    = false;
+long     initialCPU      = -1;
 /*
  * Bin choices
  */
@@ -90,6 +111,23 @@ wxString BinChoices[] = {wxT("1X"), wxT("2X"), wxT("3X"), wxT("4X")};
  */
 wxString GammaChoices[] = {wxT("1.0"), wxT("1.5"), wxT("2.0")};
 float GammaValues[] = {1.0, 1.5, 2.0};
+/*
+ * Column background reduction handed to the FITS writer's row filter
+ */
+struct ColumnReduction
+{
+    float *colMedian, *colScale;
+    float  scanMedian;
+};
+/*
+ * Running latch latency statistics, nsec. Kept by the scan thread as it goes
+ * so the row loop never touches memory that grows with the scan length.
+ */
+struct RowStats
+{
+    double sum, sumSq, lateMax;
+    int    rows, late;
+};
 /*
  * CCD Readout Thread
  */
@@ -103,6 +141,31 @@ protected:
 private:
     ScanFrame *scan;
 };
+/*
+ * Scan Spill Thread. Streams rows out of the ring to the spill file
+ */
+class SpillThread : public wxThread
+{
+public:
+    SpillThread(ScanFrame *param);
+protected:
+    virtual ExitCode Entry();
+private:
+    ScanFrame *scan;
+};
+/*
+ * Scan Rate Servo Thread. Measures star trailing in completed rows and nudges the row clock
+ */
+class ServoThread : public wxThread
+{
+public:
+    ServoThread(ScanFrame *param);
+protected:
+    virtual ExitCode Entry();
+private:
+    ScanFrame *scan;
+    bool StarElongation(uint16_t *pixels, int height, float *elongation);
+};
 /*
  * TDI Scan App class
  */
@@ -120,33 +183,63 @@ public:
     bool AutoStart(wxString& fileName);
 protected:
     friend class ScanThread;
+    friend class SpillThread;
+    friend class ServoThread;
     ScanThread    *tdiThread;
+    SpillThread   *spillThread;
+    ServoThread   *servoThread;
     HANDLE         camHandles[SXCCD_MAX_CAMS];
     t_sxccd_params camParams[SXCCD_MAX_CAMS];
     int            camSelect, camCount;
     wxString       tdiFilePath;
     wxString       tdiFileName;
-    bool           tdiFileSaved;
+    bool           tdiFileSaved, fitsCompress, fitsReduce;
     unsigned int   ccdFrameWidth, ccdFrameHeight, ccdFrameDepth, ccdPixelCount;
     unsigned int   ccdBinWidth, ccdBinHeight, ccdBinX, ccdBinY;
     float          ccdPixelWidth, ccdPixelHeight;
     uint16_t      *ccdFrame;
-    uint16_t      *tdiFrame;
+    uint16_t      *tdiRing;
+    int            tdiRingRows;
+    FILE          *tdiSpill;
+    wxString       tdiSpillName;
+    int            tdiSpilled, tdiSpillLost;
+    volatile bool  spillDone;
+    uint32_t      *columnHist, *columnFine, *scanHist;
+    uint16_t      *fineBase;
+    int            fineStartRow;
+    bool           fineSeeded;
     float          pixelGamma;
     bool           pixelFilter;
     int            tdiMinutes, numFrames;
     float          tdiScanRate, tdiExposure, binExposure;
     volatile int   tdiState, tdiLength, tdiRow;
+    RowStats       tdiRowStats;
+    bool           tdiRealTime, tdiServo;
+    volatile float rowScale;
+    int            tdiCPU;
+    float          rowLatency, rowJitter, rowLateMax;
+    int            rowLateCount;
 private:
     float          trackStarInitialX, trackStarInitialY, trackStarX, trackStarY;
     wxStopWatch   *trackWatch;
     wxImage       *scanImage;
+    struct scaler  viewScaler;
+    int            previewRow, previewMin, previewMax;
+    struct scaler  bandScaler;
+    uint16_t      *bandPixels;
+    unsigned char *bandRGB, *scaledRGB;
+    size_t         pixelAlloc, bandAlloc, scaledAlloc;
     wxTimer        tdiTimer;
     bool FitsWrite(wxString& fileName);
+    void SeedFineHist();
+    bool ReduceColumns(ColumnReduction *reduce);
     void UpdateAlign();
     void UpdateTDI();
-    void StartTDI();
+    void PreviewBand(unsigned char *rgb, int newestRow, int bandRows);
+    bool StartTDI();
     wxThread::ExitCode StopTDI();
+    void FreeScan();
+    void RowClockStats();
     void GetDuration();
     bool ConnectCamera(int index);
     void OnBackground(wxEraseEvent& event);
@@ -156,6 +249,8 @@ private:
     void OnOverride(wxCommandEvent& event);
     void OnNew(wxCommandEvent& event);
     void OnSave(wxCommandEvent& event);
+    void OnCompress(wxCommandEvent& event);
+    void OnReduce(wxCommandEvent& event);
     void OnExit(wxCommandEvent& event);
     void OnAlign(wxCommandEvent& event);
     void OnScan(wxCommandEvent& event);
@@ -163,6 +258,7 @@ private:
     void OnFilter(wxCommandEvent& event);
     void OnDuration(wxCommandEvent& event);
     void OnRate(wxCommandEvent& event);
+    void OnServo(wxCommandEvent& event);
     void OnBinX(wxCommandEvent& event);
     void OnBinY(wxCommandEvent& event);
     void OnGamma(wxCommandEvent& event);
@@ -181,9 +277,12 @@ enum
     ID_FILTER,
     ID_DURATION,
     ID_RATE,
+    ID_SERVO,
     ID_BINX,
     ID_BINY,
     ID_GAMMA,
+    ID_COMPRESS,
+    ID_REDUCE,
 };
 enum
 {
@@ -202,11 +301,14 @@ wxBEGIN_EVENT_TABLE(ScanFrame, wxFrame)
     EVT_MENU(ID_FILTER,     ScanFrame::OnFilter)
     EVT_MENU(ID_DURATION,   ScanFrame::OnDuration)
     EVT_MENU(ID_RATE,       ScanFrame::OnRate)
+    EVT_MENU(ID_SERVO,      ScanFrame::OnServo)
     EVT_MENU(ID_BINX,       ScanFrame::OnBinX)
     EVT_MENU(ID_BINY,       ScanFrame::OnBinY)
     EVT_MENU(ID_GAMMA,      ScanFrame::OnGamma)
     EVT_MENU(wxID_NEW,      ScanFrame::OnNew)
     EVT_MENU(wxID_SAVE,     ScanFrame::OnSave)
+    EVT_MENU(ID_COMPRESS,   ScanFrame::OnCompress)
+    EVT_MENU(ID_REDUCE,     ScanFrame::OnReduce)
     EVT_MENU(wxID_ABOUT,    ScanFrame::OnAbout)
     EVT_MENU(wxID_EXIT,     ScanFrame::OnExit)
     EVT_ERASE_BACKGROUND(   ScanFrame::OnBackground)
@@ -224,6 +326,11 @@ void ScanApp::OnInitCmdLine(wxCmdLineParser &parser)
     parser.AddOption(wxT("x"), wxT("xbin"), wxT("x bin (1, 2, 4)"), wxCMD_LINE_VAL_NUMBER);
     parser.AddOption(wxT("y"), wxT("ybin"), wxT("y bin (1, 2, 4)"), wxCMD_LINE_VAL_NUMBER);
     parser.AddSwitch(wxT("a"), wxT("auto"), wxT("autonomous mode"));
+    parser.AddSwitch(wxT("z"), wxT("compress"), wxT("Rice compress FITS file"));
+    parser.AddSwitch(wxT("n"), wxT("reduce"), wxT("normalize column backgrounds in FITS file"));
+    parser.AddSwitch(wxT("t"), wxT("realtime"), wxT("real-time priority row clock"));
+    parser.AddSwitch(wxT("s"), wxT("servo"), wxT("servo scan rate from star trailing"));
+    parser.AddOption(wxT("p"), wxT("cpu"), wxT("pin row clock to CPU"), wxCMD_LINE_VAL_NUMBER);
     parser.AddParam(wxT("FITS filename"), wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL);
 }
 bool ScanApp::OnCmdLineParsed(wxCmdLineParser &parser)
@@ -296,6 +403,16 @@ bool ScanApp::OnCmdLineParsed(wxCmdLineParser &parser)
     }
     if (parser.Found(wxT("a")))
         autonomous = (initialRate > 0.0 && initialDuration > 0);
+    if (parser.Found(wxT("z")))
+        initialCompress = true;
+    if (parser.Found(wxT("n")))
+        initialReduce = true;
+    if (parser.Found(wxT("t")))
+        initialRealTime = true;
+    if (parser.Found(wxT("s")))
+        initialServo = true;
+    if (parser.Found(wxT("p"), &initialCPU))
+    {}
     if (parser.GetParamCount() > 0)
         initialFileName = parser.GetParam(0);
     return wxApp::OnCmdLineParsed(parser);
@@ -307,6 +424,11 @@ bool ScanApp::OnInit()
     config.Read(wxT("ScanRate"),   &initialRate);
     config.Read(wxT("BinX"),       &initialBinX);
     config.Read(wxT("BinY"),       &initialBinY);
+    config.Read(wxT("CompressFITS"), &initialCompress);
+    config.Read(wxT("ReduceScan"), &initialReduce);
+    config.Read(wxT("RealTime"),   &initialRealTime);
+    config.Read(wxT("RateServo"),  &initialServo);
+    config.Read(wxT("RowClockCPU"), &initialCPU);
 #ifndef _MSC_VER
     config.Read(wxT("USB1Camera"), &camUSBType);
 #endif
@@ -328,12 +450,45 @@ bool ScanApp::OnInit()
     }
     return false;
 }
+/*
+ * Scale the display image to the window. The scaler keeps its weights while
+ * the window size stays the same, so redraws only pay for the filtering.
+ */
+static wxBitmap scaleBitmap(wxImage *image, int width, int height, struct scaler *viewScaler)
+{
+    wxImage scaled(width, height, false);
+    if (scalePixels(viewScaler, SCALE_BILINEAR, image->GetData(), image->GetWidth(), image->GetHeight(), image->GetWidth() * 3,
+                    scaled.GetData(), width, height, width * 3, 1, 3))
+        return wxBitmap(image->Scale(width, height, wxIMAGE_QUALITY_BILINEAR));
+    return wxBitmap(scaled);
+}
+/*
+ * Preview band buffers only ever grow, so steady scanning stops allocating
+ * once the largest band has been seen.
+ */
+static void *growBuffer(void *buffer, size_t *alloc, size_t size)
+{
+    if (size > *alloc)
+    {
+        free(buffer);
+        buffer = malloc(size);
+        *alloc = buffer ? size : 0;
+    }
+    return buffer;
+}
 ScanFrame::ScanFrame() : wxFrame(NULL, wxID_ANY, wxT("SX TDI")), tdiTimer(this, ID_TIMER)
 {
     CreateStatusBar(3);
     tdiFilePath = wxGetCwd();
     tdiFileName = initialFileName;
-    tdiFrame    = NULL;
+    tdiRing     = NULL;
+    tdiSpill    = NULL;
+    tdiRealTime = initialRealTime;
+    tdiServo    = initialServo;
+    rowScale    = 1.0;
+    servoThread = NULL;
+    tdiCPU      = initialCPU;
+    rowLateCount = -1;
     tdiState    = STATE_IDLE;
     tdiMinutes  = initialDuration * 60;
     ccdBinX     = initialBinX;
@@ -342,8 +497,20 @@ ScanFrame::ScanFrame() : wxFrame(NULL, wxID_ANY, wxT("SX TDI")), tdiTimer(this,
     tdiExposure = tdiScanRate > 0.0 ? 1000.0 / tdiScanRate : 0.0;
     ccdFrame    = NULL;
     scanImage   = NULL;
+    memset(&viewScaler, 0, sizeof(viewScaler));
+    memset(&bandScaler, 0, sizeof(bandScaler));
+    bandPixels  = NULL;
+    bandRGB     = scaledRGB = NULL;
+    pixelAlloc  = bandAlloc = scaledAlloc = 0;
     pixelFilter = false;
     pixelGamma  = 1.0;
+    fitsCompress = initialCompress;
+    fitsReduce   = initialReduce;
+    columnHist   = NULL;
+    columnFine   = NULL;
+    scanHist     = NULL;
+    fineBase     = NULL;
+    fits_set_compression(fitsCompress ? FITS_COMPRESS_RICE : FITS_COMPRESS_NONE, 0);
     wxConfig config(wxT("sxTDI"), wxT("sxToys"));
     config.Read(wxT("RedFilter"),  &pixelFilter);
     config.Read(wxT("Gamma"),      &pixelGamma);
@@ -357,6 +524,10 @@ ScanFrame::ScanFrame() : wxFrame(NULL, wxID_ANY, wxT("SX TDI")), tdiTimer(this,
     menuCamera->AppendSeparator();
     menuCamera->Append(wxID_NEW,  wxT("&New\tCtrl-N"));
     menuCamera->Append(wxID_SAVE, wxT("&Save...\tCtrl-S"));
+    menuCamera->AppendCheckItem(ID_COMPRESS, wxT("Compress FITS"));
+    menuCamera->Check(ID_COMPRESS, fitsCompress);
+    menuCamera->AppendCheckItem(ID_REDUCE, wxT("Reduce Columns"));
+    menuCamera->Check(ID_REDUCE, fitsReduce);
     menuCamera->AppendSeparator();
     menuCamera->Append(wxID_EXIT);
     wxMenu *menuView = new wxMenu;
@@ -370,6 +541,8 @@ ScanFrame::ScanFrame() : wxFrame(NULL, wxID_ANY, wxT("SX TDI")), tdiTimer(this,
     menuScan->AppendSeparator();
     menuScan->Append(ID_DURATION, wxT("Scan &Duration...\tD"));
     menuScan->Append(ID_RATE,     wxT("Scan &Rate..."));
+    menuScan->AppendCheckItem(ID_SERVO, wxT("Rate &Servo"));
+    menuScan->Check(ID_SERVO,     tdiServo);
     menuScan->Append(ID_BINX,     wxT("&X Binning..."));
     menuScan->Append(ID_BINY,     wxT("&Y Binning..."));
     wxMenu *menuHelp = new wxMenu;
@@ -391,9 +564,14 @@ void ScanFrame::OnPaint(wxPaintEvent& WXUNUSED(event))
     if (winWidth > 0 && winHeight > 0)
     {
         wxClientDC dc(this);
-        if (scanImage)
+        if (scanImage && scanImage->GetWidth() == winWidth && scanImage->GetHeight() == winHeight)
+        {
+            wxBitmap bitmap(*scanImage);
+            dc.DrawBitmap(bitmap, 0, 0);
+        }
+        else if (scanImage)
         {
-            wxBitmap bitmap(scanImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+            wxBitmap bitmap(scaleBitmap(scanImage, winWidth, winHeight, &viewScaler));
             dc.DrawBitmap(bitmap, 0, 0);
         }
         else
@@ -623,20 +801,27 @@ void ScanFrame::UpdateAlign()
             m16++;
         }
         calcRamp(pixelMin, pixelMax, pixelGamma, pixelFilter);
-        for (unsigned y = 0; y < ccdFrameWidth / 2; y++) // Rotate image 90 degrees counterclockwise as it gets copied
+        /*
+         * Rotate the frame a quarter turn clockwise, so the scan direction runs
+         * right to left, then map it through the LUT in display order.
+         */
+        uint16_t *rotFrame = (uint16_t *)malloc(sizeof(uint16_t) * ccdFrameHeight * (ccdFrameWidth / 2));
+        if (rotFrame)
         {
-            m16 = &(ccdFrame[ccdPixelCount - (ccdFrameWidth / 2) - 1 + y]);
-            for (unsigned x = 0; x < ccdFrameHeight; x++)
+            rotatePixels(ccdFrameWidth / 2, ccdFrameHeight, sizeof(uint16_t), ccdFrame, ccdFrameWidth / 2, rotFrame, ccdFrameHeight, 270);
+            m16 = rotFrame;
+            for (unsigned l = 0; l < ccdFrameHeight * (ccdFrameWidth / 2); l++)
             {
                 rgb[0] = max(rgb[0], redLUT[LUT_INDEX(*m16)]);
                 rgb[1] = max(rgb[1], blugrnLUT[LUT_INDEX(*m16)]);
                 rgb[2] = max(rgb[2], blugrnLUT[LUT_INDEX(*m16)]);
                 rgb   += 3;
-                m16   -= ccdFrameWidth / 2;
+                m16++;
             }
+            free(rotFrame);
         }
         wxClientDC dc(this);
-        wxBitmap bitmap(scanImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+        wxBitmap bitmap(scaleBitmap(scanImage, winWidth, winHeight, &viewScaler));
         dc.DrawBitmap(bitmap, 0, 0);
         if (numFrames)
         {
@@ -674,54 +859,278 @@ ScanThread::ScanThread(ScanFrame *param) : wxThread(wxTHREAD_JOINABLE)
 }
 wxThread::ExitCode ScanThread::Entry()
 {
-    ExitCode scanErr = SCAN_OK;
-    uint16_t *ccdRow = scan->tdiFrame;
-    sxClearImage(scan->camHandles[scan->camSelect], SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
-    wxStopWatch sw;
-    double rowTime = scan->binExposure; // Keep high precision running row time
+    ExitCode  scanErr = SCAN_OK;
+    uint16_t *ccdRow;
+    HANDLE    cam     = scan->camHandles[scan->camSelect];
+    RowStats *stats   = &scan->tdiRowStats;
+    int64_t   deadline, lateLimit = (int64_t)(scan->binExposure * NSEC_PER_MSEC * LATE_ROW_FRACTION);
+    double    late;
+    if ((scan->tdiRealTime || scan->tdiCPU >= 0) && rowclock_realtime(scan->tdiRealTime, scan->tdiCPU))
+        printf("Real-time row clock unavailable.\n");
+    sxClearImage(cam, SXCCD_EXP_FLAGS_FIELD_BOTH, SXCCD_IMAGE_HEAD);
+    int64_t scanStart = rowclock_now();
+    double  rowTime   = 0.0; // Keep high precision running row time in nsec
     do
     {
-        memset(ccdRow, 0, sizeof(uint16_t) * scan->ccdBinWidth); // Touch row in case swapped out
-        int deltaTime = rowTime - sw.Time();
-        if (deltaTime < 1)
-            sxLatchImage(scan->camHandles[scan->camSelect], // cam handle
-                         SXCCD_EXP_FLAGS_TDI |
-                         SXCCD_EXP_FLAGS_FIELD_BOTH, // options
-                         SXCCD_IMAGE_HEAD, // main ccd
-                         0, // xoffset
-                         0, // yoffset
-                         scan->ccdFrameWidth, // width
-                         scan->ccdBinY, // height
-                         scan->ccdBinX, // xbin
-                         scan->ccdBinY); // ybin
-        else
-            sxExposeImage(scan->camHandles[scan->camSelect], // cam handle
-                         SXCCD_EXP_FLAGS_TDI |
-                         SXCCD_EXP_FLAGS_FIELD_BOTH, // options
-                         SXCCD_IMAGE_HEAD, // main ccd
-                         0, // xoffset
-                         0, // yoffset
-                         scan->ccdFrameWidth, // width
-                         scan->ccdBinY, // height
-                         scan->ccdBinX, // xbin
-                         scan->ccdBinY, // ybin
-                         deltaTime); // msec
-        if ((deltaTime = rowTime - sw.Time() - 1) > 0)
-            wxMilliSleep(deltaTime);
-        if (!sxReadImage(scan->camHandles[scan->camSelect], // cam handle
+        /*
+         * The ring was touched when allocated and stays small enough to remain
+         * resident, so rows need no per-row setup.
+         */
+        ccdRow = &scan->tdiRing[(scan->tdiRow % scan->tdiRingRows) * scan->ccdBinWidth];
+        /*
+         * Deadlines are absolute from the start of the scan, so a late wakeup
+         * only delays its own row.
+         */
+        rowTime += scan->binExposure * scan->rowScale * NSEC_PER_MSEC;
+        deadline = (int64_t)rowTime;
+        rowclock_sleep(scanStart + deadline);
+        late = (double)(rowclock_now() - scanStart - deadline);
+        stats->sum   += late;
+        stats->sumSq += late * late;
+        if (late > stats->lateMax)
+            stats->lateMax = late;
+        if (late > lateLimit)
+            stats->late++;
+        stats->rows++;
+        sxLatchImage(cam, // cam handle
+                     SXCCD_EXP_FLAGS_TDI |
+                     SXCCD_EXP_FLAGS_FIELD_BOTH, // options
+                     SXCCD_IMAGE_HEAD, // main ccd
+                     0, // xoffset
+                     0, // yoffset
+                     scan->ccdFrameWidth, // width
+                     scan->ccdBinY, // height
+                     scan->ccdBinX, // xbin
+                     scan->ccdBinY); // ybin
+        if (!sxReadImage(cam, // cam handle
                          ccdRow, //pixbuf
                          scan->ccdBinWidth)) // pix count
         {
             scanErr = SCAN_ERR_CAMERA;
             break;
         }
-        rowTime += scan->binExposure;
-        ccdRow  += scan->ccdBinWidth;
     } while (++(scan->tdiRow) < scan->tdiLength);
     scan->tdiLength = scan->tdiRow; // Signal complete if errored out, nop if ok
     return scanErr;
 }
-void ScanFrame::StartTDI()
+SpillThread::SpillThread(ScanFrame *param) : wxThread(wxTHREAD_JOINABLE)
+{
+    scan = param;
+    Create();
+}
+wxThread::ExitCode SpillThread::Entry()
+{
+    size_t    rowSize   = sizeof(uint16_t) * scan->ccdBinWidth;
+    uint16_t *spillRows = (uint16_t *)malloc(rowSize * SPILL_CHUNK);
+    ExitCode  spillErr  = SCAN_OK;
+    bool      draining;
+    do
+    {
+        draining = scan->spillDone; // Sample before the row count so the last pass sees every row
+        int currentRow = scan->tdiRow;
+        while (scan->tdiSpilled < currentRow)
+        {
+            /*
+             * Copy up to the wrap point of the ring out to a private buffer.
+             * The scan thread never waits on the writer, so it may have been
+             * reading new rows over the oldest of these while they were copied.
+             */
+            int spillRow = scan->tdiSpilled;
+            int slot     = spillRow % scan->tdiRingRows;
+            int count    = min(min(currentRow - spillRow, scan->tdiRingRows - slot), SPILL_CHUNK);
+            memcpy(spillRows, &scan->tdiRing[slot * scan->ccdBinWidth], rowSize * count);
+            /*
+             * Row tdiRow is being read into the slot of row tdiRow - tdiRingRows,
+             * so everything up to there, plus a guard for the unfenced row count,
+             * can't be trusted. Keep the image geometry intact with blank rows.
+             */
+            int lost = scan->tdiRow - scan->tdiRingRows + SPILL_GUARD - spillRow;
+            if (lost > 0)
+            {
+                if (lost > count)
+                    lost = count;
+                memset(spillRows, 0, rowSize * lost);
+                scan->tdiSpillLost += lost;
+            }
+            else
+                lost = 0;
+            if ((int)fwrite(spillRows, rowSize, count, scan->tdiSpill) != count)
+            {
+                spillErr = SCAN_ERR_DISK;
+                break;
+            }
+            /*
+             * Build up the background histograms as the rows go by, skipping
+             * the ramp up frame that never gets saved. Coarse column bins place
+             * each column's background, the fine bins around it resolve the few
+             * ADU offsets between columns.
+             */
+            for (int r = max(spillRow + lost, (int)scan->ccdBinHeight); r < spillRow + count; r++)
+            {
+                if (r >= scan->fineStartRow && !scan->fineSeeded)
+                    scan->SeedFineHist();
+                uint16_t *m16  = &spillRows[(r - spillRow) * scan->ccdBinWidth];
+                uint32_t *hist = scan->columnHist;
+                uint32_t *fine = scan->fineSeeded ? scan->columnFine : NULL;
+                for (unsigned x = 0; x < scan->ccdBinWidth; x++)
+                {
+                    uint16_t pixel = *m16++;
+                    hist[pixel >> REDUCE_BIN_SHIFT]++;
+                    hist += REDUCE_BINS;
+                    scan->scanHist[pixel]++;
+                    if (fine)
+                    {
+                        int bin = (int)pixel - scan->fineBase[x];
+                        fine[bin < 0 ? 0 : bin >= REDUCE_FINE_BINS ? REDUCE_FINE_BINS + 1 : bin + 1]++;
+                        fine += REDUCE_FINE_BINS + 2;
+                    }
+                }
+            }
+            scan->tdiSpilled += count;
+        }
+        if (spillErr != SCAN_OK)
+            break;
+        if (!draining)
+            wxMilliSleep(SPILL_INTERVAL);
+    } while (!draining);
+    free(spillRows);
+    if (fflush(scan->tdiSpill))
+        spillErr = SCAN_ERR_DISK;
+    return spillErr;
+}
+ServoThread::ServoThread(ScanFrame *param) : wxThread(wxTHREAD_JOINABLE)
+{
+    scan = param;
+    Create();
+}
+bool ServoThread::StarElongation(uint16_t *pixels, int height, float *elongation)
+{
+    /*
+     * Find the best star in each strip across the scan and compare its second
+     * moments. A row clock that doesn't match the drift rate smears stars along
+     * the scan (rows) but not across it (columns).
+     */
+    int   width = scan->ccdBinWidth;
+    int   stars = 0;
+    float total = 0.0;
+    for (int strip = 0; strip < SERVO_STRIPS; strip++)
+    {
+        float xCentroid = (strip * 2 + 1) * width / (SERVO_STRIPS * 2);
+        float yCentroid = height / 2;
+        int   xRadius   = TRACK_STAR_RADIUS / (scan->ccdPixelWidth  * scan->ccdBinX);
+        int   yRadius   = TRACK_STAR_RADIUS / (scan->ccdPixelHeight * scan->ccdBinY) * 2;
+        if (!findBestCentroid(width,
+                              height,
+                              pixels,
+                              &xCentroid, // centroid coordinate
+                              &yCentroid,
+                              width / (SERVO_STRIPS * 2), // search range within strip
+                              height / 2,
+                              &xRadius,
+                              &yRadius,
+                              TRACK_STAR_SIGMA))
+            continue;
+        int xMin = max((int)xCentroid - xRadius * 2 - 1, 0);
+        int xMax = min((int)xCentroid + xRadius * 2 + 1, width - 1);
+        int yMin = max((int)yCentroid - yRadius * 2 - 1, 0);
+        int yMax = min((int)yCentroid + yRadius * 2 + 1, height - 1);
+        /*
+         * Background from the box edges.
+         */
+        float background = 0.0;
+        for (int x = xMin; x <= xMax; x++)
+            background += pixels[yMin * width + x] + pixels[yMax * width + x];
+        for (int y = yMin; y <= yMax; y++)
+            background += pixels[y * width + xMin] + pixels[y * width + xMax];
+        background /= (xMax - xMin + 1 + yMax - yMin + 1) * 2;
+        float sum = 0.0, xVar = 0.0, yVar = 0.0;
+        for (int y = yMin; y <= yMax; y++)
+            for (int x = xMin; x <= xMax; x++)
+            {
+                float weight = pixels[y * width + x] - background;
+                if (weight > 0.0)
+                {
+                    sum  += weight;
+                    xVar += weight * (x - xCentroid) * (x - xCentroid);
+                    yVar += weight * (y - yCentroid) * (y - yCentroid);
+                }
+            }
+        if (sum > 0.0)
+        {
+            total += (yVar - xVar) / sum;
+            stars++;
+        }
+    }
+    if (stars)
+        *elongation = total / stars;
+    return stars > 0;
+}
+wxThread::ExitCode ServoThread::Entry()
+{
+    /*
+     * Trailing alone can't tell a fast row clock from a slow one, so the row
+     * period is dithered a little either side of the current estimate and the
+     * trailing measured at each. A star crossing the sensor's H rows with the
+     * row period off by a fraction d trails over H*d rows, adding (H*d)^2/12
+     * to its along scan variance. With the true period off from the estimate
+     * by e, the two sides differ by
+     *
+     *  E(+dither) - E(-dither) = -H^2 * e * dither / 3
+     *
+     * which is signed and free of the star's own shape. The error is low pass
+     * filtered and a fraction of it folded into the estimate each pair, an
+     * integral controller on the row period. Each side is measured only on
+     * rows that spent their whole transit of the sensor at that rate.
+     */
+    int       windowRows = scan->ccdBinHeight * 2;
+    int       settleRow  = windowRows; // Skip the ramp up frame
+    uint16_t *window     = (uint16_t *)malloc(sizeof(uint16_t) * windowRows * scan->ccdBinWidth);
+    double    rowHeight  = scan->ccdBinHeight;
+    double    estimate   = scan->rowScale, dither = SERVO_DITHER, rateError = 0.0;
+    float     elongation[2];
+    int       side       = 0;
+    scan->rowScale = estimate + dither;
+    while (scan->tdiState == STATE_SCANNING)
+    {
+        wxMilliSleep(SERVO_INTERVAL);
+        int currentRow = scan->tdiRow;
+        if (currentRow < settleRow + windowRows)
+            continue;
+        /*
+         * Copy out of the ring, leaving the row in flight alone. The ring is
+         * never locked so the row clock never waits on us.
+         */
+        for (int r = 0; r < windowRows; r++)
+            memcpy(&window[r * scan->ccdBinWidth],
+                   &scan->tdiRing[((currentRow - windowRows + r) % scan->tdiRingRows) * scan->ccdBinWidth],
+                   sizeof(uint16_t) * scan->ccdBinWidth);
+        if (!StarElongation(window, windowRows, &elongation[side]))
+        {
+            settleRow = currentRow;
+            continue;
+        }
+        if (side)
+        {
+            /*
+             * Both sides measured: filter the signed error and move the estimate.
+             */
+            double error = -3.0 * (elongation[0] - elongation[1]) / (rowHeight * rowHeight * dither);
+            if (error < -SERVO_MAX_SCALE) error = -SERVO_MAX_SCALE;
+            if (error >  SERVO_MAX_SCALE) error =  SERVO_MAX_SCALE;
+            rateError = rateError * (1.0 - SERVO_FILTER) + error * SERVO_FILTER;
+            estimate += rateError * SERVO_GAIN;
+            if (estimate < 1.0 - SERVO_MAX_SCALE) estimate = 1.0 - SERVO_MAX_SCALE;
+            if (estimate > 1.0 + SERVO_MAX_SCALE) estimate = 1.0 + SERVO_MAX_SCALE;
+        }
+        side = !side;
+        scan->rowScale = estimate + (side ? -dither : dither);
+        settleRow = currentRow + scan->ccdBinHeight;
+    }
+    scan->rowScale = estimate; // Report the estimate, not a dithered side
+    free(window);
+    return SCAN_OK;
+}
+bool ScanFrame::StartTDI()
 {
     ccdBinWidth  = ccdFrameWidth  / ccdBinX;
     ccdBinHeight = ccdFrameHeight / ccdBinY;
@@ -729,37 +1138,148 @@ void ScanFrame::StartTDI()
     tdiLength    = tdiMinutes * 60000 / binExposure;
     if (tdiLength < ccdBinHeight)
         tdiLength = ccdBinHeight;
-    tdiFrame  = (uint16_t *)malloc(sizeof(uint16_t) * tdiLength * ccdBinWidth);
-    memset(tdiFrame, 0, sizeof(uint16_t) * tdiLength * ccdBinWidth);
+    /*
+     * Only the most recent rows live in memory: enough for the display plus
+     * headroom for the spill writer. Everything else streams to disk.
+     */
+    FreeScan();
+    tdiSpillName = wxFileName::CreateTempFileName(wxT("sxtdi"));
+    if (tdiSpillName.IsEmpty() || (tdiSpill = fopen(tdiSpillName.mb_str(), "w+b")) == NULL)
+        return false;
+    tdiRingRows = max((int)(RING_SECONDS * 1000 / binExposure), (int)ccdBinHeight * 4);
+    if (tdiRingRows > tdiLength)
+        tdiRingRows = tdiLength;
+    tdiRing    = (uint16_t *)calloc(tdiRingRows * ccdBinWidth, sizeof(uint16_t));
+    columnHist = (uint32_t *)calloc(REDUCE_BINS * ccdBinWidth, sizeof(uint32_t));
+    columnFine = (uint32_t *)calloc((REDUCE_FINE_BINS + 2) * ccdBinWidth, sizeof(uint32_t));
+    scanHist   = (uint32_t *)calloc(MAX_PIX + 1, sizeof(uint32_t));
+    fineBase   = (uint16_t *)calloc(ccdBinWidth, sizeof(uint16_t));
+    if (!tdiRing || !columnHist || !columnFine || !scanHist || !fineBase)
+    {
+        FreeScan();
+        return false;
+    }
+    /*
+     * The fine histograms start once a frame's worth of image rows past the
+     * ramp up has placed each column's background.
+     */
+    fineStartRow = ccdBinHeight * 2;
+    fineSeeded   = false;
+    tdiSpilled   = 0;
+    tdiSpillLost = 0;
+    spillDone    = false;
+    memset(&tdiRowStats, 0, sizeof(tdiRowStats));
+    rowLateCount = -1;
     tdiFileSaved = false;
     tdiRow       = 0;
+    rowScale     = 1.0;
     tdiState     = STATE_SCANNING;
     ENABLE_HIGH_RES_TIMER();
     tdiThread = new ScanThread(this);
     tdiThread->Run();
+    spillThread = new SpillThread(this);
+    spillThread->Run();
+    servoThread = NULL;
+    if (tdiServo)
+    {
+        servoThread = new ServoThread(this);
+        servoThread->Run();
+    }
     wxMilliSleep(100); // Give it a moment
+    return true;
 }
 wxThread::ExitCode ScanFrame::StopTDI()
 {
     tdiState = STATE_IDLE;
     wxThread::ExitCode scanErr = tdiThread->Wait();
     delete tdiThread;
+    tdiThread = NULL;
+    if (servoThread)
+    {
+        servoThread->Wait();
+        delete servoThread;
+        servoThread = NULL;
+    }
+    /*
+     * Let the spill writer drain the ring before releasing it.
+     */
+    spillDone = true;
+    wxThread::ExitCode spillErr = spillThread->Wait();
+    delete spillThread;
+    spillThread = NULL;
+    free(tdiRing);
+    tdiRing = NULL;
     DISABLE_HIGH_RES_TIMER();
-    if (tdiRow < ccdBinHeight)
+    RowClockStats();
+    if (scanErr == SCAN_OK)
+        scanErr = spillErr;
+    if (spillErr != SCAN_OK || tdiRow < ccdBinHeight)
     {
         /*
-         * Don't bother if less than a full frame image.
+         * Don't bother if less than a full frame image or the spill file is incomplete.
          */
-        free(tdiFrame);
-        tdiFrame     = NULL;
+        FreeScan();
         tdiFileSaved = true;
     }
     return scanErr;
 }
+void ScanFrame::FreeScan()
+{
+    if (columnHist)
+    {
+        free(columnHist);
+        columnHist = NULL;
+    }
+    if (columnFine)
+    {
+        free(columnFine);
+        columnFine = NULL;
+    }
+    if (scanHist)
+    {
+        free(scanHist);
+        scanHist = NULL;
+    }
+    if (fineBase)
+    {
+        free(fineBase);
+        fineBase = NULL;
+    }
+    if (tdiRing)
+    {
+        free(tdiRing);
+        tdiRing = NULL;
+    }
+    if (tdiSpill)
+    {
+        fclose(tdiSpill);
+        tdiSpill = NULL;
+        wxRemoveFile(tdiSpillName);
+    }
+}
+void ScanFrame::RowClockStats()
+{
+    /*
+     * Latch latency against the row deadlines: mean, standard deviation (jitter),
+     * worst case and count of rows late enough to smear.
+     */
+    double mean = 0.0;
+    int    rows = tdiRowStats.rows;
+    if (rows > 0)
+        mean = tdiRowStats.sum / rows;
+    rowLateCount = tdiRowStats.late;
+    rowLatency   = mean / NSEC_PER_MSEC; // Report in msec
+    rowJitter    = rows > 0 ? sqrt(max(tdiRowStats.sumSq / rows - mean * mean, 0.0)) / NSEC_PER_MSEC : 0.0;
+    rowLateMax   = tdiRowStats.lateMax / NSEC_PER_MSEC;
+}
 bool ScanFrame::AutoStart(wxString& fileName)
 {
     wxMessageOutputStderr progress;
-    StartTDI();
+    if (!StartTDI())
+    {
+        progress.Printf("Creating Spill File or Scan Buffers Error!");
+        return false;
+    }
     /*
      * Wait for scan to complete
      */
@@ -782,6 +1302,16 @@ bool ScanFrame::AutoStart(wxString& fileName)
         progress.Printf("Camera Error!");
         return false;
     }
+    if (scanErr == SCAN_ERR_DISK)
+    {
+        progress.Printf("Writing Spill File Error!");
+        return false;
+    }
+    if (tdiSpillLost)
+        progress.Printf(wxT("%d rows lost to spill overrun"), tdiSpillLost);
+    progress.Printf(wxT("Row latch: %.3f ms mean, %.3f ms jitter, %.3f ms max, %d late"), rowLatency, rowJitter, rowLateMax, rowLateCount);
+    if (tdiServo)
+        progress.Printf(wxT("Servoed rate: %2.3f row/s"), tdiScanRate / rowScale);
     if (!(tdiFileSaved = FitsWrite(fileName)))
     {
         progress.Printf("Writing FITS File Error!");
@@ -809,28 +1339,67 @@ void ScanFrame::UpdateTDI()
             GetClientSize(&winWidth, &winHeight);
             if (winWidth > 0 && winHeight > 0)
             {
-                int pixelMax       = MIN_PIX;
-                int pixelMin       = MAX_PIX;
-                unsigned char *rgb = scanImage->GetData();
-                uint16_t *pixels   = &tdiFrame[ccdBinWidth * ((currentRow < ccdBinHeight * 2) ? ccdBinHeight * 2 - 1 : currentRow)];
-                for (unsigned y = 0; y < ccdBinWidth; y++) // Rotate image 90 degrees counterclockwise as it gets copied
+                int windowRows = ccdBinHeight * 2;
+                if (!scanImage || scanImage->GetWidth() != winWidth || scanImage->GetHeight() != winHeight)
                 {
-                    uint16_t *m16 = &pixels[y];
-                    for (unsigned x = 0; x < ccdBinHeight * 2; x++)
+                    /*
+                     * New or resized window. Start from a blank preview and rebuild
+                     * it from the rows still in view.
+                     */
+                    if (scanImage)
+                        delete scanImage;
+                    scanImage  = new wxImage(winWidth, winHeight);
+                    previewRow = max(currentRow - windowRows, 0);
+                    previewMin = MAX_PIX;
+                    previewMax = MIN_PIX;
+                }
+                /*
+                 * Only rows that arrived since the last update get converted and
+                 * scaled. Each band is scaled to the window columns it covers and
+                 * lands to the left of the rows before it. The preview fills in from
+                 * the right, then scrolls right to make room once it is full.
+                 */
+                int firstRow = max(previewRow, currentRow - windowRows);
+                int firstCol = (int)((int64_t)firstRow   * winWidth / windowRows);
+                int lastCol  = (int)((int64_t)currentRow * winWidth / windowRows);
+                int bandCols = lastCol - firstCol;
+                if (bandCols > 0)
+                {
+                    int bandRows = currentRow - firstRow;
+                    int scroll   = max(lastCol - winWidth, 0) - max(firstCol - winWidth, 0);
+                    int left     = winWidth - min(firstCol, winWidth) + scroll - bandCols;
+                    size_t bandSize   = (size_t)bandRows * ccdBinWidth;
+                    size_t scaledSize = (size_t)bandCols * winHeight * 3;
+                    bandPixels = (uint16_t *)growBuffer(bandPixels, &pixelAlloc, bandSize * sizeof(uint16_t));
+                    bandRGB    = (unsigned char *)growBuffer(bandRGB, &bandAlloc, bandSize * 3);
+                    scaledRGB  = (unsigned char *)growBuffer(scaledRGB, &scaledAlloc, scaledSize);
+                    if (!bandPixels || !bandRGB || !scaledRGB)
+                        return;
+                    PreviewBand(bandRGB, currentRow - 1, bandRows);
+                    if (scalePixels(&bandScaler, SCALE_BILINEAR, bandRGB, bandRows, ccdBinWidth, bandRows * 3,
+                                    scaledRGB, bandCols, winHeight, bandCols * 3, 1, 3))
                     {
-                        if (*m16 < pixelMin && *m16 > 0) pixelMin = *m16;
-                        if (*m16 > pixelMax) pixelMax = *m16;
-                        rgb[0] = redLUT[LUT_INDEX(*m16)];
-                        rgb[1] = blugrnLUT[LUT_INDEX(*m16)];
-                        rgb[2] = blugrnLUT[LUT_INDEX(*m16)];
-                        rgb   += 3;
-                        m16   -= ccdBinWidth;
+                        wxImage band(bandRows, ccdBinWidth, bandRGB, true);
+                        memcpy(scaledRGB, band.Scale(bandCols, winHeight, wxIMAGE_QUALITY_BILINEAR).GetData(), scaledSize);
                     }
+                    unsigned char *rgb       = scanImage->GetData();
+                    unsigned char *scaledRow = scaledRGB;
+                    for (int y = 0; y < winHeight; y++)
+                    {
+                        if (scroll)
+                            memmove(rgb + scroll * 3, rgb, (winWidth - scroll) * 3);
+                        memcpy(rgb + left * 3, scaledRow, bandCols * 3);
+                        rgb       += winWidth * 3;
+                        scaledRow += bandCols * 3;
+                    }
+                    previewRow = currentRow;
+                    calcRamp(previewMin, previewMax, pixelGamma, pixelFilter); // Next band picks up the new ramp
+                    if (tdiServo)
+                        SetStatusText(wxString::Format(wxT("Rate: %2.3f row/s"), tdiScanRate / rowScale), 1);
+                    wxClientDC dc(this);
+                    wxBitmap bitmap(*scanImage);
+                    dc.DrawBitmap(bitmap, 0, 0);
                 }
-                calcRamp(pixelMin, pixelMax, pixelGamma, pixelFilter); // Behind a row in ramp updates. Oh well
-                wxClientDC dc(this);
-                wxBitmap bitmap(scanImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
-                dc.DrawBitmap(bitmap, 0, 0);
             }
         }
     }
@@ -845,7 +1414,36 @@ void ScanFrame::UpdateTDI()
             wxMessageBox("Miniumum Timing Error", "Scan Error", wxOK | wxICON_INFORMATION);
         if (scanErr == SCAN_ERR_CAMERA)
             wxMessageBox("Camera Error", "Scan Error", wxOK | wxICON_INFORMATION);
+        if (scanErr == SCAN_ERR_DISK)
+            wxMessageBox("Spill File Write Error", "Scan Error", wxOK | wxICON_INFORMATION);
         SetTitle(wxT("SX TDI"));
+        SetStatusText(wxString::Format(wxT("Jitter: %.3f ms, %d late"), rowJitter, rowLateCount), 2);
+    }
+}
+void ScanFrame::PreviewBand(unsigned char *rgb, int newestRow, int bandRows)
+{
+    /*
+     * Rotate rows a quarter turn clockwise into the band, newest row in the
+     * left column. The ring wraps at most once inside the band, so it rotates
+     * as one or two runs of contiguous rows. The caller sizes bandPixels.
+     */
+    uint16_t *band = bandPixels;
+    int oldestSlot = (newestRow - bandRows + 1) % tdiRingRows;
+    int olderRows  = min(bandRows, tdiRingRows - oldestSlot);
+    int newerRows  = bandRows - olderRows;
+    if (newerRows)
+        rotatePixels(ccdBinWidth, newerRows, sizeof(uint16_t), tdiRing, ccdBinWidth, band, bandRows, 270);
+    rotatePixels(ccdBinWidth, olderRows, sizeof(uint16_t), &tdiRing[oldestSlot * ccdBinWidth], ccdBinWidth, band + newerRows, bandRows, 270);
+    uint16_t *m16 = band;
+    for (int l = 0; l < bandRows * (int)ccdBinWidth; l++)
+    {
+        uint16_t pixel = *m16++;
+        if (pixel < previewMin && pixel > 0) previewMin = pixel;
+        if (pixel > previewMax) previewMax = pixel;
+        rgb[0] = redLUT[LUT_INDEX(pixel)];
+        rgb[1] =
+        rgb[2] = blugrnLUT[LUT_INDEX(pixel)];
+        rgb   += 3;
     }
 }
 void ScanFrame::OnTimer(wxTimerEvent& WXUNUSED(event))
@@ -898,6 +1496,10 @@ void ScanFrame::OnRate(wxCommandEvent& WXUNUSED(event))
     else
         wxBell();
 }
+void ScanFrame::OnServo(wxCommandEvent& event)
+{
+    tdiServo = event.IsChecked();
+}
 void ScanFrame::OnBinX(wxCommandEvent& WXUNUSED(event))
 {
     if (tdiState == STATE_IDLE)
@@ -970,7 +1572,7 @@ void ScanFrame::OnAlign(wxCommandEvent& WXUNUSED(event))
         if (winWidth > 0 && winHeight > 0)
         {
             wxClientDC dc(this);
-            wxBitmap bitmap(scanImage->Scale(winWidth, winHeight, wxIMAGE_QUALITY_BILINEAR));
+            wxBitmap bitmap(scaleBitmap(scanImage, winWidth, winHeight, &viewScaler));
             dc.DrawBitmap(bitmap, 0, 0);
             Refresh();
         }
@@ -1008,17 +1610,18 @@ void ScanFrame::OnScan(wxCommandEvent& WXUNUSED(event))
             if (tdiMinutes == 0)
                 return;
         }
-        if (tdiFrame)
+        if (tdiSpill && !tdiFileSaved && wxMessageBox("Overwrite unsaved image?", "Scan Warning", wxYES_NO | wxICON_INFORMATION) == wxID_NO)
+            return;
+        if (!StartTDI())
         {
-            if (!tdiFileSaved && wxMessageBox("Overwrite unsaved image?", "Scan Warning", wxYES_NO | wxICON_INFORMATION) == wxID_NO)
-                return;
-            free(tdiFrame);
+            FreeScan();
+            wxMessageBox("Unable to create spill file or scan buffers", "Start TDI Error", wxOK | wxICON_INFORMATION);
+            return;
         }
         SetTitle(wxT("SX TDI [Scanning]"));
-        StartTDI();
         if (scanImage)
             delete scanImage;
-        scanImage = new wxImage(ccdBinHeight * 2, ccdBinWidth);
+        scanImage = NULL; // Preview is built to the window size on the first update
         tdiTimer.Start(max(binExposure, MIN_SCREEN_UPDATE)); // Bound screen update rate
     }
     else
@@ -1036,24 +1639,15 @@ void ScanFrame::OnStop(wxCommandEvent& WXUNUSED(event))
             SetStatusText(statusText, 2);
             delete trackWatch;
             trackWatch = NULL;
+            DISABLE_HIGH_RES_TIMER();
         }
         else if (tdiState == STATE_SCANNING)
         {
             tdiLength = tdiRow;
-            tdiThread->Wait();
-            delete tdiThread;
-            tdiThread = NULL;
-            if (tdiRow < ccdBinHeight)
-            {
-                //
-                // Don't bother if less than a full frame Image
-                //
-                free(tdiFrame);
-                tdiFrame     = NULL;
-                tdiFileSaved = true;
-            }
+            if (StopTDI() == SCAN_ERR_DISK)
+                wxMessageBox("Spill File Write Error", "Scan Error", wxOK | wxICON_INFORMATION);
+            SetStatusText(wxString::Format(wxT("Jitter: %.3f ms, %d late"), rowJitter, rowLateCount), 2);
         }
-        DISABLE_HIGH_RES_TIMER();
         tdiState = STATE_IDLE;
         SetTitle(wxT("SX TDI"));
     }
@@ -1062,22 +1656,130 @@ void ScanFrame::OnNew(wxCommandEvent& WXUNUSED(event))
 {
     if (tdiState == STATE_IDLE)
     {
-        if (tdiFrame != NULL && !tdiFileSaved && wxMessageBox("Clear unsaved image?", "New Warning", wxYES_NO | wxICON_INFORMATION) == wxID_NO)
+        if (tdiSpill != NULL && !tdiFileSaved && wxMessageBox("Clear unsaved image?", "New Warning", wxYES_NO | wxICON_INFORMATION) == wxID_NO)
             return;
-        free(tdiFrame);
-        tdiFrame = NULL;
+        FreeScan();
     }
 }
+/*
+ * Median of a histogram, interpolated within the median bin.
+ */
+static float histMedian(const uint32_t *hist, int bins, float binWidth)
+{
+    double total = 0.0, count = 0.0, half;
+    int    bin;
+    for (bin = 0; bin < bins; bin++)
+        total += hist[bin];
+    half = total / 2.0;
+    for (bin = 0; bin < bins - 1 && count + hist[bin] < half; bin++)
+        count += hist[bin];
+    if (hist[bin] == 0)
+        return bin * binWidth;
+    return (bin + (half - count) / hist[bin]) * binWidth;
+}
+void ScanFrame::SeedFineHist()
+{
+    /*
+     * Center each column's fine window on its coarse median so far.
+     */
+    for (unsigned x = 0; x < ccdBinWidth; x++)
+    {
+        int base = (int)histMedian(&columnHist[x * REDUCE_BINS], REDUCE_BINS, 1 << REDUCE_BIN_SHIFT) - REDUCE_FINE_BINS / 2;
+        fineBase[x] = base < 0 ? 0 : base > MAX_PIX + 1 - REDUCE_FINE_BINS ? MAX_PIX + 1 - REDUCE_FINE_BINS : base;
+    }
+    fineSeeded = true;
+}
+static void reduceRow(const unsigned short *src, unsigned short *dst, int width, void *data)
+{
+    ColumnReduction *reduce = (ColumnReduction *)data;
+    for (int x = 0; x < width; x++)
+    {
+        float pixel = (src[x] - reduce->colMedian[x]) * reduce->colScale[x] + reduce->scanMedian;
+        dst[x] = pixel <= MIN_PIX ? MIN_PIX : pixel >= MAX_PIX ? MAX_PIX : (uint16_t)(pixel + 0.5);
+    }
+}
+bool ScanFrame::ReduceColumns(ColumnReduction *reduce)
+{
+    /*
+     * Flatten the column streaks of a drift scan using the column medians
+     * collected while the scan was spilled:
+     *
+     *  reduced = (MAX - scan median)/(MAX - column median)*(pixel - column median) + scan median
+     *
+     * The correction is applied by the FITS writer as each row goes out, so
+     * the scan is only read once. Histogram bins are centered on their ADU
+     * value, hence the half bin.
+     */
+    reduce->colMedian = (float *)malloc(sizeof(float) * ccdBinWidth);
+    reduce->colScale  = (float *)malloc(sizeof(float) * ccdBinWidth);
+    if (!reduce->colMedian || !reduce->colScale)
+        return false;
+    reduce->scanMedian = histMedian(scanHist, MAX_PIX + 1, 1.0) - 0.5;
+    for (unsigned x = 0; x < ccdBinWidth; x++)
+    {
+        /*
+         * Use the fine histogram when the median landed inside its window,
+         * otherwise the background wandered off and the coarse one has to do.
+         */
+        uint32_t *fine = &columnFine[x * (REDUCE_FINE_BINS + 2)];
+        double    total = 0.0;
+        for (int bin = 0; bin < REDUCE_FINE_BINS + 2; bin++)
+            total += fine[bin];
+        if (total > 0.0 && fine[0] < total / 2.0 && total - fine[REDUCE_FINE_BINS + 1] > total / 2.0)
+            reduce->colMedian[x] = fineBase[x] + histMedian(fine, REDUCE_FINE_BINS + 2, 1.0) - 1.5;
+        else
+            reduce->colMedian[x] = histMedian(&columnHist[x * REDUCE_BINS], REDUCE_BINS, 1 << REDUCE_BIN_SHIFT);
+        reduce->colScale[x] = (MAX_PIX - reduce->scanMedian) / max(MAX_PIX - reduce->colMedian[x], 1.0f);
+    }
+    return true;
+}
 bool ScanFrame::FitsWrite(wxString& fileName)
 {
     char fits_file[255];
     strcpy(fits_file, fileName.c_str());
-    if (fits_open(fits_file)
-     || fits_write_image(&tdiFrame[ccdBinWidth * ccdBinHeight], ccdBinWidth, tdiLength - ccdBinHeight)
+    /*
+     * Map the spill file rather than reading it back; pixels are converted a
+     * row at a time on the way out so the scan never has to fit in memory.
+     */
+    size_t    spillSize  = sizeof(uint16_t) * (size_t)tdiSpilled * ccdBinWidth;
+    uint16_t *scanPixels = tdiSpill ? (uint16_t *)spill_map(tdiSpill, spillSize) : NULL;
+    if (scanPixels == NULL)
+        return false;
+    uint16_t       *imagePixels = &scanPixels[ccdBinWidth * ccdBinHeight];
+    int             imageHeight = tdiLength - ccdBinHeight;
+    ColumnReduction reduce      = {NULL, NULL, 0.0};
+    bool            reduced     = fitsReduce && columnHist && columnFine && scanHist && fineBase;
+    if (reduced && !ReduceColumns(&reduce))
+    {
+        free(reduce.colMedian);
+        free(reduce.colScale);
+        spill_unmap(scanPixels, spillSize);
+        return false;
+    }
+    bool fitsErr = fits_open(fits_file)
+     || fits_write_image(imagePixels, ccdBinWidth, imageHeight)
+     || (reduced && fits_set_row_filter(reduceRow, &reduce))
      || fits_write_key_int("EXPOSURE", (tdiLength - ccdBinHeight) * tdiExposure, "Total Exposure Time")
+     || fits_write_key_int("XBINNING", ccdBinX, "Horizontal Binning")
+     || fits_write_key_int("YBINNING", ccdBinY, "Vertical Binning")
+     || fits_write_key_float("XPIXSZ", ccdPixelWidth * ccdBinX, "Binned Pixel Width (microns)")
+     || fits_write_key_float("YPIXSZ", ccdPixelHeight * ccdBinY, "Binned Pixel Height (microns)")
+     || fits_write_key_float("SCANRATE", tdiScanRate, "Scan Rate (rows/sec)")
+     || fits_write_key_float("ROWEXP", tdiExposure / 1000.0, "Row Exposure Time (sec)")
+     || (rowScale != 1.0f && fits_write_key_float("ENDRATE", tdiScanRate / rowScale, "Servoed Scan Rate at End (rows/sec)"))
+     || (rowLateCount >= 0
+      && (fits_write_key_float("ROWLATNC", rowLatency, "Mean Row Latch Latency (msec)")
+       || fits_write_key_float("ROWJITTR", rowJitter, "Row Latch Jitter (msec)")
+       || fits_write_key_int("ROWSLATE", rowLateCount, "Rows Latched Late")))
+     || (tdiSpillLost && fits_write_key_int("ROWSLOST", tdiSpillLost, "Rows Lost to Spill Overrun"))
+     || (reduced && fits_write_key_float("SCANMED", reduce.scanMedian, "Column Reduced to Scan Median (ADU)"))
      || fits_write_key_string("CREATOR", "sxTDI", "Imaging Application")
      || fits_write_key_string("CAMERA", "StarLight Xpress Camera", "Imaging Device")
-     || fits_close())
+     || fits_close();
+    spill_unmap(scanPixels, spillSize);
+    free(reduce.colMedian);
+    free(reduce.colScale);
+    if (fitsErr)
     {
         fits_cleanup();
         return false; // Writing FITS file failed
@@ -1089,7 +1791,7 @@ void ScanFrame::OnSave(wxCommandEvent& WXUNUSED(event))
     if (tdiState == STATE_IDLE)
     {
         wxFileDialog dlg(this, wxT("Save Image"), tdiFilePath, tdiFileName, wxT("*.fits"/*"FITS file (*.fits)"*/), wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
-        if (tdiFrame != NULL)
+        if (tdiSpill != NULL)
         {
             if (dlg.ShowModal() == wxID_OK)
             {
@@ -1105,6 +1807,15 @@ void ScanFrame::OnSave(wxCommandEvent& WXUNUSED(event))
     else
         wxBell();
 }
+void ScanFrame::OnCompress(wxCommandEvent& event)
+{
+    fitsCompress = event.IsChecked();
+    fits_set_compression(fitsCompress ? FITS_COMPRESS_RICE : FITS_COMPRESS_NONE, 0);
+}
+void ScanFrame::OnReduce(wxCommandEvent& event)
+{
+    fitsReduce = event.IsChecked();
+}
 void ScanFrame::OnClose(wxCloseEvent& event)
 {
     if (event.CanVeto() && tdiState == STATE_SCANNING && wxMessageBox("Cancel scan in progress?", "Exit Warning", wxYES_NO | wxICON_INFORMATION) == wxNO)
@@ -1119,31 +1830,21 @@ void ScanFrame::OnClose(wxCloseEvent& event)
         {
             delete trackWatch;
             trackWatch = NULL;
+            DISABLE_HIGH_RES_TIMER();
         }
         else if (tdiState == STATE_SCANNING)
         {
             tdiLength = tdiRow;
-            tdiThread->Wait();
-            delete tdiThread;
-            tdiThread = NULL;
-            if (tdiRow < ccdBinHeight)
-            {
-                //
-                // Don't bother if less than a full frame Image
-                //
-                free(tdiFrame);
-                tdiFrame     = NULL;
-                tdiFileSaved = true;
-            }
+            StopTDI();
         }
-        DISABLE_HIGH_RES_TIMER();
         tdiState = STATE_IDLE;
     }
-    if (tdiFrame != NULL && !tdiFileSaved && wxMessageBox("Save image before exiting?", "Exit Warning", wxYES_NO | wxICON_INFORMATION) == wxYES)
+    if (tdiSpill != NULL && !tdiFileSaved && wxMessageBox("Save image before exiting?", "Exit Warning", wxYES_NO | wxICON_INFORMATION) == wxYES)
     {
         wxCommandEvent eventSave;
         OnSave(eventSave);
     }
+    FreeScan();
     if (scanImage != NULL)
     {
         delete scanImage;
@@ -1161,6 +1862,16 @@ void ScanFrame::OnClose(wxCloseEvent& event)
     config.Write(wxT("ScanRate"),   tdiScanRate);
     config.Write(wxT("BinX"),       ccdBinX);
     config.Write(wxT("BinY"),       ccdBinY);
+    config.Write(wxT("CompressFITS"), fitsCompress);
+    config.Write(wxT("ReduceScan"), fitsReduce);
+    config.Write(wxT("RealTime"),   tdiRealTime);
+    config.Write(wxT("RateServo"),  tdiServo);
+    config.Write(wxT("RowClockCPU"), tdiCPU);
+    freeScaler(&viewScaler);
+    freeScaler(&bandScaler);
+    free(bandPixels);
+    free(bandRGB);
+    free(scaledRGB);
     Destroy();
 }
 void ScanFrame::OnExit(wxCommandEvent& WXUNUSED(event))
@@ -4,18 +4,159 @@ typedef unsigned char  uint8_t;
 typedef signed   char  int8_t;
 typedef unsigned short uint16_t;
 typedef signed   short int16_t;
+typedef signed __int64 int64_t;
 #endif
 #include <windows.h>
+#include <io.h>
 #define ENABLE_HIGH_RES_TIMER() if (tdiExposure < 1000) timeBeginPeriod(1)
 #define DISABLE_HIGH_RES_TIMER() if (tdiExposure < 1000) timeEndPeriod(1)
 #else
 #include <sys/time.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
 #define ENABLE_HIGH_RES_TIMER()
 #define DISABLE_HIGH_RES_TIMER()
 #endif
+/*
+ * TDI row clock. Monotonic time in nanoseconds with sleeps to an absolute
+ * deadline, so row timing never accumulates drift from sleep overshoot.
+ */
+#define NSEC_PER_SEC        1000000000LL
+#define NSEC_PER_MSEC       1000000LL
+#if defined(_MSC_VER)
+static int64_t rowclock_now(void)
+{
+    LARGE_INTEGER count, freq;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&freq);
+    return (count.QuadPart / freq.QuadPart) * NSEC_PER_SEC
+         + (count.QuadPart % freq.QuadPart) * NSEC_PER_SEC / freq.QuadPart;
+}
+static void rowclock_sleep(int64_t deadline)
+{
+    /*
+     * No absolute sleep on Windows: coarse sleep to within 2 msec, then spin.
+     */
+    int64_t delta;
+    while ((delta = deadline - rowclock_now()) > 2 * NSEC_PER_MSEC)
+        Sleep((DWORD)(delta / NSEC_PER_MSEC) - 1);
+    while (rowclock_now() < deadline)
+        YieldProcessor();
+}
+static int rowclock_realtime(bool fifo, int cpu)
+{
+    int err = 0;
+    if (fifo && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+        err = -1;
+    if (cpu >= 0 && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu))
+        err = -1;
+    return err;
+}
+#elif defined(__APPLE__)
+static int64_t rowclock_now(void)
+{
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0)
+        mach_timebase_info(&timebase);
+    return (int64_t)(mach_absolute_time() * timebase.numer / timebase.denom);
+}
+static void rowclock_sleep(int64_t deadline)
+{
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    mach_wait_until((uint64_t)deadline * timebase.denom / timebase.numer);
+}
+static int rowclock_realtime(bool fifo, int cpu)
+{
+    /*
+     * Thread affinity on macOS is only a hint, so the CPU is ignored.
+     */
+    struct sched_param param;
+    if (fifo)
+    {
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+            return -1;
+    }
+    return 0;
+}
+#else
+static int64_t rowclock_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+}
+static void rowclock_sleep(int64_t deadline)
+{
+    struct timespec wake;
+    wake.tv_sec  = deadline / NSEC_PER_SEC;
+    wake.tv_nsec = deadline % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+}
+static int rowclock_realtime(bool fifo, int cpu)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int err = 0;
+    if (fifo)
+    {
+        param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+            err = -1;
+    }
+    if (cpu >= 0)
+    {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+            err = -1;
+    }
+    return err;
+}
+#endif
+#include <stdio.h>
+/*
+ * Read-only mapping of the scan spill file for writing out the final image.
+ */
+#ifdef _MSC_VER
+static void *spill_map(FILE *fp, size_t size)
+{
+    HANDLE mapping = CreateFileMapping((HANDLE)_get_osfhandle(_fileno(fp)), NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return NULL;
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, size);
+    CloseHandle(mapping); // View holds its own reference
+    return view;
+}
+static void spill_unmap(void *view, size_t size)
+{
+    UnmapViewOfFile(view);
+}
+#else
+static void *spill_map(FILE *fp, size_t size)
+{
+    void *view = mmap(NULL, size, PROT_READ, MAP_SHARED, fileno(fp), 0);
+    return view == MAP_FAILED ? NULL : view;
+}
+static void spill_unmap(void *view, size_t size)
+{
+    munmap(view, size);
+}
+#endif
+#include <math.h>
 #include "sxutil.h"
 #include "aip.h"
 #include "fits.h"
 #ifndef max
 #define max(a,b)            ((a)>=(b)?(a):(b))
 #endif
+#ifndef min
+#define min(a,b)            ((a)<=(b)?(a):(b))
+#endif